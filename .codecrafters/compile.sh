@@ -8,4 +8,4 @@
 
 set -e # Exit on failure
 
-gcc -lcurl -lz -o /tmp/codecrafters-build-http-server-c app/*.c
+gcc -fno-omit-frame-pointer -lcurl -lz -ldl -lssl -lcrypto -o /tmp/codecrafters-build-http-server-c app/*.c
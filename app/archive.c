@@ -0,0 +1,514 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "archive.h"
+#include "pool.h"
+#include "static_files.h"
+#include "trace.h"
+#include "uploads.h"
+
+#define TAR_BLOCK 512
+// ustar size field, 11 octal digits, larger sizes go into a pax record
+#define TAR_MAX_SIZE 077777777777ULL
+// a pax header with its records and the ustar header behind it
+#define ARCHIVE_HEADER_MAX (3 * TAR_BLOCK + STATIC_PATH_MAX + 64)
+
+struct ArchiveMember {
+  // relative to the root, directories end with a slash
+  char *path;
+  bool is_dir;
+  mode_t mode;
+  size_t size;
+  time_t mtime;
+  size_t header_len;
+};
+
+typedef struct ArchiveMember ArchiveMember;
+
+INIT_VECTOR(ArchiveMember);
+
+// two of them end the archive
+static const uint8_t zero_blocks[2 * TAR_BLOCK] = {0};
+
+static size_t tar_padding(size_t size) {
+  return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+bool is_archive_request(HttpRequest *req) {
+  size_t len = strlen(ARCHIVE_ROUTE);
+  const char *path = req->url.path;
+  if (strncmp(path, ARCHIVE_ROUTE, len) != 0) {
+    return false;
+  }
+  return (req->method == GET && path[len] == '/') ||
+         (req->method == POST && path[len] == '\0');
+}
+
+static void write_ustar(uint8_t *block, const char *name, const char *prefix,
+                        char type, mode_t mode, size_t size, time_t mtime) {
+  memset(block, 0, TAR_BLOCK);
+  strncpy((char *)block, name, 100);
+  sprintf((char *)block + 100, "%07o", (unsigned)(mode & 07777));
+  sprintf((char *)block + 108, "%07o", 0);
+  sprintf((char *)block + 116, "%07o", 0);
+  sprintf((char *)block + 124, "%011llo",
+          (unsigned long long)(size > TAR_MAX_SIZE ? 0 : size));
+  sprintf((char *)block + 136, "%011llo",
+          (unsigned long long)(mtime < 0 ? 0 : mtime));
+  block[156] = type;
+  memcpy(block + 257, "ustar", 6);
+  memcpy(block + 263, "00", 2);
+  strncpy((char *)block + 345, prefix, 155);
+
+  // summed with the checksum field as spaces
+  memset(block + 148, ' ', 8);
+  unsigned sum = 0;
+  for (size_t i = 0; i < TAR_BLOCK; i += 1) {
+    sum += block[i];
+  }
+  sprintf((char *)block + 148, "%06o", sum);
+  block[155] = ' ';
+}
+
+// "<len> <key>=<value>\n" where len counts the whole record
+static size_t write_pax_record(char *buf, const char *key, const char *value) {
+  size_t payload = strlen(key) + strlen(value) + 3;
+  size_t len = payload + 1;
+  while (len != payload + (size_t)snprintf(NULL, 0, "%zu", len)) {
+    len = payload + snprintf(NULL, 0, "%zu", len);
+  }
+  return sprintf(buf, "%zu %s=%s\n", len, key, value);
+}
+
+// The headers in front of the member's data, `buf` holds
+// ARCHIVE_HEADER_MAX bytes
+static size_t write_member_header(uint8_t *buf, const ArchiveMember *member) {
+  const char *path = member->path;
+  size_t path_len = strlen(path);
+  char type = member->is_dir ? '5' : '0';
+
+  char prefix[156] = "";
+  const char *name = path;
+  bool pax_path = false;
+
+  if (path_len > 100) {
+    // ustar splits at a slash into a prefix of 155 and a name of 100
+    const char *split = strchr(path + (path_len > 101 ? path_len - 101 : 0),
+                               '/');
+    if (split != NULL && split - path <= 155 && split[1] != '\0') {
+      memcpy(prefix, path, split - path);
+      prefix[split - path] = '\0';
+      name = split + 1;
+    } else {
+      pax_path = true;
+    }
+  }
+
+  bool pax_size = member->size > TAR_MAX_SIZE;
+  if (!pax_path && !pax_size) {
+    write_ustar(buf, name, prefix, type, member->mode, member->size,
+                member->mtime);
+    return TAR_BLOCK;
+  }
+
+  char *records = (char *)buf + TAR_BLOCK;
+  size_t records_len = 0;
+  if (pax_path) {
+    records_len += write_pax_record(records, "path", path);
+  }
+  if (pax_size) {
+    char size[32];
+    sprintf(size, "%zu", member->size);
+    records_len += write_pax_record(records + records_len, "size", size);
+  }
+
+  size_t padding = tar_padding(records_len);
+  memset(records + records_len, 0, padding);
+  write_ustar(buf, "PaxHeader", "", 'x', 0644, records_len, member->mtime);
+
+  // the ustar name is only a fallback for readers without pax
+  size_t len = TAR_BLOCK + records_len + padding;
+  char fallback[101];
+  snprintf(fallback, sizeof(fallback), "%s", path);
+  write_ustar(buf + len, fallback, "", type, member->mode, member->size,
+              member->mtime);
+  return len + TAR_BLOCK;
+}
+
+static void push_member(Vector_ArchiveMember *members, const char *path,
+                        const struct stat *file_stat) {
+  bool is_dir = S_ISDIR(file_stat->st_mode);
+  ArchiveMember member = {
+      .path = malloc(strlen(path) + 2),
+      .is_dir = is_dir,
+      .mode = file_stat->st_mode,
+      .size = is_dir ? 0 : (size_t)file_stat->st_size,
+      .mtime = file_stat->st_mtime,
+      .header_len = 0,
+  };
+  sprintf(member.path, "%s%s", path, is_dir ? "/" : "");
+  push_vector_ArchiveMember(members, member);
+}
+
+// Adds everything below the directory, symlinks and special files are
+// skipped so nothing outside of the root ends up in the archive
+static bool collect_tree(int dirfd, const char *path,
+                         Vector_ArchiveMember *members) {
+  DIR *dir = fdopendir(dirfd);
+  if (dir == NULL) {
+    close(dirfd);
+    return false;
+  }
+
+  bool ok = true;
+  struct dirent *entry;
+  while (ok && (entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+        is_hidden(path, entry->d_name)) {
+      continue;
+    }
+
+    char child[STATIC_PATH_MAX];
+    int len = snprintf(child, sizeof(child), "%s%s%s", path,
+                       path[0] == '\0' ? "" : "/", entry->d_name);
+    if (len < 0 || (size_t)len >= sizeof(child)) {
+      printf("archive: skipping long path below %s\n", path);
+      continue;
+    }
+
+    struct stat child_stat;
+    if (fstatat(dirfd, entry->d_name, &child_stat, AT_SYMLINK_NOFOLLOW) != 0 ||
+        !(S_ISREG(child_stat.st_mode) || S_ISDIR(child_stat.st_mode))) {
+      continue;
+    }
+
+    if (members->len == ARCHIVE_MAX_MEMBERS) {
+      ok = false;
+      break;
+    }
+    push_member(members, child, &child_stat);
+
+    if (S_ISDIR(child_stat.st_mode)) {
+      int childfd = openat(dirfd, entry->d_name,
+                           O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      ok = childfd != -1 && collect_tree(childfd, child, members);
+    }
+  }
+
+  closedir(dir);
+  return ok;
+}
+
+// A normalized path, directories with everything below them
+static HttpStatus collect_path(StaticRoot *root, const char *path,
+                               Vector_ArchiveMember *members) {
+  if (is_hidden_path(path)) {
+    return NOT_FOUND;
+  }
+
+  // special files are rejected below, a FIFO mustn't block the open
+  int fd = static_openat(root, path, O_RDONLY | O_NONBLOCK, 0);
+  if (fd == -1) {
+    return errno == ENOENT || errno == ENOTDIR ? NOT_FOUND : BAD_REQ;
+  }
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0) {
+    close(fd);
+    return INTERNAL_SERVER_ERROR;
+  }
+
+  if (S_ISREG(file_stat.st_mode)) {
+    close(fd);
+    if (members->len == ARCHIVE_MAX_MEMBERS) {
+      return INTERNAL_SERVER_ERROR;
+    }
+    push_member(members, path, &file_stat);
+    return OK;
+  } else if (!S_ISDIR(file_stat.st_mode)) {
+    close(fd);
+    return NOT_FOUND;
+  }
+
+  if (path[0] != '\0') {
+    push_member(members, path, &file_stat);
+  }
+  return collect_tree(fd, path, members) ? OK : INTERNAL_SERVER_ERROR;
+}
+
+static HttpStatus collect_members(HttpRequest *req, StaticRoot *root,
+                                  Vector_ArchiveMember *members) {
+  char path[STATIC_PATH_MAX];
+
+  if (req->method == GET) {
+    const char *subtree = req->url.path + strlen(ARCHIVE_ROUTE);
+    if (!normalize_path(subtree, path, sizeof(path))) {
+      return BAD_REQ;
+    }
+    return collect_path(root, path, members);
+  }
+
+  // one path per line
+  const char *curr = (const char *)req->body.body;
+  const char *end = curr + req->body.len;
+  while (curr < end) {
+    const char *eol = memchr(curr, '\n', end - curr);
+    size_t len = (eol == NULL ? end : eol) - curr;
+    if (len > 0 && curr[len - 1] == '\r') {
+      len -= 1;
+    }
+
+    char line[STATIC_PATH_MAX];
+    if (len >= sizeof(line)) {
+      return BAD_REQ;
+    }
+    memcpy(line, curr, len);
+    line[len] = '\0';
+    curr = eol == NULL ? end : eol + 1;
+
+    if (len == 0) {
+      continue;
+    }
+    if (!normalize_path(line, path, sizeof(path)) || path[0] == '\0') {
+      return BAD_REQ;
+    }
+
+    HttpStatus status = collect_path(root, path, members);
+    if (status != OK) {
+      return status;
+    }
+  }
+
+  return members->len > 0 ? OK : BAD_REQ;
+}
+
+// Where the archive goes: straight to the socket or through deflate into
+// chunks
+struct ArchiveWriter {
+  Connection *conn;
+  bool gzip;
+  z_stream stream;
+  PoolBuffer out;
+};
+
+typedef struct ArchiveWriter ArchiveWriter;
+
+#define ARCHIVE_CHUNK (64 * 1024)
+
+static bool write_chunk(ArchiveWriter *writer, const uint8_t *data,
+                        size_t len) {
+  char size[24];
+  int size_len = sprintf(size, "%zx\r\n", len);
+  return conn_write_more(writer->conn, (const uint8_t *)size, size_len) &&
+         conn_write_more(writer->conn, data, len) &&
+         conn_write_more(writer->conn, (const uint8_t *)"\r\n", 2);
+}
+
+static bool deflate_into_chunks(ArchiveWriter *writer, const uint8_t *data,
+                                size_t len, int flush) {
+  z_stream *stream = &writer->stream;
+  stream->next_in = (Bytef *)data;
+  stream->avail_in = len;
+
+  int res = Z_OK;
+  do {
+    stream->next_out = writer->out.data;
+    stream->avail_out = writer->out.capacity;
+
+    res = deflate(stream, flush);
+    size_t produced = writer->out.capacity - stream->avail_out;
+    if (produced > 0 && !write_chunk(writer, writer->out.data, produced)) {
+      return false;
+    }
+  } while (stream->avail_out == 0 || (flush == Z_FINISH && res != Z_STREAM_END));
+
+  return true;
+}
+
+static bool archive_write(ArchiveWriter *writer, const uint8_t *data,
+                          size_t len) {
+  if (writer->gzip) {
+    return deflate_into_chunks(writer, data, len, Z_NO_FLUSH);
+  }
+  return conn_write_more(writer->conn, data, len);
+}
+
+static bool archive_zeros(ArchiveWriter *writer, size_t len) {
+  while (len > 0) {
+    size_t part = len < TAR_BLOCK ? len : TAR_BLOCK;
+    if (!archive_write(writer, zero_blocks, part)) {
+      return false;
+    }
+    len -= part;
+  }
+  return true;
+}
+
+static bool archive_file(ArchiveWriter *writer, int fd, size_t len) {
+  if (!writer->gzip) {
+    return conn_sendfile(writer->conn, fd, 0, len);
+  }
+
+  PoolBuffer in = pool_acquire(ARCHIVE_CHUNK);
+  off_t offset = 0;
+  bool ok = true;
+  while (ok && len > 0) {
+    size_t want = len < in.capacity ? len : in.capacity;
+    ssize_t res = pread(fd, in.data, want, offset);
+    if (res == -1 && errno == EINTR) {
+      continue;
+    } else if (res <= 0) {
+      // the file shrank since it was listed, the caller pads with zeros
+      break;
+    }
+    ok = archive_write(writer, in.data, res);
+    offset += res;
+    len -= res;
+  }
+  pool_release(&in);
+  return ok && len == 0;
+}
+
+// The data of a regular member as it was listed, a file that changed since
+// is cut or padded with zeros so the archive stays readable
+static bool archive_member_data(ArchiveWriter *writer, StaticRoot *root,
+                                const ArchiveMember *member) {
+  size_t sent = 0;
+  // replaced by a FIFO since it was listed, the open mustn't block
+  int fd = static_openat(root, member->path, O_RDONLY | O_NONBLOCK, 0);
+  struct stat file_stat;
+  if (fd != -1 && fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+    size_t available = (size_t)file_stat.st_size < member->size
+                           ? (size_t)file_stat.st_size
+                           : member->size;
+    if (!archive_file(writer, fd, available)) {
+      close(fd);
+      return false;
+    }
+    sent = available;
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+
+  if (sent < member->size) {
+    printf("archive: %s changed while it was sent\n", member->path);
+  }
+  return archive_zeros(writer, member->size - sent + tar_padding(member->size));
+}
+
+// The last write goes without MSG_MORE, that sends what is still held back
+static bool archive_finish(ArchiveWriter *writer) {
+  if (!writer->gzip) {
+    return conn_write(writer->conn, zero_blocks, sizeof(zero_blocks));
+  }
+  return archive_write(writer, zero_blocks, sizeof(zero_blocks)) &&
+         deflate_into_chunks(writer, NULL, 0, Z_FINISH) &&
+         conn_write(writer->conn, (const uint8_t *)"0\r\n\r\n", 5);
+}
+
+static bool write_archive_head(Connection *conn, HttpRequest *req, bool gzip,
+                               size_t size) {
+  char disposition[STATIC_PATH_MAX + 64];
+  const char *subtree = req->url.path + strlen(ARCHIVE_ROUTE);
+  const char *base = strrchr(subtree, '/');
+  base = base == NULL || base[1] == '\0' ? "archive" : base + 1;
+  snprintf(disposition, sizeof(disposition), "attachment; filename=\"%.*s.tar\"",
+           (int)strcspn(base, "\""), base);
+
+  HttpResponse resp = init_response(OK, NO_ENCODING);
+  push_header_response(&resp, CONTENT_TYPE, APPLICATION_TAR);
+  push_header_response(&resp, CONTENT_DISPOSITION, disposition);
+  push_header_response(&resp, VARY, ACCEPT_ENCODING);
+
+  char content_length[32];
+  if (gzip) {
+    push_header_response(&resp, CONTENT_ENCODING, GZIP_ENCODING);
+    push_header_response(&resp, TRANSFER_ENCODING, CHUNKED_ENCODING);
+  } else {
+    sprintf(content_length, "%zu", size);
+    push_header_response(&resp, CONTENT_LENGTH, content_length);
+  }
+  if (!req->keep_alive) {
+    push_header_response(&resp, CONNECTION, CONNECTION_CLOSE);
+  }
+
+  PoolBuffer head = pool_acquire(measure_response(&resp));
+  size_t head_len = write_response(head.data, &resp);
+  bool ok = conn_write_more(conn, head.data, head_len);
+
+  pool_release(&head);
+  free_http_response(&resp);
+  return ok;
+}
+
+bool serve_archive(Connection *conn, HttpRequest *req, AppState *state) {
+  Vector_ArchiveMember members = init_vector_ArchiveMember();
+  HttpStatus status = collect_members(req, state->root, &members);
+
+  // the headers are built once for the length and again while sending
+  uint8_t *header = malloc(ARCHIVE_HEADER_MAX);
+  size_t size = 2 * TAR_BLOCK;
+  for (size_t i = 0; status == OK && i < members.len; i += 1) {
+    ArchiveMember *member = &members.ptr[i];
+    member->header_len = write_member_header(header, member);
+    size += member->header_len + member->size + tar_padding(member->size);
+  }
+
+  bool ok = false;
+  if (status != OK) {
+    printf("archive of %s failed <%i>\n", req->url.path, status);
+    HttpOutput out = init_output();
+    handle_error(&out, status);
+    conn_write_output(conn, &out);
+    free_output(&out);
+    goto ARCHIVE_FREE;
+  }
+
+  int level = current_gzip_level();
+  ArchiveWriter writer = {
+      .conn = conn,
+      .gzip = req->headers.encoding == GZIP && level > 0,
+  };
+  if (writer.gzip) {
+    deflateInit2(&writer.stream, level, Z_DEFLATED, 0x1F, 8,
+                 Z_DEFAULT_STRATEGY);
+    writer.out = pool_acquire(ARCHIVE_CHUNK);
+  }
+
+  printf("archive of %zu members, %zu bytes%s\n", members.len, size,
+         writer.gzip ? " before gzip" : "");
+
+  uint64_t write_start = trace_begin();
+  ok = write_archive_head(conn, req, writer.gzip, size);
+  for (size_t i = 0; ok && i < members.len; i += 1) {
+    const ArchiveMember *member = &members.ptr[i];
+    write_member_header(header, member);
+    ok = archive_write(&writer, header, member->header_len) &&
+         (member->is_dir || archive_member_data(&writer, state->root, member));
+  }
+  ok = ok && archive_finish(&writer);
+  trace_end(TRACE_WRITE, write_start);
+
+  if (writer.gzip) {
+    deflateEnd(&writer.stream);
+    pool_release(&writer.out);
+  }
+
+ARCHIVE_FREE:
+  for (size_t i = 0; i < members.len; i += 1) {
+    free(members.ptr[i].path);
+  }
+  free_vector_ArchiveMember(&members);
+  free(header);
+
+  return ok && req->keep_alive;
+}
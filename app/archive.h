@@ -0,0 +1,26 @@
+#ifndef ARCHIVE
+#define ARCHIVE
+
+#include <stdbool.h>
+
+#include "conn.h"
+#include "http.h"
+#include "routes.h"
+
+// Bulk downloads as a single tar stream (ustar, pax records for long names)
+//   GET  /archive/<dir>   every file and directory below <dir>
+//   POST /archive         the paths listed in the body, one per line
+// Members are sent one after the other with sendfile. Clients accepting
+// gzip get the whole archive compressed on the fly and sent chunked.
+
+#define ARCHIVE_ROUTE "/archive"
+// members collected per archive, more are answered with a 500
+#define ARCHIVE_MAX_MEMBERS (1 << 20)
+
+bool is_archive_request(HttpRequest *req);
+
+// Streams the archive as the response over HTTP/1.1. Returns whether the
+// connection can serve another request.
+bool serve_archive(Connection *conn, HttpRequest *req, AppState *state);
+
+#endif // !ARCHIVE
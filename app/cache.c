@@ -0,0 +1,261 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+// FNV-1a
+static uint64_t hash_key(const char *key) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (const char *c = key; *c != '\0'; c += 1) {
+    hash ^= (uint8_t)*c;
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+static CacheShard *shard_for(ResponseCache *cache, uint64_t hash) {
+  return &cache->shards[hash % CACHE_SHARDS];
+}
+
+static size_t bucket_for(uint64_t hash) {
+  return (hash / CACHE_SHARDS) % CACHE_BUCKETS;
+}
+
+static size_t entry_cost(CacheEntry *entry) {
+  return sizeof(CacheEntry) + strlen(entry->key) + entry->len;
+}
+
+void init_cache(ResponseCache *cache, size_t budget) {
+  atomic_init(&cache->shard_budget, budget / CACHE_SHARDS);
+
+  for (size_t i = 0; i < CACHE_SHARDS; i += 1) {
+    CacheShard *shard = &cache->shards[i];
+    *shard = (CacheShard){
+        .mutex = {},
+        .bytes = 0,
+        .buckets = {0},
+        .lru_head = NULL,
+        .lru_tail = NULL,
+    };
+    pthread_mutex_init(&shard->mutex, NULL);
+  }
+}
+
+static void free_entry(CacheEntry *entry) {
+  free(entry->key);
+  free(entry->data);
+  free(entry);
+}
+
+void cache_release(void *arg) {
+  CacheEntry *entry = arg;
+  if (atomic_fetch_sub(&entry->refcount, 1) == 1) {
+    free_entry(entry);
+  }
+}
+
+// needs the shard lock, drops the reference held by the shard
+static void unlink_entry(CacheShard *shard, CacheEntry *entry) {
+  CacheEntry **curr = &shard->buckets[bucket_for(entry->hash)];
+  while (*curr != entry) {
+    curr = &(*curr)->hash_next;
+  }
+  *curr = entry->hash_next;
+
+  if (entry->lru_prev != NULL) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    shard->lru_head = entry->lru_next;
+  }
+
+  if (entry->lru_next != NULL) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    shard->lru_tail = entry->lru_prev;
+  }
+
+  shard->bytes -= entry_cost(entry);
+  cache_release(entry);
+}
+
+// needs the shard lock
+static void push_front(CacheShard *shard, CacheEntry *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = shard->lru_head;
+  if (shard->lru_head != NULL) {
+    shard->lru_head->lru_prev = entry;
+  }
+  shard->lru_head = entry;
+  if (shard->lru_tail == NULL) {
+    shard->lru_tail = entry;
+  }
+}
+
+// needs the shard lock
+static CacheEntry *find_entry(CacheShard *shard, const char *key,
+                              uint64_t hash) {
+  for (CacheEntry *curr = shard->buckets[bucket_for(hash)]; curr != NULL;
+       curr = curr->hash_next) {
+    if (curr->hash == hash && strcmp(curr->key, key) == 0) {
+      return curr;
+    }
+  }
+  return NULL;
+}
+
+void free_cache(ResponseCache *cache) {
+  for (size_t i = 0; i < CACHE_SHARDS; i += 1) {
+    CacheShard *shard = &cache->shards[i];
+    pthread_mutex_lock(&shard->mutex);
+    while (shard->lru_head != NULL) {
+      unlink_entry(shard, shard->lru_head);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    pthread_mutex_destroy(&shard->mutex);
+  }
+}
+
+void cache_set_budget(ResponseCache *cache, size_t budget) {
+  atomic_store(&cache->shard_budget, budget / CACHE_SHARDS);
+}
+
+CacheValidator cache_validator(const struct stat *file_stat) {
+  CacheValidator validator = {
+      .dev = file_stat->st_dev,
+      .ino = file_stat->st_ino,
+      .size = file_stat->st_size,
+      .mtime = file_stat->st_mtim,
+  };
+  return validator;
+}
+
+static bool same_validator(const CacheValidator *a, const CacheValidator *b) {
+  return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+         a->mtime.tv_sec == b->mtime.tv_sec &&
+         a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+CacheEntry *cache_lookup(ResponseCache *cache, const char *key,
+                         const CacheValidator *validator) {
+  uint64_t hash = hash_key(key);
+  CacheShard *shard = shard_for(cache, hash);
+
+  pthread_mutex_lock(&shard->mutex);
+
+  CacheEntry *entry = find_entry(shard, key, hash);
+  if (entry != NULL && !same_validator(&entry->validator, validator)) {
+    unlink_entry(shard, entry);
+    entry = NULL;
+  }
+
+  if (entry != NULL) {
+    // move to the front of the LRU
+    if (entry != shard->lru_head) {
+      entry->lru_prev->lru_next = entry->lru_next;
+      if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+      } else {
+        shard->lru_tail = entry->lru_prev;
+      }
+      push_front(shard, entry);
+    }
+
+    atomic_fetch_add(&entry->refcount, 1);
+  }
+
+  pthread_mutex_unlock(&shard->mutex);
+
+  return entry;
+}
+
+bool cache_accepts(ResponseCache *cache, size_t len) {
+  return len <= cache->shard_budget / CACHE_MAX_ENTRY_SHARE;
+}
+
+void cache_insert(ResponseCache *cache, const char *key,
+                  const CacheValidator *validator, HttpOutput *out) {
+  size_t len = output_len(out);
+  if (!cache_accepts(cache, len)) {
+    return;
+  }
+
+  for (size_t i = 0; i < out->segments.len; i += 1) {
+    if (out->segments.ptr[i].kind != SEGMENT_MEMORY) {
+      // only what is in memory can be flattened
+      return;
+    }
+  }
+
+  uint8_t *data = malloc(len);
+  if (data == NULL) {
+    // caching is best effort
+    return;
+  }
+
+  // flatten head and segments
+  memcpy(data, out->buf, out->len);
+  size_t s = out->len;
+  for (size_t i = 0; i < out->segments.len; i += 1) {
+    HttpSegment *segment = &out->segments.ptr[i];
+    memcpy(data + s, segment->data, segment->len);
+    s += segment->len;
+  }
+
+  cache_insert_data(cache, key, validator, data, len);
+}
+
+void cache_insert_data(ResponseCache *cache, const char *key,
+                       const CacheValidator *validator, uint8_t *data,
+                       size_t len) {
+  if (!cache_accepts(cache, len)) {
+    free(data);
+    return;
+  }
+
+  CacheEntry *entry = malloc(sizeof(CacheEntry));
+  char *entry_key = strdup(key);
+  if (entry == NULL || entry_key == NULL) {
+    free(entry);
+    free(data);
+    free(entry_key);
+    return;
+  }
+
+  uint64_t hash = hash_key(key);
+
+  *entry = (CacheEntry){
+      .key = entry_key,
+      .hash = hash,
+      .validator = *validator,
+      .data = data,
+      .len = len,
+      // held by the shard
+      .refcount = 1,
+      .hash_next = NULL,
+      .lru_prev = NULL,
+      .lru_next = NULL,
+  };
+
+  CacheShard *shard = shard_for(cache, hash);
+
+  pthread_mutex_lock(&shard->mutex);
+
+  CacheEntry *old = find_entry(shard, key, hash);
+  if (old != NULL) {
+    unlink_entry(shard, old);
+  }
+
+  size_t cost = entry_cost(entry);
+  while (shard->lru_tail != NULL && shard->bytes + cost > cache->shard_budget) {
+    unlink_entry(shard, shard->lru_tail);
+  }
+
+  CacheEntry **bucket = &shard->buckets[bucket_for(hash)];
+  entry->hash_next = *bucket;
+  *bucket = entry;
+  push_front(shard, entry);
+  shard->bytes += cost;
+
+  pthread_mutex_unlock(&shard->mutex);
+}
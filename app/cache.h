@@ -0,0 +1,92 @@
+#ifndef CACHE
+#define CACHE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "http.h"
+
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 256
+#define CACHE_BUDGET (64 * 1024 * 1024)
+// a single response may take at most this share of a shard
+#define CACHE_MAX_ENTRY_SHARE 4
+
+// What a cached file response was built from, if any of it changes the entry
+// is stale
+struct CacheValidator {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+};
+
+typedef struct CacheValidator CacheValidator;
+
+// A fully serialized response (head + body)
+struct CacheEntry {
+  char *key;
+  uint64_t hash;
+  CacheValidator validator;
+  uint8_t *data;
+  size_t len;
+  atomic_size_t refcount;
+  struct CacheEntry *hash_next;
+  struct CacheEntry *lru_prev;
+  struct CacheEntry *lru_next;
+};
+
+typedef struct CacheEntry CacheEntry;
+
+struct CacheShard {
+  pthread_mutex_t mutex;
+  size_t bytes;
+  CacheEntry *buckets[CACHE_BUCKETS];
+  // most recently used first
+  CacheEntry *lru_head;
+  CacheEntry *lru_tail;
+};
+
+typedef struct CacheShard CacheShard;
+
+struct ResponseCache {
+  // changed on reload while the workers use the cache
+  atomic_size_t shard_budget;
+  CacheShard shards[CACHE_SHARDS];
+};
+
+typedef struct ResponseCache ResponseCache;
+
+void init_cache(ResponseCache *cache, size_t budget);
+void free_cache(ResponseCache *cache);
+// A smaller budget evicts on the next insert into a shard
+void cache_set_budget(ResponseCache *cache, size_t budget);
+
+CacheValidator cache_validator(const struct stat *file_stat);
+
+// Returns a referenced entry matching key and validator or NULL, a stale
+// entry is dropped on the way
+CacheEntry *cache_lookup(ResponseCache *cache, const char *key,
+                         const CacheValidator *validator);
+
+// Whether a response of this size would be cached at all
+bool cache_accepts(ResponseCache *cache, size_t len);
+
+// Copies the written response into the cache, replacing an older entry for
+// the key. Responses too large for the budget are silently not cached.
+void cache_insert(ResponseCache *cache, const char *key,
+                  const CacheValidator *validator, HttpOutput *out);
+
+// Same for a response serialized by the caller, takes over the malloc'ed data
+void cache_insert_data(ResponseCache *cache, const char *key,
+                       const CacheValidator *validator, uint8_t *data,
+                       size_t len);
+
+// Drops a reference returned by cache_lookup, has the HttpReleaseFn signature
+void cache_release(void *entry);
+
+#endif // !CACHE
@@ -0,0 +1,117 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+// records are collected in the stdio buffer and go out with the closes
+#define CAPTURE_BUFFER (256 * 1024)
+
+atomic_bool capture_enabled = false;
+
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE *capture_file = NULL;
+static uint64_t capture_start = 0;
+static atomic_uint_fast32_t next_connection = 1;
+
+static uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void put_le(uint8_t *buf, uint64_t value, size_t len) {
+  for (size_t i = 0; i < len; i += 1) {
+    buf[i] = value >> (8 * i);
+  }
+}
+
+bool init_capture(const char *path) {
+  // only for the server's user, an older capture keeps its mode otherwise
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  FILE *file = NULL;
+  if (fd == -1 || fchmod(fd, 0600) != 0 || (file = fdopen(fd, "wb")) == NULL) {
+    printf("failed to open capture %s: %s\n", path, strerror(errno));
+    if (fd != -1) {
+      close(fd);
+    }
+    return false;
+  }
+  setvbuf(file, NULL, _IOFBF, CAPTURE_BUFFER);
+  fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, file);
+
+  pthread_mutex_lock(&capture_mutex);
+  capture_file = file;
+  capture_start = now_ns();
+  pthread_mutex_unlock(&capture_mutex);
+
+  atomic_store(&capture_enabled, true);
+  printf("capturing client traffic to %s\n", path);
+  return true;
+}
+
+void free_capture() {
+  atomic_store(&capture_enabled, false);
+
+  pthread_mutex_lock(&capture_mutex);
+  if (capture_file != NULL) {
+    fclose(capture_file);
+    capture_file = NULL;
+  }
+  pthread_mutex_unlock(&capture_mutex);
+}
+
+static void write_record(CaptureKind kind, uint32_t connection,
+                         const uint8_t *buf, size_t len) {
+  uint8_t header[CAPTURE_DATA_HEADER];
+  size_t header_len = CAPTURE_RECORD_HEADER;
+
+  pthread_mutex_lock(&capture_mutex);
+  if (capture_file == NULL) {
+    pthread_mutex_unlock(&capture_mutex);
+    return;
+  }
+
+  // taken under the lock, timestamps never go backwards in the log
+  header[0] = kind;
+  put_le(header + 1, connection, 4);
+  put_le(header + 5, now_ns() - capture_start, 8);
+  if (kind == CAPTURE_DATA) {
+    put_le(header + CAPTURE_RECORD_HEADER, len, 4);
+    header_len = CAPTURE_DATA_HEADER;
+  }
+
+  fwrite(header, 1, header_len, capture_file);
+  if (len > 0) {
+    fwrite(buf, 1, len, capture_file);
+  }
+  // a connection is only replayed up to the last flush
+  if (kind == CAPTURE_CLOSE) {
+    fflush(capture_file);
+  }
+  pthread_mutex_unlock(&capture_mutex);
+}
+
+uint32_t capture_open() {
+  if (__builtin_expect(
+          !atomic_load_explicit(&capture_enabled, memory_order_relaxed), 1)) {
+    return 0;
+  }
+
+  uint32_t connection = atomic_fetch_add(&next_connection, 1);
+  write_record(CAPTURE_OPEN, connection, NULL, 0);
+  return connection;
+}
+
+void capture_data(uint32_t connection, const uint8_t *buf, size_t len) {
+  write_record(CAPTURE_DATA, connection, buf, len);
+}
+
+void capture_close(uint32_t connection) {
+  write_record(CAPTURE_CLOSE, connection, NULL, 0);
+}
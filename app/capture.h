@@ -0,0 +1,54 @@
+#ifndef CAPTURE
+#define CAPTURE
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Optional capture of everything clients send, with `capture <path>` the
+// server writes a binary log that tools/replay.c sends to an instance again.
+//
+// The log starts with CAPTURE_MAGIC, followed by records with numbers in
+// little endian:
+//   u8 kind | u32 connection | u64 ns since the capture started
+// and for CAPTURE_DATA
+//   u32 len | len bytes as they were read from the client
+// Data is what the server read, after TLS, so a capture replays against a
+// plaintext listener. Connection ids start at 1 and are never reused.
+//
+// A capture holds credentials (Authorization and Cookie headers, the admin
+// token, upload bodies) in the clear, it is created with mode 0600.
+//
+// Disabled, a connection costs one relaxed load.
+
+#define CAPTURE_MAGIC "HTTPCAP1"
+#define CAPTURE_MAGIC_LEN 8
+// kind, connection and timestamp
+#define CAPTURE_RECORD_HEADER 13
+#define CAPTURE_DATA_HEADER (CAPTURE_RECORD_HEADER + 4)
+
+enum CaptureKind {
+  // accepted by the server
+  CAPTURE_OPEN = 1,
+  // read from the client
+  CAPTURE_DATA = 2,
+  // closed or handed off by the worker
+  CAPTURE_CLOSE = 3,
+};
+
+typedef enum CaptureKind CaptureKind;
+
+extern atomic_bool capture_enabled;
+
+// Truncates the log at `path` and starts capturing
+bool init_capture(const char *path);
+// Flushes and closes the log once no thread captures anymore
+void free_capture();
+
+// A new connection id, 0 while capture is disabled
+uint32_t capture_open();
+void capture_data(uint32_t connection, const uint8_t *buf, size_t len);
+void capture_close(uint32_t connection);
+
+#endif // !CAPTURE
@@ -0,0 +1,416 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "cache.h"
+#include "config.h"
+#include "pool.h"
+#include "routes.h"
+#include "thread.h"
+
+static void default_config(ServerConfig *config) {
+  *config = (ServerConfig){
+      .directory = "/tmp",
+      .modules = "",
+      .tls_cert = "",
+      .tls_key = "",
+      .listeners = init_vector_ListenAddress(),
+      .proxies = init_vector_ProxyRoute(),
+      .backlog = SOMAXCONN,
+      .workers = THREADPOOL_SIZE,
+      .io_workers = THREADPOOL_SIZE,
+      .durability = DURABILITY_NONE,
+      .dedup = false,
+      .events = false,
+      .capture = "",
+      .runtime =
+          {
+              .sockets = default_socket_profile(),
+              .timeouts = default_conn_timeouts(),
+              .read_buffer = POOL_MIN_BUFFER,
+              .max_body_size = MAX_BODY_SIZE,
+              .gzip_level = DEFAULT_GZIP_LEVEL,
+              .gzip_min_size = 0,
+              .cache_budget = CACHE_BUDGET,
+              .trace = false,
+              .admin_token = "",
+          },
+  };
+}
+
+// a number with an optional k, m or g suffix
+static bool parse_size(const char *value, size_t min, size_t max,
+                       size_t *out) {
+  char *end = NULL;
+  errno = 0;
+  unsigned long long number = strtoull(value, &end, 10);
+  if (*value == '\0' || *value == '-' || errno != 0) {
+    return false;
+  }
+
+  unsigned shift = 0;
+  switch (*end) {
+  case 'k':
+  case 'K':
+    shift = 10;
+    end += 1;
+    break;
+  case 'm':
+  case 'M':
+    shift = 20;
+    end += 1;
+    break;
+  case 'g':
+  case 'G':
+    shift = 30;
+    end += 1;
+    break;
+  }
+
+  // the suffix mustn't wrap the value around
+  if (number > (SIZE_MAX >> shift)) {
+    return false;
+  }
+  number <<= shift;
+
+  if (*end != '\0' || number < min || number > max) {
+    return false;
+  }
+
+  *out = number;
+  return true;
+}
+
+static bool parse_path(const char *value, char *out) {
+  if (strlen(value) >= CONFIG_PATH_MAX) {
+    return false;
+  }
+  strcpy(out, value);
+  return true;
+}
+
+// Where the settings are read from, the first `listen` or `proxy` of a
+// source replaces the ones of the sources before it
+struct ConfigSource {
+  const char *name;
+  size_t line;
+  bool has_listen;
+  bool has_proxy;
+};
+
+typedef struct ConfigSource ConfigSource;
+
+static bool apply_setting(ServerConfig *config, ConfigSource *source,
+                          const char *key, const char *value) {
+  RuntimeConfig *runtime = &config->runtime;
+  ConnTimeouts *timeouts = &runtime->timeouts;
+  size_t number = 0;
+  bool ok = true;
+
+  if (strcmp(key, "directory") == 0) {
+    ok = parse_path(value, config->directory);
+  } else if (strcmp(key, "modules") == 0) {
+    ok = parse_path(value, config->modules);
+  } else if (strcmp(key, "fsync") == 0) {
+    ok = parse_durability_policy(value, &config->durability);
+  } else if (strcmp(key, "dedup") == 0) {
+    ok = parse_size(value, 0, 1, &number);
+    config->dedup = number != 0;
+  } else if (strcmp(key, "events") == 0) {
+    ok = parse_size(value, 0, 1, &number);
+    config->events = number != 0;
+  } else if (strcmp(key, "capture") == 0) {
+    ok = parse_path(value, config->capture);
+  } else if (strcmp(key, "tls-cert") == 0) {
+    ok = parse_path(value, config->tls_cert);
+  } else if (strcmp(key, "tls-key") == 0) {
+    ok = parse_path(value, config->tls_key);
+  } else if (strcmp(key, "listen") == 0 || strcmp(key, "tls-listen") == 0) {
+    ListenAddress address;
+    ok = parse_listen_address(value, &address);
+    address.tls = strcmp(key, "tls-listen") == 0;
+    if (ok) {
+      if (!source->has_listen) {
+        config->listeners.len = 0;
+        source->has_listen = true;
+      }
+      push_vector_ListenAddress(&config->listeners, address);
+    }
+  } else if (strcmp(key, "proxy") == 0) {
+    ProxyRoute route;
+    ok = parse_proxy_route(value, &route);
+    if (ok) {
+      if (!source->has_proxy) {
+        config->proxies.len = 0;
+        source->has_proxy = true;
+      }
+      push_vector_ProxyRoute(&config->proxies, route);
+    }
+  } else if (strcmp(key, "backlog") == 0) {
+    ok = parse_size(value, 1, 1 << 20, &number);
+    config->backlog = number;
+  } else if (strcmp(key, "workers") == 0) {
+    ok = parse_size(value, 1, 4096, &config->workers);
+  } else if (strcmp(key, "io-workers") == 0) {
+    ok = parse_size(value, 1, 4096, &config->io_workers);
+  } else if (strcmp(key, "read-buffer") == 0) {
+    ok = parse_size(value, 1, MAX_BODY_SIZE, &runtime->read_buffer);
+  } else if (strcmp(key, "max-body-size") == 0) {
+    ok = parse_size(value, 0, MAX_BODY_SIZE, &runtime->max_body_size);
+  } else if (strcmp(key, "idle-timeout") == 0) {
+    ok = parse_size(value, 1, UINT32_MAX, &number);
+    timeouts->idle_ms = number;
+  } else if (strcmp(key, "header-timeout") == 0) {
+    ok = parse_size(value, 1, UINT32_MAX, &number);
+    timeouts->header_ms = number;
+  } else if (strcmp(key, "body-timeout") == 0) {
+    ok = parse_size(value, 1, UINT32_MAX, &number);
+    timeouts->body_ms = number;
+  } else if (strcmp(key, "write-timeout") == 0) {
+    ok = parse_size(value, 1, UINT32_MAX, &number);
+    timeouts->write_ms = number;
+  } else if (strcmp(key, "gzip-level") == 0) {
+    ok = parse_size(value, 0, 9, &number);
+    runtime->gzip_level = number;
+  } else if (strcmp(key, "gzip-min-size") == 0) {
+    ok = parse_size(value, 0, SIZE_MAX, &runtime->gzip_min_size);
+  } else if (strcmp(key, "cache-budget") == 0) {
+    ok = parse_size(value, 0, SIZE_MAX, &runtime->cache_budget);
+  } else if (strcmp(key, "trace") == 0) {
+    ok = parse_size(value, 0, 1, &number);
+    runtime->trace = number != 0;
+  } else if (strcmp(key, "admin-token") == 0) {
+    ok = strlen(value) < ADMIN_TOKEN_MAX;
+    if (ok) {
+      strcpy(runtime->admin_token, value);
+    }
+  } else if (!parse_socket_option(&runtime->sockets, key, value)) {
+    printf("%s:%zu: unknown setting or invalid value %s %s\n", source->name,
+           source->line, key, value);
+    return false;
+  }
+
+  if (!ok) {
+    printf("%s:%zu: invalid value for %s: %s\n", source->name, source->line,
+           key, value);
+  }
+  return ok;
+}
+
+static bool load_config_file(ServerConfig *config, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    printf("failed to open config %s: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  ConfigSource source = {
+      .name = path,
+      .line = 0,
+      .has_listen = false,
+      .has_proxy = false,
+  };
+
+  bool ok = true;
+  char line[CONFIG_PATH_MAX + 64];
+  while (ok && fgets(line, sizeof(line), file) != NULL) {
+    source.line += 1;
+
+    // cut comments and the line end
+    line[strcspn(line, "#\r\n")] = '\0';
+
+    char *key = line + strspn(line, " \t");
+    if (*key == '\0') {
+      continue;
+    }
+
+    size_t key_len = strcspn(key, " \t");
+    char *value = key + key_len;
+    value += strspn(value, " \t");
+
+    // trailing blanks
+    size_t value_len = strlen(value);
+    while (value_len > 0 &&
+           (value[value_len - 1] == ' ' || value[value_len - 1] == '\t')) {
+      value_len -= 1;
+    }
+    value[value_len] = '\0';
+    key[key_len] = '\0';
+
+    if (*value == '\0') {
+      printf("%s:%zu: %s needs a value\n", path, source.line, key);
+      ok = false;
+    } else {
+      ok = apply_setting(config, &source, key, value);
+    }
+  }
+
+  fclose(file);
+  return ok;
+}
+
+static bool load_command_line(ServerConfig *config, int argc, char **argv) {
+  ConfigSource source = {
+      .name = "argv",
+      .line = 0,
+      .has_listen = false,
+      .has_proxy = false,
+  };
+
+  for (int i = 1; i < argc; i += 1) {
+    source.line = i;
+
+    const char *arg = argv[i];
+    if (strncmp(arg, "--", 2) != 0) {
+      printf("unexpected argument %s\n", arg);
+      return false;
+    } else if (i + 1 == argc) {
+      printf("%s needs a value\n", arg);
+      return false;
+    }
+
+    const char *value = argv[i + 1];
+    i += 1;
+
+    // already read to find the file
+    if (strcmp(arg, "--config") == 0) {
+      continue;
+    }
+
+    if (!apply_setting(config, &source, arg + 2, value)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool load_config(ConfigStore *store, ServerConfig *config) {
+  default_config(config);
+
+  bool ok = (store->path == NULL || load_config_file(config, store->path)) &&
+            load_command_line(config, store->argc, store->argv);
+
+  if (ok && config->listeners.len == 0) {
+    ListenAddress address;
+    char port[16];
+    sprintf(port, "%d", DEFAULT_PORT);
+    parse_listen_address(port, &address);
+    push_vector_ListenAddress(&config->listeners, address);
+  }
+
+  for (size_t i = 0; ok && i < config->listeners.len; i += 1) {
+    if (config->listeners.ptr[i].tls &&
+        (config->tls_cert[0] == '\0' || config->tls_key[0] == '\0')) {
+      printf("tls-listen %s needs tls-cert and tls-key\n",
+             config->listeners.ptr[i].name);
+      ok = false;
+    }
+  }
+
+  if (!ok) {
+    free_vector_ListenAddress(&config->listeners);
+    free_vector_ProxyRoute(&config->proxies);
+  }
+  return ok;
+}
+
+bool init_config_store(ConfigStore *store, int argc, char **argv) {
+  store->path = NULL;
+  store->argc = argc;
+  store->argv = argv;
+
+  for (int i = 1; i + 1 < argc; i += 1) {
+    if (strcmp(argv[i], "--config") == 0) {
+      store->path = argv[i + 1];
+    }
+  }
+
+  if (!load_config(store, &store->config)) {
+    return false;
+  }
+
+  pthread_mutex_init(&store->mutex, NULL);
+  return true;
+}
+
+void free_config_store(ConfigStore *store) {
+  free_vector_ListenAddress(&store->config.listeners);
+  free_vector_ProxyRoute(&store->config.proxies);
+  pthread_mutex_destroy(&store->mutex);
+}
+
+RuntimeConfig current_runtime_config(ConfigStore *store) {
+  pthread_mutex_lock(&store->mutex);
+  RuntimeConfig runtime = store->config.runtime;
+  pthread_mutex_unlock(&store->mutex);
+  return runtime;
+}
+
+static bool same_listeners(Vector_ListenAddress *a, Vector_ListenAddress *b) {
+  if (a->len != b->len) {
+    return false;
+  }
+  for (size_t i = 0; i < a->len; i += 1) {
+    if (strcmp(a->ptr[i].name, b->ptr[i].name) != 0 ||
+        a->ptr[i].tls != b->ptr[i].tls) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool same_proxies(Vector_ProxyRoute *a, Vector_ProxyRoute *b) {
+  if (a->len != b->len) {
+    return false;
+  }
+  for (size_t i = 0; i < a->len; i += 1) {
+    if (!same_proxy_route(&a->ptr[i], &b->ptr[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void check_restart(bool changed, const char *key) {
+  if (changed) {
+    printf("%s changed, it only applies after a restart\n", key);
+  }
+}
+
+bool reload_config(ConfigStore *store) {
+  ServerConfig config;
+  if (!load_config(store, &config)) {
+    printf("reload failed, keeping the current configuration\n");
+    return false;
+  }
+
+  ServerConfig *current = &store->config;
+  check_restart(strcmp(config.directory, current->directory) != 0,
+                "directory");
+  check_restart(strcmp(config.modules, current->modules) != 0, "modules");
+  check_restart(strcmp(config.tls_cert, current->tls_cert) != 0 ||
+                    strcmp(config.tls_key, current->tls_key) != 0,
+                "tls-cert or tls-key");
+  check_restart(!same_listeners(&config.listeners, &current->listeners),
+                "listen");
+  check_restart(!same_proxies(&config.proxies, &current->proxies), "proxy");
+  check_restart(config.backlog != current->backlog, "backlog");
+  check_restart(config.workers != current->workers, "workers");
+  check_restart(config.io_workers != current->io_workers, "io-workers");
+  check_restart(config.durability != current->durability, "fsync");
+  check_restart(config.dedup != current->dedup, "dedup");
+  check_restart(config.events != current->events, "events");
+  check_restart(strcmp(config.capture, current->capture) != 0, "capture");
+
+  pthread_mutex_lock(&store->mutex);
+  current->runtime = config.runtime;
+  pthread_mutex_unlock(&store->mutex);
+
+  free_vector_ListenAddress(&config.listeners);
+  free_vector_ProxyRoute(&config.proxies);
+
+  printf("configuration reloaded\n");
+  return true;
+}
@@ -0,0 +1,92 @@
+#ifndef CONFIG
+#define CONFIG
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "conn.h"
+#include "listen.h"
+#include "proxy.h"
+#include "sockopt.h"
+#include "uploads.h"
+
+// Settings come from a configuration file given with `--config <path>` and
+// from the command line, every `<key> <value>` line of the file can be
+// passed as `--<key> <value>` and wins over the file. `#` starts a comment.
+//
+// SIGHUP reads both again, only the RuntimeConfig changes without a restart.
+
+#define CONFIG_PATH_MAX 4096
+#define ADMIN_TOKEN_MAX 128
+
+// Applied on reload, connections accepted afterwards use them
+struct RuntimeConfig {
+  // the listener options only apply at startup
+  SocketProfile sockets;
+  ConnTimeouts timeouts;
+  // what a connection's input buffer starts with
+  size_t read_buffer;
+  size_t max_body_size;
+  int gzip_level;
+  size_t gzip_min_size;
+  size_t cache_budget;
+  // record spans for /debug/trace
+  bool trace;
+  // `Authorization: Bearer <token>` for /debug/profile and /debug/trace,
+  // empty disables both
+  char admin_token[ADMIN_TOKEN_MAX];
+};
+
+typedef struct RuntimeConfig RuntimeConfig;
+
+struct ServerConfig {
+  char directory[CONFIG_PATH_MAX];
+  // empty without modules
+  char modules[CONFIG_PATH_MAX];
+  // PEM files, required by `tls-listen`
+  char tls_cert[CONFIG_PATH_MAX];
+  char tls_key[CONFIG_PATH_MAX];
+  Vector_ListenAddress listeners;
+  // `proxy <route> <upstream> [<upstream> ...]`, tried before the routes
+  Vector_ProxyRoute proxies;
+  int backlog;
+  size_t workers;
+  size_t io_workers;
+  DurabilityPolicy durability;
+  // content addressed uploads, see UploadStore
+  bool dedup;
+  // /events, see EventHub
+  bool events;
+  // empty without traffic capture, see capture.h
+  char capture[CONFIG_PATH_MAX];
+
+  RuntimeConfig runtime;
+};
+
+typedef struct ServerConfig ServerConfig;
+
+struct ConfigStore {
+  pthread_mutex_t mutex;
+  ServerConfig config;
+  // NULL without --config
+  const char *path;
+  int argc;
+  char **argv;
+};
+
+typedef struct ConfigStore ConfigStore;
+
+// Logs what is wrong and returns false if the file or command line is
+// invalid
+bool init_config_store(ConfigStore *store, int argc, char **argv);
+void free_config_store(ConfigStore *store);
+
+RuntimeConfig current_runtime_config(ConfigStore *store);
+
+// Loads the file and command line again, keeps the current configuration if
+// they are invalid. Changed settings that need a restart are logged and
+// ignored.
+bool reload_config(ConfigStore *store);
+
+#endif // !CONFIG
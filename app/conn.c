@@ -0,0 +1,358 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "conn.h"
+#include "pool.h"
+
+ConnTimeouts default_conn_timeouts() {
+  ConnTimeouts timeouts = {
+      .idle_ms = IDLE_TIMEOUT_MS,
+      .header_ms = HEADER_TIMEOUT_MS,
+      .body_ms = BODY_TIMEOUT_MS,
+      .write_ms = WRITE_TIMEOUT_MS,
+  };
+  return timeouts;
+}
+
+Connection init_connection(int fd, TimerWheel *timers) {
+  Connection conn = {
+      .fd = fd,
+      .timer = init_timer(fd),
+      .timers = timers,
+      .cork = false,
+      .timeouts = default_conn_timeouts(),
+      .max_body_size = MAX_BODY_SIZE,
+      .tls = NULL,
+      .kernel_tls = false,
+      .capture = 0,
+  };
+  return conn;
+}
+
+void close_connection(Connection *conn) {
+  timer_disarm(conn->timers, &conn->timer);
+  if (conn->capture != 0) {
+    capture_close(conn->capture);
+    conn->capture = 0;
+  }
+  if (conn->tls != NULL) {
+    tls_close(conn->tls);
+    conn->tls = NULL;
+  }
+  close(conn->fd);
+  conn->fd = -1;
+}
+
+bool conn_start_tls(Connection *conn, TlsContext *tls) {
+  conn->tls = tls_accept(tls, conn->fd);
+  conn->kernel_tls = conn->tls != NULL && tls_kernel_send(conn->tls);
+  return conn->tls != NULL;
+}
+
+bool conn_has_buffered(Connection *conn) {
+  return conn->tls != NULL && tls_pending(conn->tls);
+}
+
+// TLS in user space, kTLS is written like a plain socket
+static bool user_tls(Connection *conn) {
+  return conn->tls != NULL && !conn->kernel_tls;
+}
+
+void conn_arm(Connection *conn, uint32_t timeout_ms, TimerAction action) {
+  timer_arm(conn->timers, &conn->timer, timeout_ms, action);
+}
+
+bool conn_expired(Connection *conn) {
+  return timer_expired(conn->timers, &conn->timer);
+}
+
+// Reads whatever fits into the buffer, returns false once the client is gone
+// or the deadline passed
+bool conn_read_some(Connection *conn, uint8_t *buf, size_t *len,
+                    size_t capacity) {
+  size_t res = 0;
+  if (conn->tls != NULL) {
+    res = tls_read(conn->tls, buf + *len, capacity - *len);
+  } else {
+    ssize_t count = 0;
+    do {
+      count = read(conn->fd, buf + *len, capacity - *len);
+    } while (count == -1 && errno == EINTR);
+    res = count > 0 ? count : 0;
+  }
+
+  if (res == 0) {
+    return false;
+  }
+  if (conn->capture != 0) {
+    capture_data(conn->capture, buf + *len, res);
+  }
+  *len += res;
+  return true;
+}
+
+static size_t waiting_limit = 0;
+static atomic_size_t waiting = 0;
+
+void set_waiting_limit(size_t max_waiting) { waiting_limit = max_waiting; }
+
+static bool is_readable(Connection *conn) {
+  struct pollfd pfd = {
+      .fd = conn->fd,
+      .events = POLLIN,
+      .revents = 0,
+  };
+  return conn_has_buffered(conn) || poll(&pfd, 1, 0) > 0;
+}
+
+bool conn_read_request(Connection *conn, uint8_t *buf, size_t *len,
+                       size_t capacity, bool *busy) {
+  *busy = false;
+  if (is_readable(conn)) {
+    // returns right away, nothing to hold a slot for
+    return conn_read_some(conn, buf, len, capacity);
+  }
+
+  if (atomic_fetch_add(&waiting, 1) >= waiting_limit) {
+    atomic_fetch_sub(&waiting, 1);
+    *busy = true;
+    return false;
+  }
+  bool res = conn_read_some(conn, buf, len, capacity);
+  atomic_fetch_sub(&waiting, 1);
+  return res;
+}
+
+#define MAX_IOVECS 16
+
+// Sends the head and all segments, memory is gathered into as few writev
+// calls as possible and file segments go out with sendfile
+static void set_cork(Connection *conn, int value) {
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+}
+
+// Whether a file segment splits the output into several calls
+static bool needs_several_writes(HttpOutput *out) {
+  for (size_t i = 0; i < out->segments.len; i += 1) {
+    if (out->segments.ptr[i].kind == SEGMENT_FILE) {
+      return out->len > 0 || out->segments.len > 1;
+    }
+  }
+  return false;
+}
+
+// largest TLS record, pieces are gathered into full records
+#define TLS_RECORD_SIZE (16 * 1024)
+
+static bool flush_tls(Connection *conn, PoolBuffer *staging, size_t *len) {
+  bool ok = *len == 0 || tls_write(conn->tls, staging->data, *len) == *len;
+  *len = 0;
+  return ok;
+}
+
+// Without kTLS everything is copied through a record sized buffer, files
+// included, so small pieces don't end up in records of their own
+static bool write_output_tls(Connection *conn, HttpOutput *out) {
+  PoolBuffer staging = pool_acquire(TLS_RECORD_SIZE);
+  size_t len = 0;
+  bool ok = true;
+
+  for (ssize_t i = out->len > 0 ? -1 : 0;
+       ok && i < (ssize_t)out->segments.len; i += 1) {
+    HttpSegment *curr = i >= 0 ? &out->segments.ptr[i] : NULL;
+    size_t done = 0;
+    size_t total = curr == NULL ? out->len : curr->len;
+
+    while (ok && done < total) {
+      size_t chunk = total - done;
+      if (chunk > TLS_RECORD_SIZE - len) {
+        chunk = TLS_RECORD_SIZE - len;
+      }
+
+      if (curr != NULL && curr->kind == SEGMENT_FILE) {
+        ssize_t res = pread(curr->fd, staging.data + len, chunk,
+                            curr->offset + done);
+        if (res <= 0) {
+          ok = false;
+          break;
+        }
+        chunk = res;
+      } else {
+        const uint8_t *data = curr == NULL ? out->buf : curr->data;
+        memcpy(staging.data + len, data + done, chunk);
+      }
+
+      len += chunk;
+      done += chunk;
+      if (len == TLS_RECORD_SIZE) {
+        ok = flush_tls(conn, &staging, &len);
+      }
+    }
+  }
+
+  ok = ok && flush_tls(conn, &staging, &len);
+  if (!ok) {
+    printf("write failed or timed out\n");
+  }
+
+  pool_release(&staging);
+  return ok;
+}
+
+bool conn_write_output(Connection *conn, HttpOutput *out) {
+  conn_arm(conn, conn->timeouts.write_ms, TIMER_SHUT_RDWR);
+
+  if (user_tls(conn)) {
+    return write_output_tls(conn, out);
+  }
+
+  // the head and the start of a file leave in the same segment, uncorking
+  // at the end flushes the rest
+  bool cork = conn->cork && needs_several_writes(out);
+  if (cork) {
+    set_cork(conn, 1);
+  }
+
+  // current position, segment -1 is the head
+  ssize_t segment = out->len > 0 ? -1 : 0;
+  size_t offset = 0;
+
+  while (segment < (ssize_t)out->segments.len) {
+    HttpSegment *curr = segment >= 0 ? &out->segments.ptr[segment] : NULL;
+    ssize_t res = 0;
+
+    if (curr != NULL && curr->kind == SEGMENT_FILE) {
+      off_t file_offset = curr->offset + offset;
+      res = sendfile(conn->fd, curr->fd, &file_offset, curr->len - offset);
+    } else {
+      struct iovec iov[MAX_IOVECS];
+      size_t count = 0;
+      bool more = false;
+
+      for (ssize_t i = segment; i < (ssize_t)out->segments.len; i += 1) {
+        if (count == MAX_IOVECS ||
+            (i >= 0 && out->segments.ptr[i].kind != SEGMENT_MEMORY)) {
+          more = true;
+          break;
+        }
+
+        size_t skip = i == segment ? offset : 0;
+        const uint8_t *data = i < 0 ? out->buf : out->segments.ptr[i].data;
+        size_t len = i < 0 ? out->len : out->segments.ptr[i].len;
+
+        iov[count] = (struct iovec){
+            .iov_base = (uint8_t *)data + skip,
+            .iov_len = len - skip,
+        };
+        count += 1;
+      }
+
+      struct msghdr msg = {
+          .msg_iov = iov,
+          .msg_iovlen = count,
+      };
+
+      // without the cork at least hint that another call follows
+      int flags = MSG_NOSIGNAL | (more && !cork ? MSG_MORE : 0);
+      res = sendmsg(conn->fd, &msg, flags);
+    }
+
+    if (res == -1 && errno == EINTR) {
+      continue;
+    } else if (res <= 0) {
+      printf("write failed or timed out\n");
+      return false;
+    }
+
+    // advance over everything just sent
+    size_t sent = res;
+    while (sent > 0) {
+      size_t len = segment < 0 ? out->len : out->segments.ptr[segment].len;
+      size_t left = len - offset;
+      if (sent < left) {
+        offset += sent;
+        break;
+      }
+      sent -= left;
+      segment += 1;
+      offset = 0;
+    }
+  }
+
+  if (cork) {
+    set_cork(conn, 0);
+  }
+
+  return true;
+}
+
+static bool write_flags(Connection *conn, const uint8_t *buf, size_t len,
+                        int flags) {
+  conn_arm(conn, conn->timeouts.write_ms, TIMER_SHUT_RDWR);
+
+  if (user_tls(conn)) {
+    if (tls_write(conn->tls, buf, len) != len) {
+      printf("write failed or timed out\n");
+      return false;
+    }
+    return true;
+  }
+
+  size_t written = 0;
+  while (written < len) {
+    ssize_t res = send(conn->fd, buf + written, len - written, flags);
+    if (res == -1 && errno == EINTR) {
+      continue;
+    } else if (res <= 0) {
+      printf("write failed or timed out\n");
+      return false;
+    }
+    written += res;
+  }
+
+  return true;
+}
+
+bool conn_write(Connection *conn, const uint8_t *buf, size_t len) {
+  return write_flags(conn, buf, len, MSG_NOSIGNAL);
+}
+
+bool conn_write_more(Connection *conn, const uint8_t *buf, size_t len) {
+  return write_flags(conn, buf, len, MSG_NOSIGNAL | MSG_MORE);
+}
+
+bool conn_sendfile(Connection *conn, int fd, off_t offset, size_t len) {
+  if (user_tls(conn)) {
+    // the same copy through a record sized buffer as for whole outputs
+    HttpOutput out = init_output();
+    push_file_segment_output(&out, fd, offset, len);
+    bool ok = conn_write_output(conn, &out);
+    free_output(&out);
+    return ok;
+  }
+
+  conn_arm(conn, conn->timeouts.write_ms, TIMER_SHUT_RDWR);
+
+  while (len > 0) {
+    ssize_t res = sendfile(conn->fd, fd, &offset, len);
+    if (res == -1 && errno == EINTR) {
+      continue;
+    } else if (res <= 0) {
+      printf("sendfile failed or timed out\n");
+      return false;
+    }
+    len -= res;
+  }
+
+  return true;
+}
@@ -0,0 +1,84 @@
+#ifndef CONN
+#define CONN
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "http.h"
+#include "timer.h"
+#include "tls.h"
+
+// default deadlines for every phase of a connection, enforced by the timer
+// wheel ticked in the accept loop
+#define IDLE_TIMEOUT_MS 5000
+#define HEADER_TIMEOUT_MS 10000
+#define BODY_TIMEOUT_MS 30000
+#define WRITE_TIMEOUT_MS 30000
+
+struct ConnTimeouts {
+  uint32_t idle_ms;
+  uint32_t header_ms;
+  uint32_t body_ms;
+  uint32_t write_ms;
+};
+
+typedef struct ConnTimeouts ConnTimeouts;
+
+ConnTimeouts default_conn_timeouts();
+
+// A client socket together with the deadline guarding it
+struct Connection {
+  int fd;
+  Timer timer;
+  TimerWheel *timers;
+  // cork responses that take several writes, see SocketProfile
+  bool cork;
+  // taken from the configuration when the connection was accepted
+  ConnTimeouts timeouts;
+  size_t max_body_size;
+  // NULL for plaintext
+  TlsSession *tls;
+  // kTLS encrypts in the kernel, writes and sendfile go to the socket
+  bool kernel_tls;
+  // id in the traffic capture, 0 if the connection isn't captured
+  uint32_t capture;
+};
+
+typedef struct Connection Connection;
+
+Connection init_connection(int fd, TimerWheel *timers);
+// Disarms the deadline and closes the socket, ends the connection in the
+// capture
+void close_connection(Connection *conn);
+
+// TLS handshake under the currently armed deadline
+bool conn_start_tls(Connection *conn, TlsContext *tls);
+// Whether data was read from the socket that poll doesn't report anymore
+bool conn_has_buffered(Connection *conn);
+
+void conn_arm(Connection *conn, uint32_t timeout_ms, TimerAction action);
+bool conn_expired(Connection *conn);
+
+// Reads whatever fits into the buffer, returns false once the client is gone
+// or the deadline passed
+bool conn_read_some(Connection *conn, uint8_t *buf, size_t *len,
+                    size_t capacity);
+
+// Workers allowed to block on clients that still have to send a request,
+// idle keep-alive connections and unfinished headers count alike
+void set_waiting_limit(size_t max_waiting);
+// Like conn_read_some, but only blocks while a waiting slot is free, sets
+// busy and returns false if the client would have to wait without one
+bool conn_read_request(Connection *conn, uint8_t *buf, size_t *len,
+                       size_t capacity, bool *busy);
+
+// All of these arm the write deadline and return false if the client is gone
+bool conn_write_output(Connection *conn, HttpOutput *out);
+bool conn_write(Connection *conn, const uint8_t *buf, size_t len);
+// Like conn_write, but tells the kernel more data follows right away
+bool conn_write_more(Connection *conn, const uint8_t *buf, size_t len);
+bool conn_sendfile(Connection *conn, int fd, off_t offset, size_t len);
+
+#endif // !CONN
@@ -0,0 +1,549 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "events.h"
+#include "routes.h"
+#include "static_files.h"
+#include "timer.h"
+#include "uploads.h"
+
+// files count once they are complete, directories right away
+#define WATCH_MASK                                                             \
+  (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE)
+
+#define HUB_EVENTS 64
+
+static char *join_path(const char *parent, const char *name) {
+  char *path = malloc(strlen(parent) + strlen(name) + 2);
+  sprintf(path, "%s%s%s", parent, parent[0] == '\0' ? "" : "/", name);
+  return path;
+}
+
+static bool has_prefix(const char *path, const char *prefix) {
+  size_t len = strlen(prefix);
+  return len == 0 ||
+         (strncmp(path, prefix, len) == 0 &&
+          (path[len] == '\0' || path[len] == '/'));
+}
+
+// subscribers
+
+static void drop_subscriber(EventHub *hub, Subscriber *sub,
+                            Vector_SubscriberRef *dropped) {
+  epoll_ctl(hub->epoll, EPOLL_CTL_DEL, sub->fd, NULL);
+  close(sub->fd);
+  sub->fd = -1;
+
+  // swap with the last one
+  Vector_SubscriberRef *subs = &hub->subscribers;
+  Subscriber *last = subs->ptr[subs->len - 1];
+  subs->ptr[sub->index] = last;
+  last->index = sub->index;
+  subs->len -= 1;
+
+  // freed once nothing from the current epoll batch can point to it
+  push_vector_SubscriberRef(dropped, sub);
+}
+
+static void free_subscriber(Subscriber *sub) {
+  if (sub->fd != -1) {
+    close(sub->fd);
+  }
+  free(sub->prefix);
+  free(sub->queue);
+  free(sub);
+}
+
+static bool enqueue(Subscriber *sub, const char *data, size_t len) {
+  if (sub->len + len > SUBSCRIBER_QUEUE) {
+    return false;
+  }
+  if (sub->start + sub->len + len > SUBSCRIBER_QUEUE) {
+    memmove(sub->queue, sub->queue + sub->start, sub->len);
+    sub->start = 0;
+  }
+  memcpy(sub->queue + sub->start + sub->len, data, len);
+  sub->len += len;
+  return true;
+}
+
+static void watch_output(EventHub *hub, Subscriber *sub, bool blocked) {
+  struct epoll_event event = {
+      .events = EPOLLIN | EPOLLRDHUP | (blocked ? EPOLLOUT : 0),
+      .data.ptr = sub,
+  };
+  epoll_ctl(hub->epoll, EPOLL_CTL_MOD, sub->fd, &event);
+  sub->blocked = blocked;
+}
+
+// Sends what the socket takes, false once the client is gone
+static bool flush(EventHub *hub, Subscriber *sub) {
+  while (sub->len > 0) {
+    ssize_t res = send(sub->fd, sub->queue + sub->start, sub->len,
+                       MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (res == -1 && errno == EINTR) {
+      continue;
+    } else if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (!sub->blocked) {
+        watch_output(hub, sub, true);
+      }
+      return true;
+    } else if (res <= 0) {
+      return false;
+    }
+    sub->start += res;
+    sub->len -= res;
+  }
+
+  sub->start = 0;
+  if (sub->blocked) {
+    watch_output(hub, sub, false);
+  }
+  return true;
+}
+
+static void append_json_string(char *buf, size_t *len, const char *value) {
+  buf[(*len)++] = '"';
+  for (const unsigned char *curr = (const unsigned char *)value; *curr != '\0';
+       curr += 1) {
+    if (*curr == '"' || *curr == '\\') {
+      buf[(*len)++] = '\\';
+      buf[(*len)++] = *curr;
+    } else if (*curr < 0x20) {
+      *len += sprintf(buf + *len, "\\u%04x", *curr);
+    } else {
+      buf[(*len)++] = *curr;
+    }
+  }
+  buf[(*len)++] = '"';
+}
+
+static void broadcast(EventHub *hub, const char *name, const char *path,
+                      Vector_SubscriberRef *dropped) {
+  // every byte of the path may need a \u escape
+  char *message = malloc(strlen(path) * 6 + 128);
+  size_t len = sprintf(message, "id: %lu\nevent: %s\ndata: {\"path\":",
+                       (unsigned long)hub->next_id, name);
+  append_json_string(message, &len, path);
+  len += sprintf(message + len, "}\n\n");
+  hub->next_id += 1;
+
+  // backwards, dropping swaps the last subscriber into the current slot
+  for (size_t i = hub->subscribers.len; i > 0; i -= 1) {
+    Subscriber *sub = hub->subscribers.ptr[i - 1];
+    // a resync concerns everyone
+    if (path[0] != '\0' && !has_prefix(path, sub->prefix)) {
+      continue;
+    }
+
+    if (!enqueue(sub, message, len) || (!sub->blocked && !flush(hub, sub))) {
+      printf("events: dropping a subscriber that fell behind\n");
+      drop_subscriber(hub, sub, dropped);
+    }
+  }
+
+  free(message);
+}
+
+// watches
+
+static WatchedDirectory *find_watch(EventHub *hub, int wd) {
+  for (size_t i = 0; i < hub->watches.len; i += 1) {
+    if (hub->watches.ptr[i].wd == wd) {
+      return &hub->watches.ptr[i];
+    }
+  }
+  return NULL;
+}
+
+static void remove_watch_at(EventHub *hub, size_t index) {
+  Vector_WatchedDirectory *watches = &hub->watches;
+  free(watches->ptr[index].path);
+  watches->ptr[index] = watches->ptr[watches->len - 1];
+  watches->len -= 1;
+}
+
+// The directory and everything below it, a directory moved away keeps its
+// watches otherwise
+static void remove_watches(EventHub *hub, const char *path) {
+  for (size_t i = hub->watches.len; i > 0; i -= 1) {
+    if (has_prefix(hub->watches.ptr[i - 1].path, path)) {
+      inotify_rm_watch(hub->inotify, hub->watches.ptr[i - 1].wd);
+      remove_watch_at(hub, i - 1);
+    }
+  }
+}
+
+// Watches the directory and everything below it. Directories appearing
+// while the hub runs announce what they already contain, it may have been
+// written before the watch existed.
+static void add_watches(EventHub *hub, const char *path, bool announce,
+                        Vector_SubscriberRef *dropped) {
+  char *full = join_path(hub->directory, path);
+
+  int wd = inotify_add_watch(hub->inotify, full, WATCH_MASK | IN_ONLYDIR);
+  if (wd == -1) {
+    printf("events: failed to watch %s: %s\n", full, strerror(errno));
+    free(full);
+    return;
+  }
+
+  WatchedDirectory *existing = find_watch(hub, wd);
+  if (existing != NULL) {
+    free(existing->path);
+    existing->path = strdup(path);
+  } else {
+    push_vector_WatchedDirectory(&hub->watches, (WatchedDirectory){
+                                                    .wd = wd,
+                                                    .path = strdup(path),
+                                                });
+  }
+
+  DIR *dir = opendir(full);
+  free(full);
+  if (dir == NULL) {
+    return;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+        is_hidden(path, entry->d_name)) {
+      continue;
+    }
+
+    struct stat entry_stat;
+    if (fstatat(dirfd(dir), entry->d_name, &entry_stat, AT_SYMLINK_NOFOLLOW) !=
+        0) {
+      continue;
+    }
+
+    char *child = join_path(path, entry->d_name);
+    if (S_ISDIR(entry_stat.st_mode)) {
+      if (announce) {
+        broadcast(hub, "update", child, dropped);
+      }
+      add_watches(hub, child, announce, dropped);
+    } else if (announce && S_ISREG(entry_stat.st_mode)) {
+      broadcast(hub, "update", child, dropped);
+    }
+    free(child);
+  }
+  closedir(dir);
+}
+
+static void handle_inotify_event(EventHub *hub,
+                                 const struct inotify_event *event,
+                                 Vector_SubscriberRef *dropped) {
+  if (event->mask & IN_Q_OVERFLOW) {
+    broadcast(hub, "resync", "", dropped);
+    return;
+  }
+
+  WatchedDirectory *watch = find_watch(hub, event->wd);
+  if (watch == NULL) {
+    return;
+  } else if (event->mask & IN_IGNORED) {
+    remove_watch_at(hub, watch - hub->watches.ptr);
+    return;
+  } else if (event->len == 0 || is_hidden(watch->path, event->name)) {
+    return;
+  }
+
+  bool is_dir = event->mask & IN_ISDIR;
+  char *path = join_path(watch->path, event->name);
+
+  if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+    if (is_dir) {
+      remove_watches(hub, path);
+    }
+    broadcast(hub, "delete", path, dropped);
+  } else if (is_dir && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+    broadcast(hub, "update", path, dropped);
+    add_watches(hub, path, true, dropped);
+  } else if (!is_dir && (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))) {
+    broadcast(hub, "update", path, dropped);
+  }
+
+  free(path);
+}
+
+static void read_inotify(EventHub *hub, Vector_SubscriberRef *dropped) {
+  char buf[64 * 1024]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  while (1) {
+    ssize_t len = read(hub->inotify, buf, sizeof(buf));
+    if (len <= 0) {
+      return;
+    }
+
+    for (char *curr = buf; curr < buf + len;) {
+      const struct inotify_event *event = (const struct inotify_event *)curr;
+      handle_inotify_event(hub, event, dropped);
+      curr += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+// the hub thread
+
+static void take_pending(EventHub *hub) {
+  pthread_mutex_lock(&hub->mutex);
+  Vector_SubscriberRef pending = hub->pending;
+  hub->pending = init_vector_SubscriberRef();
+  pthread_mutex_unlock(&hub->mutex);
+
+  for (size_t i = 0; i < pending.len; i += 1) {
+    Subscriber *sub = pending.ptr[i];
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLRDHUP,
+        .data.ptr = sub,
+    };
+    if (epoll_ctl(hub->epoll, EPOLL_CTL_ADD, sub->fd, &event) != 0) {
+      free_subscriber(sub);
+      continue;
+    }
+
+    sub->index = hub->subscribers.len;
+    push_vector_SubscriberRef(&hub->subscribers, sub);
+  }
+  free_vector_SubscriberRef(&pending);
+}
+
+static void handle_subscriber(EventHub *hub, Subscriber *sub, uint32_t events,
+                              Vector_SubscriberRef *dropped) {
+  if (sub->fd == -1) {
+    // dropped earlier in this batch
+    return;
+  }
+
+  bool gone = events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP);
+  if (!gone && (events & EPOLLIN)) {
+    // nothing is expected from the client, anything sent is dropped
+    char discard[512];
+    ssize_t res = recv(sub->fd, discard, sizeof(discard), MSG_DONTWAIT);
+    gone = res == 0 || (res == -1 && errno != EAGAIN && errno != EINTR);
+  }
+  if (!gone && (events & EPOLLOUT)) {
+    gone = !flush(hub, sub);
+  }
+
+  if (gone) {
+    drop_subscriber(hub, sub, dropped);
+  }
+}
+
+static void send_keepalive(EventHub *hub, Vector_SubscriberRef *dropped) {
+  uint64_t now = monotonic_ms();
+  if (now - hub->last_keepalive < EVENTS_KEEPALIVE_MS) {
+    return;
+  }
+  hub->last_keepalive = now;
+
+  for (size_t i = hub->subscribers.len; i > 0; i -= 1) {
+    Subscriber *sub = hub->subscribers.ptr[i - 1];
+    if (sub->len == 0 &&
+        (!enqueue(sub, ":\n\n", 3) || !flush(hub, sub))) {
+      drop_subscriber(hub, sub, dropped);
+    }
+  }
+}
+
+static void *run_event_hub(void *arg) {
+  EventHub *hub = arg;
+  Vector_SubscriberRef dropped = init_vector_SubscriberRef();
+  struct epoll_event events[HUB_EVENTS];
+
+  while (1) {
+    pthread_mutex_lock(&hub->mutex);
+    bool stopping = hub->stopping;
+    pthread_mutex_unlock(&hub->mutex);
+    if (stopping) {
+      break;
+    }
+
+    int count = epoll_wait(hub->epoll, events, HUB_EVENTS, 1000);
+    for (int i = 0; i < count; i += 1) {
+      void *ptr = events[i].data.ptr;
+      if (ptr == &hub->inotify) {
+        read_inotify(hub, &dropped);
+      } else if (ptr == &hub->wake) {
+        uint64_t value;
+        (void)!read(hub->wake, &value, sizeof(value));
+        take_pending(hub);
+      } else {
+        handle_subscriber(hub, ptr, events[i].events, &dropped);
+      }
+    }
+
+    send_keepalive(hub, &dropped);
+
+    for (size_t i = 0; i < dropped.len; i += 1) {
+      free_subscriber(dropped.ptr[i]);
+    }
+    dropped.len = 0;
+  }
+
+  free_vector_SubscriberRef(&dropped);
+  return NULL;
+}
+
+bool init_event_hub(EventHub *hub, const char *directory) {
+  hub->directory = directory;
+  hub->stopping = false;
+  hub->pending = init_vector_SubscriberRef();
+  hub->subscribers = init_vector_SubscriberRef();
+  hub->watches = init_vector_WatchedDirectory();
+  hub->next_id = 1;
+  hub->last_keepalive = monotonic_ms();
+
+  hub->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  hub->epoll = epoll_create1(EPOLL_CLOEXEC);
+  hub->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (hub->inotify == -1 || hub->epoll == -1 || hub->wake == -1) {
+    printf("events: failed to set up the hub: %s\n", strerror(errno));
+    goto HUB_CLOSE;
+  }
+
+  struct epoll_event event = {
+      .events = EPOLLIN,
+      .data.ptr = &hub->inotify,
+  };
+  epoll_ctl(hub->epoll, EPOLL_CTL_ADD, hub->inotify, &event);
+  event.data.ptr = &hub->wake;
+  epoll_ctl(hub->epoll, EPOLL_CTL_ADD, hub->wake, &event);
+
+  // nobody is subscribed yet, nothing to announce
+  add_watches(hub, "", false, NULL);
+  if (hub->watches.len == 0) {
+    goto HUB_CLOSE;
+  }
+  printf("events: watching %zu directories\n", hub->watches.len);
+
+  pthread_mutex_init(&hub->mutex, NULL);
+  if (pthread_create(&hub->thread, NULL, &run_event_hub, hub) != 0) {
+    pthread_mutex_destroy(&hub->mutex);
+    goto HUB_CLOSE;
+  }
+  return true;
+
+HUB_CLOSE:
+  for (size_t i = 0; i < hub->watches.len; i += 1) {
+    free(hub->watches.ptr[i].path);
+  }
+  free_vector_WatchedDirectory(&hub->watches);
+  if (hub->inotify != -1) {
+    close(hub->inotify);
+  }
+  if (hub->epoll != -1) {
+    close(hub->epoll);
+  }
+  if (hub->wake != -1) {
+    close(hub->wake);
+  }
+  return false;
+}
+
+static void wake_hub(EventHub *hub) {
+  uint64_t one = 1;
+  (void)!write(hub->wake, &one, sizeof(one));
+}
+
+void free_event_hub(EventHub *hub) {
+  pthread_mutex_lock(&hub->mutex);
+  hub->stopping = true;
+  pthread_mutex_unlock(&hub->mutex);
+  wake_hub(hub);
+  pthread_join(hub->thread, NULL);
+
+  for (size_t i = 0; i < hub->pending.len; i += 1) {
+    free_subscriber(hub->pending.ptr[i]);
+  }
+  for (size_t i = 0; i < hub->subscribers.len; i += 1) {
+    free_subscriber(hub->subscribers.ptr[i]);
+  }
+  for (size_t i = 0; i < hub->watches.len; i += 1) {
+    free(hub->watches.ptr[i].path);
+  }
+  free_vector_SubscriberRef(&hub->pending);
+  free_vector_SubscriberRef(&hub->subscribers);
+  free_vector_WatchedDirectory(&hub->watches);
+
+  close(hub->inotify);
+  close(hub->epoll);
+  close(hub->wake);
+  pthread_mutex_destroy(&hub->mutex);
+}
+
+bool is_events_request(EventHub *hub, HttpRequest *req) {
+  size_t len = strlen(EVENTS_ROUTE);
+  return hub != NULL && req->method == GET &&
+         strncmp(req->url.path, EVENTS_ROUTE, len) == 0 &&
+         (req->url.path[len] == '/' || req->url.path[len] == '\0');
+}
+
+static bool events_error(Connection *conn, HttpStatus status) {
+  HttpOutput out = init_output();
+  handle_error(&out, status);
+  conn_write_output(conn, &out);
+  free_output(&out);
+  return false;
+}
+
+bool serve_events(EventHub *hub, Connection *conn, HttpRequest *req) {
+  // the hub writes to the socket itself, TLS records need the session
+  if (conn->tls != NULL) {
+    return events_error(conn, NOT_IMPLEMENTED);
+  }
+
+  char prefix[STATIC_PATH_MAX];
+  if (!normalize_path(req->url.path + strlen(EVENTS_ROUTE), prefix,
+                      sizeof(prefix))) {
+    return events_error(conn, BAD_REQ);
+  }
+
+  static const char head[] = "HTTP/1.1 200 OK\r\n"
+                             CONTENT_TYPE ": " TEXT_EVENT_STREAM "\r\n"
+                             CACHE_CONTROL ": no-cache\r\n"
+                             "\r\n"
+                             // reconnect after a second
+                             "retry: 1000\n\n";
+  if (!conn_write(conn, (const uint8_t *)head, strlen(head))) {
+    return false;
+  }
+
+  // the timer lives on the worker's stack, it must not fire for the hub
+  timer_disarm(conn->timers, &conn->timer);
+  fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+
+  Subscriber *sub = malloc(sizeof(Subscriber));
+  *sub = (Subscriber){
+      .fd = conn->fd,
+      .prefix = strdup(prefix),
+      .queue = malloc(SUBSCRIBER_QUEUE),
+      .start = 0,
+      .len = 0,
+      .blocked = false,
+      .index = 0,
+  };
+
+  pthread_mutex_lock(&hub->mutex);
+  push_vector_SubscriberRef(&hub->pending, sub);
+  pthread_mutex_unlock(&hub->mutex);
+  wake_hub(hub);
+
+  printf("events: subscribed to <%s>\n", prefix);
+  return true;
+}
@@ -0,0 +1,94 @@
+#ifndef EVENTS
+#define EVENTS
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "conn.h"
+#include "http.h"
+#include "vector.h"
+
+// Server-Sent Events about files below the directory, with `events 1`
+//   GET /events/<path>   changes below <path>, everything for /events/
+// Each event carries the path relative to the directory:
+//   update   a file was written or renamed into place, or a directory added
+//   delete   a file or directory was removed or renamed away
+//   resync   events were lost, the client has to look at the files again
+//
+// One inotify instance watches the whole tree. The worker answering the
+// request hands the socket to the hub thread, which fans events out over
+// epoll into a bounded queue per subscriber. A subscriber that can't keep
+// up with its queue is disconnected.
+
+#define EVENTS_ROUTE "/events"
+// queued bytes per subscriber before it is dropped
+#define SUBSCRIBER_QUEUE (64 * 1024)
+// a comment keeps idle streams from timing out and finds dead clients
+#define EVENTS_KEEPALIVE_MS 15000
+
+struct Subscriber {
+  int fd;
+  // normalized, empty for everything
+  char *prefix;
+  uint8_t *queue;
+  size_t start;
+  size_t len;
+  // waiting for EPOLLOUT
+  bool blocked;
+  // in the hub's list
+  size_t index;
+};
+
+typedef struct Subscriber Subscriber;
+
+typedef Subscriber *SubscriberRef;
+
+INIT_VECTOR(SubscriberRef);
+
+struct WatchedDirectory {
+  int wd;
+  // relative to the root, empty for the root itself
+  char *path;
+};
+
+typedef struct WatchedDirectory WatchedDirectory;
+
+INIT_VECTOR(WatchedDirectory);
+
+struct EventHub {
+  pthread_t thread;
+  const char *directory;
+  int inotify;
+  int epoll;
+  // wakes the hub for new subscribers and shutdown
+  int wake;
+  bool stopping;
+
+  // handed over by the workers, taken by the hub
+  pthread_mutex_t mutex;
+  Vector_SubscriberRef pending;
+
+  // only touched by the hub thread
+  Vector_SubscriberRef subscribers;
+  Vector_WatchedDirectory watches;
+  uint64_t next_id;
+  uint64_t last_keepalive;
+};
+
+typedef struct EventHub EventHub;
+
+// Watches the directory tree and starts the hub thread
+bool init_event_hub(EventHub *hub, const char *directory);
+// Stops the thread and disconnects every subscriber
+void free_event_hub(EventHub *hub);
+
+// NULL hubs never match
+bool is_events_request(EventHub *hub, HttpRequest *req);
+
+// Answers the request and hands the socket to the hub. Returns whether the
+// hub took it, otherwise an error was answered and the caller closes.
+bool serve_events(EventHub *hub, Connection *conn, HttpRequest *req);
+
+#endif // !EVENTS
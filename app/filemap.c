@@ -0,0 +1,162 @@
+#include <setjmp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "filemap.h"
+
+// the read in progress on this thread, set by filemap_read
+static __thread sigjmp_buf *fault_jump = NULL;
+static __thread const FileMapping *fault_mapping = NULL;
+
+static void on_sigbus(int signum, siginfo_t *info, void *context) {
+  (void)context;
+
+  const uint8_t *addr = info->si_addr;
+  const FileMapping *mapping = fault_mapping;
+  if (fault_jump != NULL && mapping != NULL && addr >= mapping->data &&
+      addr < mapping->data + mapping->size) {
+    siglongjmp(*fault_jump, 1);
+  }
+
+  // not a truncated mapping, the access faults again and ends the process
+  signal(signum, SIG_DFL);
+}
+
+static size_t bucket_for(const struct stat *file_stat) {
+  return (file_stat->st_ino ^ file_stat->st_dev) % FILEMAP_BUCKETS;
+}
+
+static bool same_version(FileMapping *mapping, const struct stat *file_stat) {
+  return mapping->dev == file_stat->st_dev &&
+         mapping->ino == file_stat->st_ino &&
+         mapping->size == file_stat->st_size &&
+         mapping->mtime.tv_sec == file_stat->st_mtim.tv_sec &&
+         mapping->mtime.tv_nsec == file_stat->st_mtim.tv_nsec;
+}
+
+void init_filemap(FileMapTable *table) {
+  *table = (FileMapTable){
+      .mutex = {},
+      .buckets = {0},
+  };
+  pthread_mutex_init(&table->mutex, NULL);
+
+  struct sigaction action = {
+      .sa_sigaction = &on_sigbus,
+      .sa_flags = SA_SIGINFO,
+  };
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGBUS, &action, NULL);
+}
+
+void free_filemap(FileMapTable *table) {
+  // every mapping is gone with its last reference
+  pthread_mutex_destroy(&table->mutex);
+}
+
+FileMapping *filemap_acquire(FileMapTable *table, int fd,
+                             const struct stat *file_stat) {
+  FileMapping **bucket = &table->buckets[bucket_for(file_stat)];
+
+  pthread_mutex_lock(&table->mutex);
+
+  for (FileMapping *curr = *bucket; curr != NULL; curr = curr->next) {
+    if (same_version(curr, file_stat)) {
+      curr->refcount += 1;
+      pthread_mutex_unlock(&table->mutex);
+      return curr;
+    }
+  }
+
+  pthread_mutex_unlock(&table->mutex);
+
+  // map outside of the lock, a racing request may map the same file once more
+  const uint8_t *data = NULL;
+  if (file_stat->st_size > 0) {
+    void *addr =
+        mmap(NULL, file_stat->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      return NULL;
+    }
+
+    // read front to back (compression) and fault it in ahead of time
+    madvise(addr, file_stat->st_size, MADV_SEQUENTIAL);
+    madvise(addr, file_stat->st_size, MADV_WILLNEED);
+    data = addr;
+  }
+
+  FileMapping *mapping = malloc(sizeof(FileMapping));
+  if (mapping == NULL) {
+    if (data != NULL) {
+      munmap((void *)data, file_stat->st_size);
+    }
+    return NULL;
+  }
+
+  *mapping = (FileMapping){
+      .dev = file_stat->st_dev,
+      .ino = file_stat->st_ino,
+      .size = file_stat->st_size,
+      .mtime = file_stat->st_mtim,
+      .data = data,
+      .refcount = 1,
+      .table = table,
+      .next = NULL,
+  };
+
+  pthread_mutex_lock(&table->mutex);
+  mapping->next = *bucket;
+  *bucket = mapping;
+  pthread_mutex_unlock(&table->mutex);
+
+  return mapping;
+}
+
+void filemap_release(void *arg) {
+  FileMapping *mapping = arg;
+  FileMapTable *table = mapping->table;
+
+  pthread_mutex_lock(&table->mutex);
+
+  mapping->refcount -= 1;
+  bool is_last = mapping->refcount == 0;
+
+  if (is_last) {
+    FileMapping **curr = &table->buckets[(mapping->ino ^ mapping->dev) %
+                                         FILEMAP_BUCKETS];
+    while (*curr != mapping) {
+      curr = &(*curr)->next;
+    }
+    *curr = mapping->next;
+  }
+
+  pthread_mutex_unlock(&table->mutex);
+
+  if (is_last) {
+    if (mapping->data != NULL) {
+      munmap((void *)mapping->data, mapping->size);
+    }
+    free(mapping);
+  }
+}
+
+bool filemap_read(const FileMapping *mapping, FileMapReader fn, void *arg) {
+  sigjmp_buf jump;
+  // also restores the signal mask, SIGBUS is blocked inside the handler
+  if (sigsetjmp(jump, 1) != 0) {
+    fault_jump = NULL;
+    fault_mapping = NULL;
+    printf("filemap: file shrank while it was read\n");
+    return false;
+  }
+
+  fault_mapping = mapping;
+  fault_jump = &jump;
+  fn(mapping->data, mapping->size, arg);
+  fault_jump = NULL;
+  fault_mapping = NULL;
+  return true;
+}
@@ -0,0 +1,55 @@
+#ifndef FILEMAP
+#define FILEMAP
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define FILEMAP_BUCKETS 64
+
+// A read-only shared mapping of a file version, reused by every request
+// reading the same file at the same time. A file truncated by somebody else
+// raises SIGBUS on pages past its new end, so the data is only read through
+// filemap_read.
+struct FileMapping {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  const uint8_t *data;
+  size_t refcount;
+  struct FileMapTable *table;
+  struct FileMapping *next;
+};
+
+typedef struct FileMapping FileMapping;
+
+struct FileMapTable {
+  pthread_mutex_t mutex;
+  FileMapping *buckets[FILEMAP_BUCKETS];
+};
+
+typedef struct FileMapTable FileMapTable;
+
+// Also installs the SIGBUS handler of filemap_read
+void init_filemap(FileMapTable *table);
+void free_filemap(FileMapTable *table);
+
+// Returns a referenced mapping of the opened file described by file_stat or
+// NULL if it can't be mapped. The fd can be closed right after.
+FileMapping *filemap_acquire(FileMapTable *table, int fd,
+                             const struct stat *file_stat);
+
+// Drops a reference, has the HttpReleaseFn signature
+void filemap_release(void *mapping);
+
+typedef void (*FileMapReader)(const uint8_t *data, size_t len, void *arg);
+
+// Calls fn with the mapped data, false if the file shrank while fn read it.
+// fn is abandoned at the faulting read, so everything it allocates has to be
+// reachable from `arg` for the caller to clean up.
+bool filemap_read(const FileMapping *mapping, FileMapReader fn, void *arg);
+
+#endif // !FILEMAP
@@ -0,0 +1,83 @@
+#ifndef HANDLER_API
+#define HANDLER_API
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Stable interface for route modules loaded with --modules. A module only
+// includes this header and exports ROUTE_MODULE_INIT, everything it calls in
+// the server goes through the HandlerHost it gets there. tools/example_module.c
+// is a complete module.
+
+#define HANDLER_API_VERSION 2
+
+enum HandlerMethod {
+  HANDLER_GET,
+  HANDLER_POST,
+};
+
+enum HandlerResult {
+  // the response is complete once the handler returns
+  HANDLER_DONE,
+  // the response is completed later with `complete`, from any thread. The
+  // server thread that called the handler blocks until then, so this moves
+  // the work onto a thread of the module but still holds a worker. Beyond
+  // half of the workers busy in handlers, requests get 503 without one.
+  HANDLER_PENDING,
+};
+
+typedef struct HandlerRequest HandlerRequest;
+typedef struct HandlerResponse HandlerResponse;
+typedef struct HandlerHost HandlerHost;
+
+// View of the request, valid until the response is completed
+struct HandlerRequest {
+  int method;
+  // the decoded path without dot segments, the query is separate
+  const char *url;
+  // what the route's wildcard matched, empty without one
+  const char *params;
+  const uint8_t *body;
+  size_t body_len;
+  // owned by the server
+  void *internal;
+  // the query after the '?' as it was sent, NULL without one. Since
+  // version 2.
+  const char *query;
+};
+
+typedef enum HandlerResult (*HandlerFn)(const HandlerRequest *req,
+                                        HandlerResponse *resp, void *user);
+
+struct HandlerHost {
+  unsigned version;
+
+  // `route` as in the built in table, a trailing "*" matches the rest of the
+  // url. Returns 0 on success.
+  int (*register_route)(const HandlerHost *host, int method, const char *route,
+                        HandlerFn fn, void *user);
+
+  // request header, NULL if it is missing
+  const char *(*header)(const HandlerRequest *req, const char *key);
+
+  // responses start out as 200 without headers or body, everything passed in
+  // is copied. Content-Length is set by the server, the body is compressed
+  // when the client accepts it and there is no Content-Encoding.
+  void (*set_status)(HandlerResponse *resp, unsigned code);
+  void (*add_header)(HandlerResponse *resp, const char *key,
+                     const char *value);
+  void (*append_body)(HandlerResponse *resp, const void *data, size_t len);
+  void (*complete)(HandlerResponse *resp);
+
+  // owned by the server
+  void *internal;
+};
+
+// int route_module_init(const HandlerHost *host, const char *arg)
+// `arg` is the rest of the config line or NULL and stays valid while the
+// module is loaded, returns 0 on success
+typedef int (*RouteModuleInit)(const HandlerHost *host, const char *arg);
+
+#define ROUTE_MODULE_INIT "route_module_init"
+
+#endif // !HANDLER_API
@@ -0,0 +1,538 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "hpack.h"
+#include "utils.h"
+
+// shared by the encoder and every decoder, index 1 is the first entry
+static const HpackField STATIC_TABLE[HPACK_STATIC_TABLE_LEN] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// Appendix B, the EOS symbol (256) is only valid as padding
+static const uint32_t HUFFMAN_CODES[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static const uint8_t HUFFMAN_CODE_LENS[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+#define HUFFMAN_EOS 256
+#define HUFFMAN_EOS_CODE 0x3fffffff
+#define HUFFMAN_EOS_LEN 30
+// every symbol is a leaf of a full binary tree
+#define HUFFMAN_NODES (2 * (HUFFMAN_EOS + 1))
+
+struct HuffmanNode {
+  int16_t children[2];
+  int16_t symbol;
+};
+
+typedef struct HuffmanNode HuffmanNode;
+
+static HuffmanNode huffman_tree[HUFFMAN_NODES];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void insert_huffman_code(size_t *nodes, uint32_t code, uint8_t len,
+                                int16_t symbol) {
+  size_t curr = 0;
+  for (uint8_t i = 0; i < len; i += 1) {
+    uint8_t bit = (code >> (len - i - 1)) & 1;
+    if (huffman_tree[curr].children[bit] == 0) {
+      huffman_tree[curr].children[bit] = *nodes;
+      huffman_tree[*nodes] = (HuffmanNode){
+          .children = {0, 0},
+          .symbol = -1,
+      };
+      *nodes += 1;
+    }
+    curr = huffman_tree[curr].children[bit];
+  }
+  huffman_tree[curr].symbol = symbol;
+}
+
+static void build_huffman_tree() {
+  size_t nodes = 1;
+  huffman_tree[0] = (HuffmanNode){
+      .children = {0, 0},
+      .symbol = -1,
+  };
+
+  for (size_t i = 0; i < ARRAY_SIZE(HUFFMAN_CODES); i += 1) {
+    insert_huffman_code(&nodes, HUFFMAN_CODES[i], HUFFMAN_CODE_LENS[i], i);
+  }
+  insert_huffman_code(&nodes, HUFFMAN_EOS_CODE, HUFFMAN_EOS_LEN, HUFFMAN_EOS);
+}
+
+static char *huffman_decode(const uint8_t *buf, size_t len) {
+  pthread_once(&huffman_once, &build_huffman_tree);
+
+  // the shortest code has 5 bits
+  char *out = malloc(len * 8 / 5 + 1);
+  if (out == NULL) {
+    return NULL;
+  }
+
+  size_t out_len = 0;
+  size_t curr = 0;
+  // bits since the last complete symbol, they have to be all ones
+  size_t pending_bits = 0;
+  bool pending_ones = true;
+
+  for (size_t i = 0; i < len; i += 1) {
+    for (int shift = 7; shift >= 0; shift -= 1) {
+      uint8_t bit = (buf[i] >> shift) & 1;
+      curr = huffman_tree[curr].children[bit];
+      pending_bits += 1;
+      pending_ones = pending_ones && bit == 1;
+
+      if (curr == 0) {
+        goto HUFFMAN_ERROR;
+      }
+
+      int16_t symbol = huffman_tree[curr].symbol;
+      if (symbol == HUFFMAN_EOS) {
+        goto HUFFMAN_ERROR;
+      } else if (symbol >= 0) {
+        out[out_len] = symbol;
+        out_len += 1;
+        curr = 0;
+        pending_bits = 0;
+        pending_ones = true;
+      }
+    }
+  }
+
+  // padding is a prefix of EOS shorter than a byte
+  if (pending_bits > 7 || !pending_ones) {
+    goto HUFFMAN_ERROR;
+  }
+
+  out[out_len] = '\0';
+  return out;
+
+HUFFMAN_ERROR:
+  free(out);
+  return NULL;
+}
+
+HpackDecoder init_hpack_decoder() {
+  HpackDecoder decoder = {
+      .table = init_vector_HpackEntry(),
+      .size = 0,
+      .max_size = HPACK_DEFAULT_TABLE_SIZE,
+      .settings_max_size = HPACK_DEFAULT_TABLE_SIZE,
+  };
+  return decoder;
+}
+
+static void evict_entries(HpackDecoder *decoder, size_t max_size) {
+  size_t evict = 0;
+  while (decoder->size > max_size && evict < decoder->table.len) {
+    HpackEntry *entry = &decoder->table.ptr[evict];
+    decoder->size -= entry->size;
+    free(entry->name);
+    free(entry->value);
+    evict += 1;
+  }
+
+  if (evict > 0) {
+    memmove(decoder->table.ptr, decoder->table.ptr + evict,
+            (decoder->table.len - evict) * sizeof(HpackEntry));
+    decoder->table.len -= evict;
+  }
+}
+
+void free_hpack_decoder(HpackDecoder *decoder) {
+  evict_entries(decoder, 0);
+  free_vector_HpackEntry(&decoder->table);
+}
+
+static bool insert_entry(HpackDecoder *decoder, const char *name,
+                         const char *value) {
+  size_t size = strlen(name) + strlen(value) + HPACK_ENTRY_OVERHEAD;
+
+  // an entry larger than the table empties it and is not added
+  evict_entries(decoder, size > decoder->max_size ? 0
+                                                  : decoder->max_size - size);
+  if (size > decoder->max_size) {
+    return true;
+  }
+
+  HpackEntry entry = {
+      .name = strdup(name),
+      .value = strdup(value),
+      .size = size,
+  };
+  if (entry.name == NULL || entry.value == NULL) {
+    free(entry.name);
+    free(entry.value);
+    return false;
+  }
+
+  push_vector_HpackEntry(&decoder->table, entry);
+  decoder->size += size;
+  return true;
+}
+
+static bool lookup_index(HpackDecoder *decoder, size_t index, const char **name,
+                         const char **value) {
+  if (index == 0) {
+    return false;
+  } else if (index <= HPACK_STATIC_TABLE_LEN) {
+    *name = STATIC_TABLE[index - 1].name;
+    *value = STATIC_TABLE[index - 1].value;
+    return true;
+  }
+
+  size_t dynamic = index - HPACK_STATIC_TABLE_LEN - 1;
+  if (dynamic >= decoder->table.len) {
+    return false;
+  }
+
+  HpackEntry *entry = &decoder->table.ptr[decoder->table.len - dynamic - 1];
+  *name = entry->name;
+  *value = entry->value;
+  return true;
+}
+
+static bool decode_int(const uint8_t **curr, const uint8_t *end,
+                       uint8_t prefix_bits, size_t *value) {
+  if (*curr == end) {
+    return false;
+  }
+
+  uint8_t max_prefix = (1 << prefix_bits) - 1;
+  size_t result = **curr & max_prefix;
+  *curr += 1;
+
+  if (result == max_prefix) {
+    size_t shift = 0;
+    while (1) {
+      if (*curr == end || shift > 28) {
+        return false;
+      }
+      uint8_t byte = **curr;
+      *curr += 1;
+      result += (size_t)(byte & 0x7f) << shift;
+      shift += 7;
+      if ((byte & 0x80) == 0) {
+        break;
+      }
+    }
+  }
+
+  *value = result;
+  return true;
+}
+
+static char *decode_string(const uint8_t **curr, const uint8_t *end) {
+  if (*curr == end) {
+    return NULL;
+  }
+
+  bool huffman = (**curr & 0x80) != 0;
+  size_t len = 0;
+  if (!decode_int(curr, end, 7, &len) || len > (size_t)(end - *curr)) {
+    return NULL;
+  }
+
+  const uint8_t *data = *curr;
+  *curr += len;
+
+  if (huffman) {
+    return huffman_decode(data, len);
+  }
+
+  char *str = malloc(len + 1);
+  if (str != NULL) {
+    memcpy(str, data, len);
+    str[len] = '\0';
+  }
+  return str;
+}
+
+bool hpack_decode(HpackDecoder *decoder, const uint8_t *block, size_t len,
+                  HpackFieldFn fn, void *arg) {
+  const uint8_t *curr = block;
+  const uint8_t *end = block + len;
+
+  while (curr < end) {
+    uint8_t first = *curr;
+    const char *name = NULL;
+    const char *value = NULL;
+    char *name_buf = NULL;
+    char *value_buf = NULL;
+    size_t index = 0;
+    bool indexing = false;
+
+    if (first & 0x80) {
+      // indexed header field
+      if (!decode_int(&curr, end, 7, &index) ||
+          !lookup_index(decoder, index, &name, &value)) {
+        return false;
+      }
+    } else if ((first & 0xe0) == 0x20) {
+      // dynamic table size update
+      size_t size = 0;
+      if (!decode_int(&curr, end, 5, &size) ||
+          size > decoder->settings_max_size) {
+        return false;
+      }
+      decoder->max_size = size;
+      evict_entries(decoder, size);
+      continue;
+    } else {
+      // literal with incremental indexing (6 bit) or without / never
+      // indexed (4 bit)
+      indexing = (first & 0xc0) == 0x40;
+      if (!decode_int(&curr, end, indexing ? 6 : 4, &index)) {
+        return false;
+      }
+
+      if (index == 0) {
+        name_buf = decode_string(&curr, end);
+        name = name_buf;
+      } else if (!lookup_index(decoder, index, &name, &value)) {
+        return false;
+      }
+
+      value_buf = decode_string(&curr, end);
+      value = value_buf;
+
+      if (name == NULL || value == NULL) {
+        free(name_buf);
+        free(value_buf);
+        return false;
+      }
+    }
+
+    char *owned_name = name_buf != NULL ? name_buf : strdup(name);
+    char *owned_value = value_buf != NULL ? value_buf : strdup(value);
+
+    if (owned_name == NULL || owned_value == NULL ||
+        (indexing && !insert_entry(decoder, owned_name, owned_value))) {
+      free(owned_name);
+      free(owned_value);
+      return false;
+    }
+
+    if (!fn(arg, owned_name, owned_value)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static size_t encode_int(uint8_t *buf, uint8_t flags, uint8_t prefix_bits,
+                         size_t value) {
+  uint8_t max_prefix = (1 << prefix_bits) - 1;
+  if (value < max_prefix) {
+    buf[0] = flags | value;
+    return 1;
+  }
+
+  buf[0] = flags | max_prefix;
+  value -= max_prefix;
+  size_t s = 1;
+  while (value >= 0x80) {
+    buf[s] = (value & 0x7f) | 0x80;
+    value >>= 7;
+    s += 1;
+  }
+  buf[s] = value;
+  return s + 1;
+}
+
+static size_t encode_string(uint8_t *buf, const char *str, bool lower) {
+  size_t len = strlen(str);
+  size_t s = encode_int(buf, 0x00, 7, len);
+  for (size_t i = 0; i < len; i += 1) {
+    buf[s + i] = lower ? tolower((uint8_t)str[i]) : str[i];
+  }
+  return s + len;
+}
+
+size_t hpack_measure_field(const char *name, const char *value) {
+  // prefix byte and two length prefixes of at most 5 bytes each
+  return 11 + strlen(name) + strlen(value);
+}
+
+size_t hpack_encode_field(uint8_t *buf, const char *name, const char *value) {
+  size_t name_index = 0;
+
+  for (size_t i = 0; i < HPACK_STATIC_TABLE_LEN; i += 1) {
+    const HpackField *field = &STATIC_TABLE[i];
+    if (strcasecmp(field->name, name) != 0) {
+      continue;
+    }
+
+    if (strcmp(field->value, value) == 0) {
+      // indexed header field
+      return encode_int(buf, 0x80, 7, i + 1);
+    }
+
+    if (name_index == 0) {
+      name_index = i + 1;
+    }
+  }
+
+  // literal header field without indexing
+  size_t s = encode_int(buf, 0x00, 4, name_index);
+  if (name_index == 0) {
+    s += encode_string(buf + s, name, true);
+  }
+  s += encode_string(buf + s, value, false);
+  return s;
+}
+
+// hop by hop headers, they are not allowed in HTTP/2
+static const char *const CONNECTION_HEADERS[] = {
+    CONNECTION, "Keep-Alive", "Proxy-Connection", TRANSFER_ENCODING, "Upgrade",
+};
+
+size_t hpack_encode_response(uint8_t *buf, HttpResponse *resp) {
+  char status[4];
+  sprintf(status, "%u", http_status_code(resp->status));
+
+  size_t s = hpack_encode_field(buf, ":status", status);
+
+  for (size_t i = 0; i < resp->headers.headers.len; i += 1) {
+    HttpHeader *header = &resp->headers.headers.ptr[i];
+
+    bool is_connection_header = false;
+    for (size_t j = 0; j < ARRAY_SIZE(CONNECTION_HEADERS); j += 1) {
+      is_connection_header = is_connection_header ||
+                             strcasecmp(header->key, CONNECTION_HEADERS[j]) == 0;
+    }
+
+    if (!is_connection_header) {
+      s += hpack_encode_field(buf + s, header->key, header->value);
+    }
+  }
+
+  return s;
+}
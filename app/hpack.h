@@ -0,0 +1,65 @@
+#ifndef HPACK
+#define HPACK
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http.h"
+
+// RFC 7541, header compression for HTTP/2
+
+#define HPACK_STATIC_TABLE_LEN 61
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+// every entry is accounted with this overhead on top of name and value
+#define HPACK_ENTRY_OVERHEAD 32
+
+struct HpackField {
+  const char *name;
+  const char *value;
+};
+
+typedef struct HpackField HpackField;
+
+struct HpackEntry {
+  char *name;
+  char *value;
+  size_t size;
+};
+
+typedef struct HpackEntry HpackEntry;
+
+INIT_VECTOR(HpackEntry);
+
+struct HpackDecoder {
+  // oldest first, the newest entry has the lowest index
+  Vector_HpackEntry table;
+  size_t size;
+  size_t max_size;
+  // upper bound the peer may set the table to with a size update
+  size_t settings_max_size;
+};
+
+typedef struct HpackDecoder HpackDecoder;
+
+// Gets ownership of the NUL terminated name and value
+typedef bool (*HpackFieldFn)(void *arg, char *name, char *value);
+
+HpackDecoder init_hpack_decoder();
+void free_hpack_decoder(HpackDecoder *decoder);
+
+// Decodes a complete header block, returns false on a compression error
+bool hpack_decode(HpackDecoder *decoder, const uint8_t *block, size_t len,
+                  HpackFieldFn fn, void *arg);
+
+// Upper bound of what hpack_encode_field writes
+size_t hpack_measure_field(const char *name, const char *value);
+
+// Encodes without the dynamic table, lower cases the name
+size_t hpack_encode_field(uint8_t *buf, const char *name, const char *value);
+
+// Encodes status and headers of a response as a header block, connection
+// specific headers are dropped
+size_t hpack_encode_response(uint8_t *buf, HttpResponse *resp);
+
+#endif // !HPACK
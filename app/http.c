@@ -1,25 +1,52 @@
+#define _GNU_SOURCE
+#include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
+#include "hpack.h"
 #include "http.h"
+#include "pool.h"
 #include "utils.h"
 
 #define ENDLINE "\r\n"
 
+// "HTTP/1.1 " + the longest status line + ENDLINE
+#define MAX_STATUS_LINE 64
+
 const char *find_in_header(HttpHeaders *headers, const char *const key) {
   for (size_t i = 0; i < headers->headers.len; i += 1) {
     HttpHeader *header = &headers->headers.ptr[i];
 
-    if (strcmp(header->key, key) == 0) {
+    if (strcasecmp(header->key, key) == 0) {
       return header->value;
     }
   }
   return NULL;
 }
 
+bool has_token(const char *list, const char *token) {
+  size_t token_len = strlen(token);
+  const char *curr = list;
+
+  while (*curr != '\0') {
+    while (*curr == ' ' || *curr == '\t' || *curr == ',') {
+      curr += 1;
+    }
+
+    size_t len = strcspn(curr, ", \t");
+    if (len == token_len && strncasecmp(curr, token, len) == 0) {
+      return true;
+    }
+    curr += len;
+  }
+
+  return false;
+}
+
 void push_header_headers(HttpHeaders *headers, const char *const key,
                          const char *const value) {
   push_vector_HttpHeader(&headers->headers, (HttpHeader){
@@ -52,6 +79,8 @@ size_t write_version(uint8_t *const buf, HttpVersion status) {
   switch (status) {
   case HTTP1_1:
     STRVAL(buf, "HTTP/1.1");
+  case HTTP2:
+    STRVAL(buf, "HTTP/2");
   }
   return 0;
 }
@@ -66,12 +95,65 @@ size_t write_status(uint8_t *const buf, HttpStatus status) {
     STRVAL(buf, "400 Bad Request");
   case NOT_FOUND:
     STRVAL(buf, "404 Not Found");
+  case REQUEST_TIMEOUT:
+    STRVAL(buf, "408 Request Timeout");
+  case PAYLOAD_TOO_LARGE:
+    STRVAL(buf, "413 Payload Too Large");
+  case URI_TOO_LONG:
+    STRVAL(buf, "414 URI Too Long");
+  case HEADERS_TOO_LARGE:
+    STRVAL(buf, "431 Request Header Fields Too Large");
+  case NOT_IMPLEMENTED:
+    STRVAL(buf, "501 Not Implemented");
+  case NOT_MODIFIED:
+    STRVAL(buf, "304 Not Modified");
+  case PARTIAL_CONTENT:
+    STRVAL(buf, "206 Partial Content");
+  case RANGE_NOT_SATISFIABLE:
+    STRVAL(buf, "416 Range Not Satisfiable");
+  case SWITCHING_PROTOCOLS:
+    STRVAL(buf, "101 Switching Protocols");
+  case MOVED_PERMANENTLY:
+    STRVAL(buf, "301 Moved Permanently");
+  case BAD_GATEWAY:
+    STRVAL(buf, "502 Bad Gateway");
+  case CONTINUE:
+    STRVAL(buf, "100 Continue");
+  case EXPECTATION_FAILED:
+    STRVAL(buf, "417 Expectation Failed");
+  case INSUFFICIENT_STORAGE:
+    STRVAL(buf, "507 Insufficient Storage");
+  case UPGRADE_REQUIRED:
+    STRVAL(buf, "426 Upgrade Required");
+  case UNAUTHORIZED:
+    STRVAL(buf, "401 Unauthorized");
+  case SERVICE_UNAVAILABLE:
+    STRVAL(buf, "503 Service Unavailable");
+  case INTERNAL_SERVER_ERROR:
+    STRVAL(buf, "500 Internal Server Error");
   default:
     printf("INVALID OR NOT SUPPORTED HTTP Status sent");
     exit(1);
   }
 }
 
+unsigned http_status_code(HttpStatus status) {
+  uint8_t buf[MAX_STATUS_LINE];
+  write_status(buf, status);
+  // the status line starts with the three digits
+  return (buf[0] - '0') * 100 + (buf[1] - '0') * 10 + (buf[2] - '0');
+}
+
+bool http_status_from_code(unsigned code, HttpStatus *status) {
+  for (HttpStatus curr = OK; curr <= INTERNAL_SERVER_ERROR; curr += 1) {
+    if (http_status_code(curr) == code) {
+      *status = curr;
+      return true;
+    }
+  }
+  return false;
+}
+
 size_t write_headers(uint8_t *const buf, HttpHeaders *headers) {
   size_t size = 0;
   for (size_t i = 0; i < headers->headers.len; i += 1) {
@@ -103,61 +185,279 @@ size_t write_response(uint8_t *const buf, HttpResponse *resp) {
   return s;
 }
 
-size_t parse_method(const uint8_t *buf, HttpMethod *meth) {
+size_t measure_response(HttpResponse *resp) {
+  size_t size = MAX_STATUS_LINE;
+  for (size_t i = 0; i < resp->headers.headers.len; i += 1) {
+    HttpHeader *header = &resp->headers.headers.ptr[i];
+    // "key: value\r\n" or its HPACK encoding
+    size += hpack_measure_field(header->key, header->value);
+  }
+  size += strlen(ENDLINE);
+  size += resp->body.len;
+  return size;
+}
+
+void write_response_output(HttpOutput *out, HttpResponse *resp) {
+  HttpBody body = resp->body;
+  bool inline_body = body.len <= INLINE_BODY_LIMIT;
+
+  if (!inline_body) {
+    resp->body.len = 0;
+  }
+
+  uint8_t *buf = reserve_output(out, measure_response(resp));
+
+  if (out->version == HTTP2) {
+    out->head_len = out->len + hpack_encode_response(buf, resp);
+    out->len = out->head_len;
+    if (inline_body) {
+      out->len += write_body(out->buf + out->len, &body);
+    }
+  } else {
+    out->len += write_response(buf, resp);
+    out->head_len = out->len - (inline_body ? body.len : 0);
+  }
+
+  resp->body = body;
+
+  if (!inline_body) {
+    push_segment_output(out, body.body, body.len);
+  }
+}
+
+HttpOutput init_output() {
+  HttpOutput out = {
+      .version = HTTP1_1,
+      .buf = NULL,
+      .len = 0,
+      .head_len = 0,
+      .capacity = 0,
+      .segments = init_vector_HttpSegment(),
+      .releases = init_vector_HttpRelease(),
+  };
+  return out;
+}
+
+uint8_t *reserve_output(HttpOutput *out, size_t len) {
+  if (out->len + len > out->capacity) {
+    // at least double, past the largest size class buffers are exact
+    size_t capacity = out->len + len;
+    if (capacity < out->capacity * 2) {
+      capacity = out->capacity * 2;
+    }
+
+    PoolBuffer buf = {
+        .data = out->buf,
+        .capacity = out->capacity,
+    };
+    pool_grow(&buf, out->len, capacity);
+    out->buf = buf.data;
+    out->capacity = buf.capacity;
+  }
+  return out->buf + out->len;
+}
+
+void push_segment_output(HttpOutput *out, const uint8_t *data, size_t len) {
+  if (len == 0) {
+    return;
+  }
+
+  push_vector_HttpSegment(&out->segments, (HttpSegment){
+                                              .kind = SEGMENT_MEMORY,
+                                              .data = data,
+                                              .fd = -1,
+                                              .offset = 0,
+                                              .len = len,
+                                          });
+}
+
+void push_file_segment_output(HttpOutput *out, int fd, off_t offset,
+                              size_t len) {
+  if (len == 0) {
+    return;
+  }
+
+  push_vector_HttpSegment(&out->segments, (HttpSegment){
+                                              .kind = SEGMENT_FILE,
+                                              .data = NULL,
+                                              .fd = fd,
+                                              .offset = offset,
+                                              .len = len,
+                                          });
+}
+
+void push_release_output(HttpOutput *out, HttpReleaseFn fn, void *arg) {
+  push_vector_HttpRelease(&out->releases, (HttpRelease){
+                                              .fn = fn,
+                                              .arg = arg,
+                                          });
+}
+
+size_t output_len(HttpOutput *out) {
+  size_t len = out->len;
+  for (size_t i = 0; i < out->segments.len; i += 1) {
+    len += out->segments.ptr[i].len;
+  }
+  return len;
+}
+
+void reset_output(HttpOutput *out) {
+  for (size_t i = 0; i < out->releases.len; i += 1) {
+    HttpRelease *release = &out->releases.ptr[i];
+    release->fn(release->arg);
+  }
+
+  out->len = 0;
+  out->head_len = 0;
+  out->segments.len = 0;
+  out->releases.len = 0;
+}
+
+void free_output(HttpOutput *out) {
+  reset_output(out);
+  pool_release(&(PoolBuffer){
+      .data = out->buf,
+      .capacity = out->capacity,
+  });
+  free_vector_HttpSegment(&out->segments);
+  free_vector_HttpRelease(&out->releases);
+  *out = init_output();
+}
+
+size_t find_header_end(const uint8_t *buf, size_t len) {
+  const char *const END_HEADERS = ENDLINE ENDLINE;
+  const uint8_t *end = memmem(buf, len, END_HEADERS, strlen(END_HEADERS));
+  if (end == NULL) {
+    return 0;
+  }
+  return end - buf + strlen(END_HEADERS);
+}
+
+HttpStatus check_partial_request(const uint8_t *buf, size_t len) {
+  bool has_request_line = memmem(buf, len, ENDLINE, strlen(ENDLINE)) != NULL;
+
+  // method + ' ' + url + ' ' + version, the url dominates by far
+  if (!has_request_line && len > MAX_URL_LEN + 32) {
+    return URI_TOO_LONG;
+  }
+
+  if (len >= MAX_HEADER_SIZE) {
+    return has_request_line ? HEADERS_TOO_LARGE : URI_TOO_LONG;
+  }
+
+  return OK;
+}
+
+static HttpStatus parse_method(const uint8_t *buf, size_t len, size_t *s,
+                               HttpMethod *meth) {
   char *methods_str[] = {"GET", "POST"};
   HttpMethod methods_enum[] = {GET, POST};
 
   for (size_t i = 0; i < ARRAY_SIZE(methods_enum); i += 1) {
-    bool res = starts_with((char *)buf, methods_str[i]);
-    if (res) {
+    size_t method_len = strlen(methods_str[i]);
+    if (len > method_len && memcmp(buf, methods_str[i], method_len) == 0 &&
+        buf[method_len] == ' ') {
       *meth = methods_enum[i];
-      return strlen(methods_str[i]);
+      *s += method_len;
+      return OK;
     }
   }
 
-  printf("INVALID OR NOT SUPPORTED HTTP METHOD");
-  exit(1);
+  printf("INVALID OR NOT SUPPORTED HTTP METHOD\n");
+  return NOT_IMPLEMENTED;
 }
 
-size_t parse_version(const uint8_t *buf, HttpVersion *version) {
+static HttpStatus parse_version(const uint8_t *buf, size_t len, size_t *s,
+                                HttpVersion *version) {
   const char *const VERSION = "HTTP/1.1";
 
-  if (!starts_with((char *)buf, VERSION)) {
+  if (len != strlen(VERSION) || memcmp(buf, VERSION, len) != 0) {
     printf("INVALID: missing VERSION\n");
-    exit(1);
+    return BAD_REQ;
   }
 
   *version = HTTP1_1;
+  *s += len;
 
-  return strlen(VERSION);
+  return OK;
 }
 
+static bool is_ows(uint8_t c) { return c == ' ' || c == '\t'; }
+
 // Headers
 // Host: localhost:4221\r\n     // Header that specifies the server's host and
 // User-Agent: curl/7.64.1\r\n  // Header that describes the client's user
 // Accept: */*\r\n              // Header that specifies which media types
-size_t parse_headers(const uint8_t *buf, HttpHeaders *headers) {
+static HttpStatus parse_headers(uint8_t *buf, size_t len,
+                                HttpHeaders *headers) {
   size_t s = 0;
   // end of headers
-  while (!(*(buf + s) == '\r' && *(buf + s + 1) == '\n')) {
-    // otherwise headers
+  while (s < len) {
+    uint8_t *line = buf + s;
+    uint8_t *end_line = memmem(line, len - s, ENDLINE, strlen(ENDLINE));
+    if (end_line == NULL) {
+      return BAD_REQ;
+    }
+
+    s += end_line - line + strlen(ENDLINE);
+
+    if (end_line == line) {
+      // empty line, only valid as the last one
+      return s == len ? OK : BAD_REQ;
+    }
+
+    if (headers->headers.len == MAX_HEADER_COUNT) {
+      return HEADERS_TOO_LARGE;
+    }
+
     // key
-    char *key = (char *)buf + s;
-    char *value = strstr((char *)buf + s, ": ");
-    *value = '\0';
+    uint8_t *colon = memchr(line, ':', end_line - line);
+    if (colon == NULL || colon == line || is_ows(*(colon - 1))) {
+      return BAD_REQ;
+    }
+    *colon = '\0';
+
+    // value without the optional whitespace around it
+    uint8_t *value = colon + 1;
+    while (value < end_line && is_ows(*value)) {
+      value += 1;
+    }
 
-    // value
-    value += 2;
-    char *end_value = strstr(value, "\r\n");
+    uint8_t *end_value = end_line;
+    while (end_value > value && is_ows(*(end_value - 1))) {
+      end_value -= 1;
+    }
     *end_value = '\0';
 
-    // + 2 for \r\n
+    push_header_headers(headers, (char *)line, (char *)value);
+  }
 
-    s += end_value - key + 2;
+  return BAD_REQ;
+}
 
-    push_header_headers(headers, key, value);
+static HttpStatus parse_content_length(const char *content_len,
+                                       size_t *body_len) {
+  if (*content_len == '\0') {
+    return BAD_REQ;
   }
 
+  size_t len = 0;
+  for (const char *c = content_len; *c != '\0'; c += 1) {
+    if (*c < '0' || *c > '9') {
+      return BAD_REQ;
+    }
+
+    len = len * 10 + (*c - '0');
+    if (len > MAX_BODY_SIZE) {
+      return PAYLOAD_TOO_LARGE;
+    }
+  }
+
+  *body_len = len;
+  return OK;
+}
+
+void negotiate_encoding(HttpHeaders *headers) {
   const char *content_encoding = find_in_header(headers, ACCEPT_ENCODING);
 
   // just see if gzip is requested
@@ -165,78 +465,452 @@ size_t parse_headers(const uint8_t *buf, HttpHeaders *headers) {
       strstr(content_encoding, GZIP_ENCODING) != NULL) {
     headers->encoding = GZIP;
   }
+}
 
-  return s;
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  c |= 0x20;
+  return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
 }
 
-HttpRequest parse_request(const uint8_t *buf) {
+// Decodes the escapes of a path in place, jumping from one '%' to the next
+static bool decode_path(char *path, size_t *len) {
+  char *end = path + *len;
+  char *read = memchr(path, '%', *len);
+  char *write = read;
+
+  while (read != NULL) {
+    int high = end - read < 3 ? -1 : hex_value(read[1]);
+    int low = end - read < 3 ? -1 : hex_value(read[2]);
+    if (high < 0 || low < 0) {
+      return false;
+    }
+    // a decoded '/' would split a segment after the routes saw it
+    char c = (char)(high << 4 | low);
+    if (c == '\0' || c == '/') {
+      return false;
+    }
+    *write = c;
+    write += 1;
+    read += 3;
+
+    char *next = memchr(read, '%', end - read);
+    size_t plain = (next == NULL ? end : next) - read;
+    memmove(write, read, plain);
+    write += plain;
+    read = next;
+  }
+
+  if (write != NULL) {
+    *len = write - path;
+  }
+  return true;
+}
+
+// Drops "." and empty segments and resolves ".." in place, like
+// normalize_path but keeping the leading and a trailing '/'
+static bool remove_dot_segments(char *path, size_t *len) {
+  size_t read = 0;
+  size_t write = 1;
+
+  while (read < *len) {
+    while (read < *len && path[read] == '/') {
+      read += 1;
+    }
+    if (read == *len) {
+      break;
+    }
+
+    char *slash = memchr(path + read, '/', *len - read);
+    size_t segment = (slash == NULL ? *len : (size_t)(slash - path)) - read;
+
+    if (segment == 1 && path[read] == '.') {
+      // current directory
+    } else if (segment == 2 && path[read] == '.' && path[read + 1] == '.') {
+      if (write == 1) {
+        return false;
+      }
+      // back to the separator before the last segment
+      write -= 1;
+      while (path[write - 1] != '/') {
+        write -= 1;
+      }
+    } else {
+      memmove(path + write, path + read, segment);
+      write += segment;
+      if (slash != NULL) {
+        path[write] = '/';
+        write += 1;
+      }
+    }
+
+    read += segment;
+  }
+
+  *len = write;
+  return true;
+}
+
+HttpStatus parse_url(char *target, size_t len, HttpUrl *url) {
+  *url = (HttpUrl){
+      .path = target,
+      .path_len = len,
+      .query = NULL,
+      .query_len = 0,
+      .fragment = NULL,
+      .fragment_len = 0,
+  };
+
+  // only the origin form, proxies aren't supported
+  if (len == 0 || target[0] != '/') {
+    return BAD_REQ;
+  }
+
+  char *end = target + len;
+  char *hash = memchr(target, '#', len);
+  if (hash != NULL) {
+    *hash = '\0';
+    url->fragment = hash + 1;
+    url->fragment_len = end - hash - 1;
+    end = hash;
+  }
+
+  char *question = memchr(target, '?', end - target);
+  if (question != NULL) {
+    url->query = question + 1;
+    url->query_len = end - question - 1;
+    end = question;
+  }
+
+  // most paths are already normal and stay untouched
+  size_t path_len = end - target;
+  bool normal = memchr(target, '%', path_len) == NULL &&
+                memmem(target, path_len, "/.", 2) == NULL &&
+                memmem(target, path_len, "//", 2) == NULL;
+  if (!normal && (!decode_path(target, &path_len) ||
+                  !remove_dot_segments(target, &path_len))) {
+    return BAD_REQ;
+  }
+
+  // the '?' or the end of the decoded path
+  target[path_len] = '\0';
+  url->path_len = path_len;
+  return OK;
+}
+
+// unreserved, sub-delims, ':', '@' and the separator
+static bool is_path_char(uint8_t c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') ||
+         (c != '\0' && strchr("-._~!$&'()*+,;=:@/", c) != NULL);
+}
+
+size_t format_url(char *buf, size_t capacity, const HttpUrl *url) {
+  static const char HEX[] = "0123456789ABCDEF";
+  size_t len = 0;
+
+  for (size_t i = 0; i < url->path_len; i += 1) {
+    uint8_t c = url->path[i];
+    if (len + 4 > capacity) {
+      return 0;
+    }
+
+    if (is_path_char(c)) {
+      buf[len] = c;
+      len += 1;
+    } else {
+      buf[len] = '%';
+      buf[len + 1] = HEX[c >> 4];
+      buf[len + 2] = HEX[c & 0xf];
+      len += 3;
+    }
+  }
+
+  if (url->query != NULL) {
+    if (len + url->query_len + 2 > capacity) {
+      return 0;
+    }
+    buf[len] = '?';
+    memcpy(buf + len + 1, url->query, url->query_len);
+    len += url->query_len + 1;
+  }
+
+  buf[len] = '\0';
+  return len;
+}
+
+HttpQueryIter query_iter(const HttpUrl *url) {
+  return (HttpQueryIter){
+      .curr = url->query,
+      .end = url->query == NULL ? NULL : url->query + url->query_len,
+  };
+}
+
+bool next_query_param(HttpQueryIter *iter, HttpQueryParam *param) {
+  while (iter->curr < iter->end) {
+    char *pair = iter->curr;
+    char *ampersand = memchr(pair, '&', iter->end - pair);
+    char *pair_end = ampersand == NULL ? iter->end : ampersand;
+    iter->curr = ampersand == NULL ? iter->end : ampersand + 1;
+
+    if (pair_end == pair) {
+      continue;
+    }
+
+    char *equals = memchr(pair, '=', pair_end - pair);
+    *param = (HttpQueryParam){
+        .key = pair,
+        .key_len = (equals == NULL ? pair_end : equals) - pair,
+        .value = equals == NULL ? NULL : equals + 1,
+        .value_len = equals == NULL ? 0 : pair_end - equals - 1,
+    };
+    return true;
+  }
+  return false;
+}
+
+bool find_query_param(const HttpUrl *url, const char *key,
+                      HttpQueryParam *param) {
+  size_t key_len = strlen(key);
+  HttpQueryIter iter = query_iter(url);
+  while (next_query_param(&iter, param)) {
+    if (param->key_len == key_len && memcmp(param->key, key, key_len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t decode_query_component(char *buf, size_t len) {
+  size_t write = 0;
+  for (size_t read = 0; read < len; read += 1) {
+    int high = read + 2 < len ? hex_value(buf[read + 1]) : -1;
+    int low = read + 2 < len ? hex_value(buf[read + 2]) : -1;
+
+    if (buf[read] == '%' && high >= 0 && low >= 0) {
+      buf[write] = (char)(high << 4 | low);
+      read += 2;
+    } else if (buf[read] == '+') {
+      buf[write] = ' ';
+    } else {
+      // a broken escape stays as it is
+      buf[write] = buf[read];
+    }
+    write += 1;
+  }
+  return write;
+}
+
+#define TRY_PARSE(X)                                                           \
+  do {                                                                         \
+    HttpStatus status = (X);                                                   \
+    if (status != OK) {                                                        \
+      free_http_request(req);                                                  \
+      return status;                                                           \
+    }                                                                          \
+  } while (0)
+
+HttpStatus parse_request(uint8_t *buf, size_t len, HttpRequest *req) {
+  *req = (HttpRequest){
+      .method = GET,
+      .url =
+          {
+              .path = NULL,
+              .path_len = 0,
+              .query = NULL,
+              .query_len = 0,
+              .fragment = NULL,
+              .fragment_len = 0,
+          },
+      .version = HTTP1_1,
+      .headers =
+          {
+              .headers = init_vector_HttpHeader(),
+              .encoding = NO_ENCODING,
+          },
+      .body =
+          {
+              .body = buf + len,
+              .len = 0,
+          },
+      .keep_alive = true,
+  };
+
+  if (len > MAX_HEADER_SIZE) {
+    return HEADERS_TOO_LARGE;
+  }
+
   // GET                          // HTTP method
   // /index.html                  // Request target
   // HTTP/1.1                     // HTTP version
   // \r\n                         // CRLF that marks the end of the request line
-  HttpMethod method = GET;
-  size_t s = parse_method(buf, &method);
+  uint8_t *end_line = memmem(buf, len, ENDLINE, strlen(ENDLINE));
+  if (end_line == NULL) {
+    return BAD_REQ;
+  }
+  size_t line_len = end_line - buf;
+
+  size_t s = 0;
+  TRY_PARSE(parse_method(buf, line_len, &s, &req->method));
+  s += 1;
 
-  if (buf[s] != ' ') {
+  uint8_t *url = buf + s;
+  uint8_t *end_url = memchr(url, ' ', line_len - s);
+  if (end_url == NULL || end_url == url) {
     printf("INVALID: HTTP string\n");
-    exit(1);
+    return BAD_REQ;
+  }
+
+  if ((size_t)(end_url - url) > MAX_URL_LEN) {
+    return URI_TOO_LONG;
   }
-  s += 1;
 
-  const char *url = (char *)buf + s;
-  char *end = strstr((char *)buf + s, " ");
   // allow the url to automatically work
-  *end = '\0';
+  *end_url = '\0';
+  TRY_PARSE(parse_url((char *)url, end_url - url, &req->url));
 
-  s += strlen(url) + 1;
+  s += end_url - url + 1;
 
-  HttpVersion version;
-  s += parse_version(buf + s, &version);
+  TRY_PARSE(parse_version(buf + s, line_len - s, &s, &req->version));
 
-  if (!starts_with((char *)buf + s, ENDLINE)) {
-    printf("INVALID: line does not stop with \\r\\n\n");
-    exit(1);
+  s += strlen(ENDLINE);
+
+  TRY_PARSE(parse_headers(buf + s, len - s, &req->headers));
+
+  HttpHeaders *headers = &req->headers;
+
+  negotiate_encoding(headers);
+
+  const char *connection = find_in_header(headers, CONNECTION);
+  if (connection != NULL && strcasecmp(connection, CONNECTION_CLOSE) == 0) {
+    req->keep_alive = false;
   }
 
-  s += 2;
+  if (find_in_header(headers, TRANSFER_ENCODING) != NULL) {
+    // chunked bodies are not supported
+    TRY_PARSE(NOT_IMPLEMENTED);
+  }
 
-  HttpHeaders headers = {
-      .headers = init_vector_HttpHeader(),
-      .encoding = NO_ENCODING,
-  };
+  const char *content_len = find_in_header(headers, CONTENT_LENGTH);
+  if (content_len != NULL) {
+    // there is a body attached to this msg
+    TRY_PARSE(parse_content_length(content_len, &req->body.len));
+  }
 
-  s += parse_headers(buf + s, &headers);
+  return OK;
+}
 
-  if (!starts_with((char *)buf + s, ENDLINE)) {
-    printf("INVALID: headers don't stop with \\r\\n\n");
-    exit(1);
+#undef TRY_PARSE
+
+static bool parse_range_number(const char **curr, size_t *number) {
+  const char *start = *curr;
+  size_t value = 0;
+  while (**curr >= '0' && **curr <= '9') {
+    size_t next = value * 10 + (**curr - '0');
+    if (next < value) {
+      return false;
+    }
+    value = next;
+    *curr += 1;
   }
+  *number = value;
+  return *curr != start;
+}
 
-  s += 2;
+// bytes=0-499, 500-, -200
+HttpStatus parse_range(const char *value, size_t size,
+                       Vector_HttpRange *ranges) {
+  const char *const PREFIX = BYTES_UNIT "=";
+  if (!starts_with(value, PREFIX)) {
+    return BAD_REQ;
+  }
 
-  const char *content_len = find_in_header(&headers, CONTENT_LENGTH);
+  const char *curr = value + strlen(PREFIX);
+  size_t count = 0;
 
-  HttpBody body = {
-      .body = buf + s,
-      .len = 0,
-  };
+  while (1) {
+    while (is_ows(*curr)) {
+      curr += 1;
+    }
 
-  if (content_len != NULL) {
-    // there is a body attached to this msg
-    body.len = atoll(content_len);
+    size_t start = 0;
+    size_t end = 0;
+    bool has_start = parse_range_number(&curr, &start);
+
+    if (*curr != '-') {
+      return BAD_REQ;
+    }
+    curr += 1;
+
+    bool has_end = parse_range_number(&curr, &end);
+
+    if (!has_start && !has_end) {
+      return BAD_REQ;
+    } else if (has_start && has_end && end < start) {
+      return BAD_REQ;
+    }
+
+    count += 1;
+    if (count > MAX_RANGES) {
+      return BAD_REQ;
+    }
+
+    if (!has_start) {
+      // suffix, the last n bytes
+      if (end > 0 && size > 0) {
+        start = end > size ? 0 : size - end;
+        push_vector_HttpRange(ranges, (HttpRange){
+                                          .start = start,
+                                          .end = size - 1,
+                                      });
+      }
+    } else if (start < size) {
+      push_vector_HttpRange(ranges, (HttpRange){
+                                        .start = start,
+                                        .end = !has_end || end >= size
+                                                   ? size - 1
+                                                   : end,
+                                    });
+    }
+
+    while (is_ows(*curr)) {
+      curr += 1;
+    }
+
+    if (*curr == '\0') {
+      break;
+    } else if (*curr != ',') {
+      return BAD_REQ;
+    }
+    curr += 1;
   }
 
-  HttpRequest req = {
-      .method = method,
-      .url = url,
-      .version = version,
-      .headers = headers,
-      .body = body,
-  };
+  return ranges->len > 0 ? OK : RANGE_NOT_SATISFIABLE;
+}
 
-  return req;
+#define MOVE_PTR(X, T) X = (T)(to + ((const uint8_t *)(X)-from))
+
+void move_request(HttpRequest *req, const uint8_t *from, uint8_t *to) {
+  MOVE_PTR(req->url.path, char *);
+  if (req->url.query != NULL) {
+    MOVE_PTR(req->url.query, char *);
+  }
+  if (req->url.fragment != NULL) {
+    MOVE_PTR(req->url.fragment, char *);
+  }
+  MOVE_PTR(req->body.body, const uint8_t *);
+
+  for (size_t i = 0; i < req->headers.headers.len; i += 1) {
+    HttpHeader *header = &req->headers.headers.ptr[i];
+    MOVE_PTR(header->key, const char *);
+    MOVE_PTR(header->value, const char *);
+  }
 }
 
+#undef MOVE_PTR
+
 void free_http_request(HttpRequest *req) {
   free_vector_HttpHeader(&req->headers.headers);
 }
@@ -1,13 +1,16 @@
 #ifndef HTTP
 #define HTTP
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #include "vector.h"
 
 enum HttpVersion {
   HTTP1_1,
+  HTTP2,
 };
 
 typedef enum HttpVersion HttpVersion;
@@ -19,11 +22,33 @@ enum HttpStatus {
   BAD_REQ,
   CREATED,
   NOT_FOUND,
+  REQUEST_TIMEOUT,
+  PAYLOAD_TOO_LARGE,
+  URI_TOO_LONG,
+  HEADERS_TOO_LARGE,
+  NOT_IMPLEMENTED,
+  NOT_MODIFIED,
+  PARTIAL_CONTENT,
+  RANGE_NOT_SATISFIABLE,
+  SWITCHING_PROTOCOLS,
+  MOVED_PERMANENTLY,
+  BAD_GATEWAY,
+  CONTINUE,
+  EXPECTATION_FAILED,
+  INSUFFICIENT_STORAGE,
+  UPGRADE_REQUIRED,
+  UNAUTHORIZED,
+  SERVICE_UNAVAILABLE,
+  // keep last, http_status_from_code stops here
+  INTERNAL_SERVER_ERROR,
 };
 
 typedef enum HttpStatus HttpStatus;
 
 size_t write_status(uint8_t *const buf, HttpStatus status);
+unsigned http_status_code(HttpStatus status);
+// false for codes there is no HttpStatus for
+bool http_status_from_code(unsigned code, HttpStatus *status);
 
 struct HttpHeader {
   const char *key;
@@ -49,8 +74,12 @@ struct HttpHeaders {
 typedef struct HttpHeaders HttpHeaders;
 
 const char *find_in_header(HttpHeaders *headers, const char *const key);
+// Whether a comma separated header value lists the token, case insensitive
+bool has_token(const char *list, const char *token);
 
 void push_header_headers(HttpHeaders *headers, const char *const key, const char*const value);
+// Picks the response encoding from Accept-Encoding
+void negotiate_encoding(HttpHeaders *headers);
 
 size_t write_headers(uint8_t *const buf, HttpHeaders *headers);
 
@@ -76,6 +105,78 @@ void free_http_response(HttpResponse *resp);
 
 size_t write_response(uint8_t *const buf, HttpResponse *resp);
 
+enum HttpSegmentKind {
+  SEGMENT_MEMORY,
+  // sent straight from the page cache with sendfile
+  SEGMENT_FILE,
+};
+
+typedef enum HttpSegmentKind HttpSegmentKind;
+
+struct HttpSegment {
+  HttpSegmentKind kind;
+  const uint8_t *data;
+  int fd;
+  off_t offset;
+  size_t len;
+};
+
+typedef struct HttpSegment HttpSegment;
+
+INIT_VECTOR(HttpSegment);
+
+typedef void (*HttpReleaseFn)(void *arg);
+
+struct HttpRelease {
+  HttpReleaseFn fn;
+  void *arg;
+};
+
+typedef struct HttpRelease HttpRelease;
+
+INIT_VECTOR(HttpRelease);
+
+// Everything sent for one response: the serialized head (and small bodies)
+// in `buf`, followed by segments sent as they are without copying them.
+// Releases run once the output was written.
+//
+// For HTTP2 the head is an HPACK header block of `head_len` bytes and the
+// rest is framed as DATA.
+struct HttpOutput {
+  HttpVersion version;
+  uint8_t *buf;
+  size_t len;
+  size_t head_len;
+  size_t capacity;
+  Vector_HttpSegment segments;
+  Vector_HttpRelease releases;
+};
+
+typedef struct HttpOutput HttpOutput;
+
+// bodies up to this size are copied behind the head
+#define INLINE_BODY_LIMIT 4096
+
+HttpOutput init_output();
+// Makes room for `len` more bytes and returns where to write them
+uint8_t *reserve_output(HttpOutput *out, size_t len);
+void push_segment_output(HttpOutput *out, const uint8_t *data, size_t len);
+// The fd has to stay open until the output is written
+void push_file_segment_output(HttpOutput *out, int fd, off_t offset,
+                              size_t len);
+void push_release_output(HttpOutput *out, HttpReleaseFn fn, void *arg);
+size_t output_len(HttpOutput *out);
+// Runs the releases and empties the output for the next response
+void reset_output(HttpOutput *out);
+void free_output(HttpOutput *out);
+
+// Upper bound of what write_response writes
+size_t measure_response(HttpResponse *resp);
+
+// Writes the response to the output, a body larger than INLINE_BODY_LIMIT
+// is referenced and has to stay valid until the output is written
+void write_response_output(HttpOutput *out, HttpResponse *resp);
+
 // // Request line
 // GET                          // HTTP method
 // /index.html                  // Request target
@@ -98,17 +199,115 @@ enum HttpMethod {
 
 typedef enum HttpMethod HttpMethod;
 
+// The request target split in place into NUL terminated parts. The path is
+// percent-decoded and without dot or empty segments, the query is left as it
+// was sent.
+struct HttpUrl {
+  char *path;
+  size_t path_len;
+  // after the '?', NULL without one
+  char *query;
+  size_t query_len;
+  // after the '#', NULL without one
+  char *fragment;
+  size_t fragment_len;
+};
+
+typedef struct HttpUrl HttpUrl;
+
 struct HttpRequest {
   HttpMethod method;
-  const char *url;
+  HttpUrl url;
   HttpVersion version;
   HttpHeaders headers;
   HttpBody body;
+  bool keep_alive;
 };
 
 typedef struct HttpRequest HttpRequest;
 
-HttpRequest parse_request(const uint8_t *buf);
+// limits enforced while parsing, anything larger is rejected before it is
+// buffered
+#define MAX_URL_LEN 2048
+// what format_url writes at most for a parsed url with one more byte in the
+// path, escapes take three bytes
+#define MAX_FORMATTED_URL (3 * (MAX_URL_LEN + 1) + 2)
+#define MAX_HEADER_SIZE (8 * 1024)
+#define MAX_HEADER_COUNT 64
+#define MAX_BODY_SIZE (16 * 1024 * 1024)
+
+// Returns the offset right after the empty line ending the headers or 0 if
+// the headers are not complete yet
+size_t find_header_end(const uint8_t *buf, size_t len);
+
+// Checks a request whose headers are not complete yet, returns OK as long
+// as it can still turn into a valid request
+HttpStatus check_partial_request(const uint8_t *buf, size_t len);
+
+// Parses the request line and headers in place (`len` as returned by
+// find_header_end), the body is only described and not validated to be
+// present. Returns OK or the status that should be answered.
+HttpStatus parse_request(uint8_t *buf, size_t len, HttpRequest *req);
+
+struct HttpRange {
+  size_t start;
+  // inclusive
+  size_t end;
+};
+
+typedef struct HttpRange HttpRange;
+
+INIT_VECTOR(HttpRange);
+
+// more ranges than this are answered with the full representation
+#define MAX_RANGES 16
+
+// Parses a Range header against a representation of `size` bytes. Returns
+// OK with the satisfiable ranges, RANGE_NOT_SATISFIABLE if there are none or
+// BAD_REQ if the header has to be ignored.
+HttpStatus parse_range(const char *value, size_t size, Vector_HttpRange *ranges);
+
+// Splits the NUL terminated target of `len` bytes into `url` and normalizes
+// its path in place. "/a/./b//../c%20d?x=1" has the path "/a/c d", a ".."
+// above the root, an encoded '/' or NUL or a broken escape are a BAD_REQ.
+HttpStatus parse_url(char *target, size_t len, HttpUrl *url);
+
+// Writes the url as a request target for another server, the path encoded
+// again. Returns the length or 0 if it doesn't fit into `capacity` with the
+// trailing NUL.
+size_t format_url(char *buf, size_t capacity, const HttpUrl *url);
+
+// A key=value pair of the query, slices of the request buffer that aren't
+// decoded or terminated. `value` is NULL without a '='.
+struct HttpQueryParam {
+  char *key;
+  size_t key_len;
+  char *value;
+  size_t value_len;
+};
+
+typedef struct HttpQueryParam HttpQueryParam;
+
+struct HttpQueryIter {
+  char *curr;
+  char *end;
+};
+
+typedef struct HttpQueryIter HttpQueryIter;
+
+HttpQueryIter query_iter(const HttpUrl *url);
+// Moves to the next pair, skipping empty ones
+bool next_query_param(HttpQueryIter *iter, HttpQueryParam *param);
+// The first pair with the (undecoded) key, false if there is none
+bool find_query_param(const HttpUrl *url, const char *key,
+                      HttpQueryParam *param);
+// Percent-decodes a key or value in place, '+' is a space. Returns the new
+// length, the bytes behind it are left over. A query is only iterated
+// reliably before its parts are decoded.
+size_t decode_query_component(char *buf, size_t len);
+
+// Points the request into `to`, a copy of the buffer `from` it was parsed from
+void move_request(HttpRequest *req, const uint8_t *from, uint8_t *to);
 
 void free_http_request(HttpRequest *req);
 
@@ -118,12 +317,57 @@ void free_http_request(HttpRequest *req);
 #define USER_AGENT "User-Agent"
 #define CONTENT_ENCODING "Content-Encoding"
 #define ACCEPT_ENCODING "Accept-Encoding"
+#define CONNECTION "Connection"
+#define TRANSFER_ENCODING "Transfer-Encoding"
+#define ETAG "ETag"
+#define LAST_MODIFIED "Last-Modified"
+#define IF_NONE_MATCH "If-None-Match"
+#define IF_MODIFIED_SINCE "If-Modified-Since"
+#define VARY "Vary"
+#define UPGRADE "Upgrade"
+#define HTTP2_SETTINGS "HTTP2-Settings"
+#define RANGE "Range"
+#define IF_RANGE "If-Range"
+#define ACCEPT_RANGES "Accept-Ranges"
+#define CONTENT_RANGE "Content-Range"
+#define LOCATION "Location"
+#define CONTENT_DISPOSITION "Content-Disposition"
+#define CACHE_CONTROL "Cache-Control"
+#define EXPECT "Expect"
+#define AUTHORIZATION "Authorization"
+#define WWW_AUTHENTICATE "WWW-Authenticate"
+#define SEC_WEBSOCKET_KEY "Sec-WebSocket-Key"
+#define SEC_WEBSOCKET_VERSION "Sec-WebSocket-Version"
+#define SEC_WEBSOCKET_ACCEPT "Sec-WebSocket-Accept"
+#define SEC_WEBSOCKET_EXTENSIONS "Sec-WebSocket-Extensions"
 
 // content types
 #define TEXT_PLAIN "text/plain"
 #define OCTET_STREAM "application/octet-stream"
+#define APPLICATION_JSON "application/json"
+#define APPLICATION_TAR "application/x-tar"
+#define TEXT_EVENT_STREAM "text/event-stream"
+#define MULTIPART_BYTERANGES "multipart/byteranges"
+
+// range units
+#define BYTES_UNIT "bytes"
 
 // encodings
 #define GZIP_ENCODING "gzip"
+#define CHUNKED_ENCODING "chunked"
+
+// connection
+#define CONNECTION_CLOSE "close"
+#define CONNECTION_UPGRADE "Upgrade"
+
+// authorization schemes
+#define BEARER_SCHEME "Bearer"
+
+// expectations
+#define EXPECT_CONTINUE "100-continue"
+
+// upgrade tokens
+#define H2C_UPGRADE "h2c"
+#define WEBSOCKET_UPGRADE "websocket"
 
 #endif // !HTTP
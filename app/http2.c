@@ -0,0 +1,1237 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+
+#include "hpack.h"
+#include "http2.h"
+#include "iopool.h"
+#include "utils.h"
+
+#define FRAME_HEADER_LEN 9
+// the largest frame either side sends, never raised via SETTINGS
+#define FRAME_SIZE 16384
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffff
+#define MAX_CONCURRENT_STREAMS 100
+// request bodies a session holds at once, in units of max_body_size
+#define SESSION_BODIES 4
+#define IN_BUFFER (4 * (FRAME_HEADER_LEN + FRAME_SIZE))
+
+enum FrameType {
+  FRAME_DATA = 0x0,
+  FRAME_HEADERS = 0x1,
+  FRAME_PRIORITY = 0x2,
+  FRAME_RST_STREAM = 0x3,
+  FRAME_SETTINGS = 0x4,
+  FRAME_PUSH_PROMISE = 0x5,
+  FRAME_PING = 0x6,
+  FRAME_GOAWAY = 0x7,
+  FRAME_WINDOW_UPDATE = 0x8,
+  FRAME_CONTINUATION = 0x9,
+};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+enum Http2Error {
+  H2_NO_ERROR = 0x0,
+  H2_PROTOCOL_ERROR = 0x1,
+  H2_INTERNAL_ERROR = 0x2,
+  H2_FLOW_CONTROL_ERROR = 0x3,
+  H2_STREAM_CLOSED = 0x5,
+  H2_FRAME_SIZE_ERROR = 0x6,
+  H2_REFUSED_STREAM = 0x7,
+  H2_COMPRESSION_ERROR = 0x9,
+  H2_ENHANCE_YOUR_CALM = 0xb,
+};
+
+typedef enum Http2Error Http2Error;
+
+enum SettingsId {
+  SETTINGS_HEADER_TABLE_SIZE = 0x1,
+  SETTINGS_ENABLE_PUSH = 0x2,
+  SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+  SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+  SETTINGS_MAX_FRAME_SIZE = 0x5,
+  SETTINGS_MAX_HEADER_LIST_SIZE = 0x6,
+};
+
+typedef char *OwnedString;
+
+INIT_VECTOR(OwnedString);
+
+struct Http2Stream {
+  uint32_t id;
+  // END_STREAM received, the request is complete
+  bool remote_closed;
+  bool responding;
+  int64_t send_window;
+  // what the client may still send, only refilled while the body is taken
+  int64_t recv_window;
+  // answered with 413 before the body ended, the rest is dropped
+  bool discarding;
+
+  // request, the headers point into `strings`
+  Vector_OwnedString strings;
+  Vector_HttpHeader headers;
+  // decoded size of the header block as SETTINGS_MAX_HEADER_LIST_SIZE
+  // counts it, indexed fields cost far more than they take on the wire
+  size_t header_list_size;
+  // the request pseudo-headers, all of them are required
+  const char *method;
+  bool has_scheme;
+  // split by parse_url once the request is complete
+  char *path;
+  uint8_t *body;
+  size_t body_len;
+  size_t body_capacity;
+  // answered instead of routing the request
+  HttpStatus error;
+  // what the route sees, built once the request is complete
+  HttpRequest req;
+  AppState *state;
+
+  // the route runs on the I/O pool, the stream can't be freed meanwhile
+  bool in_io;
+  // reset or dropped while in_io, freed once the route finishes
+  bool detached;
+
+  // response and how much of it was sent, segment -1 is the inline body
+  HttpOutput out;
+  bool head_sent;
+  ssize_t segment;
+  size_t offset;
+};
+
+typedef struct Http2Stream Http2Stream;
+
+typedef Http2Stream *Http2StreamPtr;
+
+INIT_VECTOR(Http2StreamPtr);
+
+struct Http2Session {
+  Connection *conn;
+  AppState *state;
+
+  uint8_t in[IN_BUFFER];
+  size_t in_len;
+  uint8_t frame[FRAME_HEADER_LEN + FRAME_SIZE];
+
+  HpackDecoder decoder;
+  Vector_Http2StreamPtr streams;
+  // routes finished on the I/O pool
+  IoCompletions completions;
+  // next stream to send a frame for
+  size_t next_stream;
+  uint32_t last_stream_id;
+
+  int64_t send_window;
+  uint32_t initial_window;
+  bool goaway_received;
+  // body bytes held by the streams, at most SESSION_BODIES * max_body_size
+  size_t buffered;
+
+  // header block split over HEADERS and CONTINUATION
+  uint32_t block_stream;
+  uint8_t block_flags;
+  uint8_t block[MAX_HEADER_SIZE];
+  size_t block_len;
+};
+
+typedef struct Http2Session Http2Session;
+
+bool is_http2_preface(const uint8_t *buf, size_t len) {
+  size_t cmp_len = len < HTTP2_PREFACE_LEN ? len : HTTP2_PREFACE_LEN;
+  return len > 0 && memcmp(buf, HTTP2_PREFACE, cmp_len) == 0;
+}
+
+bool is_http2_upgrade(HttpRequest *req) {
+  const char *upgrade = find_in_header(&req->headers, UPGRADE);
+  const char *connection = find_in_header(&req->headers, CONNECTION);
+
+  // a body would have to be read as HTTP/1.1 first, keep those on HTTP/1.1
+  return upgrade != NULL && connection != NULL && req->body.len == 0 &&
+         has_token(upgrade, H2C_UPGRADE) &&
+         has_token(connection, CONNECTION_UPGRADE) &&
+         has_token(connection, HTTP2_SETTINGS) &&
+         find_in_header(&req->headers, HTTP2_SETTINGS) != NULL;
+}
+
+static uint32_t read_u32(const uint8_t *buf) {
+  return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 |
+         (uint32_t)buf[2] << 8 | buf[3];
+}
+
+static void write_u32(uint8_t *buf, uint32_t value) {
+  buf[0] = value >> 24;
+  buf[1] = value >> 16;
+  buf[2] = value >> 8;
+  buf[3] = value;
+}
+
+static void write_frame_header(uint8_t *buf, size_t len, uint8_t type,
+                               uint8_t flags, uint32_t stream_id) {
+  buf[0] = len >> 16;
+  buf[1] = len >> 8;
+  buf[2] = len;
+  buf[3] = type;
+  buf[4] = flags;
+  write_u32(buf + 5, stream_id & MAX_WINDOW);
+}
+
+static bool send_frame(Http2Session *session, uint8_t type, uint8_t flags,
+                       uint32_t stream_id, const uint8_t *payload, size_t len) {
+  write_frame_header(session->frame, len, type, flags, stream_id);
+  memcpy(session->frame + FRAME_HEADER_LEN, payload, len);
+  return conn_write(session->conn, session->frame, FRAME_HEADER_LEN + len);
+}
+
+static bool send_settings(Http2Session *session) {
+  uint8_t payload[2 * 6];
+  const uint32_t settings[][2] = {
+      {SETTINGS_MAX_CONCURRENT_STREAMS, MAX_CONCURRENT_STREAMS},
+      {SETTINGS_MAX_HEADER_LIST_SIZE, MAX_HEADER_SIZE},
+  };
+
+  for (size_t i = 0; i < ARRAY_SIZE(settings); i += 1) {
+    payload[i * 6] = settings[i][0] >> 8;
+    payload[i * 6 + 1] = settings[i][0];
+    write_u32(payload + i * 6 + 2, settings[i][1]);
+  }
+
+  return send_frame(session, FRAME_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+static bool send_rst_stream(Http2Session *session, uint32_t stream_id,
+                            Http2Error error) {
+  uint8_t payload[4];
+  write_u32(payload, error);
+  return send_frame(session, FRAME_RST_STREAM, 0, stream_id, payload,
+                    sizeof(payload));
+}
+
+static bool send_goaway(Http2Session *session, Http2Error error) {
+  uint8_t payload[8];
+  write_u32(payload, session->last_stream_id);
+  write_u32(payload + 4, error);
+  return send_frame(session, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+}
+
+static bool send_window_update(Http2Session *session, uint32_t stream_id,
+                               uint32_t increment) {
+  uint8_t payload[4];
+  write_u32(payload, increment);
+  return send_frame(session, FRAME_WINDOW_UPDATE, 0, stream_id, payload,
+                    sizeof(payload));
+}
+
+static Http2Stream *find_stream(Http2Session *session, uint32_t stream_id) {
+  for (size_t i = 0; i < session->streams.len; i += 1) {
+    if (session->streams.ptr[i]->id == stream_id) {
+      return session->streams.ptr[i];
+    }
+  }
+  return NULL;
+}
+
+static Http2Stream *new_stream(Http2Session *session, uint32_t stream_id) {
+  Http2Stream *stream = malloc(sizeof(Http2Stream));
+  if (stream == NULL) {
+    return NULL;
+  }
+
+  *stream = (Http2Stream){
+      .id = stream_id,
+      .remote_closed = false,
+      .responding = false,
+      .send_window = session->initial_window,
+      .recv_window = DEFAULT_WINDOW,
+      .discarding = false,
+      .strings = init_vector_OwnedString(),
+      .headers = init_vector_HttpHeader(),
+      .header_list_size = 0,
+      .method = NULL,
+      .has_scheme = false,
+      .path = NULL,
+      .body = NULL,
+      .body_len = 0,
+      .body_capacity = 0,
+      .error = OK,
+      .state = session->state,
+      .in_io = false,
+      .detached = false,
+      .out = init_output(),
+      .head_sent = false,
+      .segment = -1,
+      .offset = 0,
+  };
+  stream->out.version = HTTP2;
+
+  push_vector_Http2StreamPtr(&session->streams, stream);
+  session->last_stream_id = stream_id;
+
+  return stream;
+}
+
+static void free_stream(Http2Stream *stream) {
+  free_output(&stream->out);
+  for (size_t i = 0; i < stream->strings.len; i += 1) {
+    free(stream->strings.ptr[i]);
+  }
+  free_vector_OwnedString(&stream->strings);
+  free_vector_HttpHeader(&stream->headers);
+  free(stream->body);
+  free(stream);
+}
+
+static void remove_stream(Http2Session *session, Http2Stream *stream) {
+  session->buffered -= stream->body_len;
+
+  Vector_Http2StreamPtr *streams = &session->streams;
+  for (size_t i = 0; i < streams->len; i += 1) {
+    if (streams->ptr[i] == stream) {
+      memmove(streams->ptr + i, streams->ptr + i + 1,
+              (streams->len - i - 1) * sizeof(Http2StreamPtr));
+      streams->len -= 1;
+      break;
+    }
+  }
+
+  if (stream->in_io) {
+    stream->detached = true;
+  } else {
+    free_stream(stream);
+  }
+}
+
+static void push_string(Http2Stream *stream, char *str) {
+  push_vector_OwnedString(&stream->strings, str);
+}
+
+// HpackFieldFn, collects the request of a stream. Fails the block once it
+// decodes to more than the advertised MAX_HEADER_SIZE.
+static bool on_header_field(void *arg, char *name, char *value) {
+  Http2Stream *stream = arg;
+  stream->header_list_size +=
+      strlen(name) + strlen(value) + HPACK_ENTRY_OVERHEAD;
+
+  if (stream->header_list_size > MAX_HEADER_SIZE) {
+    free(name);
+    free(value);
+    stream->error = HEADERS_TOO_LARGE;
+    return false;
+  }
+
+  bool is_method = strcmp(name, ":method") == 0;
+  bool is_path = strcmp(name, ":path") == 0;
+  if (strcmp(name, ":scheme") == 0) {
+    stream->has_scheme = true;
+  }
+  // only what the request keeps is owned by the stream
+  if ((name[0] == ':' && !is_method && !is_path) ||
+      (name[0] != ':' && stream->headers.len == MAX_HEADER_COUNT)) {
+    if (name[0] != ':') {
+      stream->error = HEADERS_TOO_LARGE;
+    }
+    free(name);
+    free(value);
+    return true;
+  }
+
+  push_string(stream, name);
+  push_string(stream, value);
+
+  if (is_method) {
+    stream->method = value;
+    return true;
+  } else if (is_path) {
+    stream->path = value;
+    return true;
+  }
+
+  push_vector_HttpHeader(&stream->headers, (HttpHeader){
+                                               .key = name,
+                                               .value = value,
+                                           });
+  return true;
+}
+
+// IoJobFn, everything it touches belongs to the stream until it is reaped
+static void run_stream_route(void *arg) {
+  Http2Stream *stream = arg;
+  handle_routes(&stream->out, &stream->req, stream->state);
+}
+
+// Runs the route of a complete request on the I/O pool, the response is sent
+// from the loop once it finished
+static void dispatch_stream(Http2Session *session, Http2Stream *stream) {
+  stream->req = (HttpRequest){
+      .method = GET,
+      .url =
+          {
+              .path = NULL,
+              .path_len = 0,
+              .query = NULL,
+              .query_len = 0,
+              .fragment = NULL,
+              .fragment_len = 0,
+          },
+      .version = HTTP2,
+      .headers =
+          {
+              .headers = stream->headers,
+              .encoding = NO_ENCODING,
+          },
+      .body =
+          {
+              .body = stream->body,
+              .len = stream->body_len,
+          },
+      .keep_alive = true,
+  };
+
+  HttpRequest *req = &stream->req;
+  negotiate_encoding(&req->headers);
+
+  // malformed without :method, :scheme or :path, methods other than the two
+  // routed ones are treated the same
+  HttpStatus status = stream->error;
+  if (status == OK && (stream->method == NULL || !stream->has_scheme ||
+                       stream->path == NULL || stream->path[0] == '\0')) {
+    status = BAD_REQ;
+  } else if (status == OK && strcmp(stream->method, "GET") == 0) {
+    req->method = GET;
+  } else if (status == OK && strcmp(stream->method, "POST") == 0) {
+    req->method = POST;
+  } else if (status == OK) {
+    status = BAD_REQ;
+  }
+
+  if (status == OK) {
+    // split in place, the stream owns the string
+    size_t path_len = strlen(stream->path);
+    status = path_len > MAX_URL_LEN
+                 ? URI_TOO_LONG
+                 : parse_url(stream->path, path_len, &req->url);
+  }
+
+  if (status != OK) {
+    handle_error(&stream->out, status);
+    stream->responding = true;
+    return;
+  }
+
+  stream->in_io = true;
+  io_submit(session->state->io, &session->completions, &run_stream_route,
+            stream);
+}
+
+// Starts sending every response whose route finished
+static void reap_routes(Http2Session *session) {
+  Http2Stream *stream = NULL;
+  while ((stream = io_reap(&session->completions)) != NULL) {
+    stream->in_io = false;
+    if (stream->detached) {
+      free_stream(stream);
+    } else {
+      stream->responding = true;
+    }
+  }
+}
+
+// After END_STREAM went out, a client still sending a discarded body is
+// told to stop
+static bool finish_stream(Http2Session *session, Http2Stream *stream) {
+  bool ok = !stream->discarding || stream->remote_closed ||
+            send_rst_stream(session, stream->id, H2_NO_ERROR);
+  remove_stream(session, stream);
+  return ok;
+}
+
+// bytes of the response body not sent yet, starting at the current piece
+static size_t piece_left(Http2Stream *stream) {
+  if (stream->segment < 0) {
+    return stream->out.len - stream->out.head_len - stream->offset;
+  }
+  return stream->out.segments.ptr[stream->segment].len - stream->offset;
+}
+
+static bool is_last_piece(Http2Stream *stream) {
+  return stream->segment + 1 >= (ssize_t)stream->out.segments.len;
+}
+
+static void skip_empty_pieces(Http2Stream *stream) {
+  while (!is_last_piece(stream) && piece_left(stream) == 0) {
+    stream->segment += 1;
+    stream->offset = 0;
+  }
+}
+
+static bool send_head(Http2Session *session, Http2Stream *stream) {
+  skip_empty_pieces(stream);
+  bool has_body = piece_left(stream) > 0;
+
+  size_t len = stream->out.head_len;
+  size_t sent = 0;
+  do {
+    size_t chunk = len - sent > FRAME_SIZE ? FRAME_SIZE : len - sent;
+    bool is_last = sent + chunk == len;
+
+    uint8_t type = sent == 0 ? FRAME_HEADERS : FRAME_CONTINUATION;
+    uint8_t flags = (is_last ? FLAG_END_HEADERS : 0) |
+                    (sent == 0 && !has_body ? FLAG_END_STREAM : 0);
+
+    if (!send_frame(session, type, flags, stream->id, stream->out.buf + sent,
+                    chunk)) {
+      return false;
+    }
+    sent += chunk;
+  } while (sent < len);
+
+  stream->head_sent = true;
+  return true;
+}
+
+// Sends one DATA frame as far as flow control allows, `blocked` is set if
+// nothing could be sent
+static bool send_data(Http2Session *session, Http2Stream *stream,
+                      bool *blocked) {
+  skip_empty_pieces(stream);
+
+  size_t len = piece_left(stream);
+  int64_t window = session->send_window < stream->send_window
+                       ? session->send_window
+                       : stream->send_window;
+
+  if (len > FRAME_SIZE) {
+    len = FRAME_SIZE;
+  }
+  if ((int64_t)len > window) {
+    len = window > 0 ? window : 0;
+  }
+
+  bool end_stream = len == piece_left(stream) && is_last_piece(stream);
+  if (len == 0 && !end_stream) {
+    *blocked = true;
+    return true;
+  }
+
+  uint8_t flags = end_stream ? FLAG_END_STREAM : 0;
+  HttpSegment *segment = stream->segment >= 0
+                             ? &stream->out.segments.ptr[stream->segment]
+                             : NULL;
+
+  if (segment != NULL && segment->kind == SEGMENT_FILE) {
+    uint8_t header[FRAME_HEADER_LEN];
+    write_frame_header(header, len, FRAME_DATA, flags, stream->id);
+    if (!conn_write_more(session->conn, header, sizeof(header)) ||
+        !conn_sendfile(session->conn, segment->fd,
+                       segment->offset + stream->offset, len)) {
+      return false;
+    }
+  } else {
+    const uint8_t *data =
+        segment != NULL ? segment->data
+                        : stream->out.buf + stream->out.head_len;
+    if (!send_frame(session, FRAME_DATA, flags, stream->id,
+                    data + stream->offset, len)) {
+      return false;
+    }
+  }
+
+  stream->offset += len;
+  stream->send_window -= len;
+  session->send_window -= len;
+
+  return !end_stream || finish_stream(session, stream);
+}
+
+// Sends at most one frame for every stream with a pending response, `sent`
+// tells if anything went out
+static bool send_round(Http2Session *session, bool *sent) {
+  *sent = false;
+
+  size_t count = session->streams.len;
+  for (size_t i = 0; i < count && session->streams.len > 0; i += 1) {
+    size_t index = session->next_stream % session->streams.len;
+    Http2Stream *stream = session->streams.ptr[index];
+    session->next_stream = index + 1;
+
+    if (!stream->responding) {
+      continue;
+    }
+
+    if (!stream->head_sent) {
+      if (!send_head(session, stream)) {
+        return false;
+      }
+      *sent = true;
+
+      skip_empty_pieces(stream);
+      // END_STREAM went out with the headers
+      if (piece_left(stream) == 0 && !finish_stream(session, stream)) {
+        return false;
+      }
+      continue;
+    }
+
+    bool blocked = false;
+    if (!send_data(session, stream, &blocked)) {
+      return false;
+    }
+    *sent = *sent || !blocked;
+  }
+
+  return true;
+}
+
+static bool has_pending_response(Http2Session *session) {
+  for (size_t i = 0; i < session->streams.len; i += 1) {
+    if (session->streams.ptr[i]->responding) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static Http2Error apply_settings(Http2Session *session, const uint8_t *payload,
+                                 size_t len) {
+  if (len % 6 != 0) {
+    return H2_FRAME_SIZE_ERROR;
+  }
+
+  for (size_t i = 0; i < len; i += 6) {
+    uint16_t id = payload[i] << 8 | payload[i + 1];
+    uint32_t value = read_u32(payload + i + 2);
+
+    switch (id) {
+    case SETTINGS_INITIAL_WINDOW_SIZE:
+      if (value > MAX_WINDOW) {
+        return H2_FLOW_CONTROL_ERROR;
+      }
+      // applies to every open stream as well
+      for (size_t j = 0; j < session->streams.len; j += 1) {
+        Http2Stream *stream = session->streams.ptr[j];
+        stream->send_window += (int64_t)value - session->initial_window;
+        if (stream->send_window > MAX_WINDOW) {
+          return H2_FLOW_CONTROL_ERROR;
+        }
+      }
+      session->initial_window = value;
+      break;
+    case SETTINGS_MAX_FRAME_SIZE:
+      if (value < FRAME_SIZE || value > 0xffffff) {
+        return H2_PROTOCOL_ERROR;
+      }
+      // frames sent stay at the minimum every peer accepts
+      break;
+    case SETTINGS_ENABLE_PUSH:
+      if (value > 1) {
+        return H2_PROTOCOL_ERROR;
+      }
+      break;
+    default:
+      // the encoder does not use the dynamic table, unknown ones are ignored
+      break;
+    }
+  }
+
+  return H2_NO_ERROR;
+}
+
+static Http2Error end_header_block(Http2Session *session) {
+  uint32_t stream_id = session->block_stream;
+  bool end_stream = (session->block_flags & FLAG_END_STREAM) != 0;
+  session->block_stream = 0;
+
+  Http2Stream *stream = find_stream(session, stream_id);
+  bool is_trailer = stream != NULL;
+
+  if (is_trailer && (stream->remote_closed || !end_stream)) {
+    return H2_PROTOCOL_ERROR;
+  }
+
+  // refused streams still have to be decoded to keep the table in sync
+  Http2Stream refused = {
+      .strings = init_vector_OwnedString(),
+      .headers = init_vector_HttpHeader(),
+  };
+  bool is_refused = !is_trailer && session->streams.len >= MAX_CONCURRENT_STREAMS;
+
+  Http2Stream *target = stream;
+  if (is_refused) {
+    target = &refused;
+    session->last_stream_id = stream_id;
+  } else if (!is_trailer) {
+    target = new_stream(session, stream_id);
+    if (target == NULL) {
+      return H2_INTERNAL_ERROR;
+    }
+  }
+
+  // trailers are decoded into a throw away stream as well
+  Http2Stream trailers = {
+      .strings = init_vector_OwnedString(),
+      .headers = init_vector_HttpHeader(),
+  };
+  if (is_trailer) {
+    target = &trailers;
+  }
+
+  bool decoded = hpack_decode(&session->decoder, session->block,
+                              session->block_len, &on_header_field, target);
+
+  for (size_t i = 0; i < refused.strings.len; i += 1) {
+    free(refused.strings.ptr[i]);
+  }
+  for (size_t i = 0; i < trailers.strings.len; i += 1) {
+    free(trailers.strings.ptr[i]);
+  }
+  free_vector_OwnedString(&refused.strings);
+  free_vector_HttpHeader(&refused.headers);
+  free_vector_OwnedString(&trailers.strings);
+  free_vector_HttpHeader(&trailers.headers);
+
+  // the rest of the block wasn't decoded, the table is out of sync
+  if (!decoded && target->header_list_size > MAX_HEADER_SIZE) {
+    return H2_ENHANCE_YOUR_CALM;
+  } else if (!decoded) {
+    return H2_COMPRESSION_ERROR;
+  }
+
+  if (is_refused) {
+    return send_rst_stream(session, stream_id, H2_REFUSED_STREAM)
+               ? H2_NO_ERROR
+               : H2_INTERNAL_ERROR;
+  }
+
+  if (is_trailer || end_stream) {
+    stream = is_trailer ? stream : target;
+    stream->remote_closed = true;
+    // a discarded body was answered when it got too large
+    if (!stream->discarding) {
+      dispatch_stream(session, stream);
+    }
+  }
+
+  return H2_NO_ERROR;
+}
+
+// Strips padding (and priority) off HEADERS and DATA
+static bool strip_padding(uint8_t flags, const uint8_t **payload,
+                          size_t *len) {
+  if (flags & FLAG_PADDED) {
+    if (*len < 1 || (*payload)[0] >= *len) {
+      return false;
+    }
+    *len -= 1 + (*payload)[0];
+    *payload += 1;
+  }
+  return true;
+}
+
+static Http2Error on_headers(Http2Session *session, uint8_t type,
+                             uint8_t flags, uint32_t stream_id,
+                             const uint8_t *payload, size_t len) {
+  if (type == FRAME_HEADERS) {
+    if (session->block_stream != 0 || stream_id == 0 ||
+        stream_id % 2 == 0) {
+      return H2_PROTOCOL_ERROR;
+    }
+
+    if (find_stream(session, stream_id) == NULL &&
+        stream_id <= session->last_stream_id) {
+      return H2_PROTOCOL_ERROR;
+    }
+
+    if (!strip_padding(flags, &payload, &len)) {
+      return H2_PROTOCOL_ERROR;
+    }
+
+    if (flags & FLAG_PRIORITY) {
+      // priorities are not used
+      if (len < 5) {
+        return H2_FRAME_SIZE_ERROR;
+      }
+      payload += 5;
+      len -= 5;
+    }
+
+    session->block_stream = stream_id;
+    session->block_flags = flags;
+    session->block_len = 0;
+  } else if (session->block_stream != stream_id) {
+    return H2_PROTOCOL_ERROR;
+  }
+
+  if (session->block_len + len > sizeof(session->block)) {
+    return H2_ENHANCE_YOUR_CALM;
+  }
+  memcpy(session->block + session->block_len, payload, len);
+  session->block_len += len;
+
+  if (flags & FLAG_END_HEADERS) {
+    return end_header_block(session);
+  }
+
+  return H2_NO_ERROR;
+}
+
+static Http2Error on_data(Http2Session *session, uint8_t flags,
+                          uint32_t stream_id, const uint8_t *payload,
+                          size_t len) {
+  if (stream_id == 0) {
+    return H2_PROTOCOL_ERROR;
+  }
+
+  // flow control counts the whole frame, padding included
+  size_t frame_len = len;
+  if (!strip_padding(flags, &payload, &len)) {
+    return H2_PROTOCOL_ERROR;
+  }
+
+  // the connection window is refilled right away, SESSION_BODIES bounds the
+  // memory and the stream windows pace every stream
+  if (frame_len > 0 && !send_window_update(session, 0, frame_len)) {
+    return H2_INTERNAL_ERROR;
+  }
+
+  Http2Stream *stream = find_stream(session, stream_id);
+  if (stream == NULL || stream->remote_closed) {
+    if (stream_id > session->last_stream_id) {
+      return H2_PROTOCOL_ERROR;
+    }
+    return send_rst_stream(session, stream_id, H2_STREAM_CLOSED)
+               ? H2_NO_ERROR
+               : H2_INTERNAL_ERROR;
+  }
+
+  Http2Error reset = H2_NO_ERROR;
+  if ((int64_t)frame_len > stream->recv_window) {
+    reset = H2_FLOW_CONTROL_ERROR;
+  } else if (!stream->discarding && session->buffered + len >
+             SESSION_BODIES * session->conn->max_body_size) {
+    // not processed, the client may send it again later
+    reset = H2_REFUSED_STREAM;
+  }
+  if (reset != H2_NO_ERROR) {
+    remove_stream(session, stream);
+    return send_rst_stream(session, stream_id, reset) ? H2_NO_ERROR
+                                                      : H2_INTERNAL_ERROR;
+  }
+  stream->recv_window -= frame_len;
+
+  if (stream->discarding) {
+    stream->remote_closed = (flags & FLAG_END_STREAM) != 0;
+    return H2_NO_ERROR;
+  } else if (stream->body_len + len > session->conn->max_body_size) {
+    // answered right away, the body goes and its window isn't refilled
+    session->buffered -= stream->body_len;
+    free(stream->body);
+    stream->body = NULL;
+    stream->body_len = 0;
+    stream->body_capacity = 0;
+    stream->error = PAYLOAD_TOO_LARGE;
+    stream->discarding = true;
+    stream->remote_closed = (flags & FLAG_END_STREAM) != 0;
+    dispatch_stream(session, stream);
+    return H2_NO_ERROR;
+  } else if (len > 0) {
+    if (stream->body_len + len > stream->body_capacity) {
+      size_t capacity = stream->body_capacity == 0 ? 4096 : stream->body_capacity;
+      while (capacity < stream->body_len + len) {
+        capacity *= 2;
+      }
+      uint8_t *body = realloc(stream->body, capacity);
+      if (body == NULL) {
+        return H2_INTERNAL_ERROR;
+      }
+      stream->body = body;
+      stream->body_capacity = capacity;
+    }
+    memcpy(stream->body + stream->body_len, payload, len);
+    stream->body_len += len;
+    session->buffered += len;
+  }
+
+  if (flags & FLAG_END_STREAM) {
+    stream->remote_closed = true;
+    dispatch_stream(session, stream);
+  } else if (frame_len > 0) {
+    if (!send_window_update(session, stream_id, frame_len)) {
+      return H2_INTERNAL_ERROR;
+    }
+    stream->recv_window += frame_len;
+  }
+
+  return H2_NO_ERROR;
+}
+
+static Http2Error process_frame(Http2Session *session, uint8_t type,
+                                uint8_t flags, uint32_t stream_id,
+                                const uint8_t *payload, size_t len) {
+  if (session->block_stream != 0 && type != FRAME_CONTINUATION) {
+    // a header block can't be interleaved with anything
+    return H2_PROTOCOL_ERROR;
+  }
+
+  switch (type) {
+  case FRAME_HEADERS:
+  case FRAME_CONTINUATION:
+    return on_headers(session, type, flags, stream_id, payload, len);
+  case FRAME_DATA:
+    return on_data(session, flags, stream_id, payload, len);
+  case FRAME_SETTINGS: {
+    if (stream_id != 0) {
+      return H2_PROTOCOL_ERROR;
+    }
+    if (flags & FLAG_ACK) {
+      return len == 0 ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+    }
+    Http2Error error = apply_settings(session, payload, len);
+    if (error != H2_NO_ERROR) {
+      return error;
+    }
+    return send_frame(session, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0)
+               ? H2_NO_ERROR
+               : H2_INTERNAL_ERROR;
+  }
+  case FRAME_PING:
+    if (stream_id != 0 || len != 8) {
+      return stream_id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR;
+    }
+    if (flags & FLAG_ACK) {
+      return H2_NO_ERROR;
+    }
+    return send_frame(session, FRAME_PING, FLAG_ACK, 0, payload, len)
+               ? H2_NO_ERROR
+               : H2_INTERNAL_ERROR;
+  case FRAME_WINDOW_UPDATE: {
+    if (len != 4) {
+      return H2_FRAME_SIZE_ERROR;
+    }
+    uint32_t increment = read_u32(payload) & MAX_WINDOW;
+    if (increment == 0) {
+      return H2_PROTOCOL_ERROR;
+    }
+
+    if (stream_id == 0) {
+      session->send_window += increment;
+      return session->send_window > MAX_WINDOW ? H2_FLOW_CONTROL_ERROR
+                                               : H2_NO_ERROR;
+    }
+
+    Http2Stream *stream = find_stream(session, stream_id);
+    if (stream != NULL) {
+      stream->send_window += increment;
+      if (stream->send_window > MAX_WINDOW) {
+        remove_stream(session, stream);
+        return send_rst_stream(session, stream_id, H2_FLOW_CONTROL_ERROR)
+                   ? H2_NO_ERROR
+                   : H2_INTERNAL_ERROR;
+      }
+    }
+    return H2_NO_ERROR;
+  }
+  case FRAME_RST_STREAM: {
+    if (stream_id == 0 || len != 4) {
+      return stream_id == 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR;
+    }
+    Http2Stream *stream = find_stream(session, stream_id);
+    if (stream != NULL) {
+      remove_stream(session, stream);
+    }
+    return H2_NO_ERROR;
+  }
+  case FRAME_PRIORITY:
+    return len == 5 ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+  case FRAME_GOAWAY:
+    session->goaway_received = true;
+    return H2_NO_ERROR;
+  case FRAME_PUSH_PROMISE:
+    // clients can't push
+    return H2_PROTOCOL_ERROR;
+  default:
+    // unknown frame types are ignored
+    return H2_NO_ERROR;
+  }
+}
+
+// Processes every complete frame that is buffered
+static Http2Error process_frames(Http2Session *session) {
+  size_t s = 0;
+  Http2Error error = H2_NO_ERROR;
+
+  while (session->in_len - s >= FRAME_HEADER_LEN) {
+    const uint8_t *header = session->in + s;
+    size_t len = header[0] << 16 | header[1] << 8 | header[2];
+
+    if (len > FRAME_SIZE) {
+      error = H2_FRAME_SIZE_ERROR;
+      break;
+    }
+
+    if (session->in_len - s < FRAME_HEADER_LEN + len) {
+      break;
+    }
+
+    uint32_t stream_id = read_u32(header + 5) & MAX_WINDOW;
+    error = process_frame(session, header[3], header[4], stream_id,
+                          header + FRAME_HEADER_LEN, len);
+    s += FRAME_HEADER_LEN + len;
+
+    if (error != H2_NO_ERROR) {
+      break;
+    }
+  }
+
+  memmove(session->in, session->in + s, session->in_len - s);
+  session->in_len -= s;
+
+  return error;
+}
+
+// Decodes the base64url SETTINGS payload of an upgrade request
+static Http2Error apply_upgrade_settings(Http2Session *session,
+                                         const char *settings) {
+  size_t len = strlen(settings);
+  uint8_t *payload = malloc(len);
+  if (payload == NULL) {
+    return H2_INTERNAL_ERROR;
+  }
+
+  size_t payload_len = 0;
+  Http2Error error = H2_PROTOCOL_ERROR;
+  if (base64url_decode(settings, payload, &payload_len)) {
+    error = apply_settings(session, payload, payload_len);
+  }
+
+  free(payload);
+  return error;
+}
+
+// The upgraded request becomes the half closed stream 1
+static Http2Error upgrade_stream(Http2Session *session, HttpRequest *req) {
+  Http2Error error = apply_upgrade_settings(
+      session, find_in_header(&req->headers, HTTP2_SETTINGS));
+  if (error != H2_NO_ERROR) {
+    return error;
+  }
+
+  Http2Stream *stream = new_stream(session, 1);
+  if (stream == NULL) {
+    return H2_INTERNAL_ERROR;
+  }
+
+  // parsed again with the stream, so encoded again
+  char target[MAX_FORMATTED_URL];
+  format_url(target, sizeof(target), &req->url);
+
+  char *method = strdup(req->method == POST ? "POST" : "GET");
+  char *path = strdup(target);
+  if (method == NULL || path == NULL) {
+    free(method);
+    free(path);
+    return H2_INTERNAL_ERROR;
+  }
+  push_string(stream, method);
+  push_string(stream, path);
+  stream->method = method;
+  // the upgraded request's scheme is http
+  stream->has_scheme = true;
+  stream->path = path;
+
+  for (size_t i = 0; i < req->headers.headers.len; i += 1) {
+    HttpHeader *header = &req->headers.headers.ptr[i];
+    if (strcasecmp(header->key, CONNECTION) == 0 ||
+        strcasecmp(header->key, UPGRADE) == 0 ||
+        strcasecmp(header->key, HTTP2_SETTINGS) == 0) {
+      continue;
+    }
+
+    char *key = strdup(header->key);
+    char *value = strdup(header->value);
+    if (key == NULL || value == NULL) {
+      free(key);
+      free(value);
+      return H2_INTERNAL_ERROR;
+    }
+    on_header_field(stream, key, value);
+  }
+
+  stream->remote_closed = true;
+  dispatch_stream(session, stream);
+
+  return H2_NO_ERROR;
+}
+
+// Waits for the client or a finished route, true if the socket is readable
+static bool wait_events(Http2Session *session) {
+  struct pollfd pfds[2] = {
+      {
+          .fd = session->conn->fd,
+          .events = POLLIN,
+          .revents = 0,
+      },
+      {
+          .fd = session->completions.eventfd,
+          .events = POLLIN,
+          .revents = 0,
+      },
+  };
+
+  // decrypted and buffered already, poll wouldn't wake up for it
+  if (conn_has_buffered(session->conn)) {
+    return true;
+  }
+
+  if (poll(pfds, ARRAY_SIZE(pfds), -1) <= 0) {
+    return false;
+  }
+  return pfds[0].revents != 0;
+}
+
+static bool is_readable(int fd) {
+  struct pollfd pfd = {
+      .fd = fd,
+      .events = POLLIN,
+      .revents = 0,
+  };
+  return poll(&pfd, 1, 0) > 0;
+}
+
+void serve_http2(Connection *conn, const uint8_t *buf, size_t len,
+                 HttpRequest *upgrade, AppState *state) {
+  Http2Session *session = malloc(sizeof(Http2Session));
+  if (session == NULL || len > IN_BUFFER ||
+      !init_io_completions(&session->completions)) {
+    free(session);
+    return;
+  }
+
+  session->conn = conn;
+  session->state = state;
+  memcpy(session->in, buf, len);
+  session->in_len = len;
+  session->decoder = init_hpack_decoder();
+  session->streams = init_vector_Http2StreamPtr();
+  session->next_stream = 0;
+  session->last_stream_id = 0;
+  session->send_window = DEFAULT_WINDOW;
+  session->initial_window = DEFAULT_WINDOW;
+  session->goaway_received = false;
+  session->buffered = 0;
+  session->block_stream = 0;
+  session->block_flags = 0;
+  session->block_len = 0;
+
+  printf("serving HTTP/2\n");
+
+  // frames are small and waiting on WINDOW_UPDATEs, don't let Nagle hold
+  // them back for a delayed ACK
+  int nodelay = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+  Http2Error error = H2_NO_ERROR;
+
+  if (!send_settings(session)) {
+    goto HTTP2_CLEAN_UP;
+  }
+
+  if (upgrade != NULL) {
+    error = upgrade_stream(session, upgrade);
+    if (error != H2_NO_ERROR) {
+      goto HTTP2_GOAWAY;
+    }
+  }
+
+  // the client preface, after the 101 for an upgrade
+  conn_arm(conn, conn->timeouts.header_ms, TIMER_SHUT_RD);
+  while (session->in_len < HTTP2_PREFACE_LEN) {
+    if (!is_http2_preface(session->in, session->in_len) && session->in_len > 0) {
+      break;
+    }
+    if (!conn_read_some(conn, session->in, &session->in_len, IN_BUFFER)) {
+      goto HTTP2_CLEAN_UP;
+    }
+  }
+
+  if (memcmp(session->in, HTTP2_PREFACE, HTTP2_PREFACE_LEN) != 0) {
+    error = H2_PROTOCOL_ERROR;
+    goto HTTP2_GOAWAY;
+  }
+
+  memmove(session->in, session->in + HTTP2_PREFACE_LEN,
+          session->in_len - HTTP2_PREFACE_LEN);
+  session->in_len -= HTTP2_PREFACE_LEN;
+
+  while (1) {
+    error = process_frames(session);
+    if (error != H2_NO_ERROR) {
+      goto HTTP2_GOAWAY;
+    }
+
+    reap_routes(session);
+
+    bool sent = false;
+    if (!send_round(session, &sent)) {
+      goto HTTP2_CLEAN_UP;
+    }
+
+    if (session->goaway_received && session->streams.len == 0) {
+      goto HTTP2_GOAWAY;
+    }
+
+    bool readable = true;
+    if (sent) {
+      // keep sending, but pick up frames that arrived in the meantime
+      if (!conn_has_buffered(conn) && !is_readable(conn->fd)) {
+        continue;
+      }
+    } else {
+      if (has_pending_response(session)) {
+        // only flow control holds the responses back
+        conn_arm(conn, conn->timeouts.write_ms, TIMER_SHUT_RD);
+      } else {
+        conn_arm(conn,
+                 session->streams.len == 0 ? conn->timeouts.idle_ms
+                                           : conn->timeouts.body_ms,
+                 TIMER_SHUT_RD);
+      }
+      readable = wait_events(session);
+    }
+
+    if (readable &&
+        !conn_read_some(conn, session->in, &session->in_len, IN_BUFFER)) {
+      // closed by the client or timed out, say goodbye if still possible
+      error = H2_NO_ERROR;
+      goto HTTP2_GOAWAY;
+    }
+  }
+
+HTTP2_GOAWAY:
+  send_goaway(session, error);
+
+HTTP2_CLEAN_UP:
+  while (session->streams.len > 0) {
+    remove_stream(session, session->streams.ptr[0]);
+  }
+  // routes still running own their streams until they finish
+  while (session->completions.in_flight > 0) {
+    io_wait(&session->completions);
+    reap_routes(session);
+  }
+  free_io_completions(&session->completions);
+  free_vector_Http2StreamPtr(&session->streams);
+  free_hpack_decoder(&session->decoder);
+  free(session);
+}
@@ -0,0 +1,29 @@
+#ifndef H2C
+#define H2C
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "conn.h"
+#include "http.h"
+#include "routes.h"
+
+// RFC 9113, cleartext HTTP/2 (h2c) on top of the same routes
+
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LEN 24
+
+// Whether the buffered bytes start like the client connection preface
+bool is_http2_preface(const uint8_t *buf, size_t len);
+
+// Whether the request asks for an upgrade to h2c
+bool is_http2_upgrade(HttpRequest *req);
+
+// Serves the connection as HTTP/2 until it is closed. `buf` holds what was
+// read already, for prior knowledge starting with the preface. An upgraded
+// request is answered as stream 1 after the 101 was sent.
+void serve_http2(Connection *conn, const uint8_t *buf, size_t len,
+                 HttpRequest *upgrade, AppState *state);
+
+#endif // !H2C
@@ -0,0 +1,111 @@
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "iopool.h"
+
+static void run_io_job(void *payload) {
+  IoJob *job = payload;
+  job->fn(job->arg);
+
+  IoCompletions *completions = job->completions;
+
+  pthread_mutex_lock(&completions->mutex);
+  job->next = NULL;
+  if (completions->head == NULL) {
+    completions->head = job;
+  } else {
+    completions->last->next = job;
+  }
+  completions->last = job;
+
+  // still under the lock, once the job is reaped the owner may close the
+  // eventfd and free the completions
+  uint64_t one = 1;
+  while (write(completions->eventfd, &one, sizeof(one)) == -1 &&
+         errno == EINTR) {
+  }
+  pthread_mutex_unlock(&completions->mutex);
+}
+
+void init_io_pool(IoPool *pool, size_t size) {
+  pool->threads = init_threadpool(&run_io_job, size);
+}
+
+void free_io_pool(IoPool *pool) { free_threadpool(&pool->threads); }
+
+bool init_io_completions(IoCompletions *completions) {
+  *completions = (IoCompletions){
+      .mutex = {},
+      .eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK),
+      .head = NULL,
+      .last = NULL,
+      .in_flight = 0,
+  };
+
+  pthread_mutex_init(&completions->mutex, NULL);
+  return completions->eventfd != -1;
+}
+
+void free_io_completions(IoCompletions *completions) {
+  assert(completions->in_flight == 0);
+  if (completions->eventfd != -1) {
+    close(completions->eventfd);
+  }
+  pthread_mutex_destroy(&completions->mutex);
+}
+
+void io_submit(IoPool *pool, IoCompletions *completions, IoJobFn fn,
+               void *arg) {
+  IoJob *job = malloc(sizeof(IoJob));
+  assert(job != NULL);
+
+  *job = (IoJob){
+      .fn = fn,
+      .arg = arg,
+      .completions = completions,
+      .next = NULL,
+  };
+
+  completions->in_flight += 1;
+  add_threaded_task(&pool->threads, job);
+}
+
+void *io_reap(IoCompletions *completions) {
+  pthread_mutex_lock(&completions->mutex);
+
+  IoJob *job = completions->head;
+  if (job == NULL) {
+    // everything is taken, a write racing with this read only causes one
+    // spurious wake up
+    uint64_t count = 0;
+    ssize_t res = read(completions->eventfd, &count, sizeof(count));
+    (void)res;
+    pthread_mutex_unlock(&completions->mutex);
+    return NULL;
+  }
+
+  completions->head = job->next;
+  if (completions->head == NULL) {
+    completions->last = NULL;
+  }
+  pthread_mutex_unlock(&completions->mutex);
+
+  void *arg = job->arg;
+  free(job);
+  completions->in_flight -= 1;
+  return arg;
+}
+
+void io_wait(IoCompletions *completions) {
+  struct pollfd pfd = {
+      .fd = completions->eventfd,
+      .events = POLLIN,
+      .revents = 0,
+  };
+  poll(&pfd, 1, -1);
+}
@@ -0,0 +1,62 @@
+#ifndef IOPOOL
+#define IOPOOL
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "thread.h"
+
+// Blocking file work (open, stat, read) runs on a separate thread pool so a
+// worker serving several streams keeps serving the others while the disk is
+// busy. Finished jobs are handed back through an eventfd the submitting
+// thread polls next to its socket.
+
+typedef void (*IoJobFn)(void *arg);
+
+struct IoJob {
+  IoJobFn fn;
+  void *arg;
+  struct IoCompletions *completions;
+  struct IoJob *next;
+};
+
+typedef struct IoJob IoJob;
+
+// Owned by one submitting thread
+struct IoCompletions {
+  pthread_mutex_t mutex;
+  int eventfd;
+  // finished, oldest first
+  IoJob *head;
+  IoJob *last;
+  // submitted and not reaped yet, only touched by the owner
+  size_t in_flight;
+};
+
+typedef struct IoCompletions IoCompletions;
+
+struct IoPool {
+  ThreadPool threads;
+};
+
+typedef struct IoPool IoPool;
+
+void init_io_pool(IoPool *pool, size_t size);
+// Queued jobs are dropped, free it once no completions are waited on
+void free_io_pool(IoPool *pool);
+
+bool init_io_completions(IoCompletions *completions);
+// Only once nothing is in flight anymore
+void free_io_completions(IoCompletions *completions);
+
+void io_submit(IoPool *pool, IoCompletions *completions, IoJobFn fn,
+               void *arg);
+
+// The arg of a finished job or NULL if none finished since the last call
+void *io_reap(IoCompletions *completions);
+
+// Blocks until a job finished, for shutting down with jobs in flight
+void io_wait(IoCompletions *completions);
+
+#endif // !IOPOOL
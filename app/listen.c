@@ -0,0 +1,194 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "listen.h"
+
+#define UNIX_PREFIX "unix:"
+
+static bool parse_port(const char *value, in_port_t *port) {
+  char *end = NULL;
+  long number = strtol(value, &end, 10);
+  if (*value == '\0' || *end != '\0' || number <= 0 || number > 65535) {
+    return false;
+  }
+  *port = htons(number);
+  return true;
+}
+
+static bool parse_unix_address(const char *path, ListenAddress *address) {
+  struct sockaddr_un *un = (struct sockaddr_un *)&address->addr;
+  un->sun_family = AF_UNIX;
+
+  size_t len = strlen(path);
+  if (len <= 1 || len >= sizeof(un->sun_path)) {
+    return false;
+  }
+
+  // the abstract name starts with a NUL instead of the '@' and is not
+  // terminated, the length says where it ends
+  memcpy(un->sun_path, path, len);
+  if (path[0] == '@') {
+    un->sun_path[0] = '\0';
+    address->len = offsetof(struct sockaddr_un, sun_path) + len;
+  } else {
+    address->len = sizeof(*un);
+  }
+  return true;
+}
+
+static bool parse_ipv6_address(const char *value, ListenAddress *address) {
+  struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&address->addr;
+  in6->sin6_family = AF_INET6;
+  address->len = sizeof(*in6);
+
+  const char *end = strchr(value, ']');
+  if (end == NULL || end[1] != ':') {
+    return false;
+  }
+
+  char host[INET6_ADDRSTRLEN];
+  size_t host_len = end - (value + 1);
+  if (host_len >= sizeof(host)) {
+    return false;
+  }
+  memcpy(host, value + 1, host_len);
+  host[host_len] = '\0';
+
+  return inet_pton(AF_INET6, host, &in6->sin6_addr) == 1 &&
+         parse_port(end + 2, &in6->sin6_port);
+}
+
+bool parse_listen_address(const char *value, ListenAddress *address) {
+  if (strlen(value) >= LISTEN_NAME_MAX) {
+    return false;
+  }
+
+  *address = (ListenAddress){0};
+  strcpy(address->name, value);
+
+  if (strncmp(value, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0) {
+    return parse_unix_address(value + strlen(UNIX_PREFIX), address);
+  } else if (value[0] == '[') {
+    return parse_ipv6_address(value, address);
+  }
+
+  struct sockaddr_in *in = (struct sockaddr_in *)&address->addr;
+  in->sin_family = AF_INET;
+  in->sin_addr.s_addr = htonl(INADDR_ANY);
+  address->len = sizeof(*in);
+
+  const char *colon = strrchr(value, ':');
+  if (colon == NULL) {
+    return parse_port(value, &in->sin_port);
+  }
+
+  char host[INET_ADDRSTRLEN];
+  size_t host_len = colon - value;
+  if (host_len >= sizeof(host)) {
+    return false;
+  }
+  memcpy(host, value, host_len);
+  host[host_len] = '\0';
+
+  return inet_pton(AF_INET, host, &in->sin_addr) == 1 &&
+         parse_port(colon + 1, &in->sin_port);
+}
+
+// the socket file of a path address, NULL for other addresses
+static const char *socket_path(const ListenAddress *address) {
+  const struct sockaddr_un *un = (const struct sockaddr_un *)&address->addr;
+  if (address->addr.ss_family != AF_UNIX || un->sun_path[0] == '\0') {
+    return NULL;
+  }
+  return un->sun_path;
+}
+
+// a socket left behind by a previous run would fail the bind, anything else
+// at the path is kept
+static void remove_stale_socket(const char *path) {
+  struct stat path_stat;
+  if (lstat(path, &path_stat) == 0 && S_ISSOCK(path_stat.st_mode)) {
+    unlink(path);
+  }
+}
+
+int open_listener(const ListenAddress *address, int backlog,
+                  const SocketProfile *profile) {
+  int family = address->addr.ss_family;
+  int fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    printf("Socket creation failed for %s: %s...\n", address->name,
+           strerror(errno));
+    return -1;
+  }
+
+  if (family == AF_UNIX) {
+    const char *path = socket_path(address);
+    if (path != NULL) {
+      remove_stale_socket(path);
+    }
+  } else {
+    // Since the tester restarts your program quite often, setting
+    // SO_REUSEADDR ensures that we don't run into 'Address already in use'
+    // errors
+    int reuse = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+      printf("SO_REUSEADDR failed: %s \n", strerror(errno));
+      goto LISTENER_ERROR;
+    }
+  }
+
+  if (family == AF_INET6) {
+    // dual stack for the wildcard, a specific address only takes IPv6 anyway
+    int v6only = 0;
+    if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) <
+        0) {
+      printf("IPV6_V6ONLY failed: %s \n", strerror(errno));
+    }
+  }
+
+  apply_listener_options(fd, family, profile);
+
+  if (bind(fd, (struct sockaddr *)&address->addr, address->len) != 0) {
+    printf("Bind to %s failed: %s \n", address->name, strerror(errno));
+    goto LISTENER_ERROR;
+  }
+
+  // bursts queue up in the kernel until the accept loop drains them
+  if (listen(fd, backlog) != 0) {
+    printf("Listen failed: %s \n", strerror(errno));
+    goto LISTENER_ERROR;
+  }
+
+  // accept until EAGAIN after every wake up, the clients stay blocking
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    printf("O_NONBLOCK failed: %s \n", strerror(errno));
+    goto LISTENER_ERROR;
+  }
+
+  printf("listening on %s%s\n", address->name, address->tls ? " (TLS)" : "");
+  return fd;
+
+LISTENER_ERROR:
+  close(fd);
+  return -1;
+}
+
+void close_listener(int fd, const ListenAddress *address) {
+  close(fd);
+
+  const char *path = socket_path(address);
+  if (path != NULL) {
+    unlink(path);
+  }
+}
@@ -0,0 +1,42 @@
+#ifndef LISTEN
+#define LISTEN
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#include "sockopt.h"
+#include "vector.h"
+
+#define DEFAULT_PORT 4221
+#define LISTEN_NAME_MAX 128
+
+// Where the server accepts connections, parsed from the `listen` setting
+struct ListenAddress {
+  struct sockaddr_storage addr;
+  socklen_t len;
+  // as it was configured, for logs and comparing configurations
+  char name[LISTEN_NAME_MAX];
+  // from `tls-listen`, clients start with a TLS handshake
+  bool tls;
+};
+
+typedef struct ListenAddress ListenAddress;
+
+INIT_VECTOR(ListenAddress);
+
+// One of
+//   "<port>"             every IPv4 address
+//   "<ipv4>:<port>"
+//   "[<ipv6>]:<port>"    "[::]" is dual stack and takes IPv4 as well
+//   "unix:<path>"        a stale socket file at the path is replaced
+//   "unix:@<name>"       Linux abstract namespace, nothing on disk
+bool parse_listen_address(const char *value, ListenAddress *address);
+
+// Binds and listens with SO_REUSEADDR and the listener options, the socket
+// is non blocking. Returns -1 and logs on failure.
+int open_listener(const ListenAddress *address, int backlog,
+                  const SocketProfile *profile);
+// Closes the listener and removes its socket file
+void close_listener(int fd, const ListenAddress *address);
+
+#endif // !LISTEN
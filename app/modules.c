@@ -0,0 +1,257 @@
+#include <dlfcn.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modules.h"
+#include "utils.h"
+
+static int host_register_route(const HandlerHost *host, int method,
+                               const char *route, HandlerFn fn, void *user) {
+  RouteModules *modules = host->internal;
+
+  if (route == NULL || fn == NULL ||
+      (method != HANDLER_GET && method != HANDLER_POST)) {
+    return -1;
+  }
+
+  push_vector_ModuleRoute(&modules->routes,
+                          (ModuleRoute){
+                              .route = strdup(route),
+                              .method = method == HANDLER_GET ? GET : POST,
+                              .fn = fn,
+                              .user = user,
+                          });
+  printf("module route %s registered\n", route);
+  return 0;
+}
+
+static const char *host_header(const HandlerRequest *req, const char *key) {
+  HttpRequest *http = req->internal;
+  return find_in_header(&http->headers, key);
+}
+
+static void host_set_status(HandlerResponse *resp, unsigned code) {
+  resp->code = code;
+}
+
+static void host_add_header(HandlerResponse *resp, const char *key,
+                            const char *value) {
+  char *key_copy = strdup(key);
+  char *value_copy = strdup(value);
+  if (key_copy == NULL || value_copy == NULL) {
+    free(key_copy);
+    free(value_copy);
+    resp->failed = true;
+    return;
+  }
+  push_vector_HttpHeader(&resp->headers, (HttpHeader){
+                                             .key = key_copy,
+                                             .value = value_copy,
+                                         });
+}
+
+static void host_append_body(HandlerResponse *resp, const void *data,
+                             size_t len) {
+  if (resp->failed) {
+    return;
+  }
+
+  if (resp->len + len > resp->capacity) {
+    size_t capacity = resp->capacity == 0 ? 256 : resp->capacity * 2;
+    while (capacity < resp->len + len) {
+      capacity *= 2;
+    }
+    uint8_t *body = realloc(resp->body, capacity);
+    if (body == NULL) {
+      // the body so far stays for free_handler_response
+      resp->failed = true;
+      return;
+    }
+    resp->body = body;
+    resp->capacity = capacity;
+  }
+
+  memcpy(resp->body + resp->len, data, len);
+  resp->len += len;
+}
+
+static void host_complete(HandlerResponse *resp) {
+  pthread_mutex_lock(&resp->mutex);
+  resp->completed = true;
+  pthread_cond_signal(&resp->cond);
+  pthread_mutex_unlock(&resp->mutex);
+}
+
+void init_route_modules(RouteModules *modules) {
+  modules->host = (HandlerHost){
+      .version = HANDLER_API_VERSION,
+      .register_route = &host_register_route,
+      .header = &host_header,
+      .set_status = &host_set_status,
+      .add_header = &host_add_header,
+      .append_body = &host_append_body,
+      .complete = &host_complete,
+      .internal = modules,
+  };
+  modules->routes = init_vector_ModuleRoute();
+  modules->loaded = init_vector_LoadedModule();
+}
+
+void free_route_modules(RouteModules *modules) {
+  for (size_t i = 0; i < modules->routes.len; i += 1) {
+    free(modules->routes.ptr[i].route);
+  }
+  free_vector_ModuleRoute(&modules->routes);
+
+  for (size_t i = 0; i < modules->loaded.len; i += 1) {
+    dlclose(modules->loaded.ptr[i].handle);
+    free(modules->loaded.ptr[i].arg);
+  }
+  free_vector_LoadedModule(&modules->loaded);
+}
+
+static bool load_route_module(RouteModules *modules, const char *path,
+                              const char *arg) {
+  void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL) {
+    printf("failed to load module %s: %s\n", path, dlerror());
+    return false;
+  }
+
+  RouteModuleInit init;
+  // the ISO C way to turn the object pointer into a function pointer
+  *(void **)&init = dlsym(handle, ROUTE_MODULE_INIT);
+  if (init == NULL) {
+    printf("module %s has no %s\n", path, ROUTE_MODULE_INIT);
+    dlclose(handle);
+    return false;
+  }
+
+  LoadedModule module = {
+      .handle = handle,
+      .arg = arg == NULL ? NULL : strdup(arg),
+  };
+  push_vector_LoadedModule(&modules->loaded, module);
+
+  if (init(&modules->host, module.arg) != 0) {
+    printf("module %s failed to initialize\n", path);
+    return false;
+  }
+
+  printf("module %s loaded\n", path);
+  return true;
+}
+
+bool load_route_modules(RouteModules *modules, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    printf("failed to open module config %s\n", path);
+    return false;
+  }
+
+  bool ok = true;
+  char line[1024];
+  while (ok && fgets(line, sizeof(line), file) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+
+    char *module = line + strspn(line, " \t");
+    if (*module == '\0' || *module == '#') {
+      continue;
+    }
+
+    char *arg = NULL;
+    size_t module_len = strcspn(module, " \t");
+    if (module[module_len] != '\0') {
+      module[module_len] = '\0';
+      arg = module + module_len + 1;
+      arg += strspn(arg, " \t");
+    }
+
+    ok = load_route_module(modules, module, arg);
+  }
+
+  fclose(file);
+  return ok;
+}
+
+const ModuleRoute *match_module_route(RouteModules *modules, const char *url,
+                                      HttpMethod method, const char **params) {
+  for (size_t i = 0; i < modules->routes.len; i += 1) {
+    const ModuleRoute *curr = &modules->routes.ptr[i];
+    if (curr->method != method) {
+      continue;
+    }
+
+    size_t res = starts_with_wildcard(url, curr->route);
+    if (res == (size_t)NO_MATCH) {
+      continue;
+    }
+
+    *params = res == (size_t)ALL_MATCH ? "" : url + res;
+    return curr;
+  }
+  return NULL;
+}
+
+static size_t handler_limit = 0;
+static atomic_size_t handlers = 0;
+
+void set_module_handler_limit(size_t max_handlers) {
+  handler_limit = max_handlers;
+}
+
+bool run_module_route(const ModuleRoute *route, HttpRequest *req,
+                      const char *params, HandlerResponse *resp) {
+  if (atomic_fetch_add(&handlers, 1) >= handler_limit) {
+    // the remaining workers are kept for everything else
+    atomic_fetch_sub(&handlers, 1);
+    return false;
+  }
+
+  *resp = (HandlerResponse){
+      .code = 200,
+      .headers = init_vector_HttpHeader(),
+      .body = NULL,
+      .len = 0,
+      .capacity = 0,
+      .failed = false,
+      .completed = false,
+  };
+  pthread_mutex_init(&resp->mutex, NULL);
+  pthread_cond_init(&resp->cond, NULL);
+
+  HandlerRequest view = {
+      .method = req->method == GET ? HANDLER_GET : HANDLER_POST,
+      .url = req->url.path,
+      .params = params,
+      .body = req->body.body,
+      .body_len = req->body.len,
+      .internal = req,
+      .query = req->url.query,
+  };
+
+  if (route->fn(&view, resp, route->user) == HANDLER_PENDING) {
+    // the view has to stay valid, so the worker waits for the completion
+    pthread_mutex_lock(&resp->mutex);
+    while (!resp->completed) {
+      pthread_cond_wait(&resp->cond, &resp->mutex);
+    }
+    pthread_mutex_unlock(&resp->mutex);
+  }
+
+  atomic_fetch_sub(&handlers, 1);
+  return true;
+}
+
+void free_handler_response(HandlerResponse *resp) {
+  for (size_t i = 0; i < resp->headers.len; i += 1) {
+    free((char *)resp->headers.ptr[i].key);
+    free((char *)resp->headers.ptr[i].value);
+  }
+  free_vector_HttpHeader(&resp->headers);
+  free(resp->body);
+  pthread_cond_destroy(&resp->cond);
+  pthread_mutex_destroy(&resp->mutex);
+}
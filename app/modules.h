@@ -0,0 +1,82 @@
+#ifndef MODULES
+#define MODULES
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "handler_api.h"
+#include "http.h"
+#include "vector.h"
+
+struct ModuleRoute {
+  char *route;
+  HttpMethod method;
+  HandlerFn fn;
+  void *user;
+};
+
+typedef struct ModuleRoute ModuleRoute;
+
+INIT_VECTOR(ModuleRoute);
+
+struct LoadedModule {
+  void *handle;
+  // stays valid for the module after its init
+  char *arg;
+};
+
+typedef struct LoadedModule LoadedModule;
+
+INIT_VECTOR(LoadedModule);
+
+// Routes registered by the modules, only changed while loading them
+struct RouteModules {
+  HandlerHost host;
+  Vector_ModuleRoute routes;
+  Vector_LoadedModule loaded;
+};
+
+typedef struct RouteModules RouteModules;
+
+// What a module handler builds, the header strings and body are owned
+struct HandlerResponse {
+  unsigned code;
+  Vector_HttpHeader headers;
+  uint8_t *body;
+  size_t len;
+  size_t capacity;
+  // a header or the body couldn't be stored, answered with a 500
+  bool failed;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool completed;
+};
+
+void init_route_modules(RouteModules *modules);
+void free_route_modules(RouteModules *modules);
+
+// Loads the modules listed in `path`, one shared object per line followed by
+// an optional argument for its init. Empty lines and lines starting with '#'
+// are skipped.
+bool load_route_modules(RouteModules *modules, const char *path);
+
+// The first route registered for the url and method, `params` is set to what
+// its wildcard matched
+const ModuleRoute *match_module_route(RouteModules *modules, const char *url,
+                                      HttpMethod method, const char **params);
+
+// Handlers hold their worker until the response is completed, requests
+// beyond `max_handlers` at once aren't run. Set before serving.
+void set_module_handler_limit(size_t max_handlers);
+
+// Runs the handler and blocks the calling thread until its response is
+// completed, HANDLER_PENDING doesn't give the worker back. False without
+// touching resp if the handler limit is reached.
+bool run_module_route(const ModuleRoute *route, HttpRequest *req,
+                      const char *params, HandlerResponse *resp);
+void free_handler_response(HandlerResponse *resp);
+
+#endif // !MODULES
@@ -0,0 +1,99 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+// a cached buffer holds the link to the next one in its first bytes
+struct PoolFree {
+  struct PoolFree *next;
+};
+
+typedef struct PoolFree PoolFree;
+
+static __thread PoolFree *free_lists[POOL_CLASSES];
+static __thread size_t cached[POOL_CLASSES];
+
+static size_t class_size(size_t class) {
+  return (size_t)POOL_MIN_BUFFER << (class * POOL_CLASS_SHIFT);
+}
+
+// POOL_CLASSES if the length is above every class
+static size_t class_of(size_t len) {
+  size_t class = 0;
+  while (class < POOL_CLASSES && class_size(class) < len) {
+    class += 1;
+  }
+  return class;
+}
+
+PoolBuffer pool_acquire(size_t len) {
+  size_t class = class_of(len);
+
+  if (class == POOL_CLASSES) {
+    PoolBuffer buf = {
+        .data = malloc(len),
+        .capacity = len,
+    };
+    assert(buf.data != NULL);
+    return buf;
+  }
+
+  PoolBuffer buf = {
+      .data = (uint8_t *)free_lists[class],
+      .capacity = class_size(class),
+  };
+
+  if (buf.data != NULL) {
+    free_lists[class] = free_lists[class]->next;
+    cached[class] -= 1;
+  } else {
+    buf.data = malloc(buf.capacity);
+    assert(buf.data != NULL);
+  }
+
+  return buf;
+}
+
+void pool_grow(PoolBuffer *buf, size_t used, size_t len) {
+  if (len <= buf->capacity) {
+    return;
+  }
+
+  PoolBuffer bigger = pool_acquire(len);
+  memcpy(bigger.data, buf->data, used);
+  pool_release(buf);
+  *buf = bigger;
+}
+
+void pool_release(PoolBuffer *buf) {
+  if (buf->data == NULL) {
+    return;
+  }
+
+  size_t class = class_of(buf->capacity);
+
+  if (class == POOL_CLASSES || class_size(class) != buf->capacity ||
+      cached[class] == POOL_MAX_CACHED) {
+    free(buf->data);
+  } else {
+    PoolFree *node = (PoolFree *)buf->data;
+    node->next = free_lists[class];
+    free_lists[class] = node;
+    cached[class] += 1;
+  }
+
+  buf->data = NULL;
+  buf->capacity = 0;
+}
+
+void pool_free_thread() {
+  for (size_t class = 0; class < POOL_CLASSES; class += 1) {
+    while (free_lists[class] != NULL) {
+      PoolFree *next = free_lists[class]->next;
+      free(free_lists[class]);
+      free_lists[class] = next;
+    }
+    cached[class] = 0;
+  }
+}
@@ -0,0 +1,36 @@
+#ifndef POOL
+#define POOL
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Size classed buffers cached per thread, handed out without zeroing them.
+// The smallest class fits a typical request, every class is 8 times the one
+// before and anything above the largest one is allocated exactly.
+#define POOL_CLASSES 4
+#define POOL_MIN_BUFFER (2 * 1024)
+#define POOL_CLASS_SHIFT 3
+// buffers kept per class and thread, more are freed on release
+#define POOL_MAX_CACHED 4
+
+struct PoolBuffer {
+  uint8_t *data;
+  size_t capacity;
+};
+
+typedef struct PoolBuffer PoolBuffer;
+
+// A buffer with room for at least len bytes
+PoolBuffer pool_acquire(size_t len);
+
+// Moves the first `used` bytes into a buffer with room for len bytes, does
+// nothing if it is large enough already
+void pool_grow(PoolBuffer *buf, size_t used, size_t len);
+
+// Hands the buffer back to the pool of the calling thread
+void pool_release(PoolBuffer *buf);
+
+// Frees the buffers cached by the calling thread, for threads that exit
+void pool_free_thread();
+
+#endif // !POOL
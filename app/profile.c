@@ -0,0 +1,603 @@
+#define _GNU_SOURCE
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "profile.h"
+#include "vector.h"
+
+// frame pointers further above the interrupted stack pointer than this are
+// taken as garbage, the default thread stack size
+#define PROFILE_STACK_SPAN (8 * 1024 * 1024)
+// readability is checked once per this many bytes of stack
+#define CHECK_GRANULE 4096
+// words above the stack pointer searched for a way back into code with
+// frame pointers
+#define PROFILE_SCAN_WORDS 512
+// the kernel's "comm", 15 characters and the terminator
+#define THREAD_NAME_MAX 16
+// executable segments of all loaded objects
+#define MAX_TEXT_RANGES 64
+
+struct TextRange {
+  uintptr_t start;
+  uintptr_t end;
+};
+
+typedef struct TextRange TextRange;
+
+struct ProfileSample {
+  pid_t tid;
+  // index into the thread names once the profile stopped
+  uint32_t thread;
+  uint32_t depth;
+  // innermost first, the interrupted pc followed by return addresses
+  uintptr_t pcs[PROFILE_MAX_DEPTH];
+};
+
+typedef struct ProfileSample ProfileSample;
+
+struct Profile {
+  ProfileSample *samples;
+  atomic_size_t taken;
+  // handlers still writing a sample
+  atomic_int active;
+  atomic_bool running;
+  // collected before the timer starts, the handler only reads them
+  TextRange text[MAX_TEXT_RANGES];
+  size_t text_count;
+};
+
+typedef struct Profile Profile;
+
+static Profile profile;
+// one profile at a time, the timer and the handler are process wide
+static atomic_flag profile_busy = ATOMIC_FLAG_INIT;
+
+// Whether the word at `addr` can be read without faulting. The kernel copies
+// the new signal set before it looks at the invalid `how`, so this fails with
+// EFAULT for unmapped memory and with EINVAL otherwise.
+static bool is_readable(uintptr_t addr) {
+  long res = syscall(SYS_rt_sigprocmask, ~0, (void *)addr, NULL, 8);
+  return !(res == -1 && errno == EFAULT);
+}
+
+// Reads the word at `addr` if it can be read, `checked` remembers the last
+// granule that could. Stacks are read as they are, including what
+// AddressSanitizer poisons.
+__attribute__((no_sanitize_address)) static bool read_word(uintptr_t addr, uintptr_t *checked, uintptr_t *word) {
+  uintptr_t granule = addr / CHECK_GRANULE;
+  if (granule != *checked) {
+    if (!is_readable(addr)) {
+      return false;
+    }
+    *checked = granule;
+  }
+  *word = *(uintptr_t *)addr;
+  return true;
+}
+
+static bool is_text(uintptr_t pc) {
+  for (size_t i = 0; i < profile.text_count; i += 1) {
+    if (pc >= profile.text[i].start && pc < profile.text[i].end) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Follows the saved frame pointers from `fp` on. Each frame has to sit above
+// the last one on the same stack, anything else is code that uses the
+// register for something else.
+static uint32_t walk_frames(uintptr_t fp, uintptr_t sp, uintptr_t *pcs,
+                            uint32_t depth) {
+  uintptr_t low = sp;
+  uintptr_t checked = 0;
+  while (depth < PROFILE_MAX_DEPTH && fp >= low &&
+         fp - sp < PROFILE_STACK_SPAN && fp % sizeof(uintptr_t) == 0) {
+    // the saved frame pointer and the return address next to it
+    uintptr_t next = 0;
+    uintptr_t ret = 0;
+    if (!read_word(fp, &checked, &next) ||
+        !read_word(fp + sizeof(uintptr_t), &checked, &ret) || ret == 0) {
+      break;
+    }
+    pcs[depth] = ret;
+    depth += 1;
+
+    // stacks grow down, the caller's frame is always above
+    if (next <= fp) {
+      break;
+    }
+    low = fp + 2 * sizeof(uintptr_t);
+    fp = next;
+  }
+  return depth;
+}
+
+// Code without frame pointers often keeps the register for itself. Its
+// caller's frame pointer is then saved right below the return address into
+// the caller, the first such pair above the stack pointer is taken as the
+// next frame.
+static bool scan_for_frame(uintptr_t sp, uintptr_t *fp) {
+  uintptr_t checked = 0;
+  for (size_t i = 1; i < PROFILE_SCAN_WORDS; i += 1) {
+    uintptr_t addr = sp + i * sizeof(uintptr_t);
+    uintptr_t ret = 0;
+    uintptr_t saved = 0;
+    if (!read_word(addr, &checked, &ret) ||
+        !read_word(addr - sizeof(uintptr_t), &checked, &saved)) {
+      return false;
+    }
+    if (is_text(ret) && saved > addr && saved - sp < PROFILE_STACK_SPAN) {
+      *fp = addr - sizeof(uintptr_t);
+      return true;
+    }
+  }
+  return false;
+}
+
+// The interrupted pc followed by the return addresses of its callers
+static uint32_t capture_stack(void *context, uintptr_t *pcs) {
+  ucontext_t *uc = context;
+  uintptr_t pc = 0;
+  uintptr_t fp = 0;
+  uintptr_t sp = 0;
+#if defined(__x86_64__)
+  pc = uc->uc_mcontext.gregs[REG_RIP];
+  fp = uc->uc_mcontext.gregs[REG_RBP];
+  sp = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+  pc = uc->uc_mcontext.pc;
+  fp = uc->uc_mcontext.regs[29];
+  sp = uc->uc_mcontext.sp;
+#else
+  (void)uc;
+  return 0;
+#endif
+
+  pcs[0] = pc;
+  uint32_t depth = walk_frames(fp, sp, pcs, 1);
+  if (depth == 1 && scan_for_frame(sp, &fp)) {
+    depth = walk_frames(fp, sp, pcs, 1);
+  }
+  return depth;
+}
+
+static void on_sigprof(int signum, siginfo_t *info, void *context) {
+  (void)signum;
+  (void)info;
+  int saved_errno = errno;
+
+  atomic_fetch_add(&profile.active, 1);
+  if (atomic_load(&profile.running)) {
+    size_t index = atomic_fetch_add(&profile.taken, 1);
+    if (index < PROFILE_MAX_SAMPLES) {
+      ProfileSample *sample = &profile.samples[index];
+      sample->tid = gettid();
+      sample->depth = capture_stack(context, sample->pcs);
+    }
+  }
+  atomic_fetch_sub(&profile.active, 1);
+
+  errno = saved_errno;
+}
+
+struct ThreadName {
+  pid_t tid;
+  // the first thread with the same name
+  uint32_t group;
+  char name[THREAD_NAME_MAX];
+};
+
+typedef struct ThreadName ThreadName;
+
+INIT_VECTOR(ThreadName);
+
+// Index of the thread's name, threads with the same name share one so their
+// stacks are folded together
+static uint32_t thread_index(Vector_ThreadName *names, pid_t tid) {
+  for (size_t i = 0; i < names->len; i += 1) {
+    if (names->ptr[i].tid == tid) {
+      return names->ptr[i].group;
+    }
+  }
+
+  ThreadName thread = {.tid = tid, .group = names->len, .name = "thread"};
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/task/%d/comm", tid);
+  FILE *file = fopen(path, "r");
+  if (file != NULL) {
+    if (fgets(thread.name, sizeof(thread.name), file) != NULL) {
+      thread.name[strcspn(thread.name, "\n")] = '\0';
+    }
+    fclose(file);
+  }
+
+  for (size_t i = 0; i < names->len; i += 1) {
+    if (strcmp(names->ptr[i].name, thread.name) == 0) {
+      thread.group = names->ptr[i].group;
+      break;
+    }
+  }
+  push_vector_ThreadName(names, thread);
+  return thread.group;
+}
+
+struct Symbol {
+  uintptr_t start;
+  size_t size;
+  const char *name;
+};
+
+typedef struct Symbol Symbol;
+
+INIT_VECTOR(Symbol);
+
+struct LoadedObject {
+  uintptr_t start;
+  uintptr_t end;
+  char name[64];
+};
+
+typedef struct LoadedObject LoadedObject;
+
+INIT_VECTOR(LoadedObject);
+
+struct FileMapping {
+  void *data;
+  size_t len;
+};
+
+typedef struct FileMapping FileMapping;
+
+INIT_VECTOR(FileMapping);
+
+// The function symbols of every loaded object, names point into the mapped
+// files
+struct SymbolTable {
+  Vector_Symbol symbols;
+  Vector_LoadedObject objects;
+  Vector_FileMapping files;
+};
+
+typedef struct SymbolTable SymbolTable;
+
+// Reads .symtab, or .dynsym for stripped files, of the object at `path`
+// loaded `bias` bytes off its link addresses
+static void load_symbols(SymbolTable *table, const char *path,
+                         uintptr_t bias) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return;
+  }
+  struct stat stat;
+  if (fstat(fd, &stat) == -1 || (size_t)stat.st_size < sizeof(ElfW(Ehdr))) {
+    close(fd);
+    return;
+  }
+  size_t size = stat.st_size;
+  uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return;
+  }
+  push_vector_FileMapping(&table->files, (FileMapping){data, size});
+
+  ElfW(Ehdr) *header = (ElfW(Ehdr) *)data;
+  if (memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 ||
+      header->e_shentsize != sizeof(ElfW(Shdr)) ||
+      header->e_shoff + (size_t)header->e_shnum * sizeof(ElfW(Shdr)) > size) {
+    return;
+  }
+
+  ElfW(Shdr) *sections = (ElfW(Shdr) *)(data + header->e_shoff);
+  ElfW(Shdr) *symtab = NULL;
+  for (size_t i = 0; i < header->e_shnum; i += 1) {
+    if (sections[i].sh_type == SHT_SYMTAB ||
+        (sections[i].sh_type == SHT_DYNSYM && symtab == NULL)) {
+      symtab = &sections[i];
+    }
+  }
+  if (symtab == NULL || symtab->sh_link >= header->e_shnum ||
+      symtab->sh_offset + symtab->sh_size > size) {
+    return;
+  }
+
+  ElfW(Shdr) *strtab = &sections[symtab->sh_link];
+  if (strtab->sh_offset + strtab->sh_size > size || strtab->sh_size == 0) {
+    return;
+  }
+  const char *strings = (const char *)data + strtab->sh_offset;
+  // names are only read if the table ends in a terminator
+  if (strings[strtab->sh_size - 1] != '\0') {
+    return;
+  }
+
+  ElfW(Sym) *symbols = (ElfW(Sym) *)(data + symtab->sh_offset);
+  size_t count = symtab->sh_size / sizeof(ElfW(Sym));
+  for (size_t i = 0; i < count; i += 1) {
+    ElfW(Sym) *symbol = &symbols[i];
+    int type = ELF64_ST_TYPE(symbol->st_info);
+    if ((type != STT_FUNC && type != STT_GNU_IFUNC) || symbol->st_value == 0 ||
+        symbol->st_name >= strtab->sh_size) {
+      continue;
+    }
+    push_vector_Symbol(&table->symbols,
+                       (Symbol){
+                           .start = bias + symbol->st_value,
+                           .size = symbol->st_size,
+                           .name = strings + symbol->st_name,
+                       });
+  }
+}
+
+static int add_object(struct dl_phdr_info *info, size_t size, void *arg) {
+  (void)size;
+  SymbolTable *table = arg;
+
+  // the executable itself comes without a name
+  const char *path = info->dlpi_name[0] == '\0' ? "/proc/self/exe"
+                                                : info->dlpi_name;
+  const char *base = strrchr(path, '/');
+  base = base == NULL ? path : base + 1;
+
+  for (size_t i = 0; i < info->dlpi_phnum; i += 1) {
+    const ElfW(Phdr) *segment = &info->dlpi_phdr[i];
+    if (segment->p_type != PT_LOAD) {
+      continue;
+    }
+    LoadedObject object = {
+        .start = info->dlpi_addr + segment->p_vaddr,
+        .end = info->dlpi_addr + segment->p_vaddr + segment->p_memsz,
+    };
+    snprintf(object.name, sizeof(object.name), "[%s]", base);
+    push_vector_LoadedObject(&table->objects, object);
+  }
+
+  load_symbols(table, path, info->dlpi_addr);
+  return 0;
+}
+
+static int compare_symbols(const void *a, const void *b) {
+  const Symbol *left = a;
+  const Symbol *right = b;
+  return (left->start > right->start) - (left->start < right->start);
+}
+
+static SymbolTable init_symbol_table() {
+  SymbolTable table = {
+      .symbols = init_vector_Symbol(),
+      .objects = init_vector_LoadedObject(),
+      .files = init_vector_FileMapping(),
+  };
+  dl_iterate_phdr(&add_object, &table);
+  qsort(table.symbols.ptr, table.symbols.len, sizeof(Symbol), &compare_symbols);
+  return table;
+}
+
+static void free_symbol_table(SymbolTable *table) {
+  for (size_t i = 0; i < table->files.len; i += 1) {
+    munmap(table->files.ptr[i].data, table->files.ptr[i].len);
+  }
+  free_vector_FileMapping(&table->files);
+  free_vector_Symbol(&table->symbols);
+  free_vector_LoadedObject(&table->objects);
+}
+
+// The function containing `pc`, or the object for code without symbols
+static const char *symbolize(SymbolTable *table, uintptr_t pc) {
+  size_t low = 0;
+  size_t high = table->symbols.len;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (table->symbols.ptr[mid].start <= pc) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  if (low > 0) {
+    Symbol *symbol = &table->symbols.ptr[low - 1];
+    if (pc < symbol->start + (symbol->size > 0 ? symbol->size : 1)) {
+      return symbol->name;
+    }
+  }
+
+  for (size_t i = 0; i < table->objects.len; i += 1) {
+    LoadedObject *object = &table->objects.ptr[i];
+    if (pc >= object->start && pc < object->end) {
+      return object->name;
+    }
+  }
+  return "[unknown]";
+}
+
+static int compare_samples(const void *a, const void *b) {
+  const ProfileSample *left = a;
+  const ProfileSample *right = b;
+  if (left->thread != right->thread) {
+    return left->thread < right->thread ? -1 : 1;
+  }
+  if (left->depth != right->depth) {
+    return left->depth < right->depth ? -1 : 1;
+  }
+  return memcmp(left->pcs, right->pcs, left->depth * sizeof(uintptr_t));
+}
+
+struct FoldedStack {
+  char *line;
+  size_t count;
+};
+
+typedef struct FoldedStack FoldedStack;
+
+INIT_VECTOR(FoldedStack);
+
+static int compare_folded(const void *a, const void *b) {
+  return strcmp(((const FoldedStack *)a)->line,
+                ((const FoldedStack *)b)->line);
+}
+
+// Counts the distinct stacks, symbolizes each once and merges the ones that
+// end up with the same names
+static char *fold_samples(ProfileSample *samples, size_t count, size_t *len) {
+  Vector_ThreadName names = init_vector_ThreadName();
+  for (size_t i = 0; i < count; i += 1) {
+    samples[i].thread = thread_index(&names, samples[i].tid);
+  }
+  qsort(samples, count, sizeof(ProfileSample), &compare_samples);
+
+  SymbolTable table = init_symbol_table();
+  Vector_FoldedStack stacks = init_vector_FoldedStack();
+
+  for (size_t i = 0; i < count;) {
+    size_t same = 1;
+    while (i + same < count &&
+           compare_samples(&samples[i], &samples[i + same]) == 0) {
+      same += 1;
+    }
+
+    ProfileSample *sample = &samples[i];
+    FoldedStack stack = {.line = NULL, .count = same};
+    size_t line_len = 0;
+    FILE *line = open_memstream(&stack.line, &line_len);
+    fputs(names.ptr[sample->thread].name, line);
+    for (uint32_t depth = sample->depth; depth > 0; depth -= 1) {
+      // return addresses point behind the call, which may be the next
+      // function already
+      uintptr_t pc = sample->pcs[depth - 1] - (depth > 1 ? 1 : 0);
+      fprintf(line, ";%s", symbolize(&table, pc));
+    }
+    fclose(line);
+    push_vector_FoldedStack(&stacks, stack);
+
+    i += same;
+  }
+
+  free_symbol_table(&table);
+  free_vector_ThreadName(&names);
+
+  qsort(stacks.ptr, stacks.len, sizeof(FoldedStack), &compare_folded);
+
+  char *folded = NULL;
+  FILE *out = open_memstream(&folded, len);
+  for (size_t i = 0; i < stacks.len;) {
+    size_t total = 0;
+    size_t same = 0;
+    while (i + same < stacks.len &&
+           strcmp(stacks.ptr[i].line, stacks.ptr[i + same].line) == 0) {
+      total += stacks.ptr[i + same].count;
+      same += 1;
+    }
+    fprintf(out, "%s %zu\n", stacks.ptr[i].line, total);
+    i += same;
+  }
+  fclose(out);
+
+  for (size_t i = 0; i < stacks.len; i += 1) {
+    free(stacks.ptr[i].line);
+  }
+  free_vector_FoldedStack(&stacks);
+  return folded;
+}
+
+static int add_text_ranges(struct dl_phdr_info *info, size_t size,
+                           void *arg) {
+  (void)size;
+  (void)arg;
+  for (size_t i = 0; i < info->dlpi_phnum; i += 1) {
+    const ElfW(Phdr) *segment = &info->dlpi_phdr[i];
+    if (segment->p_type != PT_LOAD || (segment->p_flags & PF_X) == 0 ||
+        profile.text_count == MAX_TEXT_RANGES) {
+      continue;
+    }
+    profile.text[profile.text_count] = (TextRange){
+        .start = info->dlpi_addr + segment->p_vaddr,
+        .end = info->dlpi_addr + segment->p_vaddr + segment->p_memsz,
+    };
+    profile.text_count += 1;
+  }
+  return 0;
+}
+
+// Stops the timer and waits for handlers that are still running
+static void stop_sampling() {
+  struct itimerval off = {0};
+  setitimer(ITIMER_PROF, &off, NULL);
+
+  atomic_store(&profile.running, false);
+  // a SIGPROF still pending would terminate the process once the handler
+  // is gone
+  signal(SIGPROF, SIG_IGN);
+  while (atomic_load(&profile.active) > 0) {
+    sched_yield();
+  }
+}
+
+char *run_profile(unsigned seconds, size_t *len) {
+  if (atomic_flag_test_and_set(&profile_busy)) {
+    return NULL;
+  }
+
+  char *folded = NULL;
+  profile.samples = malloc(PROFILE_MAX_SAMPLES * sizeof(ProfileSample));
+  if (profile.samples == NULL) {
+    goto PROFILE_DONE;
+  }
+  atomic_store(&profile.taken, 0);
+  profile.text_count = 0;
+  dl_iterate_phdr(&add_text_ranges, NULL);
+
+  // syscalls interrupted by a sample continue where they were
+  struct sigaction action = {
+      .sa_sigaction = &on_sigprof,
+      .sa_flags = SA_SIGINFO | SA_RESTART,
+  };
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, NULL);
+  atomic_store(&profile.running, true);
+
+  struct itimerval timer = {
+      .it_interval = {.tv_sec = 0, .tv_usec = 1000000 / PROFILE_HZ},
+      .it_value = {.tv_sec = 0, .tv_usec = 1000000 / PROFILE_HZ},
+  };
+  if (setitimer(ITIMER_PROF, &timer, NULL) == -1) {
+    printf("profile: setitimer failed: %s\n", strerror(errno));
+    stop_sampling();
+    goto PROFILE_DONE;
+  }
+
+  printf("profile: sampling for %us\n", seconds);
+  struct timespec remaining = {.tv_sec = seconds, .tv_nsec = 0};
+  while (nanosleep(&remaining, &remaining) == -1 && errno == EINTR) {
+  }
+  stop_sampling();
+
+  size_t taken = atomic_load(&profile.taken);
+  size_t count = taken < PROFILE_MAX_SAMPLES ? taken : PROFILE_MAX_SAMPLES;
+  printf("profile: %zu samples, %zu dropped\n", count, taken - count);
+
+  folded = fold_samples(profile.samples, count, len);
+
+PROFILE_DONE:
+  free(profile.samples);
+  profile.samples = NULL;
+  atomic_flag_clear(&profile_busy);
+  return folded;
+}
@@ -0,0 +1,28 @@
+#ifndef PROFILE
+#define PROFILE
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// On demand CPU profile of the whole process for /debug/profile. SIGPROF
+// fires every 1/PROFILE_HZ s of CPU time any thread used and the handler
+// records the stack of the thread it interrupted by following the frame
+// pointers. The result are folded stacks for flamegraph.pl or speedscope,
+// one line per distinct stack:
+//   <thread name>;<outermost frame>;...;<innermost frame> <samples>
+//
+// Code built without frame pointers (libc, zlib) cuts its callers off, the
+// function that was running is always there.
+
+#define PROFILE_HZ 99
+#define PROFILE_MAX_SECONDS 60
+#define PROFILE_MAX_DEPTH 64
+// further samples are dropped, enough for PROFILE_HZ on 5 busy cores for
+// the longest profile
+#define PROFILE_MAX_SAMPLES (PROFILE_HZ * PROFILE_MAX_SECONDS * 5)
+
+// Samples for `seconds` and returns the folded stacks, NULL if another
+// profile is running or the timer couldn't be started. The caller frees it.
+char *run_profile(unsigned seconds, size_t *len);
+
+#endif // !PROFILE
@@ -0,0 +1,649 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "proxy.h"
+#include "routes.h"
+#include "utils.h"
+
+bool parse_proxy_route(const char *value, ProxyRoute *route) {
+  *route = (ProxyRoute){0};
+
+  size_t route_len = strcspn(value, " \t");
+  if (route_len == 0 || route_len >= PROXY_ROUTE_MAX || value[0] != '/') {
+    return false;
+  }
+  memcpy(route->route, value, route_len);
+  route->route[route_len] = '\0';
+
+  const char *curr = value + route_len;
+  while (1) {
+    curr += strspn(curr, " \t");
+    size_t len = strcspn(curr, " \t");
+    if (len == 0) {
+      break;
+    }
+
+    char name[LISTEN_NAME_MAX];
+    if (len >= sizeof(name) || route->upstream_count == PROXY_MAX_UPSTREAMS) {
+      return false;
+    }
+    memcpy(name, curr, len);
+    name[len] = '\0';
+
+    Upstream *upstream = &route->upstreams[route->upstream_count];
+    if (!parse_listen_address(name, &upstream->address)) {
+      return false;
+    }
+    route->upstream_count += 1;
+    curr += len;
+  }
+
+  return route->upstream_count > 0;
+}
+
+bool same_proxy_route(const ProxyRoute *a, const ProxyRoute *b) {
+  if (strcmp(a->route, b->route) != 0 ||
+      a->upstream_count != b->upstream_count) {
+    return false;
+  }
+  for (size_t i = 0; i < a->upstream_count; i += 1) {
+    if (strcmp(a->upstreams[i].address.name, b->upstreams[i].address.name) !=
+        0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+ProxyRoute *match_proxy_route(Vector_ProxyRoute *routes, const char *url) {
+  for (size_t i = 0; i < routes->len; i += 1) {
+    if (starts_with_wildcard(url, routes->ptr[i].route) != (size_t)NO_MATCH) {
+      return &routes->ptr[i];
+    }
+  }
+  return NULL;
+}
+
+// least outstanding requests, counted as soon as it is picked
+static Upstream *pick_upstream(ProxyRoute *route) {
+  size_t start = atomic_fetch_add(&route->next, 1);
+  Upstream *best = NULL;
+  size_t best_outstanding = SIZE_MAX;
+
+  for (size_t i = 0; i < route->upstream_count; i += 1) {
+    Upstream *curr = &route->upstreams[(start + i) % route->upstream_count];
+    size_t outstanding = atomic_load(&curr->outstanding);
+    if (outstanding < best_outstanding) {
+      best = curr;
+      best_outstanding = outstanding;
+    }
+  }
+
+  atomic_fetch_add(&best->outstanding, 1);
+  return best;
+}
+
+// Idle keep-alive connections of this worker, most recent last
+#define PROXY_IDLE_MAX 32
+
+struct IdleUpstream {
+  const Upstream *upstream;
+  int fd;
+};
+
+typedef struct IdleUpstream IdleUpstream;
+
+static __thread IdleUpstream idle[PROXY_IDLE_MAX];
+static __thread size_t idle_count = 0;
+
+static void remove_idle(size_t index) {
+  memmove(&idle[index], &idle[index + 1],
+          (idle_count - index - 1) * sizeof(IdleUpstream));
+  idle_count -= 1;
+}
+
+// An idle connection is readable only once the upstream closed it
+static bool is_stale(int fd) {
+  struct pollfd pfd = {
+      .fd = fd,
+      .events = POLLIN,
+      .revents = 0,
+  };
+  return poll(&pfd, 1, 0) != 0;
+}
+
+static int take_idle(const Upstream *upstream) {
+  for (size_t i = idle_count; i > 0; i -= 1) {
+    if (idle[i - 1].upstream != upstream) {
+      continue;
+    }
+
+    int fd = idle[i - 1].fd;
+    remove_idle(i - 1);
+    if (!is_stale(fd)) {
+      return fd;
+    }
+    close(fd);
+  }
+  return -1;
+}
+
+static void put_idle(const Upstream *upstream, int fd) {
+  if (idle_count == PROXY_IDLE_MAX) {
+    close(idle[0].fd);
+    remove_idle(0);
+  }
+  idle[idle_count] = (IdleUpstream){
+      .upstream = upstream,
+      .fd = fd,
+  };
+  idle_count += 1;
+}
+
+void proxy_free_thread() {
+  while (idle_count > 0) {
+    close(idle[idle_count - 1].fd);
+    idle_count -= 1;
+  }
+}
+
+static int dial_upstream(const Upstream *upstream) {
+  const ListenAddress *address = &upstream->address;
+  int fd = socket(address->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -1;
+  }
+
+  if (connect(fd, (const struct sockaddr *)&address->addr, address->len) !=
+      0) {
+    printf("upstream %s: connect failed: %s\n", address->name,
+           strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  if (address->addr.ss_family != AF_UNIX) {
+    // the head and the body leave in separate writes
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+// headers only meaningful for a single connection, replaced on both sides
+static bool is_hop_by_hop(const char *key) {
+  static const char *const hop_by_hop[] = {
+      CONNECTION, "Keep-Alive", "Proxy-Connection", "TE", "Trailer", UPGRADE,
+      HTTP2_SETTINGS,
+      // the body is forwarded without waiting for a 100 Continue
+      "Expect",
+  };
+  for (size_t i = 0; i < ARRAY_SIZE(hop_by_hop); i += 1) {
+    if (strcasecmp(key, hop_by_hop[i]) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// the forwarded request head, without a trailing NUL
+static size_t write_request_head(uint8_t *buf, HttpRequest *req) {
+  // the path as it was routed, ".." can't reach past the route upstream
+  char target[MAX_FORMATTED_URL];
+  format_url(target, sizeof(target), &req->url);
+
+  size_t size = sprintf((char *)buf, "%s %s HTTP/1.1\r\n",
+                        req->method == GET ? "GET" : "POST", target);
+
+  Vector_HttpHeader *headers = &req->headers.headers;
+  for (size_t i = 0; i < headers->len; i += 1) {
+    const char *key = headers->ptr[i].key;
+    if (!is_hop_by_hop(key) && strcasecmp(key, CONTENT_LENGTH) != 0) {
+      size += sprintf((char *)buf + size, "%s: %s\r\n", key,
+                      headers->ptr[i].value);
+    }
+  }
+
+  if (req->body.len > 0 || req->method == POST) {
+    size += sprintf((char *)buf + size, CONTENT_LENGTH ": %zu\r\n",
+                    req->body.len);
+  }
+  size += sprintf((char *)buf + size, "\r\n");
+  return size;
+}
+
+// How the end of the response body is found
+enum ProxyFraming {
+  FRAMING_NONE,
+  FRAMING_LENGTH,
+  FRAMING_CHUNKED,
+  // until the upstream closes
+  FRAMING_CLOSE,
+};
+
+typedef enum ProxyFraming ProxyFraming;
+
+enum ChunkState {
+  CHUNK_SIZE,
+  CHUNK_EXTENSION,
+  CHUNK_DATA,
+  CHUNK_DATA_END,
+  CHUNK_TRAILER,
+  CHUNK_DONE,
+  CHUNK_INVALID,
+};
+
+typedef enum ChunkState ChunkState;
+
+// Follows the chunked framing of bytes that are forwarded as they are
+struct ChunkParser {
+  ChunkState state;
+  size_t size;
+  // digits of the size line, characters of a trailer line
+  size_t line_len;
+};
+
+typedef struct ChunkParser ChunkParser;
+
+static void chunk_line_end(ChunkParser *parser) {
+  parser->state = parser->line_len == 0 ? CHUNK_INVALID
+                  : parser->size == 0   ? CHUNK_TRAILER
+                                        : CHUNK_DATA;
+  parser->line_len = 0;
+}
+
+static void chunk_size_digit(ChunkParser *parser, size_t digit) {
+  if (parser->size > SIZE_MAX / 16) {
+    // would wrap around and lose the framing
+    parser->state = CHUNK_INVALID;
+    return;
+  }
+  parser->size = parser->size * 16 + digit;
+  parser->line_len += 1;
+}
+
+// Returns the bytes up to and including the end of the body
+static size_t advance_chunks(ChunkParser *parser, const uint8_t *buf,
+                             size_t len) {
+  size_t i = 0;
+  while (i < len && parser->state != CHUNK_DONE &&
+         parser->state != CHUNK_INVALID) {
+    uint8_t c = buf[i];
+
+    switch (parser->state) {
+    case CHUNK_SIZE:
+      if (c >= '0' && c <= '9') {
+        chunk_size_digit(parser, c - '0');
+      } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+        chunk_size_digit(parser, (c | 0x20) - 'a' + 10);
+      } else if (c == ';' || c == ' ' || c == '\t') {
+        // the size needs at least one digit
+        parser->state =
+            parser->line_len == 0 ? CHUNK_INVALID : CHUNK_EXTENSION;
+      } else if (c == '\n') {
+        chunk_line_end(parser);
+      } else if (c != '\r') {
+        parser->state = CHUNK_INVALID;
+      }
+      i += 1;
+      break;
+    case CHUNK_EXTENSION:
+      if (c == '\n') {
+        // digits were counted before the extension started
+        parser->state = parser->size == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+        parser->line_len = 0;
+      }
+      i += 1;
+      break;
+    case CHUNK_DATA: {
+      size_t take = len - i < parser->size ? len - i : parser->size;
+      parser->size -= take;
+      i += take;
+      if (parser->size == 0) {
+        parser->state = CHUNK_DATA_END;
+      }
+      break;
+    }
+    case CHUNK_DATA_END:
+      if (c == '\n') {
+        parser->state = CHUNK_SIZE;
+      }
+      i += 1;
+      break;
+    case CHUNK_TRAILER:
+      // trailer fields until an empty line
+      if (c == '\n') {
+        parser->state = parser->line_len == 0 ? CHUNK_DONE : CHUNK_TRAILER;
+        parser->line_len = 0;
+      } else if (c != '\r') {
+        parser->line_len += 1;
+      }
+      i += 1;
+      break;
+    case CHUNK_DONE:
+    case CHUNK_INVALID:
+      break;
+    }
+  }
+  return i;
+}
+
+struct ProxyResponse {
+  unsigned status;
+  ProxyFraming framing;
+  size_t length;
+  // the upstream closes after this response
+  bool upstream_close;
+};
+
+typedef struct ProxyResponse ProxyResponse;
+
+// Parses the upstream head and writes the one for the client into `out`
+static bool parse_response_head(const uint8_t *head, size_t len,
+                                ProxyResponse *resp, bool client_close,
+                                uint8_t *out, size_t *out_len) {
+  // "HTTP/1.x nnn" followed by the end of the line or a reason phrase
+  const char *end_line = memmem(head, len, "\r\n", 2);
+  size_t line_len =
+      end_line == NULL ? 0 : (size_t)((const uint8_t *)end_line - head);
+  if (line_len < 12 || memcmp(head, "HTTP/1.", 7) != 0 ||
+      (head[7] != '0' && head[7] != '1') || head[8] != ' ' ||
+      (line_len > 12 && head[12] != ' ')) {
+    return false;
+  }
+
+  resp->status = 0;
+  for (size_t i = 9; i < 12; i += 1) {
+    if (head[i] < '0' || head[i] > '9') {
+      return false;
+    }
+    resp->status = resp->status * 10 + (head[i] - '0');
+  }
+  resp->framing = FRAMING_CLOSE;
+  resp->length = 0;
+  // HTTP/1.0 closes unless asked not to
+  resp->upstream_close = head[7] == '0';
+
+  // status line as it is, always announced as HTTP/1.1
+  size_t size = sprintf((char *)out, "HTTP/1.1");
+  memcpy(out + size, head + 8, line_len - 8);
+  size += line_len - 8;
+  size += sprintf((char *)out + size, "\r\n");
+
+  const char *curr = end_line + 2;
+  const char *end = (const char *)head + len;
+  while (curr < end) {
+    const char *eol = memmem(curr, end - curr, "\r\n", 2);
+    if (eol == NULL || eol == curr) {
+      break;
+    }
+
+    const char *colon = memchr(curr, ':', eol - curr);
+    if (colon == NULL) {
+      return false;
+    }
+
+    char key[64];
+    size_t key_len = colon - curr;
+    if (key_len >= sizeof(key)) {
+      key_len = sizeof(key) - 1;
+    }
+    memcpy(key, curr, key_len);
+    key[key_len] = '\0';
+
+    const char *value = colon + 1;
+    while (value < eol && (*value == ' ' || *value == '\t')) {
+      value += 1;
+    }
+    size_t value_len = eol - value;
+
+    if (strcasecmp(key, CONTENT_LENGTH) == 0) {
+      resp->framing = FRAMING_LENGTH;
+      resp->length = strtoull(value, NULL, 10);
+    } else if (strcasecmp(key, TRANSFER_ENCODING) == 0 &&
+               value_len >= 7 &&
+               strncasecmp(value + value_len - 7, "chunked", 7) == 0) {
+      resp->framing = FRAMING_CHUNKED;
+    } else if (strcasecmp(key, CONNECTION) == 0) {
+      resp->upstream_close = value_len == 5 && strncasecmp(value, "close", 5) == 0;
+    }
+
+    if (!is_hop_by_hop(key)) {
+      memcpy(out + size, curr, eol - curr + 2);
+      size += eol - curr + 2;
+    }
+    curr = eol + 2;
+  }
+
+  // chunked wins over a length, as the upstream frames it that way
+  if (resp->framing == FRAMING_CHUNKED) {
+    resp->length = 0;
+  }
+  if (resp->status == 204 || resp->status == 304) {
+    resp->framing = FRAMING_NONE;
+  }
+
+  if (client_close || resp->framing == FRAMING_CLOSE) {
+    size += sprintf((char *)out + size, CONNECTION ": " CONNECTION_CLOSE "\r\n");
+  }
+  size += sprintf((char *)out + size, "\r\n");
+
+  *out_len = size;
+  return true;
+}
+
+#define PROXY_CHUNK (16 * 1024)
+
+static bool send_error(Connection *client, HttpStatus status) {
+  HttpOutput out = init_output();
+  handle_error(&out, status);
+  conn_write_output(client, &out);
+  free_output(&out);
+  return false;
+}
+
+// Sends the head and the buffered part of the body, dialing a new
+// connection once if a reused one turns out to be gone
+static bool send_request_start(Connection *upstream_conn, Upstream *upstream,
+                               TimerWheel *timers, const uint8_t *head,
+                               size_t head_len, const uint8_t *body,
+                               size_t body_len, bool more) {
+  int fd = take_idle(upstream);
+  bool reused = fd != -1;
+
+  while (1) {
+    if (fd == -1) {
+      fd = dial_upstream(upstream);
+      reused = false;
+      if (fd == -1) {
+        return false;
+      }
+    }
+
+    ConnTimeouts timeouts = upstream_conn->timeouts;
+    *upstream_conn = init_connection(fd, timers);
+    upstream_conn->timeouts = timeouts;
+
+    bool sent = body_len > 0 || more
+                    ? conn_write_more(upstream_conn, head, head_len)
+                    : conn_write(upstream_conn, head, head_len);
+    if (sent && body_len > 0) {
+      sent = more ? conn_write_more(upstream_conn, body, body_len)
+                  : conn_write(upstream_conn, body, body_len);
+    }
+
+    if (sent) {
+      return true;
+    }
+
+    close_connection(upstream_conn);
+    fd = -1;
+    if (!reused) {
+      return false;
+    }
+  }
+}
+
+bool proxy_request(Connection *client, ProxyRoute *route, HttpRequest *req,
+                   const uint8_t *buffered, size_t buffered_len) {
+  Upstream *upstream = pick_upstream(route);
+  bool client_keep = req->keep_alive;
+  bool upstream_keep = false;
+
+  PoolBuffer buf = pool_acquire(MAX_HEADER_SIZE + MAX_FORMATTED_URL + 256);
+  size_t head_len = write_request_head(buf.data, req);
+
+  size_t body_buffered =
+      buffered_len < req->body.len ? buffered_len : req->body.len;
+  size_t body_left = req->body.len - body_buffered;
+
+  Connection upstream_conn = init_connection(-1, client->timers);
+  upstream_conn.timeouts = client->timeouts;
+
+  if (!send_request_start(&upstream_conn, upstream, client->timers, buf.data,
+                          head_len, buffered, body_buffered, body_left > 0)) {
+    client_keep = send_error(client, BAD_GATEWAY);
+    goto PROXY_DONE;
+  }
+
+  // stream the rest of the body, never reading past it
+  while (body_left > 0) {
+    size_t chunk = body_left < buf.capacity ? body_left : buf.capacity;
+    size_t len = 0;
+
+    conn_arm(client, client->timeouts.body_ms, TIMER_SHUT_RD);
+    if (!conn_read_some(client, buf.data, &len, chunk)) {
+      // the client is gone, so is the upstream request
+      client_keep = false;
+      goto PROXY_CLOSE_UPSTREAM;
+    }
+
+    body_left -= len;
+    bool sent = body_left > 0 ? conn_write_more(&upstream_conn, buf.data, len)
+                              : conn_write(&upstream_conn, buf.data, len);
+    if (!sent) {
+      client_keep = send_error(client, BAD_GATEWAY);
+      goto PROXY_CLOSE_UPSTREAM;
+    }
+  }
+
+  // the response head, informational ones are dropped
+  size_t len = 0;
+  size_t header_len = 0;
+  ProxyResponse resp;
+  uint8_t *client_head = NULL;
+  size_t client_head_len = 0;
+
+  while (1) {
+    conn_arm(&upstream_conn, upstream_conn.timeouts.body_ms, TIMER_SHUT_RD);
+    while ((header_len = find_header_end(buf.data, len)) == 0) {
+      if (len == buf.capacity ||
+          !conn_read_some(&upstream_conn, buf.data, &len, buf.capacity)) {
+        client_keep = send_error(client, BAD_GATEWAY);
+        goto PROXY_CLOSE_UPSTREAM;
+      }
+    }
+
+    client_head = malloc(header_len + 64);
+    if (!parse_response_head(buf.data, header_len, &resp, !client_keep,
+                             client_head, &client_head_len)) {
+      free(client_head);
+      client_keep = send_error(client, BAD_GATEWAY);
+      goto PROXY_CLOSE_UPSTREAM;
+    }
+
+    if (resp.status >= 200 || resp.status == 101) {
+      break;
+    }
+
+    free(client_head);
+    len -= header_len;
+    memmove(buf.data, buf.data + header_len, len);
+  }
+
+  if (resp.framing == FRAMING_CLOSE) {
+    client_keep = false;
+  }
+
+  bool has_body = resp.framing != FRAMING_NONE;
+  bool sent = has_body ? conn_write_more(client, client_head, client_head_len)
+                       : conn_write(client, client_head, client_head_len);
+  free(client_head);
+  if (!sent) {
+    client_keep = false;
+    goto PROXY_CLOSE_UPSTREAM;
+  }
+
+  // forward the body as it comes in, starting with what followed the head
+  ChunkParser chunks = {
+      .state = CHUNK_SIZE,
+      .size = 0,
+      .line_len = 0,
+  };
+  size_t length_left = resp.length;
+  bool done = !has_body;
+  len -= header_len;
+  memmove(buf.data, buf.data + header_len, len);
+
+  while (!done) {
+    size_t forward = len;
+    if (resp.framing == FRAMING_LENGTH) {
+      forward = len < length_left ? len : length_left;
+      length_left -= forward;
+      done = length_left == 0;
+    } else if (resp.framing == FRAMING_CHUNKED) {
+      forward = advance_chunks(&chunks, buf.data, len);
+      if (chunks.state == CHUNK_INVALID) {
+        client_keep = false;
+        goto PROXY_CLOSE_UPSTREAM;
+      }
+      done = chunks.state == CHUNK_DONE;
+    }
+
+    if (forward > 0 &&
+        !(done ? conn_write(client, buf.data, forward)
+               : conn_write_more(client, buf.data, forward))) {
+      client_keep = false;
+      goto PROXY_CLOSE_UPSTREAM;
+    }
+
+    // anything after the end would be a response nobody asked for
+    if (done) {
+      upstream_keep = forward == len && !resp.upstream_close;
+      break;
+    }
+
+    len = 0;
+    conn_arm(&upstream_conn, upstream_conn.timeouts.body_ms, TIMER_SHUT_RD);
+    if (!conn_read_some(&upstream_conn, buf.data, &len, buf.capacity)) {
+      // the expected end for close delimited bodies, an error otherwise
+      if (resp.framing != FRAMING_CLOSE) {
+        client_keep = false;
+      }
+      break;
+    }
+  }
+
+PROXY_CLOSE_UPSTREAM:
+  if (upstream_keep) {
+    timer_disarm(upstream_conn.timers, &upstream_conn.timer);
+    put_idle(upstream, upstream_conn.fd);
+  } else {
+    close_connection(&upstream_conn);
+  }
+
+PROXY_DONE:
+  atomic_fetch_sub(&upstream->outstanding, 1);
+  pool_release(&buf);
+  return client_keep;
+}
@@ -0,0 +1,60 @@
+#ifndef PROXY
+#define PROXY
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "conn.h"
+#include "http.h"
+#include "listen.h"
+#include "vector.h"
+
+// Routes forwarded to upstream HTTP/1.1 servers, configured as
+//   proxy <route> <upstream> [<upstream> ...]
+// with the route as in the built in table and the upstreams in the syntax
+// of `listen`. Bodies are streamed in both directions, idle upstream
+// connections are kept per worker thread and every request goes to the
+// upstream with the fewest requests in flight.
+
+#define PROXY_ROUTE_MAX 128
+#define PROXY_MAX_UPSTREAMS 16
+
+struct Upstream {
+  ListenAddress address;
+  // requests in flight over all workers
+  atomic_size_t outstanding;
+};
+
+typedef struct Upstream Upstream;
+
+struct ProxyRoute {
+  char route[PROXY_ROUTE_MAX];
+  Upstream upstreams[PROXY_MAX_UPSTREAMS];
+  size_t upstream_count;
+  // where the search for the least busy upstream starts, spreads ties
+  atomic_size_t next;
+};
+
+typedef struct ProxyRoute ProxyRoute;
+
+INIT_VECTOR(ProxyRoute);
+
+// "<route> <upstream> [<upstream> ...]"
+bool parse_proxy_route(const char *value, ProxyRoute *route);
+bool same_proxy_route(const ProxyRoute *a, const ProxyRoute *b);
+
+ProxyRoute *match_proxy_route(Vector_ProxyRoute *routes, const char *url);
+
+// Forwards the request and streams the response back to the client. The
+// first `buffered` bytes after the headers were read already, they may run
+// past the body into a pipelined request. Returns whether the client
+// connection can serve another request.
+bool proxy_request(Connection *client, ProxyRoute *route, HttpRequest *req,
+                   const uint8_t *buffered, size_t buffered_len);
+
+// Closes the idle upstream connections of the calling thread
+void proxy_free_thread();
+
+#endif // !PROXY
@@ -1,27 +1,52 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <openssl/crypto.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <zlib.h>
 
+#include "archive.h"
+#include "cache.h"
+#include "filemap.h"
 #include "http.h"
+#include "modules.h"
+#include "profile.h"
 #include "routes.h"
+#include "static_files.h"
+#include "trace.h"
 #include "utils.h"
 
 typedef const char *HttpParams;
 
-typedef size_t (*fnPtr)(uint8_t *const buf, HttpRequest *req, HttpParams params,
-                        AppState *state);
+typedef void (*fnPtr)(HttpOutput *out, HttpRequest *req, HttpParams params,
+                      AppState *state);
+// everything a route can reject without the body
+typedef HttpStatus (*checkPtr)(HttpRequest *req, HttpParams params,
+                               AppState *state);
 
 // SEE: stackoverflow
 // https://stackoverflow.com/questions/49622938/gzip-compression-using-zlib-into-buffer
+// changed on reload, 0 turns compression off
+static atomic_int gzip_level = DEFAULT_GZIP_LEVEL;
+static atomic_size_t gzip_min_size = 0;
+
+void set_compression(int level, size_t min_size) {
+  atomic_store(&gzip_level, level);
+  atomic_store(&gzip_min_size, min_size);
+}
+
+int current_gzip_level() { return atomic_load(&gzip_level); }
+
 int compress_to_gzip(const uint8_t *data, int input_size, uint8_t **output) {
   z_stream stream = {0};
-  deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 0x1F, 8,
+  deflateInit2(&stream, atomic_load(&gzip_level), Z_DEFLATED, 0x1F, 8,
                Z_DEFAULT_STRATEGY);
 
   size_t max_len = deflateBound(&stream, input_size);
@@ -39,16 +64,29 @@ int compress_to_gzip(const uint8_t *data, int input_size, uint8_t **output) {
   return len;
 }
 
-size_t write_response_helper(uint8_t *const buf, HttpResponse *resp) {
+// Whether a body of `len` bytes goes out gzipped to a client accepting
+// `encoding`
+static bool should_compress(HttpContentEncoding encoding, size_t len) {
+  return len > 0 && encoding == GZIP && atomic_load(&gzip_level) > 0 &&
+         len >= atomic_load(&gzip_min_size);
+}
+
+void write_response_helper(HttpOutput *out, HttpResponse *resp) {
   char content_length[100];
   HttpBody org_body = resp->body;
-  uint8_t *new_buf_body = NULL;
   bool has_body = resp->body.body != NULL && resp->body.len > 0;
 
-  if (has_body && resp->headers.encoding == GZIP) {
+  bool compress = has_body && should_compress(resp->headers.encoding,
+                                              resp->body.len);
+
+  if (compress) {
     push_header_response(resp, CONTENT_ENCODING, GZIP_ENCODING);
 
+    uint8_t *new_buf_body = NULL;
+    uint64_t gzip_start = trace_begin();
     int len = compress_to_gzip(org_body.body, org_body.len, &new_buf_body);
+    trace_end(TRACE_GZIP, gzip_start);
+    push_release_output(out, &free, new_buf_body);
 
     resp->body = (HttpBody){
         .body = new_buf_body,
@@ -56,193 +94,723 @@ size_t write_response_helper(uint8_t *const buf, HttpResponse *resp) {
     };
   }
 
-  if (has_body) {
-    sprintf(content_length, "%zu", resp->body.len);
+  // always framed, the connection stays open for the next request
+  if (resp->status != NOT_MODIFIED &&
+      find_in_header(&resp->headers, CONTENT_LENGTH) == NULL) {
+    sprintf(content_length, "%zu", has_body ? resp->body.len : 0);
     push_header_response(resp, CONTENT_LENGTH, content_length);
   }
 
-  size_t res = write_response(buf, resp);
+  write_response_output(out, resp);
 
   resp->body = org_body;
 
-  if (new_buf_body != NULL) {
-    free(new_buf_body);
-  }
-
   printf("wrote response\n");
-  return res;
 }
 
-size_t handle_bad_req(uint8_t *const buf, HttpRequest *req) {
+void handle_bad_req(HttpOutput *out, HttpRequest *req) {
 
   HttpResponse resp = init_response(BAD_REQ, req->headers.encoding);
 
-  size_t res = write_response(buf, &resp);
+  write_response_helper(out, &resp);
 
   free_http_response(&resp);
-
-  return res;
 }
 
-size_t handle_not_found(uint8_t *const buf, HttpRequest *req) {
+void handle_not_found(HttpOutput *out, HttpRequest *req) {
 
   HttpResponse resp = init_response(NOT_FOUND, req->headers.encoding);
 
-  size_t res = write_response(buf, &resp);
+  write_response_helper(out, &resp);
 
   free_http_response(&resp);
+}
+
+void handle_error(HttpOutput *out, HttpStatus status) {
+
+  HttpResponse resp = init_response(status, NO_ENCODING);
+  push_header_response(&resp, CONTENT_LENGTH, "0");
+  push_header_response(&resp, CONNECTION, CONNECTION_CLOSE);
 
-  return res;
+  write_response_output(out, &resp);
+
+  free_http_response(&resp);
+}
+
+void handle_upgrade(HttpOutput *out, const char *protocol) {
+  HttpResponse resp = init_response(SWITCHING_PROTOCOLS, NO_ENCODING);
+  push_header_response(&resp, CONNECTION, CONNECTION_UPGRADE);
+  push_header_response(&resp, UPGRADE, protocol);
+
+  write_response_output(out, &resp);
+
+  free_http_response(&resp);
+}
+
+void handle_continue(HttpOutput *out) {
+  HttpResponse resp = init_response(CONTINUE, NO_ENCODING);
+
+  write_response_output(out, &resp);
+
+  free_http_response(&resp);
 }
 
-size_t handle_root(uint8_t *const buf, HttpRequest *req, HttpParams params,
+void handle_root(HttpOutput *out, HttpRequest *req, HttpParams params,
                    AppState *state) {
   (void)params;
   (void)state;
 
   HttpResponse resp = init_response(OK, req->headers.encoding);
 
-  size_t res = write_response_helper(buf, &resp);
+  write_response_helper(out, &resp);
 
   free_http_response(&resp);
-
-  return res;
 }
 
-size_t handle_echo(uint8_t *const buf, HttpRequest *req, HttpParams params,
+void handle_echo(HttpOutput *out, HttpRequest *req, HttpParams params,
                    AppState *state) {
   (void)state;
 
   HttpResponse resp = init_response(OK, req->headers.encoding);
 
-  uint8_t body_buf[1024];
-  strcpy((char *)body_buf, params);
-
   resp.body = (HttpBody){
-      .body = body_buf,
+      .body = (const uint8_t *)params,
       .len = strlen(params),
   };
 
   push_header_response(&resp, CONTENT_TYPE, TEXT_PLAIN);
 
-  size_t res = write_response_helper(buf, &resp);
+  write_response_helper(out, &resp);
 
   free_http_response(&resp);
-
-  return res;
 }
 
-size_t handle_user_agent(uint8_t *const buf, HttpRequest *req,
+void handle_user_agent(HttpOutput *out, HttpRequest *req,
                          HttpParams params, AppState *state) {
 
   (void)params;
   (void)state;
-  uint8_t body_buf[1024];
 
-  // Assuming there is a user agent header
   const char *user_agent = find_in_header(&req->headers, USER_AGENT);
-  strcpy((char *)body_buf, user_agent);
+  if (user_agent == NULL) {
+    handle_bad_req(out, req);
+    return;
+  }
 
   HttpResponse resp = init_response(OK, req->headers.encoding);
 
   push_header_response(&resp, CONTENT_TYPE, TEXT_PLAIN);
 
   resp.body = (HttpBody){
-      .body = body_buf,
+      .body = (const uint8_t *)user_agent,
       .len = strlen(user_agent),
   };
 
-  size_t res = write_response_helper(buf, &resp);
+  write_response_helper(out, &resp);
 
   free_http_response(&resp);
+}
+
+// room for "sha256-<hash>-gz" and the quotes
+#define ETAG_MAX (UPLOAD_HASH_LEN + 16)
+
+// Strong validator, one per representation. Deduplicated uploads use their
+// content hash, everything else the inode, mtime and size.
+// `gzip` if the body is sent compressed, not just accepted that way
+static void write_etag(char *etag, const struct stat *file_stat,
+                       const char *hash, bool gzip) {
+  if (hash != NULL) {
+    sprintf(etag, "\"sha256-%s%s\"", hash, gzip ? "-gz" : "");
+    return;
+  }
 
-  return res;
+  uint64_t mtime = (uint64_t)file_stat->st_mtim.tv_sec * 1000000000 +
+                   file_stat->st_mtim.tv_nsec;
+  sprintf(etag, "\"%lx-%lx-%lx%s\"", (unsigned long)file_stat->st_ino,
+          (unsigned long)mtime, (unsigned long)file_stat->st_size,
+          gzip ? "-gz" : "");
 }
 
-size_t handle_file_get(uint8_t *const buf, HttpRequest *req, HttpParams params,
-                       AppState *state) {
-  assert(state->directory != NULL);
+// If-None-Match takes precedence, If-Modified-Since is only looked at
+// without it
+static bool is_not_modified(HttpRequest *req, const char *etag, time_t mtime) {
+  const char *if_none_match = find_in_header(&req->headers, IF_NONE_MATCH);
+  if (if_none_match != NULL) {
+    return etag_list_matches(if_none_match, etag);
+  }
 
-  char filepath[100];
+  const char *if_modified_since =
+      find_in_header(&req->headers, IF_MODIFIED_SINCE);
+  time_t since = 0;
+  if (if_modified_since != NULL &&
+      parse_http_date(if_modified_since, &since)) {
+    return mtime <= since;
+  }
 
-  char *delim =
-      params[0] == '/' || state->directory[strlen(state->directory) - 1] == '/'
-          ? ""
-          : "/";
+  return false;
+}
 
-  sprintf(filepath, "%s%s%s", state->directory, delim, params);
+static void close_release(void *arg) { close((int)(intptr_t)arg); }
 
-  struct stat file_stat;
-  size_t res = stat(filepath, &file_stat);
+// If-Range needs an exact match, either the strong ETag or the date
+static bool if_range_matches(HttpRequest *req, const char *etag,
+                             time_t mtime) {
+  const char *if_range = find_in_header(&req->headers, IF_RANGE);
+  if (if_range == NULL) {
+    return true;
+  }
 
-  if (res != 0) {
-    return handle_not_found(buf, req);
+  if (if_range[0] == '"') {
+    return strcmp(if_range, etag) == 0;
   }
 
-  // alloc correct body size
-  size_t size = file_stat.st_size;
+  time_t date = 0;
+  return parse_http_date(if_range, &date) && date == mtime;
+}
+
+#define BYTERANGE_PART_HEAD 256
+
+// Answers with the requested ranges straight from the file, returns false if
+// the Range header has to be ignored. Takes ownership of fd otherwise.
+static bool handle_file_range(HttpOutput *out, const char *range, int fd,
+                              const struct stat *file_stat, const char *mime,
+                              const char *etag, const char *last_modified) {
+  size_t size = file_stat->st_size;
+  Vector_HttpRange ranges = init_vector_HttpRange();
+
+  HttpStatus status = parse_range(range, size, &ranges);
+  if (status == BAD_REQ) {
+    free_vector_HttpRange(&ranges);
+    return false;
+  }
+
+  char content_range[100];
+  char content_length[32];
+  char content_type[100];
+
+  HttpResponse resp = init_response(status == OK ? PARTIAL_CONTENT : status,
+                                    NO_ENCODING);
+  push_header_response(&resp, ETAG, etag);
+  push_header_response(&resp, LAST_MODIFIED, last_modified);
+  push_header_response(&resp, ACCEPT_RANGES, BYTES_UNIT);
+
+  if (status == RANGE_NOT_SATISFIABLE) {
+    sprintf(content_range, BYTES_UNIT " */%zu", size);
+    push_header_response(&resp, CONTENT_RANGE, content_range);
+    write_response_helper(out, &resp);
+    close(fd);
+  } else if (ranges.len == 1) {
+    HttpRange *curr = &ranges.ptr[0];
+    size_t len = curr->end - curr->start + 1;
+
+    sprintf(content_range, BYTES_UNIT " %zu-%zu/%zu", curr->start, curr->end,
+            size);
+    sprintf(content_length, "%zu", len);
+    push_header_response(&resp, CONTENT_TYPE, mime);
+    push_header_response(&resp, CONTENT_RANGE, content_range);
+    push_header_response(&resp, CONTENT_LENGTH, content_length);
+    write_response_helper(out, &resp);
+
+    push_file_segment_output(out, fd, curr->start, len);
+    push_release_output(out, &close_release, (void *)(intptr_t)fd);
+  } else {
+    // multipart/byteranges, the part heads live in one buffer the file
+    // segments are interleaved with
+    static atomic_ulong boundary_counter = 0;
+    char boundary[40];
+    sprintf(boundary, "%016lx%016lx", (unsigned long)file_stat->st_ino,
+            atomic_fetch_add(&boundary_counter, 1));
+
+    uint8_t *parts = malloc(BYTERANGE_PART_HEAD * (ranges.len + 1));
+    assert(parts != NULL);
+    push_release_output(out, &free, parts);
+
+    // write all part heads first, the head of the response needs the length
+    size_t parts_len = 0;
+    size_t body_len = 0;
+    size_t *part_offsets = malloc(sizeof(size_t) * (ranges.len + 2));
+    assert(part_offsets != NULL);
+
+    for (size_t i = 0; i < ranges.len; i += 1) {
+      HttpRange *curr = &ranges.ptr[i];
+      part_offsets[i] = parts_len;
+      parts_len += sprintf((char *)parts + parts_len,
+                           "\r\n--%s\r\n" CONTENT_TYPE ": %s\r\n" CONTENT_RANGE
+                           ": " BYTES_UNIT " %zu-%zu/%zu\r\n\r\n",
+                           boundary, mime, curr->start, curr->end, size);
+      body_len += curr->end - curr->start + 1;
+    }
+    part_offsets[ranges.len] = parts_len;
+    parts_len += sprintf((char *)parts + parts_len, "\r\n--%s--\r\n", boundary);
+    part_offsets[ranges.len + 1] = parts_len;
+    body_len += parts_len;
+
+    sprintf(content_type, MULTIPART_BYTERANGES "; boundary=%s", boundary);
+    sprintf(content_length, "%zu", body_len);
+    push_header_response(&resp, CONTENT_TYPE, content_type);
+    push_header_response(&resp, CONTENT_LENGTH, content_length);
+    write_response_helper(out, &resp);
+
+    for (size_t i = 0; i < ranges.len; i += 1) {
+      HttpRange *curr = &ranges.ptr[i];
+      push_segment_output(out, parts + part_offsets[i],
+                          part_offsets[i + 1] - part_offsets[i]);
+      push_file_segment_output(out, fd, curr->start,
+                               curr->end - curr->start + 1);
+    }
+    push_segment_output(out, parts + part_offsets[ranges.len],
+                        part_offsets[ranges.len + 1] - part_offsets[ranges.len]);
+    push_release_output(out, &close_release, (void *)(intptr_t)fd);
+
+    free(part_offsets);
+  }
 
-  uint8_t *body_buf = malloc(sizeof(uint8_t) * size);
-  assert(body_buf != NULL);
+  free_http_response(&resp);
+  free_vector_HttpRange(&ranges);
 
-  // read file into buffe
-  int fd = open(filepath, O_RDONLY);
-  assert(fd != -1);
+  return true;
+}
 
-  size_t size_read = read(fd, body_buf, size);
+// A directory without the trailing slash, relative links in its index
+// would resolve against the parent otherwise
+static void handle_directory_redirect(HttpOutput *out, HttpRequest *req) {
+  char path[MAX_URL_LEN + 2];
+  snprintf(path, sizeof(path), "%s/", req->url.path);
 
-  assert(size_read == size);
+  HttpUrl url = req->url;
+  url.path = path;
+  url.path_len = strlen(path);
+
+  char location[MAX_FORMATTED_URL];
+  if (format_url(location, sizeof(location), &url) == 0) {
+    handle_bad_req(out, req);
+    return;
+  }
+
+  HttpResponse resp = init_response(MOVED_PERMANENTLY, NO_ENCODING);
+  push_header_response(&resp, LOCATION, location);
+  write_response_helper(out, &resp);
+  free_http_response(&resp);
+}
+
+// Head of a full identity response for a file sent with sendfile
+static void write_file_head(HttpOutput *out, StaticFile *file,
+                            const char *etag, const char *last_modified) {
+  char content_length[32];
+  sprintf(content_length, "%zu", (size_t)file->stat.st_size);
+
+  HttpResponse resp = init_response(OK, NO_ENCODING);
+  push_header_response(&resp, CONTENT_TYPE, file->mime);
+  push_header_response(&resp, ETAG, etag);
+  push_header_response(&resp, LAST_MODIFIED, last_modified);
+  push_header_response(&resp, VARY, ACCEPT_ENCODING);
+  push_header_response(&resp, ACCEPT_RANGES, BYTES_UNIT);
+  push_header_response(&resp, CONTENT_LENGTH, content_length);
+  write_response_helper(out, &resp);
+  free_http_response(&resp);
+}
+
+// Whether the request carries the admin token, compared in constant time
+static bool is_admin_request(HttpRequest *req, const char *token) {
+  const char *authorization = find_in_header(&req->headers, AUTHORIZATION);
+  size_t scheme_len = strlen(BEARER_SCHEME);
+  if (authorization == NULL ||
+      strncasecmp(authorization, BEARER_SCHEME, scheme_len) != 0 ||
+      authorization[scheme_len] != ' ') {
+    return false;
+  }
+
+  const char *given = authorization + scheme_len + 1;
+  size_t token_len = strlen(token);
+  return strlen(given) == token_len &&
+         CRYPTO_memcmp(given, token, token_len) == 0;
+}
+
+// Answers the request unless it carries the admin token, endpoints behind it
+// don't exist without one configured
+static bool check_admin(HttpOutput *out, HttpRequest *req, AppState *state) {
+  RuntimeConfig config = current_runtime_config(state->config);
+  if (config.admin_token[0] == '\0') {
+    handle_not_found(out, req);
+    return false;
+  }
+
+  if (!is_admin_request(req, config.admin_token)) {
+    HttpResponse resp = init_response(UNAUTHORIZED, req->headers.encoding);
+    push_header_response(&resp, WWW_AUTHENTICATE, BEARER_SCHEME);
+    write_response_helper(out, &resp);
+    free_http_response(&resp);
+    return false;
+  }
+  return true;
+}
+
+void handle_trace(HttpOutput *out, HttpRequest *req, HttpParams params,
+                  AppState *state) {
+  (void)params;
+
+  if (!check_admin(out, req, state)) {
+    return;
+  }
+
+  size_t len = 0;
+  char *json = trace_export_json(&len);
+  if (json == NULL) {
+    // only there while tracing is enabled
+    handle_not_found(out, req);
+    return;
+  }
 
   HttpResponse resp = init_response(OK, req->headers.encoding);
-  push_header_response(&resp, CONTENT_TYPE, OCTET_STREAM);
+  push_header_response(&resp, CONTENT_TYPE, APPLICATION_JSON);
 
   resp.body = (HttpBody){
-      .body = body_buf,
-      .len = size,
+      .body = (const uint8_t *)json,
+      .len = len,
   };
 
-  res = write_response_helper(buf, &resp);
+  write_response_helper(out, &resp);
+  // a large body is only referenced by the output
+  push_release_output(out, &free, json);
 
   free_http_response(&resp);
-  free(body_buf);
+}
 
-  return res;
+// GET /debug/profile/<seconds> or /debug/profile?seconds=<seconds> like
+// pprof, samples the whole process meanwhile and answers with folded stacks
+void handle_profile(HttpOutput *out, HttpRequest *req, HttpParams params,
+                    AppState *state) {
+  if (!check_admin(out, req, state)) {
+    return;
+  }
+
+  char query_seconds[16] = "";
+  HttpQueryParam param;
+  if (params == NULL && find_query_param(&req->url, "seconds", &param) &&
+      param.value != NULL) {
+    size_t len = decode_query_component(param.value, param.value_len);
+    snprintf(query_seconds, sizeof(query_seconds), "%.*s", (int)len,
+             param.value);
+  }
+
+  const char *given = params == NULL ? query_seconds : params;
+  char *end = NULL;
+  unsigned long seconds = strtoul(given, &end, 10);
+  if (end == given || *end != '\0' || seconds == 0 ||
+      seconds > PROFILE_MAX_SECONDS) {
+    handle_bad_req(out, req);
+    return;
+  }
+
+  size_t len = 0;
+  char *folded = run_profile(seconds, &len);
+  if (folded == NULL) {
+    // another profile is running
+    HttpResponse resp =
+        init_response(SERVICE_UNAVAILABLE, req->headers.encoding);
+    write_response_helper(out, &resp);
+    free_http_response(&resp);
+    return;
+  }
+
+  HttpResponse resp = init_response(OK, req->headers.encoding);
+  push_header_response(&resp, CONTENT_TYPE, TEXT_PLAIN);
+  push_header_response(&resp, CACHE_CONTROL, "no-store");
+
+  resp.body = (HttpBody){
+      .body = (const uint8_t *)folded,
+      .len = len,
+  };
+
+  write_response_helper(out, &resp);
+  // a large body is only referenced by the output
+  push_release_output(out, &free, folded);
+
+  free_http_response(&resp);
 }
 
-size_t handle_file_post(uint8_t *const buf, HttpRequest *req, HttpParams params,
-                        AppState *state) {
+// What a file response is built from, filled while the mapping is read
+struct FileBody {
+  bool gzip;
+  z_stream stream;
+  uint8_t *data;
+  size_t capacity;
+  size_t len;
+};
 
-  assert(state->directory != NULL);
+// Compresses or copies the mapped file, filemap_read abandons it if the file
+// is truncated meanwhile
+static void read_file_body(const uint8_t *data, size_t len, void *arg) {
+  struct FileBody *body = arg;
+  if (body->gzip) {
+    uint64_t gzip_start = trace_begin();
+    body->stream.next_in = (Bytef *)data;
+    body->stream.avail_in = len;
+    body->stream.next_out = body->data;
+    body->stream.avail_out = body->capacity;
+    deflate(&body->stream, Z_FINISH);
+    body->len = body->stream.total_out;
+    trace_end(TRACE_GZIP, gzip_start);
+  } else {
+    memcpy(body->data, data, len);
+    body->len = len;
+  }
+}
 
-  char filepath[100];
+// The gzip body of a mapped file, NULL if the file shrank while it was read
+static uint8_t *compress_file_body(FileMapping *mapping, size_t *len) {
+  struct FileBody body = {
+      .gzip = true,
+      .stream = {0},
+      .data = NULL,
+      .capacity = 0,
+      .len = 0,
+  };
+  deflateInit2(&body.stream, atomic_load(&gzip_level), Z_DEFLATED, 0x1F, 8,
+               Z_DEFAULT_STRATEGY);
+  body.capacity = deflateBound(&body.stream, mapping->size);
 
-  char *delim =
-      params[0] == '/' || state->directory[strlen(state->directory) - 1] == '/'
-          ? ""
-          : "/";
+  body.data = malloc(body.capacity);
+  bool ok = body.data != NULL && filemap_read(mapping, &read_file_body, &body);
 
-  sprintf(filepath, "%s%s%s", state->directory, delim, params);
+  deflateEnd(&body.stream);
+  if (!ok) {
+    free(body.data);
+    return NULL;
+  }
 
-  int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  *len = body.len;
+  return body.data;
+}
 
-  if (fd == -1) {
-    printf("INVALID: open returned an error <%i>", errno);
-    exit(1);
+// Caches the head written to `out` followed by the mapped file, which is
+// copied right into the entry
+static void cache_file_response(ResponseCache *cache, const char *key,
+                                const CacheValidator *validator,
+                                HttpOutput *out, FileMapping *mapping) {
+  size_t len = out->len + mapping->size;
+  if (!cache_accepts(cache, len)) {
+    return;
   }
 
-  write(fd, req->body.body, req->body.len);
+  uint8_t *data = malloc(len);
+  if (data == NULL) {
+    return;
+  }
+  memcpy(data, out->buf, out->len);
+
+  struct FileBody body = {
+      .gzip = false,
+      .stream = {0},
+      .data = data + out->len,
+      .capacity = mapping->size,
+      .len = 0,
+  };
+  // a file truncated meanwhile is just not cached
+  if (!filemap_read(mapping, &read_file_body, &body)) {
+    free(data);
+    return;
+  }
+  cache_insert_data(cache, key, validator, data, len);
+}
+
+void handle_file_get(HttpOutput *out, HttpRequest *req, HttpParams params,
+                     AppState *state) {
+  StaticFile file;
+  StaticResult result = static_open(state->root, params, &file);
+
+  if (result == STATIC_DIRECTORY) {
+    handle_directory_redirect(out, req);
+    return;
+  } else if (result == STATIC_BAD_PATH) {
+    handle_bad_req(out, req);
+    return;
+  } else if (result != STATIC_FOUND) {
+    handle_not_found(out, req);
+    return;
+  }
+
+  int fd = file.fd;
+  struct stat file_stat = file.stat;
+
+  // a file too small or with compression turned off goes out as it is
+  bool gzip = should_compress(req->headers.encoding, file_stat.st_size);
+
+  char hash_buf[UPLOAD_HASH_LEN + 1];
+  const char *hash =
+      upload_content_hash(state->uploads, fd, hash_buf) ? hash_buf : NULL;
+
+  char etag[ETAG_MAX];
+  write_etag(etag, &file_stat, hash, gzip);
+
+  char last_modified[HTTP_DATE_LEN];
+  format_http_date(last_modified, file_stat.st_mtime);
+
+  if (is_not_modified(req, etag, file_stat.st_mtime)) {
+    close(fd);
+
+    HttpResponse resp = init_response(NOT_MODIFIED, NO_ENCODING);
+    push_header_response(&resp, ETAG, etag);
+    push_header_response(&resp, LAST_MODIFIED, last_modified);
+    // caches store the 304 like the full response
+    push_header_response(&resp, VARY, ACCEPT_ENCODING);
+    write_response_helper(out, &resp);
+    free_http_response(&resp);
+    return;
+  }
+
+  const char *range = find_in_header(&req->headers, RANGE);
+  if (range != NULL) {
+    // ranges are always served from the identity representation
+    char identity_etag[ETAG_MAX];
+    write_etag(identity_etag, &file_stat, hash, false);
+
+    if (if_range_matches(req, identity_etag, file_stat.st_mtime) &&
+        handle_file_range(out, range, fd, &file_stat, file.mime,
+                          identity_etag, last_modified)) {
+      return;
+    }
+  }
+
+  // alloc correct body size
+  size_t size = file_stat.st_size;
+
+  CacheValidator validator = cache_validator(&file_stat);
+  // entries are serialized HTTP/1.1, HTTP/2 frames the head on its own
+  bool cacheable = out->version == HTTP1_1;
+
+  if (!gzip && (!cacheable || !cache_accepts(state->cache, size))) {
+    // not cached as a whole, let the kernel send it behind a head that is
+    // only built once per file version
+    char head_key[STATIC_PATH_MAX + 16];
+    sprintf(head_key, "head:%s", file.path);
+
+    CacheEntry *head =
+        cacheable ? cache_lookup(state->cache, head_key, &validator) : NULL;
+
+    if (head != NULL) {
+      printf("cache hit <%s>\n", head_key);
+      push_segment_output(out, head->data, head->len);
+      push_release_output(out, &cache_release, head);
+    } else {
+      write_file_head(out, &file, etag, last_modified);
+      if (cacheable) {
+        cache_insert(state->cache, head_key, &validator, out);
+      }
+    }
+
+    push_file_segment_output(out, fd, 0, size);
+    push_release_output(out, &close_release, (void *)(intptr_t)fd);
+    return;
+  }
+
+  // one entry per encoding
+  char key[STATIC_PATH_MAX + 16];
+  sprintf(key, "%s:%s", gzip ? GZIP_ENCODING : "identity", file.path);
+  CacheEntry *entry =
+      cacheable ? cache_lookup(state->cache, key, &validator) : NULL;
+
+  if (entry != NULL) {
+    close(fd);
+    printf("cache hit <%s>\n", key);
+    push_segment_output(out, entry->data, entry->len);
+    push_release_output(out, &cache_release, entry);
+    return;
+  }
+
+  // compress or cache straight from the page cache
+  FileMapping *mapping = filemap_acquire(state->files, fd, &file_stat);
+
+  if (!gzip) {
+    // the kernel sends the file, the entry is the only copy of it
+    write_file_head(out, &file, etag, last_modified);
+    if (mapping != NULL) {
+      cache_file_response(state->cache, key, &validator, out, mapping);
+      filemap_release(mapping);
+    }
+
+    push_file_segment_output(out, fd, 0, size);
+    push_release_output(out, &close_release, (void *)(intptr_t)fd);
+    return;
+  }
+
+  close(fd);
+
+  if (mapping == NULL) {
+    handle_not_found(out, req);
+    return;
+  }
+
+  size_t body_len = 0;
+  uint8_t *body = compress_file_body(mapping, &body_len);
+  filemap_release(mapping);
+
+  if (body == NULL) {
+    handle_error(out, INTERNAL_SERVER_ERROR);
+    return;
+  }
+
+  // already compressed, write_response_helper leaves it alone
+  HttpResponse resp = init_response(OK, NO_ENCODING);
+  push_header_response(&resp, CONTENT_ENCODING, GZIP_ENCODING);
+  push_header_response(&resp, CONTENT_TYPE, file.mime);
+  push_header_response(&resp, ETAG, etag);
+  push_header_response(&resp, LAST_MODIFIED, last_modified);
+  push_header_response(&resp, VARY, ACCEPT_ENCODING);
+  push_header_response(&resp, ACCEPT_RANGES, BYTES_UNIT);
+
+  resp.body = (HttpBody){
+      .body = body,
+      .len = body_len,
+  };
+
+  write_response_helper(out, &resp);
+  // a large body is only referenced by the output
+  push_release_output(out, &free, body);
+
+  free_http_response(&resp);
+
+  if (cacheable) {
+    cache_insert(state->cache, key, &validator, out);
+  }
+}
+
+void handle_file_post(HttpOutput *out, HttpRequest *req, HttpParams params,
+                        AppState *state) {
+  char path[STATIC_PATH_MAX];
+  if (!normalize_path(params, path, sizeof(path)) || path[0] == '\0') {
+    handle_bad_req(out, req);
+    return;
+  }
+
+  HttpStatus status =
+      store_upload(state->uploads, path, req->body.body, req->body.len);
+  if (status != CREATED) {
+    printf("INVALID: upload of %s failed <%i>\n", path, status);
+    handle_error(out, status);
+    return;
+  }
 
   HttpResponse resp = init_response(CREATED, req->headers.encoding);
-  size_t res = write_response_helper(buf, &resp);
+  write_response_helper(out, &resp);
   free_http_response(&resp);
+}
 
-  return res;
+HttpStatus check_file_post(HttpRequest *req, HttpParams params,
+                           AppState *state) {
+  char path[STATIC_PATH_MAX];
+  if (!normalize_path(params, path, sizeof(path)) || path[0] == '\0') {
+    return BAD_REQ;
+  }
+  return check_upload(state->uploads, path, req->body.len);
 }
 
 #define MAX_MATCH_COUNT 1
 
 struct Route {
   fnPtr fn;
+  // NULL if nothing can be checked up front
+  checkPtr check;
   const char *route;
   HttpMethod method;
 };
@@ -268,33 +836,158 @@ static const struct Route routes[] = {
         .route = "/files/*",
         .method = GET,
     },
+    {
+        .fn = &handle_trace,
+        .route = "/debug/trace",
+        .method = GET,
+    },
+    {
+        .fn = &handle_profile,
+        .route = "/debug/profile",
+        .method = GET,
+    },
+    {
+        .fn = &handle_profile,
+        .route = "/debug/profile/*",
+        .method = GET,
+    },
     {
         .fn = &handle_file_post,
+        .check = &check_file_post,
         .route = "/files/*",
         .method = POST,
     },
 };
 
-size_t handle_routes(uint8_t *const buf, HttpRequest *req, AppState *state) {
+void handle_module_route(HttpOutput *out, HttpRequest *req,
+                         const ModuleRoute *route, const char *params) {
+  HandlerResponse module_resp;
+  if (!run_module_route(route, req, params, &module_resp)) {
+    handle_error(out, SERVICE_UNAVAILABLE);
+    return;
+  }
+
+  HttpStatus status;
+  if (module_resp.failed) {
+    printf("ERROR: module response ran out of memory\n");
+    free_handler_response(&module_resp);
+    handle_error(out, INTERNAL_SERVER_ERROR);
+    return;
+  } else if (!http_status_from_code(module_resp.code, &status)) {
+    printf("INVALID: module answered with status %u\n", module_resp.code);
+    free_handler_response(&module_resp);
+    handle_error(out, INTERNAL_SERVER_ERROR);
+    return;
+  }
+
+  HttpContentEncoding encoding = req->headers.encoding;
+  HttpHeaders module_headers = {
+      .headers = module_resp.headers,
+      .encoding = NO_ENCODING,
+  };
+  if (find_in_header(&module_headers, CONTENT_ENCODING) != NULL) {
+    encoding = NO_ENCODING;
+  }
+
+  HttpResponse resp = init_response(status, encoding);
+  for (size_t i = 0; i < module_resp.headers.len; i += 1) {
+    HttpHeader *header = &module_resp.headers.ptr[i];
+    if (strcasecmp(header->key, CONTENT_LENGTH) != 0) {
+      push_header_response(&resp, header->key, header->value);
+    }
+  }
 
-  printf("request for %s\n", req->url);
+  resp.body = (HttpBody){
+      .body = module_resp.body,
+      .len = module_resp.len,
+  };
 
+  write_response_helper(out, &resp);
+
+  // large bodies are only referenced by the output
+  push_release_output(out, &free, module_resp.body);
+  module_resp.body = NULL;
+
+  free_http_response(&resp);
+  free_handler_response(&module_resp);
+}
+
+// The built in route for the method and url, `params` is NULL unless it
+// matched a wildcard
+static const struct Route *match_route(HttpRequest *req, HttpParams *params) {
   for (size_t i = 0; i < ARRAY_SIZE(routes); i += 1) {
     const struct Route *const curr = &routes[i];
 
-    size_t res = starts_with_wildcard(req->url, curr->route);
-    if (res == (size_t)NO_MATCH) {
+    size_t res = starts_with_wildcard(req->url.path, curr->route);
+    if (res == (size_t)NO_MATCH || curr->method != req->method) {
       continue;
-    } else if (res == (size_t)ALL_MATCH && curr->method == req->method) {
-      printf("match no wildcard -- <%s>\n", curr->route);
-      return curr->fn(buf, req, NULL, state);
-    } else if (curr->method == req->method) {
-      printf("match with wildcard -- <%zu> -- <%s>\n", i, curr->route);
-      HttpParams params = req->url + res;
-      return curr->fn(buf, req, params, state);
     }
+
+    *params = res == (size_t)ALL_MATCH ? NULL : req->url.path + res;
+    return curr;
+  }
+  return NULL;
+}
+
+HttpStatus check_routes(HttpRequest *req, AppState *state) {
+  if (match_proxy_route(&state->config->config.proxies, req->url.path) != NULL ||
+      is_archive_request(req) || is_events_request(state->events, req)) {
+    return OK;
+  }
+
+  HttpParams params;
+  const struct Route *route = match_route(req, &params);
+  if (route != NULL) {
+    return route->check == NULL ? OK : route->check(req, params, state);
+  }
+
+  if (match_module_route(state->modules, req->url.path, req->method, &params) !=
+      NULL) {
+    return OK;
+  }
+  return NOT_FOUND;
+}
+
+static void dispatch_routes(HttpOutput *out, HttpRequest *req,
+                            AppState *state) {
+
+  printf("request for %s\n", req->url.path);
+
+  // HTTP/1.1 connections stream these instead of getting here, HTTP/2
+  // streams are answered from a complete output
+  if (match_proxy_route(&state->config->config.proxies, req->url.path) != NULL ||
+      is_archive_request(req) || is_events_request(state->events, req)) {
+    handle_error(out, NOT_IMPLEMENTED);
+    return;
   }
 
-  printf("NO MATCH FOR <%s>\n", req->url);
-  return handle_not_found(buf, req);
+  HttpParams params;
+  const struct Route *route = match_route(req, &params);
+  if (route != NULL && params == NULL) {
+    printf("match no wildcard -- <%s>\n", route->route);
+    route->fn(out, req, NULL, state);
+    return;
+  } else if (route != NULL) {
+    printf("match with wildcard -- <%zu> -- <%s>\n", (size_t)(route - routes),
+           route->route);
+    route->fn(out, req, params, state);
+    return;
+  }
+
+  const ModuleRoute *module_route =
+      match_module_route(state->modules, req->url.path, req->method, &params);
+  if (module_route != NULL) {
+    printf("match module route -- <%s>\n", module_route->route);
+    handle_module_route(out, req, module_route, params);
+    return;
+  }
+
+  printf("NO MATCH FOR <%s>\n", req->url.path);
+  handle_not_found(out, req);
+}
+
+void handle_routes(HttpOutput *out, HttpRequest *req, AppState *state) {
+  uint64_t route_start = trace_begin();
+  dispatch_routes(out, req, state);
+  trace_end(TRACE_ROUTE, route_start);
 }
@@ -3,14 +3,54 @@
 
 #include <stdint.h>
 
+#include "cache.h"
+#include "config.h"
+#include "events.h"
+#include "filemap.h"
 #include "http.h"
+#include "iopool.h"
+#include "modules.h"
+#include "static_files.h"
+#include "tls.h"
+#include "uploads.h"
 
 struct AppState {
   char *directory;
+  StaticRoot *root;
+  ResponseCache *cache;
+  FileMapTable *files;
+  // blocking file work of multiplexed connections
+  IoPool *io;
+  UploadStore *uploads;
+  // routes loaded with --modules, tried after the built in ones
+  RouteModules *modules;
+  ConfigStore *config;
+  // NULL without TLS listeners
+  TlsContext *tls;
+  // NULL unless `events 1`
+  EventHub *events;
 };
 
 typedef struct AppState AppState;
 
-size_t handle_routes(uint8_t *const buf, HttpRequest *req, AppState *state);
+void handle_routes(HttpOutput *out, HttpRequest *req, AppState *state);
+
+#define DEFAULT_GZIP_LEVEL 6
+
+// Level 1-9 or 0 for no compression, bodies below `min_size` are sent as
+// they are
+void set_compression(int level, size_t min_size);
+int current_gzip_level();
+
+// Writes a bodyless error response that closes the connection
+void handle_error(HttpOutput *out, HttpStatus status);
+// 101 switching the connection to `protocol`
+void handle_upgrade(HttpOutput *out, const char *protocol);
+// 100 telling the client to send the body
+void handle_continue(HttpOutput *out);
+
+// Checks a request before its body is read, for Expect: 100-continue.
+// Returns OK or the status the request would be answered with anyway.
+HttpStatus check_routes(HttpRequest *req, AppState *state);
 
 #endif // !ROUTES
@@ -1,5 +1,7 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <pthread.h>
@@ -8,15 +10,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "archive.h"
+#include "cache.h"
+#include "capture.h"
+#include "config.h"
+#include "conn.h"
+#include "events.h"
 #include "http.h"
+#include "http2.h"
+#include "listen.h"
+#include "modules.h"
+#include "pool.h"
+#include "proxy.h"
 #include "routes.h"
 #include "thread.h"
-
-#define INITIAL_BUFFER 16 * 1014
+#include "timer.h"
+#include "trace.h"
+#include "websocket.h"
 
 bool is_running = true;
 
@@ -26,148 +41,463 @@ void sig_int_handler(int signum) {
   is_running = false;
 }
 
-void handle_client(int client_fd, AppState *state) {
+// picked up by the accept loop, the handler only sets it
+volatile sig_atomic_t reload_requested = 0;
+
+void sig_hup_handler(int signum) {
+  (void)signum;
+  reload_requested = 1;
+}
+
+TimerWheel timers;
+
+// Answers `Expect: 100-continue` once the request passed everything that can
+// be checked without its body, the client only sends it afterwards
+static HttpStatus handle_expect(Connection *conn, HttpOutput *out,
+                                HttpRequest *req, AppState *state,
+                                size_t body_read) {
+  const char *expect = find_in_header(&req->headers, EXPECT);
+  if (expect == NULL) {
+    return OK;
+  } else if (strcasecmp(expect, EXPECT_CONTINUE) != 0) {
+    return EXPECTATION_FAILED;
+  }
+
+  HttpStatus status = check_routes(req, state);
+  // some clients send the body without waiting
+  if (status != OK || body_read >= req->body.len) {
+    return status;
+  }
+
+  handle_continue(out);
+  bool written = conn_write_output(conn, out);
+  reset_output(out);
+  return written ? OK : BAD_REQ;
+}
+
+void handle_client(int client_fd, const ListenAddress *listener,
+                   AppState *state) {
+  int family = listener->addr.ss_family;
   pthread_t self = pthread_self();
 
   printf("Client connected to %lu\n", self);
 
-  size_t buffer_size = INITIAL_BUFFER;
+  // a reload only changes connections accepted afterwards
+  RuntimeConfig config = current_runtime_config(state->config);
+
+  apply_client_options(client_fd, family, &config.sockets);
 
-  uint8_t *in_buf = calloc(buffer_size, sizeof(uint8_t));
+  Connection conn = init_connection(client_fd, &timers);
+  // TCP_CORK only exists for TCP
+  conn.cork = config.sockets.cork && family != AF_UNIX;
+  conn.timeouts = config.timeouts;
+  conn.max_body_size = config.max_body_size;
+  conn.capture = capture_open();
 
-  HttpRequest req;
-  size_t s = 0;
+  if (listener->tls) {
+    conn_arm(&conn, conn.timeouts.header_ms, TIMER_SHUT_RDWR);
+    if (!conn_start_tls(&conn, state->tls)) {
+      close_connection(&conn);
+      return;
+    }
+  }
 
-  while (1) {
-    // there should be enough space for the initial request headers
-    s = read(client_fd, in_buf + s, INITIAL_BUFFER);
-    // if (s == INITIAL_BUFFER) {
-    //   printf("read max buffer size -- resizing of buffer required!");
-    //   exit(1);
-    // }
+  // starts at the configured size class, grown only for large requests
+  size_t read_buffer = config.read_buffer;
+  PoolBuffer in = pool_acquire(read_buffer);
 
-    req = parse_request(in_buf);
+  HttpOutput out = init_output();
 
-    if (s <= buffer_size) {
-      // there might be a body or we are large enough at this point :)
-      break;
+  // bytes currently buffered, may already contain a pipelined request
+  size_t len = 0;
+
+  while (is_running) {
+    HttpStatus status = OK;
+    size_t header_len = 0;
+
+    // a pipelined request starts right away, otherwise with its first byte
+    uint64_t request_start = len > 0 ? trace_begin() : 0;
+
+    // waiting for the first byte counts as idle
+    conn_arm(&conn, len == 0 ? conn.timeouts.idle_ms : conn.timeouts.header_ms,
+             TIMER_SHUT_RD);
+
+    while ((header_len = find_header_end(in.data, len)) == 0) {
+      status = check_partial_request(in.data, len);
+      if (status != OK) {
+        break;
+      }
+
+      if (len == in.capacity) {
+        // headers larger than the buffer, the limit is checked above
+        pool_grow(&in, len, len + 1);
+      }
+
+      bool was_idle = len == 0;
+      bool busy = false;
+      if (!conn_read_request(&conn, in.data, &len, in.capacity, &busy)) {
+        if (busy) {
+          printf("Too many clients waiting, dropping %lu's connection\n",
+                 self);
+        }
+        status = len > 0 && busy                  ? SERVICE_UNAVAILABLE
+                 : len > 0 && conn_expired(&conn) ? REQUEST_TIMEOUT
+                                                  : BAD_REQ;
+        // an idle or closed connection just goes away
+        if (len == 0 || status == BAD_REQ) {
+          goto CLIENT_CLEAN_UP;
+        }
+        break;
+      }
+
+      if (was_idle) {
+        conn_arm(&conn, conn.timeouts.header_ms, TIMER_SHUT_RD);
+        request_start = trace_begin();
+      }
     }
+    trace_end(TRACE_READ, request_start);
 
-    // get new lenght requirement
-    if (req.body.len > 0) {
-      // there is a body attached to this msg
-      //
-      // body attached check msg buffer size and if required expand it
-      // some more
-      size_t header_len = in_buf - req.body.body;
-      buffer_size = header_len + req.body.len;
-      in_buf = realloc(in_buf, buffer_size);
-      memset(in_buf + s, 0, buffer_size - s);
+    if (status == OK && is_http2_preface(in.data, header_len)) {
+      // prior knowledge, the preface looks like a request up to "SM"
+      serve_http2(&conn, in.data, len, NULL, state);
+      goto CLIENT_CLEAN_UP;
     }
-  }
 
-  uint8_t *out_buf = calloc(INITIAL_BUFFER, sizeof(uint8_t));
+    HttpRequest req;
+    if (status == OK) {
+      uint64_t parse_start = trace_begin();
+      status = parse_request(in.data, header_len, &req);
+      trace_end(TRACE_PARSE, parse_start);
+      if (status == OK && req.body.len > conn.max_body_size) {
+        free_http_request(&req);
+        status = PAYLOAD_TOO_LARGE;
+      }
+      if (status == OK) {
+        status = handle_expect(&conn, &out, &req, state, len - header_len);
+        if (status != OK) {
+          free_http_request(&req);
+        }
+      }
+    }
+
+    if (status != OK) {
+      handle_error(&out, status);
+      conn_write_output(&conn, &out);
+      goto CLIENT_CLEAN_UP;
+    }
 
-  s = handle_routes(out_buf, &req, state);
+    size_t total = header_len + req.body.len;
 
-  write(client_fd, out_buf, s);
+    ProxyRoute *proxy =
+        match_proxy_route(&state->config->config.proxies, req.url.path);
+    if (proxy != NULL) {
+      // the body is streamed, only what came with the headers is buffered
+      bool keep_alive = proxy_request(&conn, proxy, &req, in.data + header_len,
+                                      len - header_len);
+      trace_end(TRACE_REQUEST, request_start);
+      free_http_request(&req);
 
-  free_http_request(&req);
+      if (!keep_alive) {
+        break;
+      }
+
+      size_t used = len < total ? len : total;
+      len -= used;
+      memmove(in.data, in.data + used, len);
+      continue;
+    }
 
-  free(out_buf);
-  free(in_buf);
+    if (total > in.capacity) {
+      // body attached, escalate to a size class holding the whole request
+      PoolBuffer bigger = pool_acquire(total);
+      memcpy(bigger.data, in.data, len);
+      move_request(&req, in.data, bigger.data);
+      pool_release(&in);
+      in = bigger;
+    }
+
+    conn_arm(&conn, conn.timeouts.body_ms, TIMER_SHUT_RD);
+
+    uint64_t body_start = len < total ? trace_begin() : 0;
+    while (len < total) {
+      if (!conn_read_some(&conn, in.data, &len, total)) {
+        if (conn_expired(&conn)) {
+          handle_error(&out, REQUEST_TIMEOUT);
+          conn_write_output(&conn, &out);
+        }
+        free_http_request(&req);
+        goto CLIENT_CLEAN_UP;
+      }
+    }
+    trace_end(TRACE_READ, body_start);
+
+    if (is_http2_upgrade(&req)) {
+      handle_upgrade(&out, H2C_UPGRADE);
+      if (conn_write_output(&conn, &out)) {
+        serve_http2(&conn, in.data + total, len - total, &req, state);
+      }
+      free_http_request(&req);
+      goto CLIENT_CLEAN_UP;
+    }
+
+    if (is_websocket_upgrade(&req)) {
+      // the worker stays with the connection until either side closes
+      serve_websocket(&conn, &req, in.data + total, len - total);
+      free_http_request(&req);
+      goto CLIENT_CLEAN_UP;
+    }
+
+    if (is_events_request(state->events, &req)) {
+      // the hub owns the socket from here on
+      if (serve_events(state->events, &conn, &req)) {
+        conn.fd = -1;
+      }
+      free_http_request(&req);
+      goto CLIENT_CLEAN_UP;
+    }
+
+    bool keep_alive = req.keep_alive;
+    bool written = false;
+    if (is_archive_request(&req)) {
+      // members go to the socket one after the other
+      written = serve_archive(&conn, &req, state);
+    } else {
+      handle_routes(&out, &req, state);
+
+      uint64_t write_start = trace_begin();
+      written = conn_write_output(&conn, &out);
+      trace_end(TRACE_WRITE, write_start);
+    }
+    trace_end(TRACE_REQUEST, request_start);
+
+    reset_output(&out);
+    free_http_request(&req);
+
+    if (!written || !keep_alive) {
+      break;
+    }
+
+    // keep pipelined bytes for the next request
+    len -= total;
+    if (in.capacity > read_buffer) {
+      // hand a grown buffer back, the next request starts small again
+      PoolBuffer smaller = pool_acquire(len > read_buffer ? len : read_buffer);
+      memcpy(smaller.data, in.data + total, len);
+      pool_release(&in);
+      in = smaller;
+    } else {
+      memmove(in.data, in.data + total, len);
+    }
+  }
+
+CLIENT_CLEAN_UP:
+  close_connection(&conn);
+
+  free_output(&out);
+  pool_release(&in);
+}
+
+// connections taken off the listen queue per wake up before handing them
+// to the workers
+#define ACCEPT_BATCH 64
+
+// errors that only end the current batch, the listener keeps working
+static bool is_transient_accept_error(int err) {
+  switch (err) {
+  case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+  case EWOULDBLOCK:
+#endif
+  case EINTR:
+  case ECONNABORTED:
+  case EPROTO:
+  case EMFILE:
+  case ENFILE:
+  case ENOBUFS:
+  case ENOMEM:
+    return true;
+  default:
+    return false;
+  }
+}
 
-  close(client_fd);
+// transient errors that won't clear while the listener is still readable,
+// selecting on it again right away would spin
+static bool is_resource_accept_error(int err) {
+  return err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM;
 }
 
 struct ThreadFunctionHelper {
   int client_fd;
+  // that accepted it, lives as long as the server
+  const ListenAddress *listener;
   AppState *state;
 };
 
 void thread_function(void *args) {
   struct ThreadFunctionHelper *state = args;
-  handle_client(state->client_fd, state->state);
+  handle_client(state->client_fd, state->listener, state->state);
   free(state);
 }
 
+// settings a reload changes outside of the connections
+static void apply_runtime_config(ConfigStore *store, ResponseCache *cache) {
+  RuntimeConfig config = current_runtime_config(store);
+  set_compression(config.gzip_level, config.gzip_min_size);
+  set_tracing(config.trace);
+  cache_set_budget(cache, config.cache_budget);
+}
+
 int main(int argc, char *argv[]) {
   // Disable output buffering
   setbuf(stdout, NULL);
   setbuf(stderr, NULL);
 
   signal(SIGINT, sig_int_handler);
+  signal(SIGHUP, sig_hup_handler);
 
-  char *directory = "/tmp";
-  // get directory from
-  for (int i = 1; i < argc; i += 1) {
-    if (strcmp(argv[i], "--directory") == 0) {
-      directory = argv[i + 1];
-      break;
-    }
+  // configuration file and command line overrides
+  ConfigStore store;
+  if (!init_config_store(&store, argc, argv)) {
+    return 1;
   }
+  ServerConfig *config = &store.config;
 
   printf("ONLINE\n");
 
-  ThreadPool pool = init_threadpool(&thread_function);
-
-  AppState state = {
-      .directory = directory,
-  };
-
-  int server_fd;
-  struct sockaddr_in client_addr;
-  socklen_t client_addr_len;
-
-  server_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (server_fd == -1) {
-    printf("Socket creation failed: %s...\n", strerror(errno));
+  StaticRoot root;
+  if (!init_static_root(&root, config->directory)) {
+    free_config_store(&store);
     return 1;
   }
 
-  // Since the tester restarts your program quite often, setting SO_REUSEADDR
-  // ensures that we don't run into 'Address already in use' errors
-  int reuse = 1;
-  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) <
-      0) {
-    printf("SO_REUSEADDR failed: %s \n", strerror(errno));
+  RouteModules modules;
+  init_route_modules(&modules);
+  if (config->modules[0] != '\0' &&
+      !load_route_modules(&modules, config->modules)) {
+    free_route_modules(&modules);
+    free_static_root(&root);
+    free_config_store(&store);
     return 1;
   }
 
-  struct sockaddr_in serv_addr = {
-      .sin_family = AF_INET,
-      .sin_port = htons(4221),
-      .sin_addr = {htonl(INADDR_ANY)},
-  };
+  TlsContext *tls = NULL;
+  if (config->tls_cert[0] != '\0') {
+    tls = init_tls_context(config->tls_cert, config->tls_key);
+    if (tls == NULL) {
+      free_route_modules(&modules);
+      free_static_root(&root);
+      free_config_store(&store);
+      return 1;
+    }
+  }
 
-  if (bind(server_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) != 0) {
-    printf("Bind failed: %s \n", strerror(errno));
-    return 1;
+  size_t listener_count = config->listeners.len;
+  int *listeners = malloc(listener_count * sizeof(int));
+  assert(listeners != NULL);
+
+  int max_fd = -1;
+  for (size_t i = 0; i < listener_count; i += 1) {
+    listeners[i] = open_listener(&config->listeners.ptr[i], config->backlog,
+                                 &config->runtime.sockets);
+    if (listeners[i] == -1) {
+      for (size_t j = 0; j < i; j += 1) {
+        close_listener(listeners[j], &config->listeners.ptr[j]);
+      }
+      free(listeners);
+      free_tls_context(tls);
+      free_route_modules(&modules);
+      free_static_root(&root);
+      free_config_store(&store);
+      return 1;
+    }
+    if (listeners[i] > max_fd) {
+      max_fd = listeners[i];
+    }
   }
 
-  int connection_backlog = 5;
-  if (listen(server_fd, connection_backlog) != 0) {
-    printf("Listen failed: %s \n", strerror(errno));
-    return 1;
+  init_timer_wheel(&timers);
+
+  ThreadPool pool = init_threadpool(&thread_function, config->workers);
+  // WebSockets hold their worker, half of them stay for requests
+  set_websocket_limit(config->workers / 2);
+  // so do module handlers until they complete
+  set_module_handler_limit(config->workers > 1 ? config->workers / 2 : 1);
+  // so do clients that are slow to send a request, which leaves at least one
+  // worker for those that are ready once WebSockets take their half
+  set_waiting_limit(config->workers > 2
+                        ? config->workers - config->workers / 2 - 1
+                        : 1);
+
+  IoPool io;
+  init_io_pool(&io, config->io_workers);
+
+  ResponseCache cache;
+  init_cache(&cache, config->runtime.cache_budget);
+
+  FileMapTable files;
+  init_filemap(&files);
+
+  UploadStore uploads;
+  init_upload_store(&uploads, &root, config->durability, config->dedup);
+
+  EventHub hub;
+  // a server without notifications still serves everything else
+  bool has_events = config->events && init_event_hub(&hub, config->directory);
+
+  // same for a capture that can't be written
+  if (config->capture[0] != '\0') {
+    init_capture(config->capture);
   }
-  client_addr_len = sizeof(client_addr);
+
+  apply_runtime_config(&store, &cache);
+
+  AppState state = {
+      .directory = config->directory,
+      .root = &root,
+      .cache = &cache,
+      .files = &files,
+      .io = &io,
+      .uploads = &uploads,
+      .modules = &modules,
+      .config = &store,
+      .tls = tls,
+      .events = has_events ? &hub : NULL,
+  };
+
+  struct sockaddr_storage client_addr;
+  socklen_t client_addr_len;
 
   printf("Waiting for a client to connect...\n");
 
   fd_set rfds;
-  FD_ZERO(&rfds);
+  // out of descriptors or memory, the listeners sit out a tick
+  bool backoff = false;
   while (is_running) {
+    if (reload_requested) {
+      reload_requested = 0;
+      if (reload_config(&store)) {
+        apply_runtime_config(&store, &cache);
+      }
+    }
 
-    FD_SET(server_fd, &rfds);
+    FD_ZERO(&rfds);
+    for (size_t i = 0; i < listener_count && !backoff; i += 1) {
+      FD_SET(listeners[i], &rfds);
+    }
+    backoff = false;
     // set select time on the socket
     struct timeval tv;
     tv.tv_sec = 0;
-    tv.tv_usec = 500000;
+    tv.tv_usec = TIMER_TICK_MS * 1000;
 
-    int ret = select(server_fd + 1, &rfds, NULL, NULL, &tv);
+    int ret = select(max_fd + 1, &rfds, NULL, NULL, &tv);
+
+    timer_wheel_tick(&timers);
 
     if (ret == -1 && errno == EINTR) {
-      break;
+      // SIGINT ends the loop, SIGHUP reloads at the top
+      continue;
     } else if (ret == -1) {
       printf("ERROR: select() errored out\n");
       is_running = false;
@@ -176,30 +506,78 @@ int main(int argc, char *argv[]) {
       continue;
     }
 
-    int client_fd_raw =
-        accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_len);
-
-    if (client_fd_raw == -1) {
-      break;
+    for (size_t i = 0; i < listener_count; i += 1) {
+      if (!FD_ISSET(listeners[i], &rfds)) {
+        continue;
+      }
+
+      void *batch[ACCEPT_BATCH];
+      size_t count = 0;
+
+      while (count < ACCEPT_BATCH) {
+        client_addr_len = sizeof(client_addr);
+        int client_fd_raw =
+            accept4(listeners[i], (struct sockaddr *)&client_addr,
+                    &client_addr_len, SOCK_CLOEXEC);
+
+        if (client_fd_raw == -1) {
+          if (!is_transient_accept_error(errno)) {
+            printf("ERROR: accept() failed: %s\n", strerror(errno));
+            is_running = false;
+          } else if (is_resource_accept_error(errno)) {
+            backoff = true;
+          }
+          break;
+        }
+
+        struct ThreadFunctionHelper *tf =
+            malloc(sizeof(struct ThreadFunctionHelper));
+
+        assert(tf != NULL);
+
+        tf->client_fd = client_fd_raw;
+        tf->listener = &config->listeners.ptr[i];
+        tf->state = &state;
+
+        batch[count] = tf;
+        count += 1;
+      }
+
+      if (count > 0) {
+        printf("%zu client connection(s) added to the thread pool\n", count);
+
+        // move the whole burst to the thread pool at once
+        add_threaded_tasks(&pool, batch, count);
+      }
     }
-
-    struct ThreadFunctionHelper *tf =
-        malloc(sizeof(struct ThreadFunctionHelper));
-
-    assert(tf != NULL);
-
-    tf->client_fd = client_fd_raw;
-    tf->state = &state;
-
-    printf("Client connection added to the thread pool\n");
-
-    // move client to thread pool
-    add_threaded_task(&pool, tf);
   }
 
-  free_threadpool(&pool);
+  // wake up every worker still blocked on a client
+  timer_wheel_close(&timers);
 
-  close(server_fd);
+  free_threadpool(&pool);
+  // only after the workers, they wait for the jobs they submitted
+  free_io_pool(&io);
+  free_timer_wheel(&timers);
+  free_cache(&cache);
+  free_filemap(&files);
+  free_upload_store(&uploads);
+  if (has_events) {
+    free_event_hub(&hub);
+  }
+  // only after the workers, they capture until their connections close
+  free_capture();
+  // only after the workers, their handlers live in the modules
+  free_route_modules(&modules);
+  free_tls_context(tls);
+  free_static_root(&root);
+
+  for (size_t i = 0; i < listener_count; i += 1) {
+    close_listener(listeners[i], &config->listeners.ptr[i]);
+  }
+  free(listeners);
+  free_config_store(&store);
+  free_tracing();
 
   return 0;
 }
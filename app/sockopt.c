@@ -0,0 +1,109 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "sockopt.h"
+
+SocketProfile default_socket_profile() {
+  SocketProfile profile = {
+      .no_delay = true,
+      .cork = true,
+      .defer_accept_s = 1,
+      .fastopen_queue = 16,
+      .rcvbuf = 0,
+      .sndbuf = 0,
+      .busy_poll_us = 0,
+  };
+  return profile;
+}
+
+static bool parse_int(const char *value, int *out) {
+  if (value == NULL || *value == '\0') {
+    return false;
+  }
+
+  char *end = NULL;
+  long number = strtol(value, &end, 10);
+  if (*end != '\0' || number < 0 || number > 1 << 30) {
+    return false;
+  }
+
+  *out = number;
+  return true;
+}
+
+bool parse_socket_option(SocketProfile *profile, const char *name,
+                         const char *value) {
+  int number = 0;
+  if (!parse_int(value, &number)) {
+    return false;
+  }
+
+  if (strcmp(name, "tcp-nodelay") == 0) {
+    profile->no_delay = number != 0;
+  } else if (strcmp(name, "tcp-cork") == 0) {
+    profile->cork = number != 0;
+  } else if (strcmp(name, "tcp-defer-accept") == 0) {
+    profile->defer_accept_s = number;
+  } else if (strcmp(name, "tcp-fastopen") == 0) {
+    profile->fastopen_queue = number;
+  } else if (strcmp(name, "so-rcvbuf") == 0) {
+    profile->rcvbuf = number;
+  } else if (strcmp(name, "so-sndbuf") == 0) {
+    profile->sndbuf = number;
+  } else if (strcmp(name, "busy-poll") == 0) {
+    profile->busy_poll_us = number;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+static void set_option(int fd, int level, int option, int value,
+                       const char *name) {
+  if (setsockopt(fd, level, option, &value, sizeof(value)) != 0) {
+    printf("%s failed: %s \n", name, strerror(errno));
+  }
+}
+
+static bool is_tcp(int family) {
+  return family == AF_INET || family == AF_INET6;
+}
+
+void apply_listener_options(int fd, int family, const SocketProfile *profile) {
+  if (is_tcp(family) && profile->defer_accept_s > 0) {
+    set_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, profile->defer_accept_s,
+               "TCP_DEFER_ACCEPT");
+  }
+
+  if (is_tcp(family) && profile->fastopen_queue > 0) {
+    set_option(fd, IPPROTO_TCP, TCP_FASTOPEN, profile->fastopen_queue,
+               "TCP_FASTOPEN");
+  }
+
+  // inherited by accepted sockets, it has to be set before the handshake
+  // for the window scale to take it into account
+  if (profile->rcvbuf > 0) {
+    set_option(fd, SOL_SOCKET, SO_RCVBUF, profile->rcvbuf, "SO_RCVBUF");
+  }
+}
+
+void apply_client_options(int fd, int family, const SocketProfile *profile) {
+  if (is_tcp(family) && profile->no_delay) {
+    set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+  }
+
+  if (profile->sndbuf > 0) {
+    set_option(fd, SOL_SOCKET, SO_SNDBUF, profile->sndbuf, "SO_SNDBUF");
+  }
+
+  if (is_tcp(family) && profile->busy_poll_us > 0) {
+    set_option(fd, SOL_SOCKET, SO_BUSY_POLL, profile->busy_poll_us,
+               "SO_BUSY_POLL");
+  }
+}
@@ -0,0 +1,38 @@
+#ifndef SOCKOPT
+#define SOCKOPT
+
+#include <stdbool.h>
+
+// Socket options applied to the listener and every accepted client, each
+// can be changed in the configuration as `<name> <value>`
+struct SocketProfile {
+  // TCP_NODELAY, responses are written whole so Nagle only adds latency
+  bool no_delay;
+  // TCP_CORK around responses written in several calls (head + sendfile)
+  bool cork;
+  // TCP_DEFER_ACCEPT, seconds the kernel holds a connection without data
+  int defer_accept_s;
+  // TCP_FASTOPEN queue length, data in the SYN saves a round trip
+  int fastopen_queue;
+  // SO_RCVBUF / SO_SNDBUF, 0 keeps the kernel autotuning
+  int rcvbuf;
+  int sndbuf;
+  // SO_BUSY_POLL on clients, microseconds to spin before sleeping
+  int busy_poll_us;
+};
+
+typedef struct SocketProfile SocketProfile;
+
+SocketProfile default_socket_profile();
+
+// Applies `<name> <value>` if it is a socket option, returns false if the
+// name is unknown or the value invalid
+bool parse_socket_option(SocketProfile *profile, const char *name,
+                         const char *value);
+
+// Failing options are logged and skipped, none of them is required. The TCP
+// options are left out for other address families.
+void apply_listener_options(int fd, int family, const SocketProfile *profile);
+void apply_client_options(int fd, int family, const SocketProfile *profile);
+
+#endif // !SOCKOPT
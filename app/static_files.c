@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/openat2.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "static_files.h"
+#include "utils.h"
+
+// tried in order when a directory is requested
+static const char *const INDEX_FILES[] = {"index.html", "index.htm"};
+
+struct MimeType {
+  const char *extension;
+  const char *type;
+};
+
+// sorted by extension for the binary search
+static const struct MimeType MIME_TYPES[] = {
+    {"avif", "image/avif"},
+    {"css", "text/css; charset=utf-8"},
+    {"csv", "text/csv; charset=utf-8"},
+    {"gif", "image/gif"},
+    {"gz", "application/gzip"},
+    {"htm", "text/html; charset=utf-8"},
+    {"html", "text/html; charset=utf-8"},
+    {"ico", "image/x-icon"},
+    {"jpeg", "image/jpeg"},
+    {"jpg", "image/jpeg"},
+    {"js", "text/javascript; charset=utf-8"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"md", "text/markdown; charset=utf-8"},
+    {"mjs", "text/javascript; charset=utf-8"},
+    {"mp3", "audio/mpeg"},
+    {"mp4", "video/mp4"},
+    {"ogg", "audio/ogg"},
+    {"otf", "font/otf"},
+    {"pdf", "application/pdf"},
+    {"png", "image/png"},
+    {"svg", "image/svg+xml"},
+    {"tar", "application/x-tar"},
+    {"tgz", "application/gzip"},
+    {"ttf", "font/ttf"},
+    {"txt", "text/plain; charset=utf-8"},
+    {"wasm", "application/wasm"},
+    {"wav", "audio/wav"},
+    {"webm", "video/webm"},
+    {"webp", "image/webp"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"xml", "application/xml"},
+    {"zip", "application/zip"},
+    {"zst", "application/zstd"},
+};
+
+const char *mime_type(const char *path) {
+  const char *name = strrchr(path, '/');
+  name = name == NULL ? path : name + 1;
+
+  const char *dot = strrchr(name, '.');
+  if (dot == NULL || dot == name) {
+    return OCTET_STREAM;
+  }
+
+  const char *extension = dot + 1;
+  size_t low = 0;
+  size_t high = ARRAY_SIZE(MIME_TYPES);
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    int cmp = strcasecmp(extension, MIME_TYPES[mid].extension);
+    if (cmp == 0) {
+      return MIME_TYPES[mid].type;
+    } else if (cmp < 0) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
+  }
+
+  return OCTET_STREAM;
+}
+
+bool init_static_root(StaticRoot *root, const char *directory) {
+  root->dirfd = open(directory, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (root->dirfd == -1) {
+    printf("Opening <%s> failed: %s \n", directory, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void free_static_root(StaticRoot *root) {
+  if (root->dirfd != -1) {
+    close(root->dirfd);
+  }
+  root->dirfd = -1;
+}
+
+bool normalize_path(const char *path, char *out, size_t capacity) {
+  size_t len = 0;
+  const char *curr = path;
+
+  while (*curr != '\0') {
+    while (*curr == '/') {
+      curr += 1;
+    }
+
+    size_t segment = strcspn(curr, "/");
+    if (segment == 0) {
+      break;
+    }
+
+    if (segment == 1 && curr[0] == '.') {
+      // current directory
+    } else if (segment == 2 && curr[0] == '.' && curr[1] == '.') {
+      if (len == 0) {
+        return false;
+      }
+      // drop the last segment together with its separator
+      while (len > 0 && out[len - 1] != '/') {
+        len -= 1;
+      }
+      if (len > 0) {
+        len -= 1;
+      }
+    } else {
+      if (len + (len > 0) + segment + 1 > capacity) {
+        return false;
+      }
+      if (len > 0) {
+        out[len] = '/';
+        len += 1;
+      }
+      memcpy(out + len, curr, segment);
+      len += segment;
+    }
+
+    curr += segment;
+  }
+
+  out[len] = '\0';
+  return true;
+}
+
+// Opens the path one component at a time without following any symlink,
+// stricter than RESOLVE_BENEATH which allows links that stay inside
+static int walk_beneath(int dirfd, const char *path, int flags, mode_t mode) {
+  int curr = dirfd;
+  for (;;) {
+    size_t len = strcspn(path, "/");
+    char name[NAME_MAX + 1];
+    if (len > NAME_MAX) {
+      errno = ENAMETOOLONG;
+      goto fail;
+    }
+    memcpy(name, path, len);
+    name[len] = '\0';
+
+    // a normalized path has neither, anything else is refused
+    if (len == 0 || strcmp(name, "..") == 0 ||
+        (strcmp(name, ".") == 0 && (path[len] != '\0' || curr != dirfd))) {
+      errno = EXDEV;
+      goto fail;
+    }
+
+    if (path[len] == '\0') {
+      int fd = openat(curr, name, flags | O_CLOEXEC | O_NOFOLLOW, mode);
+      if (curr != dirfd) {
+        int saved = errno;
+        close(curr);
+        errno = saved;
+      }
+      return fd;
+    }
+
+    int next =
+        openat(curr, name, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (next == -1) {
+      goto fail;
+    }
+    if (curr != dirfd) {
+      close(curr);
+    }
+    curr = next;
+    path += len + 1;
+  }
+
+fail:
+  if (curr != dirfd) {
+    int saved = errno;
+    close(curr);
+    errno = saved;
+  }
+  return -1;
+}
+
+static int open_beneath(int dirfd, const char *path, int flags, mode_t mode) {
+  struct open_how how = {
+      .flags = flags | O_CLOEXEC,
+      .mode = flags & O_CREAT ? mode : 0,
+      .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+  };
+
+  int fd = syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+  if (fd == -1 && errno == ENOSYS) {
+    // before Linux 5.6 there is no RESOLVE_BENEATH to lean on
+    fd = walk_beneath(dirfd, path, flags, mode);
+  }
+  return fd;
+}
+
+int static_openat(StaticRoot *root, const char *path, int flags,
+                  mode_t mode) {
+  return open_beneath(root->dirfd, path[0] == '\0' ? "." : path, flags, mode);
+}
+
+// whether the path names a directory explicitly
+static bool has_trailing_slash(const char *path) {
+  size_t len = strlen(path);
+  return len == 0 || path[len - 1] == '/';
+}
+
+StaticResult static_open(StaticRoot *root, const char *path,
+                         StaticFile *file) {
+  file->fd = -1;
+
+  if (!normalize_path(path, file->path, MAX_URL_LEN + 1)) {
+    return STATIC_BAD_PATH;
+  }
+
+  // a FIFO would block the open until a writer shows up
+  int fd = static_openat(root, file->path, O_RDONLY | O_NONBLOCK, 0);
+  if (fd == -1) {
+    return errno == EXDEV ? STATIC_BAD_PATH : STATIC_NOT_FOUND;
+  }
+
+  if (fstat(fd, &file->stat) != 0) {
+    close(fd);
+    return STATIC_NOT_FOUND;
+  }
+
+  if (S_ISDIR(file->stat.st_mode)) {
+    if (!has_trailing_slash(path)) {
+      close(fd);
+      return STATIC_DIRECTORY;
+    }
+
+    int dirfd = fd;
+    fd = -1;
+
+    for (size_t i = 0; i < ARRAY_SIZE(INDEX_FILES) && fd == -1; i += 1) {
+      fd = open_beneath(dirfd, INDEX_FILES[i], O_RDONLY | O_NONBLOCK, 0);
+      if (fd == -1) {
+        continue;
+      }
+
+      if (fstat(fd, &file->stat) != 0 || !S_ISREG(file->stat.st_mode)) {
+        close(fd);
+        fd = -1;
+        continue;
+      }
+
+      size_t len = strlen(file->path);
+      sprintf(file->path + len, "%s%s", len > 0 ? "/" : "", INDEX_FILES[i]);
+    }
+
+    close(dirfd);
+    if (fd == -1) {
+      return STATIC_NOT_FOUND;
+    }
+  }
+
+  if (!S_ISREG(file->stat.st_mode)) {
+    close(fd);
+    return STATIC_NOT_FOUND;
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  file->fd = fd;
+  file->mime = mime_type(file->path);
+  return STATIC_FOUND;
+}
@@ -0,0 +1,61 @@
+#ifndef STATIC_FILES
+#define STATIC_FILES
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "http.h"
+
+// a normalized path is never longer than the url it comes from, plus the
+// index file appended for directories
+#define STATIC_PATH_MAX (MAX_URL_LEN + 32)
+
+// The directory files are served from, every path is resolved beneath it
+struct StaticRoot {
+  int dirfd;
+};
+
+typedef struct StaticRoot StaticRoot;
+
+enum StaticResult {
+  STATIC_FOUND,
+  STATIC_NOT_FOUND,
+  // the path tries to leave the root
+  STATIC_BAD_PATH,
+  // a directory without the trailing slash, relative links need it
+  STATIC_DIRECTORY,
+};
+
+typedef enum StaticResult StaticResult;
+
+struct StaticFile {
+  int fd;
+  struct stat stat;
+  const char *mime;
+  // relative to the root, with the index file for directories
+  char path[STATIC_PATH_MAX];
+};
+
+typedef struct StaticFile StaticFile;
+
+bool init_static_root(StaticRoot *root, const char *directory);
+void free_static_root(StaticRoot *root);
+
+// Drops empty and "." segments and resolves ".." lexically, the result has
+// no leading slash. Returns false if the path climbs above the root or does
+// not fit.
+bool normalize_path(const char *path, char *out, size_t capacity);
+
+// Opens a regular file or the index file of a directory for reading
+StaticResult static_open(StaticRoot *root, const char *path, StaticFile *file);
+
+// openat2 with RESOLVE_BENEATH for a normalized path, -1 with errno set;
+// without openat2 no symlink on the way is followed at all
+int static_openat(StaticRoot *root, const char *path, int flags, mode_t mode);
+
+// Content-Type for the extension of the path
+const char *mime_type(const char *path);
+
+#endif // !STATIC_FILES
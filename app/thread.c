@@ -1,4 +1,6 @@
 #include "thread.h"
+#include "pool.h"
+#include "proxy.h"
 #include <pthread.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -22,16 +24,30 @@ static void *thread_start(void *arg) {
       info->fn(task);
     }
 
-    // wait until queue has something to do
+    // wait until queue has something to do, workers stay busy on keep-alive
+    // connections so a wake up may have happened while not waiting
     pthread_mutex_lock(&info->queue.mutex);
-    pthread_cond_wait(&info->queue.cond, &info->queue.mutex);
+    while (info->queue.head == NULL) {
+      pthread_rwlock_rdlock(&info->mutex);
+      is_active = info->is_active;
+      pthread_rwlock_unlock(&info->mutex);
+
+      if (!is_active) {
+        break;
+      }
+
+      pthread_cond_wait(&info->queue.cond, &info->queue.mutex);
+    }
     pthread_mutex_unlock(&info->queue.mutex);
   }
 
+  pool_free_thread();
+  proxy_free_thread();
+
   return NULL;
 }
 
-ThreadPool init_threadpool(ThreadFunction fn) {
+ThreadPool init_threadpool(ThreadFunction fn, size_t size) {
 
   ThreadPoolState *state = malloc(sizeof(ThreadPoolState));
   state->is_active = true;
@@ -42,11 +58,12 @@ ThreadPool init_threadpool(ThreadFunction fn) {
   pthread_rwlock_init(&state->mutex, NULL);
 
   ThreadPool pool = {
-      .thread = {0},
+      .thread = calloc(size, sizeof(pthread_t)),
+      .size = size,
       .state = state,
   };
 
-  for (size_t i = 0; i < THREADPOOL_SIZE; i += 1) {
+  for (size_t i = 0; i < size; i += 1) {
     // INIT Threadpool
     pthread_create(&pool.thread[i], NULL, &thread_start, state);
   }
@@ -57,17 +74,24 @@ void add_threaded_task(ThreadPool *pool, void *task) {
   add_task(&pool->state->queue, task);
 }
 
+void add_threaded_tasks(ThreadPool *pool, void **tasks, size_t count) {
+  add_tasks(&pool->state->queue, tasks, count);
+}
+
 void free_threadpool(ThreadPool *pool) {
   pthread_rwlock_wrlock(&pool->state->mutex);
   pool->state->is_active = false;
   pthread_rwlock_unlock(&pool->state->mutex);
 
-  // wake all threads
+  // wake all threads, under the queue lock so no wake up gets lost
+  pthread_mutex_lock(&pool->state->queue.mutex);
   pthread_cond_broadcast(&pool->state->queue.cond);
+  pthread_mutex_unlock(&pool->state->queue.mutex);
 
-  for (size_t i = 0; i < THREADPOOL_SIZE; i += 1) {
+  for (size_t i = 0; i < pool->size; i += 1) {
     pthread_join(pool->thread[i], NULL);
   }
+  free(pool->thread);
 
   free_queue(&pool->state->queue);
   pthread_rwlock_destroy(&pool->state->mutex);
@@ -109,20 +133,44 @@ void free_queue(ThreadQueue *queue) {
   pthread_mutex_destroy(&queue->mutex);
 }
 
-void add_task(ThreadQueue *queue, void *task) {
-  pthread_mutex_lock(&queue->mutex);
-  ThreadTask *task_node = malloc(sizeof(ThreadTask));
-  task_node->payload = task;
-  task_node->next = NULL;
-  queue->last = task_node;
+void add_task(ThreadQueue *queue, void *task) { add_tasks(queue, &task, 1); }
 
+void add_tasks(ThreadQueue *queue, void **tasks, size_t count) {
+  if (count == 0) {
+    return;
+  }
+
+  // link the batch up front, the queue lock is only taken to splice it in
+  ThreadTask *first = NULL;
+  ThreadTask *last = NULL;
+  for (size_t i = 0; i < count; i += 1) {
+    ThreadTask *task_node = malloc(sizeof(ThreadTask));
+    task_node->payload = tasks[i];
+    task_node->next = NULL;
+
+    if (first == NULL) {
+      first = task_node;
+    } else {
+      last->next = task_node;
+    }
+    last = task_node;
+  }
+
+  pthread_mutex_lock(&queue->mutex);
   if (queue->head == NULL) {
-    queue->head = task_node;
+    queue->head = first;
+  } else {
+    queue->last->next = first;
   }
+  queue->last = last;
   pthread_mutex_unlock(&queue->mutex);
 
-  // start one of the waiting threads
-  pthread_cond_signal(&queue->cond);
+  // start as many of the waiting threads as there is work
+  if (count == 1) {
+    pthread_cond_signal(&queue->cond);
+  } else {
+    pthread_cond_broadcast(&queue->cond);
+  }
 }
 
 void *pop_task(ThreadQueue *queue) {
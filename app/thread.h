@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+// default number of threads
 #define THREADPOOL_SIZE 8
 
 struct ThreadTask {
@@ -29,6 +30,9 @@ void free_queue(ThreadQueue *queue);
 
 void add_task(ThreadQueue *queue, void *task);
 
+// Queues the tasks in order with a single lock round trip
+void add_tasks(ThreadQueue *queue, void **tasks, size_t count);
+
 void *pop_task(ThreadQueue *queue);
 
 typedef void (*ThreadFunction)(void *);
@@ -44,12 +48,14 @@ typedef struct ThreadPoolState ThreadPoolState;
 
 struct ThreadPool {
   ThreadPoolState *state;
-  pthread_t thread[THREADPOOL_SIZE];
+  pthread_t *thread;
+  size_t size;
 };
 typedef struct ThreadPool ThreadPool;
 
-ThreadPool init_threadpool(ThreadFunction fn);
+ThreadPool init_threadpool(ThreadFunction fn, size_t size);
 void add_threaded_task(ThreadPool *pool, void *task);
+void add_threaded_tasks(ThreadPool *pool, void **tasks, size_t count);
 
 void free_threadpool(ThreadPool *pool);
 
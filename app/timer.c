@@ -0,0 +1,159 @@
+#include <stddef.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "timer.h"
+
+uint64_t monotonic_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t now_tick(TimerWheel *wheel) {
+  return (monotonic_ms() - wheel->start_ms) / TIMER_TICK_MS;
+}
+
+void init_timer_wheel(TimerWheel *wheel) {
+  *wheel = (TimerWheel){
+      .mutex = {},
+      .start_ms = monotonic_ms(),
+      .current_tick = 0,
+      .closed = false,
+      .slots = {0},
+  };
+
+  pthread_mutex_init(&wheel->mutex, NULL);
+}
+
+void free_timer_wheel(TimerWheel *wheel) {
+  pthread_mutex_destroy(&wheel->mutex);
+}
+
+Timer init_timer(int fd) {
+  Timer timer = {
+      .fd = fd,
+      .expires_tick = 0,
+      .action = TIMER_SHUT_RD,
+      .armed = false,
+      .expired = false,
+      .prev = NULL,
+      .next = NULL,
+  };
+  return timer;
+}
+
+// needs the wheel lock
+static void unlink_timer(TimerWheel *wheel, Timer *timer) {
+  if (!timer->armed) {
+    return;
+  }
+
+  if (timer->prev != NULL) {
+    timer->prev->next = timer->next;
+  } else {
+    wheel->slots[timer->expires_tick % TIMER_WHEEL_SLOTS] = timer->next;
+  }
+
+  if (timer->next != NULL) {
+    timer->next->prev = timer->prev;
+  }
+
+  timer->prev = NULL;
+  timer->next = NULL;
+  timer->armed = false;
+}
+
+// needs the wheel lock
+static void fire_timer(TimerWheel *wheel, Timer *timer) {
+  unlink_timer(wheel, timer);
+  timer->expired = true;
+  shutdown(timer->fd, timer->action == TIMER_SHUT_RD ? SHUT_RD : SHUT_RDWR);
+}
+
+void timer_arm(TimerWheel *wheel, Timer *timer, uint32_t timeout_ms,
+               TimerAction action) {
+  pthread_mutex_lock(&wheel->mutex);
+
+  unlink_timer(wheel, timer);
+  timer->action = action;
+  timer->expired = false;
+
+  if (wheel->closed) {
+    fire_timer(wheel, timer);
+    goto ARM_CLEAN_UP;
+  }
+
+  // round up, a deadline may never fire early
+  uint64_t ticks = (timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+  timer->expires_tick = now_tick(wheel) + (ticks == 0 ? 1 : ticks);
+  timer->armed = true;
+
+  Timer **slot = &wheel->slots[timer->expires_tick % TIMER_WHEEL_SLOTS];
+  timer->prev = NULL;
+  timer->next = *slot;
+  if (*slot != NULL) {
+    (*slot)->prev = timer;
+  }
+  *slot = timer;
+
+ARM_CLEAN_UP:
+  pthread_mutex_unlock(&wheel->mutex);
+}
+
+void timer_disarm(TimerWheel *wheel, Timer *timer) {
+  pthread_mutex_lock(&wheel->mutex);
+  unlink_timer(wheel, timer);
+  pthread_mutex_unlock(&wheel->mutex);
+}
+
+bool timer_expired(TimerWheel *wheel, Timer *timer) {
+  pthread_mutex_lock(&wheel->mutex);
+  bool expired = timer->expired;
+  pthread_mutex_unlock(&wheel->mutex);
+  return expired;
+}
+
+void timer_wheel_tick(TimerWheel *wheel) {
+  pthread_mutex_lock(&wheel->mutex);
+
+  uint64_t target = now_tick(wheel);
+
+  // walk every slot passed since the last tick, but never more than one
+  // full revolution
+  uint64_t from = wheel->current_tick;
+  if (target - from > TIMER_WHEEL_SLOTS) {
+    from = target - TIMER_WHEEL_SLOTS;
+  }
+
+  for (uint64_t tick = from; tick <= target; tick += 1) {
+    Timer *curr = wheel->slots[tick % TIMER_WHEEL_SLOTS];
+    while (curr != NULL) {
+      Timer *next = curr->next;
+      if (curr->expires_tick <= target) {
+        fire_timer(wheel, curr);
+      }
+      curr = next;
+    }
+  }
+
+  wheel->current_tick = target;
+
+  pthread_mutex_unlock(&wheel->mutex);
+}
+
+void timer_wheel_close(TimerWheel *wheel) {
+  pthread_mutex_lock(&wheel->mutex);
+
+  wheel->closed = true;
+
+  for (size_t i = 0; i < TIMER_WHEEL_SLOTS; i += 1) {
+    while (wheel->slots[i] != NULL) {
+      Timer *curr = wheel->slots[i];
+      curr->action = TIMER_SHUT_RDWR;
+      fire_timer(wheel, curr);
+    }
+  }
+
+  pthread_mutex_unlock(&wheel->mutex);
+}
@@ -0,0 +1,63 @@
+#ifndef TIMER
+#define TIMER
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// resolution of the wheel, the acceptor loop ticks it at this rate
+#define TIMER_TICK_MS 100
+#define TIMER_WHEEL_SLOTS 64
+
+// how the socket is shut down once the deadline passes
+enum TimerAction {
+  // wakes up a blocked read, the worker can still answer with a 408
+  TIMER_SHUT_RD,
+  // wakes up a blocked write, nothing can be sent anymore
+  TIMER_SHUT_RDWR,
+};
+
+typedef enum TimerAction TimerAction;
+
+struct Timer {
+  int fd;
+  uint64_t expires_tick;
+  TimerAction action;
+  bool armed;
+  bool expired;
+  struct Timer *prev;
+  struct Timer *next;
+};
+
+typedef struct Timer Timer;
+
+struct TimerWheel {
+  pthread_mutex_t mutex;
+  uint64_t start_ms;
+  uint64_t current_tick;
+  bool closed;
+  Timer *slots[TIMER_WHEEL_SLOTS];
+};
+
+typedef struct TimerWheel TimerWheel;
+
+uint64_t monotonic_ms();
+
+void init_timer_wheel(TimerWheel *wheel);
+void free_timer_wheel(TimerWheel *wheel);
+
+Timer init_timer(int fd);
+
+// (Re)arms the timer, an already armed timer is moved to the new deadline
+void timer_arm(TimerWheel *wheel, Timer *timer, uint32_t timeout_ms,
+               TimerAction action);
+void timer_disarm(TimerWheel *wheel, Timer *timer);
+bool timer_expired(TimerWheel *wheel, Timer *timer);
+
+// Expires every timer whose deadline has passed, called from the event loop
+void timer_wheel_tick(TimerWheel *wheel);
+
+// Expires every armed timer and refuses new ones, used on shutdown
+void timer_wheel_close(TimerWheel *wheel);
+
+#endif // !TIMER
@@ -0,0 +1,154 @@
+#include <errno.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tls.h"
+
+struct TlsContext {
+  SSL_CTX *ctx;
+};
+
+// what a client resuming a session has to have talked to
+#define TLS_SESSION_CONTEXT "http-server"
+
+// length prefixed, most preferred first
+static const uint8_t alpn_protocols[] = "\x02h2\x08http/1.1";
+
+static int select_alpn(SSL *ssl, const uint8_t **out, uint8_t *out_len,
+                       const uint8_t *in, unsigned in_len, void *arg) {
+  (void)ssl;
+  (void)arg;
+
+  if (SSL_select_next_proto((uint8_t **)out, out_len, alpn_protocols,
+                            sizeof(alpn_protocols) - 1, in,
+                            in_len) != OPENSSL_NPN_NEGOTIATED) {
+    // no overlap, carry on without ALPN
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  return SSL_TLSEXT_ERR_OK;
+}
+
+TlsContext *init_tls_context(const char *cert, const char *key) {
+  SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+  if (ctx == NULL) {
+    goto TLS_CONTEXT_ERROR;
+  }
+
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+                               SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+  if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+      SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(ctx) != 1) {
+    goto TLS_CONTEXT_ERROR;
+  }
+
+  // tickets are on by default, the cache covers TLS 1.2 session ids
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_set_session_id_context(ctx, (const uint8_t *)TLS_SESSION_CONTEXT,
+                                 strlen(TLS_SESSION_CONTEXT));
+
+  SSL_CTX_set_alpn_select_cb(ctx, &select_alpn, NULL);
+
+  TlsContext *tls = malloc(sizeof(TlsContext));
+  tls->ctx = ctx;
+  return tls;
+
+TLS_CONTEXT_ERROR:
+  printf("TLS setup with %s and %s failed\n", cert, key);
+  ERR_print_errors_fp(stdout);
+  SSL_CTX_free(ctx);
+  return NULL;
+}
+
+void free_tls_context(TlsContext *tls) {
+  if (tls == NULL) {
+    return;
+  }
+  SSL_CTX_free(tls->ctx);
+  free(tls);
+}
+
+// signals interrupt the blocking socket calls underneath OpenSSL
+static bool should_retry(SSL *ssl, int ret) {
+  switch (SSL_get_error(ssl, ret)) {
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    return true;
+  case SSL_ERROR_SYSCALL:
+    return errno == EINTR;
+  default:
+    return false;
+  }
+}
+
+TlsSession *tls_accept(TlsContext *tls, int fd) {
+  SSL *ssl = SSL_new(tls->ctx);
+  if (ssl == NULL || SSL_set_fd(ssl, fd) != 1) {
+    SSL_free(ssl);
+    return NULL;
+  }
+
+  int ret;
+  while ((ret = SSL_accept(ssl)) != 1) {
+    if (!should_retry(ssl, ret)) {
+      printf("TLS handshake failed\n");
+      ERR_clear_error();
+      SSL_free(ssl);
+      return NULL;
+    }
+  }
+
+  printf("TLS %s %s%s\n", SSL_get_version(ssl),
+         SSL_session_reused(ssl) ? "resumed" : "full handshake",
+         BIO_get_ktls_send(SSL_get_wbio(ssl)) ? ", kTLS send" : "");
+
+  return (TlsSession *)ssl;
+}
+
+void tls_close(TlsSession *session) {
+  SSL *ssl = (SSL *)session;
+  // a failing close_notify doesn't matter, the socket is closed anyway
+  SSL_shutdown(ssl);
+  ERR_clear_error();
+  SSL_free(ssl);
+}
+
+bool tls_kernel_send(TlsSession *session) {
+  return BIO_get_ktls_send(SSL_get_wbio((SSL *)session));
+}
+
+bool tls_pending(TlsSession *session) {
+  return SSL_has_pending((SSL *)session);
+}
+
+size_t tls_read(TlsSession *session, uint8_t *buf, size_t len) {
+  SSL *ssl = (SSL *)session;
+  size_t read = 0;
+  int ret;
+  while ((ret = SSL_read_ex(ssl, buf, len, &read)) != 1) {
+    if (!should_retry(ssl, ret)) {
+      ERR_clear_error();
+      return 0;
+    }
+  }
+  return read;
+}
+
+size_t tls_write(TlsSession *session, const uint8_t *buf, size_t len) {
+  SSL *ssl = (SSL *)session;
+  size_t written = 0;
+  int ret;
+  while ((ret = SSL_write_ex(ssl, buf, len, &written)) != 1) {
+    if (!should_retry(ssl, ret)) {
+      ERR_clear_error();
+      return 0;
+    }
+  }
+  return written;
+}
@@ -0,0 +1,42 @@
+#ifndef TLS
+#define TLS
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// TLS termination with OpenSSL. The handshake runs in user space, afterwards
+// OpenSSL hands the keys to the kernel (kTLS) when the kernel supports it,
+// then the socket is written with plain write and sendfile and the kernel
+// encrypts the records. Without kTLS every byte goes through SSL_write.
+//
+// ALPN offers h2 and http/1.1, resumption works with stateless tickets and a
+// server side session cache.
+
+struct TlsContext;
+typedef struct TlsContext TlsContext;
+
+// One connection, opaque outside of tls.c
+struct TlsSession;
+typedef struct TlsSession TlsSession;
+
+// Logs the reason and returns NULL if the certificate or key can't be used
+TlsContext *init_tls_context(const char *cert, const char *key);
+void free_tls_context(TlsContext *tls);
+
+// Runs the handshake on the blocking socket, NULL if it failed
+TlsSession *tls_accept(TlsContext *tls, int fd);
+// Sends close_notify if still possible and frees the session
+void tls_close(TlsSession *session);
+
+// Whether the kernel encrypts what is written to the socket
+bool tls_kernel_send(TlsSession *session);
+// Decrypted bytes buffered in user space that poll can't see
+bool tls_pending(TlsSession *session);
+
+// Both return the bytes transferred, 0 once the connection is gone
+size_t tls_read(TlsSession *session, uint8_t *buf, size_t len);
+size_t tls_write(TlsSession *session, const uint8_t *buf, size_t len);
+
+#endif // !TLS
@@ -0,0 +1,162 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE(phase, start, end)                                         \
+  DTRACE_PROBE3(http_server, span, phase, start, end)
+#else
+#define TRACE_PROBE(phase, start, end)
+#endif
+
+#include "trace.h"
+
+atomic_bool tracing_enabled = false;
+
+struct TraceSpan {
+  // index + 1 of the write that filled it, 0 while it is written
+  atomic_uint_fast64_t seq;
+  uint64_t start;
+  uint64_t end;
+  TracePhase phase;
+};
+
+typedef struct TraceSpan TraceSpan;
+
+// Written by its thread only, read by the exporter
+struct TraceRing {
+  pid_t tid;
+  atomic_uint_fast64_t written;
+  struct TraceRing *next;
+  TraceSpan spans[TRACE_RING_SIZE];
+};
+
+typedef struct TraceRing TraceRing;
+
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+// rings outlive their threads until free_tracing
+static TraceRing *rings = NULL;
+
+static __thread TraceRing *thread_ring = NULL;
+
+static const char *const phase_names[] = {
+    [TRACE_REQUEST] = "request", [TRACE_READ] = "read",
+    [TRACE_PARSE] = "parse",     [TRACE_ROUTE] = "route",
+    [TRACE_GZIP] = "gzip",       [TRACE_WRITE] = "write",
+};
+
+void set_tracing(bool enabled) { atomic_store(&tracing_enabled, enabled); }
+
+static TraceRing *acquire_ring() {
+  if (thread_ring == NULL) {
+    TraceRing *ring = calloc(1, sizeof(TraceRing));
+    ring->tid = gettid();
+
+    pthread_mutex_lock(&rings_mutex);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_mutex);
+
+    thread_ring = ring;
+  }
+  return thread_ring;
+}
+
+void trace_record(TracePhase phase, uint64_t start) {
+  uint64_t end = trace_begin();
+  if (end == 0) {
+    // disabled in between
+    return;
+  }
+
+  TRACE_PROBE(phase, start, end);
+
+  TraceRing *ring = acquire_ring();
+  uint64_t index = atomic_load_explicit(&ring->written, memory_order_relaxed);
+  TraceSpan *span = &ring->spans[index % TRACE_RING_SIZE];
+
+  // the exporter skips the slot while it is rewritten
+  atomic_store_explicit(&span->seq, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  span->start = start;
+  span->end = end;
+  span->phase = phase;
+  atomic_store_explicit(&span->seq, index + 1, memory_order_release);
+
+  atomic_store_explicit(&ring->written, index + 1, memory_order_release);
+}
+
+// Copies the span if it was not rewritten meanwhile
+static bool read_span(TraceSpan *span, uint64_t seq, TraceSpan *copy) {
+  if (atomic_load_explicit(&span->seq, memory_order_acquire) != seq) {
+    return false;
+  }
+  copy->start = span->start;
+  copy->end = span->end;
+  copy->phase = span->phase;
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&span->seq, memory_order_relaxed) == seq;
+}
+
+#define TRACE_EVENT_MAX 160
+
+char *trace_export_json(size_t *len) {
+  if (!atomic_load(&tracing_enabled)) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&rings_mutex);
+
+  size_t ring_count = 0;
+  for (TraceRing *ring = rings; ring != NULL; ring = ring->next) {
+    ring_count += 1;
+  }
+
+  size_t capacity = 64 + ring_count * TRACE_RING_SIZE * TRACE_EVENT_MAX;
+  char *json = malloc(capacity);
+  size_t size = sprintf(json, "{\"traceEvents\":[");
+  bool first = true;
+  pid_t pid = getpid();
+
+  for (TraceRing *ring = rings; ring != NULL; ring = ring->next) {
+    uint64_t written = atomic_load_explicit(&ring->written, memory_order_acquire);
+    uint64_t from = written > TRACE_RING_SIZE ? written - TRACE_RING_SIZE : 0;
+
+    for (uint64_t index = from; index < written; index += 1) {
+      TraceSpan span;
+      if (!read_span(&ring->spans[index % TRACE_RING_SIZE], index + 1,
+                     &span)) {
+        continue;
+      }
+
+      // complete events, timestamps in microseconds
+      size += sprintf(json + size,
+                      "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+                      "\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+                      first ? "" : ",", phase_names[span.phase],
+                      span.start / 1000.0, (span.end - span.start) / 1000.0,
+                      pid, ring->tid);
+      first = false;
+    }
+  }
+
+  pthread_mutex_unlock(&rings_mutex);
+
+  size += sprintf(json + size, "]}");
+  *len = size;
+  return json;
+}
+
+void free_tracing() {
+  pthread_mutex_lock(&rings_mutex);
+  while (rings != NULL) {
+    TraceRing *next = rings->next;
+    free(rings);
+    rings = next;
+  }
+  pthread_mutex_unlock(&rings_mutex);
+}
@@ -0,0 +1,66 @@
+#ifndef TRACE
+#define TRACE
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Optional per request tracing. Every thread records finished spans into a
+// ring of its own, /debug/trace (behind the admin token) exports the rings as
+// Chrome trace event JSON (chrome://tracing, Perfetto). With <sys/sdt.h>
+// around every span is also a USDT probe `http_server:span` for perf and
+// bpftrace.
+//
+// Disabled, a span costs one relaxed load and a predicted branch.
+
+enum TracePhase {
+  // from the first byte to the written response
+  TRACE_REQUEST,
+  TRACE_READ,
+  TRACE_PARSE,
+  TRACE_ROUTE,
+  TRACE_GZIP,
+  TRACE_WRITE,
+};
+
+typedef enum TracePhase TracePhase;
+
+// spans kept per thread, older ones are overwritten
+#define TRACE_RING_SIZE 4096
+
+extern atomic_bool tracing_enabled;
+
+void set_tracing(bool enabled);
+
+// Start of a span or 0 while tracing is disabled
+static inline uint64_t trace_begin() {
+  if (__builtin_expect(
+          !atomic_load_explicit(&tracing_enabled, memory_order_relaxed), 1)) {
+    return 0;
+  }
+
+  // vDSO, no syscall and unlike the coarse clock fine enough for spans of a
+  // few microseconds
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void trace_record(TracePhase phase, uint64_t start);
+
+static inline void trace_end(TracePhase phase, uint64_t start) {
+  if (start != 0) {
+    trace_record(phase, start);
+  }
+}
+
+// The spans of every thread as {"traceEvents":[...]}, NULL while tracing is
+// disabled. The caller frees it.
+char *trace_export_json(size_t *len);
+
+// Once no thread records anymore
+void free_tracing();
+
+#endif // !TRACE
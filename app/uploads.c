@@ -0,0 +1,411 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "uploads.h"
+
+bool parse_durability_policy(const char *name, DurabilityPolicy *policy) {
+  if (strcmp(name, "none") == 0) {
+    *policy = DURABILITY_NONE;
+  } else if (strcmp(name, "fdatasync") == 0) {
+    *policy = DURABILITY_FDATASYNC;
+  } else if (strcmp(name, "group") == 0) {
+    *policy = DURABILITY_GROUP_COMMIT;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void init_upload_store(UploadStore *store, StaticRoot *root,
+                       DurabilityPolicy policy, bool dedup) {
+  store->root = root;
+  store->policy = policy;
+  store->blobs = -1;
+  store->counter = 0;
+
+  if (dedup) {
+    if (mkdirat(root->dirfd, BLOB_DIRECTORY, 0755) != 0 && errno != EEXIST) {
+      printf("failed to create %s: %s \n", BLOB_DIRECTORY, strerror(errno));
+    }
+    store->blobs = openat(root->dirfd, BLOB_DIRECTORY,
+                          O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (store->blobs == -1) {
+      printf("failed to open %s, uploads are copied: %s \n", BLOB_DIRECTORY,
+             strerror(errno));
+    }
+  }
+
+  SyncGroup *group = &store->group;
+  pthread_mutex_init(&group->mutex, NULL);
+  pthread_cond_init(&group->cond, NULL);
+  group->batch = init_vector_SyncRequest();
+  group->submitted = 0;
+  group->synced = 0;
+  group->syncing = false;
+}
+
+void free_upload_store(UploadStore *store) {
+  if (store->blobs != -1) {
+    close(store->blobs);
+  }
+
+  SyncGroup *group = &store->group;
+  free_vector_SyncRequest(&group->batch);
+  pthread_cond_destroy(&group->cond);
+  pthread_mutex_destroy(&group->mutex);
+}
+
+// syncfs once per file system in the batch, that flushes every file and
+// directory entry of it
+static bool sync_batch(Vector_SyncRequest *batch) {
+  bool ok = true;
+  for (size_t i = 0; i < batch->len; i += 1) {
+    bool seen = false;
+    for (size_t j = 0; j < i && !seen; j += 1) {
+      seen = batch->ptr[j].dev == batch->ptr[i].dev;
+    }
+
+    if (!seen && syncfs(batch->ptr[i].fd) != 0) {
+      printf("syncfs failed: %s \n", strerror(errno));
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+// Returns once a sync that started after this call finished
+static bool group_commit(SyncGroup *group, int fd) {
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0) {
+    return false;
+  }
+
+  pthread_mutex_lock(&group->mutex);
+
+  push_vector_SyncRequest(&group->batch, (SyncRequest){
+                                             .fd = fd,
+                                             .dev = file_stat.st_dev,
+                                         });
+  group->submitted += 1;
+  uint64_t ticket = group->submitted;
+  bool ok = true;
+
+  while (group->synced < ticket) {
+    if (group->syncing) {
+      pthread_cond_wait(&group->cond, &group->mutex);
+      continue;
+    }
+
+    // lead the next sync with everything queued so far, the fds stay open
+    // because their owners wait for this sync
+    Vector_SyncRequest batch = group->batch;
+    group->batch = init_vector_SyncRequest();
+    uint64_t target = group->submitted;
+    group->syncing = true;
+    pthread_mutex_unlock(&group->mutex);
+
+    ok = sync_batch(&batch) && ok;
+    free_vector_SyncRequest(&batch);
+
+    pthread_mutex_lock(&group->mutex);
+    group->synced = target;
+    group->syncing = false;
+    pthread_cond_broadcast(&group->cond);
+  }
+
+  pthread_mutex_unlock(&group->mutex);
+
+  return ok;
+}
+
+static HttpStatus status_from_errno(int err) {
+  switch (err) {
+  case ENOENT:
+  case ENOTDIR:
+    return NOT_FOUND;
+  case EXDEV:
+  case EISDIR:
+  case ENAMETOOLONG:
+    return BAD_REQ;
+  case ENOSPC:
+  case EDQUOT:
+    return INSUFFICIENT_STORAGE;
+  default:
+    return INTERNAL_SERVER_ERROR;
+  }
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t len) {
+  size_t written = 0;
+  while (written < len) {
+    ssize_t res = write(fd, data + written, len - written);
+    if (res == -1 && errno == EINTR) {
+      continue;
+    } else if (res <= 0) {
+      return false;
+    }
+    written += res;
+  }
+  return true;
+}
+
+// Opens the directory the path lives in, `name` is set to the rest
+static int open_parent(UploadStore *store, const char *path,
+                       const char **name) {
+  char parent[STATIC_PATH_MAX];
+  const char *slash = strrchr(path, '/');
+  *name = slash == NULL ? path : slash + 1;
+  size_t parent_len = slash == NULL ? 0 : (size_t)(slash - path);
+  memcpy(parent, path, parent_len);
+  parent[parent_len] = '\0';
+
+  return static_openat(store->root, parent, O_RDONLY | O_DIRECTORY, 0);
+}
+
+bool is_hidden(const char *parent, const char *name) {
+  return strncmp(name, UPLOAD_TEMP_PREFIX, strlen(UPLOAD_TEMP_PREFIX)) == 0 ||
+         (parent[0] == '\0' && strcmp(name, BLOB_DIRECTORY) == 0);
+}
+
+bool is_hidden_path(const char *path) {
+  const char *name = path;
+  while (true) {
+    const char *slash = strchr(name, '/');
+    size_t len = slash == NULL ? strlen(name) : (size_t)(slash - name);
+    char component[STATIC_PATH_MAX];
+    if (len >= sizeof(component)) {
+      return false;
+    }
+    memcpy(component, name, len);
+    component[len] = '\0';
+    // only the root's name matters for the parent
+    if (is_hidden(name == path ? "" : path, component)) {
+      return true;
+    } else if (slash == NULL) {
+      return false;
+    }
+    name = slash + 1;
+  }
+}
+
+// Uploads must not replace the blobs other names link to
+static bool is_blob_path(UploadStore *store, const char *path) {
+  size_t len = strlen(BLOB_DIRECTORY);
+  return store->blobs != -1 && strncmp(path, BLOB_DIRECTORY, len) == 0 &&
+         (path[len] == '\0' || path[len] == '/');
+}
+
+HttpStatus check_upload(UploadStore *store, const char *path, size_t len) {
+  if (is_blob_path(store, path)) {
+    return BAD_REQ;
+  }
+
+  const char *name;
+  int dirfd = open_parent(store, path, &name);
+  if (dirfd == -1) {
+    return status_from_errno(errno);
+  }
+
+  HttpStatus status = OK;
+  struct statvfs fs;
+  if (fstatvfs(dirfd, &fs) == 0 &&
+      (unsigned long long)fs.f_bavail * fs.f_frsize < len) {
+    status = INSUFFICIENT_STORAGE;
+  }
+
+  close(dirfd);
+  return status;
+}
+
+static void temp_name(UploadStore *store, char *temp) {
+  sprintf(temp, UPLOAD_TEMP_PREFIX "%d-%lu", getpid(),
+          atomic_fetch_add(&store->counter, 1));
+}
+
+// the data has to be on disk before a name points to it
+static bool sync_file(UploadStore *store, int fd) {
+  if (store->policy == DURABILITY_FDATASYNC) {
+    return fdatasync(fd) == 0;
+  } else if (store->policy == DURABILITY_GROUP_COMMIT) {
+    return group_commit(&store->group, fd);
+  }
+  return true;
+}
+
+// and a new name is only durable with its directory
+static bool sync_directory(UploadStore *store, int dirfd) {
+  if (store->policy == DURABILITY_FDATASYNC) {
+    return fsync(dirfd) == 0;
+  } else if (store->policy == DURABILITY_GROUP_COMMIT) {
+    return group_commit(&store->group, dirfd);
+  }
+  return true;
+}
+
+// Writes `name` in the directory through a temp file renamed into place,
+// blobs get their hash attached
+static HttpStatus write_file(UploadStore *store, int dirfd, const char *name,
+                             const uint8_t *data, size_t len,
+                             const char *hash) {
+  HttpStatus status = CREATED;
+
+  // the temp file lives in the same directory, rename can't cross devices
+  char temp[64];
+  temp_name(store, temp);
+
+  int fd = openat(dirfd, temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (fd == -1) {
+    return status_from_errno(errno);
+  }
+
+  // reserve the blocks up front, a full disk fails before anything is sent
+  if (len > 0 && fallocate(fd, 0, 0, len) != 0 && errno != EOPNOTSUPP) {
+    printf("fallocate failed: %s \n", strerror(errno));
+    status = status_from_errno(errno);
+    goto UPLOAD_UNLINK;
+  }
+
+  if (!write_all(fd, data, len)) {
+    printf("upload write failed: %s \n", strerror(errno));
+    status = status_from_errno(errno);
+    goto UPLOAD_UNLINK;
+  }
+
+  // without xattr support the ETag falls back to the file's metadata
+  if (hash != NULL &&
+      fsetxattr(fd, UPLOAD_HASH_XATTR, hash, UPLOAD_HASH_LEN, 0) != 0) {
+    printf("failed to tag blob %s: %s \n", hash, strerror(errno));
+  }
+
+  if (!sync_file(store, fd)) {
+    status = INTERNAL_SERVER_ERROR;
+    goto UPLOAD_UNLINK;
+  }
+
+  if (renameat(dirfd, temp, dirfd, name) != 0) {
+    status = status_from_errno(errno);
+    goto UPLOAD_UNLINK;
+  }
+
+  if (!sync_directory(store, dirfd)) {
+    status = INTERNAL_SERVER_ERROR;
+  }
+  goto UPLOAD_CLOSE;
+
+UPLOAD_UNLINK:
+  unlinkat(dirfd, temp, 0);
+
+UPLOAD_CLOSE:
+  close(fd);
+
+  return status;
+}
+
+static void hash_content(const uint8_t *data, size_t len, char *hash) {
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len = 0;
+  // libcrypto picks the SHA extensions or AVX2 kernel of the CPU
+  EVP_Digest(data, len, digest, &digest_len, EVP_sha256(), NULL);
+
+  for (unsigned int i = 0; i < digest_len; i += 1) {
+    sprintf(hash + 2 * i, "%02x", digest[i]);
+  }
+}
+
+// Whether the stored blob carries the hash it is named after, a blob that
+// was tampered with or lost its xattr is written again
+static bool blob_matches(UploadStore *store, const char *hash, size_t len) {
+  int fd = openat(store->blobs, hash, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+
+  struct stat blob_stat;
+  char recorded[UPLOAD_HASH_LEN];
+  bool matches = fstat(fd, &blob_stat) == 0 && S_ISREG(blob_stat.st_mode) &&
+                 (size_t)blob_stat.st_size == len &&
+                 fgetxattr(fd, UPLOAD_HASH_XATTR, recorded, UPLOAD_HASH_LEN) ==
+                     UPLOAD_HASH_LEN &&
+                 memcmp(recorded, hash, UPLOAD_HASH_LEN) == 0;
+  close(fd);
+  return matches;
+}
+
+// Links the blob of the content to the name, storing the blob only if it
+// is new
+static HttpStatus store_linked(UploadStore *store, int dirfd,
+                               const char *name, const uint8_t *data,
+                               size_t len) {
+  char hash[UPLOAD_HASH_LEN + 1];
+  hash_content(data, len, hash);
+
+  if (blob_matches(store, hash, len)) {
+    printf("dedup hit <%s>\n", hash);
+  } else {
+    HttpStatus status = write_file(store, store->blobs, hash, data, len, hash);
+    if (status != CREATED) {
+      return status;
+    }
+  }
+
+  // link can't replace the name, rename does that atomically
+  char temp[64];
+  temp_name(store, temp);
+  if (linkat(store->blobs, hash, dirfd, temp, 0) != 0) {
+    // a mount below the root or too many links, keep a copy instead
+    if (errno == EXDEV || errno == EMLINK) {
+      return write_file(store, dirfd, name, data, len, NULL);
+    }
+    return status_from_errno(errno);
+  }
+
+  if (renameat(dirfd, temp, dirfd, name) != 0) {
+    HttpStatus status = status_from_errno(errno);
+    unlinkat(dirfd, temp, 0);
+    return status;
+  }
+
+  return sync_directory(store, dirfd) ? CREATED : INTERNAL_SERVER_ERROR;
+}
+
+HttpStatus store_upload(UploadStore *store, const char *path,
+                        const uint8_t *data, size_t len) {
+  if (is_blob_path(store, path)) {
+    return BAD_REQ;
+  }
+
+  const char *name;
+  int dirfd = open_parent(store, path, &name);
+  if (dirfd == -1) {
+    return status_from_errno(errno);
+  }
+
+  HttpStatus status = store->blobs == -1
+                          ? write_file(store, dirfd, name, data, len, NULL)
+                          : store_linked(store, dirfd, name, data, len);
+
+  close(dirfd);
+  return status;
+}
+
+bool upload_content_hash(UploadStore *store, int fd,
+                         char hash[UPLOAD_HASH_LEN + 1]) {
+  if (store->blobs == -1) {
+    return false;
+  }
+
+  ssize_t len = fgetxattr(fd, UPLOAD_HASH_XATTR, hash, UPLOAD_HASH_LEN);
+  if (len != UPLOAD_HASH_LEN) {
+    return false;
+  }
+  hash[UPLOAD_HASH_LEN] = '\0';
+  return true;
+}
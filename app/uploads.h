@@ -0,0 +1,99 @@
+#ifndef UPLOADS
+#define UPLOADS
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "http.h"
+#include "static_files.h"
+
+// How much of an upload survives a crash once it was answered with 201
+enum DurabilityPolicy {
+  // atomic only, the data reaches the disk whenever the kernel writes it
+  DURABILITY_NONE,
+  // fdatasync the file and fsync the directory for every upload
+  DURABILITY_FDATASYNC,
+  // uploads finishing at the same time share one syncfs per file system
+  DURABILITY_GROUP_COMMIT,
+};
+
+typedef enum DurabilityPolicy DurabilityPolicy;
+
+struct SyncRequest {
+  int fd;
+  dev_t dev;
+};
+
+typedef struct SyncRequest SyncRequest;
+
+INIT_VECTOR(SyncRequest);
+
+// Group commit, the first waiting upload syncs the whole batch collected
+// while the previous sync ran, everybody else waits for it
+struct SyncGroup {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  Vector_SyncRequest batch;
+  uint64_t submitted;
+  uint64_t synced;
+  bool syncing;
+};
+
+typedef struct SyncGroup SyncGroup;
+
+// With `dedup 1` uploads are stored once per content under
+// BLOB_DIRECTORY/<sha256> and hard linked to the requested names, a
+// duplicate upload only adds a link. The hash is kept in the blob's
+// UPLOAD_HASH_XATTR and serves as its ETag.
+#define BLOB_DIRECTORY ".blobs"
+#define UPLOAD_HASH_XATTR "user.sha256"
+// hex digits of a SHA-256
+#define UPLOAD_HASH_LEN 64
+// uploads are written to temp files named like this next to their target
+#define UPLOAD_TEMP_PREFIX ".upload-"
+
+struct UploadStore {
+  StaticRoot *root;
+  DurabilityPolicy policy;
+  // BLOB_DIRECTORY, -1 if uploads are copied
+  int blobs;
+  SyncGroup group;
+  atomic_ulong counter;
+};
+
+typedef struct UploadStore UploadStore;
+
+// "none", "fdatasync" or "group"
+bool parse_durability_policy(const char *name, DurabilityPolicy *policy);
+
+// Falls back to copies if the blob directory can't be opened
+void init_upload_store(UploadStore *store, StaticRoot *root,
+                       DurabilityPolicy policy, bool dedup);
+void free_upload_store(UploadStore *store);
+
+// What can be checked before the body arrives: the directory of the
+// normalized path exists and its file system has room for `len` bytes.
+// Returns OK or the status the upload would fail with.
+HttpStatus check_upload(UploadStore *store, const char *path, size_t len);
+
+// Writes the data to a temp file next to the normalized path (or links the
+// blob of its content there) and renames it into place, readers see either
+// the old or the complete new file
+HttpStatus store_upload(UploadStore *store, const char *path,
+                        const uint8_t *data, size_t len);
+
+// Temp files of uploads and the blob store, nothing that lists the root
+// shows them. `parent` is the normalized path of the directory holding `name`.
+bool is_hidden(const char *parent, const char *name);
+// Whether any component of the normalized path is hidden
+bool is_hidden_path(const char *path);
+
+// The content hash of a deduplicated file, false for anything else
+bool upload_content_hash(UploadStore *store, int fd,
+                         char hash[UPLOAD_HASH_LEN + 1]);
+
+#endif // !UPLOADS
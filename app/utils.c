@@ -1,5 +1,8 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <stddef.h>
+#include <string.h>
+#include <time.h>
 
 #include "utils.h"
 
@@ -50,3 +53,100 @@ size_t starts_with_wildcard(const char *buf, const char *with) {
     i += 1;
   }
 }
+
+#define HTTP_DATE_FORMAT "%a, %d %b %Y %H:%M:%S GMT"
+
+void format_http_date(char *buf, time_t time) {
+  struct tm tm;
+  gmtime_r(&time, &tm);
+  strftime(buf, HTTP_DATE_LEN, HTTP_DATE_FORMAT, &tm);
+}
+
+bool parse_http_date(const char *date, time_t *time) {
+  struct tm tm = {0};
+  const char *end = strptime(date, HTTP_DATE_FORMAT, &tm);
+  if (end == NULL || *end != '\0') {
+    return false;
+  }
+  *time = timegm(&tm);
+  return true;
+}
+
+bool etag_list_matches(const char *list, const char *etag) {
+  size_t etag_len = strlen(etag);
+
+  const char *curr = list;
+  while (*curr != '\0') {
+    while (*curr == ' ' || *curr == '\t' || *curr == ',') {
+      curr += 1;
+    }
+
+    if (*curr == '*') {
+      return true;
+    }
+
+    if (starts_with(curr, "W/")) {
+      curr += 2;
+    }
+
+    const char *end = strchr(curr, ',');
+    size_t len = end == NULL ? strlen(curr) : (size_t)(end - curr);
+    while (len > 0 && (curr[len - 1] == ' ' || curr[len - 1] == '\t')) {
+      len -= 1;
+    }
+
+    if (len == etag_len && memcmp(curr, etag, len) == 0) {
+      return true;
+    }
+
+    curr += len;
+    while (*curr != '\0' && *curr != ',') {
+      curr += 1;
+    }
+  }
+
+  return false;
+}
+
+static int base64url_value(char c) {
+  if (c >= 'A' && c <= 'Z') {
+    return c - 'A';
+  }
+  if (c >= 'a' && c <= 'z') {
+    return c - 'a' + 26;
+  }
+  if (c >= '0' && c <= '9') {
+    return c - '0' + 52;
+  }
+  if (c == '-') {
+    return 62;
+  }
+  if (c == '_') {
+    return 63;
+  }
+  return -1;
+}
+
+bool base64url_decode(const char *str, uint8_t *out, size_t *out_len) {
+  uint32_t bits = 0;
+  size_t bit_count = 0;
+  size_t len = 0;
+
+  for (const char *c = str; *c != '\0' && *c != '='; c += 1) {
+    int value = base64url_value(*c);
+    if (value < 0) {
+      return false;
+    }
+
+    bits = bits << 6 | value;
+    bit_count += 6;
+    if (bit_count >= 8) {
+      bit_count -= 8;
+      out[len] = bits >> bit_count;
+      len += 1;
+    }
+  }
+
+  *out_len = len;
+  return true;
+}
@@ -1,7 +1,9 @@
 #ifndef UTILS
 #define UTILS
 #include "stdbool.h"
+#include "stdint.h"
 #include "stdlib.h"
+#include "time.h"
 
 #define ARRAY_SIZE(X) sizeof(X) / sizeof(X[0])
 
@@ -18,4 +20,16 @@ bool starts_with(const char *buf, const char *with);
 // - n from which offset the wildcard WILDCARD is found
 size_t starts_with_wildcard(const char *buf, const char *with);
 
+// "Sun, 06 Nov 1994 08:49:37 GMT" + '\0'
+#define HTTP_DATE_LEN 30
+
+void format_http_date(char *buf, time_t time);
+bool parse_http_date(const char *date, time_t *time);
+
+// Weak comparison of an If-None-Match list against an entity tag
+bool etag_list_matches(const char *list, const char *etag);
+
+// Decodes unpadded base64url, `out` needs room for 3/4 of the input length
+bool base64url_decode(const char *str, uint8_t *out, size_t *out_len);
+
 #endif // !UTILS
@@ -0,0 +1,900 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/evp.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+
+#include "routes.h"
+#include "utils.h"
+#include "websocket.h"
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WEBSOCKET_VERSION "13"
+// base64 of the 16 byte nonce
+#define WEBSOCKET_KEY_LEN 24
+// base64 of a SHA-1
+#define WEBSOCKET_ACCEPT_LEN 28
+#define PERMESSAGE_DEFLATE "permessage-deflate"
+
+#define MAX_FRAME_HEADER 14
+#define MAX_CONTROL_PAYLOAD 125
+// frames up to this size are copied behind their header and written at once
+#define INLINE_FRAME_LIMIT 4096
+
+#define FIN_BIT 0x80
+#define RSV1_BIT 0x40
+#define RSV_BITS 0x70
+#define OPCODE_BITS 0x0F
+#define MASK_BIT 0x80
+#define LEN_BITS 0x7F
+#define LEN_16 126
+#define LEN_64 127
+
+// a sync flush ends in an empty stored block, it is left off on the wire
+static const uint8_t DEFLATE_TAIL[] = {0x00, 0x00, 0xFF, 0xFF};
+
+struct FrameHeader {
+  bool fin;
+  bool compressed;
+  // RSV2 or RSV3, no extension defines them
+  bool reserved;
+  WebSocketOpcode opcode;
+  bool masked;
+  uint8_t key[4];
+  uint64_t len;
+};
+
+typedef struct FrameHeader FrameHeader;
+
+static bool echo_message(WebSocket *ws, WebSocketOpcode opcode,
+                         const uint8_t *data, size_t len) {
+  return websocket_send(ws, opcode, data, len);
+}
+
+struct WebSocketRoute {
+  const char *route;
+  WebSocketHandler handler;
+};
+
+typedef struct WebSocketRoute WebSocketRoute;
+
+static WebSocketRoute WEBSOCKET_ROUTES[] = {
+    {WEBSOCKET_ECHO_ROUTE, echo_message},
+};
+
+// The route itself or anything below it
+static WebSocketHandler find_handler(const char *url) {
+  for (size_t i = 0; i < ARRAY_SIZE(WEBSOCKET_ROUTES); i += 1) {
+    size_t len = strlen(WEBSOCKET_ROUTES[i].route);
+    if (strncmp(url, WEBSOCKET_ROUTES[i].route, len) == 0 &&
+        (url[len] == '/' || url[len] == '\0')) {
+      return WEBSOCKET_ROUTES[i].handler;
+    }
+  }
+  return NULL;
+}
+
+bool is_websocket_upgrade(HttpRequest *req) {
+  const char *upgrade = find_in_header(&req->headers, UPGRADE);
+  const char *connection = find_in_header(&req->headers, CONNECTION);
+
+  return req->method == GET && upgrade != NULL && connection != NULL &&
+         has_token(upgrade, WEBSOCKET_UPGRADE) &&
+         has_token(connection, CONNECTION_UPGRADE);
+}
+
+// XORs the payload with the client's key, 16 bytes at a time through GCC
+// vector extensions which turn into SSE or NEON
+typedef uint8_t MaskBlock __attribute__((vector_size(16)));
+
+static void unmask(uint8_t *data, size_t len, const uint8_t key[4]) {
+  MaskBlock mask;
+  for (size_t i = 0; i < sizeof(mask); i += 1) {
+    mask[i] = key[i % 4];
+  }
+
+  size_t i = 0;
+  for (; i + sizeof(MaskBlock) <= len; i += sizeof(MaskBlock)) {
+    MaskBlock block;
+    memcpy(&block, data + i, sizeof(block));
+    block ^= mask;
+    memcpy(data + i, &block, sizeof(block));
+  }
+  // the block size is a multiple of the key, the rest lines up with it
+  for (; i < len; i += 1) {
+    data[i] ^= key[i % 4];
+  }
+}
+
+static bool is_valid_utf8(const uint8_t *data, size_t len) {
+  size_t i = 0;
+  while (i < len) {
+    // skip ASCII a word at a time
+    if (i + sizeof(uint64_t) <= len) {
+      uint64_t word;
+      memcpy(&word, data + i, sizeof(word));
+      if ((word & 0x8080808080808080ULL) == 0) {
+        i += sizeof(word);
+        continue;
+      }
+    }
+
+    uint8_t c = data[i];
+    if (c < 0x80) {
+      i += 1;
+      continue;
+    }
+
+    size_t follow = 0;
+    uint32_t point = 0;
+    if ((c & 0xE0) == 0xC0) {
+      follow = 1;
+      point = c & 0x1F;
+    } else if ((c & 0xF0) == 0xE0) {
+      follow = 2;
+      point = c & 0x0F;
+    } else if ((c & 0xF8) == 0xF0) {
+      follow = 3;
+      point = c & 0x07;
+    } else {
+      return false;
+    }
+
+    if (len - i <= follow) {
+      return false;
+    }
+    for (size_t j = 1; j <= follow; j += 1) {
+      if ((data[i + j] & 0xC0) != 0x80) {
+        return false;
+      }
+      point = point << 6 | (data[i + j] & 0x3F);
+    }
+
+    // overlong forms, surrogates and anything past Unicode
+    static const uint32_t smallest[] = {0, 0x80, 0x800, 0x10000};
+    if (point < smallest[follow] || point > 0x10FFFF ||
+        (point >= 0xD800 && point <= 0xDFFF)) {
+      return false;
+    }
+    i += follow + 1;
+  }
+  return true;
+}
+
+// Returns the header length or 0 if the header isn't complete yet
+static size_t parse_frame_header(const uint8_t *buf, size_t len,
+                                 FrameHeader *frame) {
+  if (len < 2) {
+    return 0;
+  }
+
+  frame->fin = (buf[0] & FIN_BIT) != 0;
+  frame->compressed = (buf[0] & RSV1_BIT) != 0;
+  frame->reserved = (buf[0] & RSV_BITS & ~RSV1_BIT) != 0;
+  frame->opcode = buf[0] & OPCODE_BITS;
+  frame->masked = (buf[1] & MASK_BIT) != 0;
+
+  size_t header_len = 2;
+  uint64_t payload_len = buf[1] & LEN_BITS;
+  size_t extended = payload_len == LEN_16 ? 2 : payload_len == LEN_64 ? 8 : 0;
+
+  if (len < header_len + extended + (frame->masked ? 4 : 0)) {
+    return 0;
+  }
+
+  if (extended > 0) {
+    payload_len = 0;
+    for (size_t i = 0; i < extended; i += 1) {
+      payload_len = payload_len << 8 | buf[header_len + i];
+    }
+    header_len += extended;
+  }
+  frame->len = payload_len;
+
+  if (frame->masked) {
+    memcpy(frame->key, buf + header_len, sizeof(frame->key));
+    header_len += sizeof(frame->key);
+  }
+
+  return header_len;
+}
+
+static bool is_control(WebSocketOpcode opcode) { return (opcode & 0x8) != 0; }
+
+// Returns 0 if the frame may follow what came before or the close code
+static uint16_t check_frame(WebSocket *ws, FrameHeader *frame) {
+  switch (frame->opcode) {
+  case WS_CONTINUATION:
+    if (!ws->in_message || frame->compressed) {
+      return WS_CLOSE_PROTOCOL_ERROR;
+    }
+    break;
+  case WS_TEXT:
+  case WS_BINARY:
+    if (ws->in_message || (frame->compressed && !ws->deflate.enabled)) {
+      return WS_CLOSE_PROTOCOL_ERROR;
+    }
+    break;
+  case WS_CLOSE:
+  case WS_PING:
+  case WS_PONG:
+    if (!frame->fin || frame->compressed ||
+        frame->len > MAX_CONTROL_PAYLOAD) {
+      return WS_CLOSE_PROTOCOL_ERROR;
+    }
+    break;
+  default:
+    return WS_CLOSE_PROTOCOL_ERROR;
+  }
+
+  // clients always mask, the top bit of a 64 bit length is reserved
+  if (frame->reserved || !frame->masked || frame->len > INT64_MAX) {
+    return WS_CLOSE_PROTOCOL_ERROR;
+  }
+
+  if (!is_control(frame->opcode) &&
+      frame->len > ws->max_message - ws->message_len) {
+    return WS_CLOSE_TOO_BIG;
+  }
+  return 0;
+}
+
+static bool send_frame(WebSocket *ws, uint8_t first, const uint8_t *data,
+                       size_t len) {
+  uint8_t buf[MAX_FRAME_HEADER + INLINE_FRAME_LIMIT];
+  size_t header_len = 2;
+
+  buf[0] = first;
+  if (len < LEN_16) {
+    buf[1] = len;
+  } else if (len <= UINT16_MAX) {
+    buf[1] = LEN_16;
+    buf[2] = len >> 8;
+    buf[3] = len;
+    header_len += 2;
+  } else {
+    buf[1] = LEN_64;
+    for (size_t i = 0; i < 8; i += 1) {
+      buf[2 + i] = (uint64_t)len >> (56 - 8 * i);
+    }
+    header_len += 8;
+  }
+
+  if (len <= INLINE_FRAME_LIMIT) {
+    if (len > 0) {
+      memcpy(buf + header_len, data, len);
+    }
+    return conn_write(ws->conn, buf, header_len + len);
+  }
+  return conn_write_more(ws->conn, buf, header_len) &&
+         conn_write(ws->conn, data, len);
+}
+
+static bool send_close(WebSocket *ws, uint16_t code) {
+  uint8_t payload[2] = {code >> 8, code & 0xFF};
+  return send_frame(ws, FIN_BIT | WS_CLOSE, payload, sizeof(payload));
+}
+
+static bool grow(uint8_t **buf, size_t *capacity, size_t needed) {
+  if (needed <= *capacity) {
+    return true;
+  }
+
+  size_t next = *capacity * 2 > needed ? *capacity * 2 : needed;
+  if (next < INLINE_FRAME_LIMIT) {
+    next = INLINE_FRAME_LIMIT;
+  }
+  uint8_t *bigger = realloc(*buf, next);
+  if (bigger == NULL) {
+    return false;
+  }
+  *buf = bigger;
+  *capacity = next;
+  return true;
+}
+
+// Compresses into ws->deflated without the trailing empty block
+static bool deflate_message(WebSocket *ws, const uint8_t *data, size_t len,
+                            size_t *out_len) {
+  z_stream *stream = &ws->deflate.deflate;
+
+  // room for the flush on top of the bound for the data
+  size_t bound = deflateBound(stream, len) + 16;
+  if (!grow(&ws->deflated, &ws->deflated_capacity, bound)) {
+    return false;
+  }
+
+  stream->next_in = (Bytef *)data;
+  stream->avail_in = len;
+  size_t produced = 0;
+  while (1) {
+    stream->next_out = ws->deflated + produced;
+    stream->avail_out = ws->deflated_capacity - produced;
+    int res = deflate(stream, Z_SYNC_FLUSH);
+    if (res != Z_OK && res != Z_BUF_ERROR) {
+      return false;
+    }
+    produced = ws->deflated_capacity - stream->avail_out;
+    // a full buffer may still hold back output, no progress means it didn't
+    if (stream->avail_out > 0 || res == Z_BUF_ERROR) {
+      break;
+    }
+    if (!grow(&ws->deflated, &ws->deflated_capacity, produced + 1)) {
+      return false;
+    }
+  }
+
+  if (produced < sizeof(DEFLATE_TAIL) ||
+      memcmp(ws->deflated + produced - sizeof(DEFLATE_TAIL), DEFLATE_TAIL,
+             sizeof(DEFLATE_TAIL)) != 0) {
+    return false;
+  }
+  *out_len = produced - sizeof(DEFLATE_TAIL);
+
+  if (ws->deflate.server_no_context_takeover) {
+    deflateReset(stream);
+  }
+  return true;
+}
+
+bool websocket_send(WebSocket *ws, WebSocketOpcode opcode, const uint8_t *data,
+                    size_t len) {
+  uint8_t first = FIN_BIT | opcode;
+
+  // once the context saw the message it has to go out compressed, the
+  // client's window would be off otherwise
+  if (ws->deflate.enabled && !is_control(opcode) &&
+      len >= WEBSOCKET_DEFLATE_MIN) {
+    size_t compressed_len = 0;
+    if (!deflate_message(ws, data, len, &compressed_len)) {
+      return false;
+    }
+    first |= RSV1_BIT;
+    data = ws->deflated;
+    len = compressed_len;
+  }
+
+  return send_frame(ws, first, data, len);
+}
+
+// Inflates the collected message into ws->inflated, returns 0 or the close
+// code
+static uint16_t inflate_message(WebSocket *ws, size_t *out_len) {
+  if (!grow(&ws->message, &ws->message_capacity,
+            ws->message_len + sizeof(DEFLATE_TAIL))) {
+    return WS_CLOSE_TOO_BIG;
+  }
+  memcpy(ws->message + ws->message_len, DEFLATE_TAIL, sizeof(DEFLATE_TAIL));
+
+  z_stream *stream = &ws->deflate.inflate;
+  stream->next_in = ws->message;
+  stream->avail_in = ws->message_len + sizeof(DEFLATE_TAIL);
+
+  size_t produced = 0;
+  uint16_t code = 0;
+  while (1) {
+    // one byte past the limit tells a message that is too large apart
+    size_t needed = produced + WEBSOCKET_READ_BUFFER;
+    if (needed > ws->max_message + 1) {
+      needed = ws->max_message + 1;
+    }
+    if (produced == needed ||
+        !grow(&ws->inflated, &ws->inflated_capacity, needed)) {
+      code = WS_CLOSE_TOO_BIG;
+      break;
+    }
+
+    stream->next_out = ws->inflated + produced;
+    stream->avail_out = needed - produced;
+    int res = inflate(stream, Z_SYNC_FLUSH);
+    produced = needed - stream->avail_out;
+
+    if (res == Z_STREAM_END) {
+      // a final block, the next message starts a new stream
+      inflateReset(stream);
+      break;
+    } else if (res != Z_OK && res != Z_BUF_ERROR) {
+      code = WS_CLOSE_INVALID_DATA;
+      break;
+    } else if (stream->avail_in == 0 && stream->avail_out > 0) {
+      break;
+    }
+  }
+
+  if (code == 0 && produced > ws->max_message) {
+    code = WS_CLOSE_TOO_BIG;
+  }
+  if (code != 0 || ws->deflate.client_no_context_takeover) {
+    inflateReset(stream);
+  }
+  *out_len = produced;
+  return code;
+}
+
+// Hands a complete message to the handler, returns 0 or the close code
+static uint16_t deliver_message(WebSocket *ws, WebSocketHandler handler,
+                                WebSocketOpcode opcode, bool compressed,
+                                const uint8_t *data, size_t len) {
+  if (compressed) {
+    uint16_t code = inflate_message(ws, &len);
+    if (code != 0) {
+      return code;
+    }
+    data = ws->inflated;
+  }
+
+  if (opcode == WS_TEXT && !is_valid_utf8(data, len)) {
+    return WS_CLOSE_INVALID_DATA;
+  }
+
+  if (!handler(ws, opcode, data, len)) {
+    return WS_CLOSE_NORMAL;
+  }
+  return 0;
+}
+
+// Delivers the collected message and starts over for the next one
+static uint16_t finish_message(WebSocket *ws, WebSocketHandler handler) {
+  ws->in_message = false;
+  uint16_t code =
+      deliver_message(ws, handler, ws->message_opcode, ws->message_compressed,
+                      ws->message, ws->message_len);
+  ws->message_len = 0;
+  return code;
+}
+
+static bool is_valid_close_code(uint16_t code) {
+  return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011) ||
+         (code >= 3000 && code <= 4999);
+}
+
+// Answers control frames, returns 0 to go on or the close code, the close
+// handshake is done once a close frame came in
+static uint16_t handle_control(WebSocket *ws, FrameHeader *frame,
+                               const uint8_t *payload, bool *closed) {
+  switch (frame->opcode) {
+  case WS_PING:
+    if (!send_frame(ws, FIN_BIT | WS_PONG, payload, frame->len)) {
+      *closed = true;
+    }
+    return 0;
+  case WS_PONG:
+    return 0;
+  case WS_CLOSE:
+    break;
+  default:
+    return WS_CLOSE_PROTOCOL_ERROR;
+  }
+
+  *closed = true;
+  if (frame->len == 0) {
+    send_frame(ws, FIN_BIT | WS_CLOSE, NULL, 0);
+    return 0;
+  }
+
+  uint16_t code = (uint16_t)payload[0] << 8 | payload[1];
+  if (frame->len == 1 || !is_valid_close_code(code)) {
+    code = WS_CLOSE_PROTOCOL_ERROR;
+  } else if (!is_valid_utf8(payload + 2, frame->len - 2)) {
+    code = WS_CLOSE_INVALID_DATA;
+  }
+  // the client's code is sent back as it is
+  send_close(ws, code);
+  return 0;
+}
+
+// Waits for the next frame, pinging the client once it was quiet for a while
+static bool wait_for_frame(WebSocket *ws) {
+  Connection *conn = ws->conn;
+
+  // decrypted and buffered already, poll wouldn't wake up for it
+  while (!conn_has_buffered(conn)) {
+    // only fires on shutdown, the poll below gives up first otherwise
+    conn_arm(conn, 2 * WEBSOCKET_PING_MS + conn->timeouts.write_ms,
+             TIMER_SHUT_RD);
+
+    struct pollfd pfd = {
+        .fd = conn->fd,
+        .events = POLLIN,
+        .revents = 0,
+    };
+    int res = poll(&pfd, 1, WEBSOCKET_PING_MS);
+    if (res > 0) {
+      return true;
+    } else if (res == -1 && errno == EINTR) {
+      continue;
+    } else if (res == -1 || ws->ping_sent) {
+      // no pong for the last ping
+      return false;
+    }
+
+    ws->ping_sent = true;
+    if (!send_frame(ws, FIN_BIT | WS_PING, NULL, 0)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Reads until `needed` bytes from `pos` on are buffered, moving them to the
+// front of the buffer first
+static bool fill_input(WebSocket *ws, size_t *pos, size_t needed) {
+  if (*pos > 0) {
+    ws->in_len -= *pos;
+    memmove(ws->in, ws->in + *pos, ws->in_len);
+    *pos = 0;
+  }
+
+  while (ws->in_len < needed) {
+    if (ws->in_len == 0) {
+      if (!wait_for_frame(ws)) {
+        return false;
+      }
+    }
+    // a frame started, the rest has to come in time
+    conn_arm(ws->conn, ws->conn->timeouts.body_ms, TIMER_SHUT_RD);
+    if (!conn_read_some(ws->conn, ws->in, &ws->in_len,
+                        WEBSOCKET_READ_BUFFER)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Reads a data frame too large for the input buffer straight into the
+// message, returns false once the client is gone
+static bool read_large_frame(WebSocket *ws, size_t *pos, FrameHeader *frame) {
+  size_t start = ws->message_len;
+  size_t end = start + frame->len;
+  if (!grow(&ws->message, &ws->message_capacity,
+            end + sizeof(DEFLATE_TAIL))) {
+    return false;
+  }
+
+  // whatever arrived with the header, all of it belongs to this frame
+  size_t buffered = ws->in_len - *pos;
+  memcpy(ws->message + start, ws->in + *pos, buffered);
+  ws->message_len += buffered;
+  *pos = 0;
+  ws->in_len = 0;
+
+  conn_arm(ws->conn, ws->conn->timeouts.body_ms, TIMER_SHUT_RD);
+  while (ws->message_len < end) {
+    if (!conn_read_some(ws->conn, ws->message, &ws->message_len, end)) {
+      return false;
+    }
+  }
+
+  unmask(ws->message + start, frame->len, frame->key);
+  return true;
+}
+
+static void serve_frames(WebSocket *ws, WebSocketHandler handler) {
+  size_t pos = 0;
+  uint16_t code = 0;
+  bool closed = false;
+
+  while (code == 0 && !closed) {
+    FrameHeader frame;
+    size_t header_len = 0;
+    while ((header_len = parse_frame_header(ws->in + pos, ws->in_len - pos,
+                                            &frame)) == 0) {
+      if (!fill_input(ws, &pos, ws->in_len - pos + 1)) {
+        return;
+      }
+    }
+
+    // anything coming in shows the client is still there
+    ws->ping_sent = false;
+
+    code = check_frame(ws, &frame);
+    if (code != 0) {
+      break;
+    }
+
+    if (!is_control(frame.opcode) && frame.opcode != WS_CONTINUATION) {
+      ws->in_message = true;
+      ws->message_opcode = frame.opcode;
+      ws->message_compressed = frame.compressed;
+    }
+
+    if (header_len + frame.len > WEBSOCKET_READ_BUFFER) {
+      // only data frames get this large
+      pos += header_len;
+      if (!read_large_frame(ws, &pos, &frame)) {
+        return;
+      }
+      if (frame.fin) {
+        code = finish_message(ws, handler);
+      }
+      continue;
+    }
+
+    if (!fill_input(ws, &pos, header_len + frame.len)) {
+      return;
+    }
+    uint8_t *payload = ws->in + pos + header_len;
+    pos += header_len + frame.len;
+    unmask(payload, frame.len, frame.key);
+
+    if (is_control(frame.opcode)) {
+      code = handle_control(ws, &frame, payload, &closed);
+    } else if (frame.fin && frame.opcode != WS_CONTINUATION &&
+               !ws->message_compressed) {
+      // a whole message in one frame, handed over from the input buffer
+      ws->in_message = false;
+      code = deliver_message(ws, handler, frame.opcode, false, payload,
+                             frame.len);
+    } else {
+      if (!grow(&ws->message, &ws->message_capacity,
+                ws->message_len + frame.len + sizeof(DEFLATE_TAIL))) {
+        code = WS_CLOSE_TOO_BIG;
+        break;
+      }
+      memcpy(ws->message + ws->message_len, payload, frame.len);
+      ws->message_len += frame.len;
+
+      if (frame.fin) {
+        code = finish_message(ws, handler);
+      }
+    }
+  }
+
+  if (code != 0) {
+    send_close(ws, code);
+  }
+}
+
+static bool parse_window_bits(const char *value, int *bits) {
+  char *end = NULL;
+  long parsed = strtol(value, &end, 10);
+  if (end == value || *end != '\0' || parsed < 8 || parsed > 15) {
+    return false;
+  }
+  *bits = parsed;
+  return true;
+}
+
+static char *trim(char *str) {
+  while (*str == ' ' || *str == '\t') {
+    str += 1;
+  }
+  size_t len = strlen(str);
+  while (len > 0 && (str[len - 1] == ' ' || str[len - 1] == '\t')) {
+    len -= 1;
+  }
+  str[len] = '\0';
+  return str;
+}
+
+// Takes a permessage-deflate offer if every parameter can be honoured
+static bool accept_deflate_offer(char *offer, WebSocketDeflate *deflate) {
+  char *save = NULL;
+  char *name = strtok_r(offer, ";", &save);
+  if (name == NULL || strcasecmp(trim(name), PERMESSAGE_DEFLATE) != 0) {
+    return false;
+  }
+
+  WebSocketDeflate accepted = {0};
+  bool client_bits = false;
+  char *param = NULL;
+  while ((param = strtok_r(NULL, ";", &save)) != NULL) {
+    char *value = strchr(param, '=');
+    if (value != NULL) {
+      *value = '\0';
+      value = trim(value + 1);
+      size_t len = strlen(value);
+      if (len >= 2 && value[0] == '"' && value[len - 1] == '"') {
+        value[len - 1] = '\0';
+        value += 1;
+      }
+    }
+    param = trim(param);
+
+    if (strcasecmp(param, "server_no_context_takeover") == 0 &&
+        value == NULL && !accepted.server_no_context_takeover) {
+      accepted.server_no_context_takeover = true;
+    } else if (strcasecmp(param, "client_no_context_takeover") == 0 &&
+               value == NULL && !accepted.client_no_context_takeover) {
+      accepted.client_no_context_takeover = true;
+    } else if (strcasecmp(param, "server_max_window_bits") == 0 &&
+               value != NULL && accepted.server_max_window_bits == 0) {
+      int bits = 0;
+      // zlib has no raw deflate with a 256 byte window
+      if (!parse_window_bits(value, &bits) || bits < 9) {
+        return false;
+      }
+      accepted.server_max_window_bits = bits;
+    } else if (strcasecmp(param, "client_max_window_bits") == 0 &&
+               !client_bits) {
+      // inflating with the largest window reads any smaller one
+      int bits = 0;
+      if (value != NULL && !parse_window_bits(value, &bits)) {
+        return false;
+      }
+      client_bits = true;
+    } else {
+      return false;
+    }
+  }
+
+  *deflate = accepted;
+  deflate->enabled = true;
+  return true;
+}
+
+// Picks the first offer that can be accepted and writes the response for it,
+// an empty response if none could
+static void negotiate_deflate(HttpRequest *req, WebSocketDeflate *deflate,
+                              char *response, size_t capacity) {
+  response[0] = '\0';
+
+  const char *offers = find_in_header(&req->headers, SEC_WEBSOCKET_EXTENSIONS);
+  if (offers == NULL || current_gzip_level() <= 0) {
+    return;
+  }
+
+  char *copy = strdup(offers);
+  if (copy == NULL) {
+    return;
+  }
+
+  char *save = NULL;
+  for (char *offer = strtok_r(copy, ",", &save); offer != NULL;
+       offer = strtok_r(NULL, ",", &save)) {
+    if (accept_deflate_offer(offer, deflate)) {
+      break;
+    }
+  }
+  free(copy);
+
+  if (!deflate->enabled) {
+    return;
+  }
+
+  int window = deflate->server_max_window_bits > 0
+                   ? deflate->server_max_window_bits
+                   : 15;
+  if (deflateInit2(&deflate->deflate, current_gzip_level(), Z_DEFLATED,
+                   -window, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    deflate->enabled = false;
+    return;
+  }
+  if (inflateInit2(&deflate->inflate, -15) != Z_OK) {
+    deflateEnd(&deflate->deflate);
+    deflate->enabled = false;
+    return;
+  }
+
+  size_t len = snprintf(response, capacity, PERMESSAGE_DEFLATE);
+  if (deflate->server_no_context_takeover) {
+    len += snprintf(response + len, capacity - len,
+                    "; server_no_context_takeover");
+  }
+  if (deflate->client_no_context_takeover) {
+    len += snprintf(response + len, capacity - len,
+                    "; client_no_context_takeover");
+  }
+  if (deflate->server_max_window_bits > 0) {
+    snprintf(response + len, capacity - len, "; server_max_window_bits=%d",
+             deflate->server_max_window_bits);
+  }
+}
+
+// Sec-WebSocket-Accept for the client's key
+static bool accept_key(const char *key, char *accept) {
+  char input[WEBSOCKET_KEY_LEN + sizeof(WEBSOCKET_GUID)];
+  int len = snprintf(input, sizeof(input), "%s%s", key, WEBSOCKET_GUID);
+
+  uint8_t digest[EVP_MAX_MD_SIZE];
+  unsigned digest_len = 0;
+  if (EVP_Digest(input, len, digest, &digest_len, EVP_sha1(), NULL) != 1) {
+    return false;
+  }
+  EVP_EncodeBlock((uint8_t *)accept, digest, digest_len);
+  return true;
+}
+
+static size_t session_limit = 0;
+static atomic_size_t sessions = 0;
+
+void set_websocket_limit(size_t max_sessions) {
+  session_limit = max_sessions;
+}
+
+void serve_websocket(Connection *conn, HttpRequest *req, const uint8_t *buf,
+                     size_t len) {
+  HttpOutput out = init_output();
+  HttpStatus status = OK;
+
+  WebSocketHandler handler = find_handler(req->url.path);
+  const char *key = find_in_header(&req->headers, SEC_WEBSOCKET_KEY);
+  const char *version = find_in_header(&req->headers, SEC_WEBSOCKET_VERSION);
+  char accept[WEBSOCKET_ACCEPT_LEN + 1];
+
+  if (handler == NULL) {
+    status = NOT_FOUND;
+  } else if (version == NULL || strcmp(version, WEBSOCKET_VERSION) != 0) {
+    status = UPGRADE_REQUIRED;
+  } else if (key == NULL || strlen(key) != WEBSOCKET_KEY_LEN ||
+             req->body.len > 0 || len > WEBSOCKET_READ_BUFFER ||
+             !accept_key(key, accept)) {
+    status = BAD_REQ;
+  } else if (atomic_fetch_add(&sessions, 1) >= session_limit) {
+    // the remaining workers are kept for everything else
+    atomic_fetch_sub(&sessions, 1);
+    status = SERVICE_UNAVAILABLE;
+  }
+
+  if (status == UPGRADE_REQUIRED) {
+    // tells the client which version to retry with
+    HttpResponse resp = init_response(status, NO_ENCODING);
+    push_header_response(&resp, SEC_WEBSOCKET_VERSION, WEBSOCKET_VERSION);
+    push_header_response(&resp, CONTENT_LENGTH, "0");
+    push_header_response(&resp, CONNECTION, CONNECTION_CLOSE);
+    write_response_output(&out, &resp);
+    free_http_response(&resp);
+  } else if (status != OK) {
+    handle_error(&out, status);
+  }
+
+  if (status != OK) {
+    conn_write_output(conn, &out);
+    free_output(&out);
+    return;
+  }
+
+  WebSocket ws = {
+      .conn = conn,
+      .in = malloc(WEBSOCKET_READ_BUFFER),
+      .in_len = len,
+      .max_message = conn->max_body_size,
+  };
+  if (ws.in == NULL) {
+    atomic_fetch_sub(&sessions, 1);
+    free_output(&out);
+    return;
+  }
+  memcpy(ws.in, buf, len);
+
+  char extensions[128];
+  negotiate_deflate(req, &ws.deflate, extensions, sizeof(extensions));
+
+  HttpResponse resp = init_response(SWITCHING_PROTOCOLS, NO_ENCODING);
+  push_header_response(&resp, CONNECTION, CONNECTION_UPGRADE);
+  push_header_response(&resp, UPGRADE, WEBSOCKET_UPGRADE);
+  push_header_response(&resp, SEC_WEBSOCKET_ACCEPT, accept);
+  if (ws.deflate.enabled) {
+    push_header_response(&resp, SEC_WEBSOCKET_EXTENSIONS, extensions);
+  }
+  write_response_output(&out, &resp);
+  free_http_response(&resp);
+
+  if (conn_write_output(conn, &out)) {
+    printf("serving WebSocket%s\n",
+           ws.deflate.enabled ? " with " PERMESSAGE_DEFLATE : "");
+
+    // messages are answered one by one, don't let Nagle wait for an ACK
+    int nodelay = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    serve_frames(&ws, handler);
+  }
+
+  if (ws.deflate.enabled) {
+    deflateEnd(&ws.deflate.deflate);
+    inflateEnd(&ws.deflate.inflate);
+  }
+  free(ws.in);
+  free(ws.message);
+  free(ws.inflated);
+  free(ws.deflated);
+  free_output(&out);
+  atomic_fetch_sub(&sessions, 1);
+}
@@ -0,0 +1,107 @@
+#ifndef WEBSOCKET
+#define WEBSOCKET
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "conn.h"
+#include "http.h"
+
+// RFC 6455 WebSockets on top of an HTTP/1.1 upgrade, served by the worker
+// that parsed the request until either side closes. Handlers get whole
+// messages: fragments are joined and permessage-deflate (RFC 7692) is
+// undone before, and messages are compressed again on the way out.
+//   GET /echo   (Upgrade: websocket)   sends every message back
+
+#define WEBSOCKET_ECHO_ROUTE "/echo"
+
+// frames read at once, larger frames go straight into the message
+#define WEBSOCKET_READ_BUFFER (64 * 1024)
+// an idle connection gets a ping after this, and is closed if nothing came
+// back after another one
+#define WEBSOCKET_PING_MS 30000
+// smaller messages are sent as they are
+#define WEBSOCKET_DEFLATE_MIN 64
+
+enum WebSocketOpcode {
+  WS_CONTINUATION = 0x0,
+  WS_TEXT = 0x1,
+  WS_BINARY = 0x2,
+  WS_CLOSE = 0x8,
+  WS_PING = 0x9,
+  WS_PONG = 0xA,
+};
+
+typedef enum WebSocketOpcode WebSocketOpcode;
+
+// close codes
+#define WS_CLOSE_NORMAL 1000
+#define WS_CLOSE_GOING_AWAY 1001
+#define WS_CLOSE_PROTOCOL_ERROR 1002
+#define WS_CLOSE_INVALID_DATA 1007
+#define WS_CLOSE_TOO_BIG 1009
+
+struct WebSocketDeflate {
+  bool enabled;
+  // reset the contexts after every message instead of keeping the window
+  bool server_no_context_takeover;
+  bool client_no_context_takeover;
+  // 0 if the client didn't limit it
+  int server_max_window_bits;
+  z_stream deflate;
+  z_stream inflate;
+};
+
+typedef struct WebSocketDeflate WebSocketDeflate;
+
+struct WebSocket {
+  Connection *conn;
+
+  uint8_t *in;
+  size_t in_len;
+
+  // a fragmented, large or compressed message being put together
+  uint8_t *message;
+  size_t message_len;
+  size_t message_capacity;
+  WebSocketOpcode message_opcode;
+  bool message_compressed;
+  bool in_message;
+
+  // the last inflated message and the last compressed one sent
+  uint8_t *inflated;
+  size_t inflated_capacity;
+  uint8_t *deflated;
+  size_t deflated_capacity;
+
+  size_t max_message;
+  bool ping_sent;
+
+  WebSocketDeflate deflate;
+};
+
+typedef struct WebSocket WebSocket;
+
+// Gets every text or binary message, returns false to close the connection
+typedef bool (*WebSocketHandler)(WebSocket *ws, WebSocketOpcode opcode,
+                                 const uint8_t *data, size_t len);
+
+// A GET asking to upgrade to a WebSocket, the route isn't looked at
+bool is_websocket_upgrade(HttpRequest *req);
+
+// A session keeps its worker until it closes, upgrades beyond
+// `max_sessions` at once are answered with 503. Set before serving.
+void set_websocket_limit(size_t max_sessions);
+
+// Answers the handshake and serves the connection until it closes, `buf`
+// holds whatever the client sent after the request
+void serve_websocket(Connection *conn, HttpRequest *req, const uint8_t *buf,
+                     size_t len);
+
+// Sends a message in a single frame, returns false once the client is gone
+bool websocket_send(WebSocket *ws, WebSocketOpcode opcode, const uint8_t *data,
+                    size_t len);
+
+#endif // !WEBSOCKET
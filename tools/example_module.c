@@ -0,0 +1,132 @@
+// A route module for --modules (see app/handler_api.h).
+//
+//   gcc -shared -fPIC -Wall -O2 -Iapp -o /tmp/example.so tools/example_module.c
+//   echo "/tmp/example.so /example" > /tmp/modules.conf
+//   ./your_program.sh --modules /tmp/modules.conf
+//
+// The argument is the prefix of its routes, "/example" without one:
+//   GET <prefix>/echo/*    the decoded path, what the wildcard matched and
+//                          the query, `?name=` greets by name
+//   GET <prefix>/later     answered with HANDLER_PENDING from a thread of the
+//                          module
+//   POST <prefix>/reverse  the body backwards
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "handler_api.h"
+
+#define ROUTE_MAX 256
+
+static const HandlerHost *server;
+
+static void set_text(HandlerResponse *resp) {
+  server->add_header(resp, "Content-Type", "text/plain");
+}
+
+static void append_text(HandlerResponse *resp, const char *text) {
+  server->append_body(resp, text, strlen(text));
+}
+
+// Writes the value of `key` in the raw query to `value`, left undecoded
+static int find_query(const char *query, const char *key, char *value,
+                      size_t capacity) {
+  size_t key_len = strlen(key);
+  while (query != NULL && *query != '\0') {
+    size_t len = strcspn(query, "&");
+    if (len > key_len && strncmp(query, key, key_len) == 0 &&
+        query[key_len] == '=') {
+      snprintf(value, capacity, "%.*s", (int)(len - key_len - 1),
+               query + key_len + 1);
+      return 1;
+    }
+    query += len + (query[len] == '&');
+  }
+  return 0;
+}
+
+static enum HandlerResult echo(const HandlerRequest *req,
+                               HandlerResponse *resp, void *user) {
+  (void)user;
+
+  set_text(resp);
+  append_text(resp, "path: ");
+  append_text(resp, req->url);
+  append_text(resp, "\nparams: ");
+  append_text(resp, req->params);
+  append_text(resp, "\nquery: ");
+  append_text(resp, req->query == NULL ? "(none)" : req->query);
+  append_text(resp, "\n");
+
+  char name[64];
+  if (find_query(req->query, "name", name, sizeof(name))) {
+    append_text(resp, "hello ");
+    append_text(resp, name);
+    append_text(resp, "\n");
+  }
+  return HANDLER_DONE;
+}
+
+static void *complete_later(void *arg) {
+  HandlerResponse *resp = arg;
+  set_text(resp);
+  append_text(resp, "completed by the module\n");
+  server->complete(resp);
+  return NULL;
+}
+
+static enum HandlerResult later(const HandlerRequest *req,
+                                HandlerResponse *resp, void *user) {
+  (void)req;
+  (void)user;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, &complete_later, resp) != 0) {
+    server->set_status(resp, 503);
+    return HANDLER_DONE;
+  }
+  pthread_detach(thread);
+  // the worker waits for `complete`, see HANDLER_PENDING
+  return HANDLER_PENDING;
+}
+
+static enum HandlerResult reverse(const HandlerRequest *req,
+                                  HandlerResponse *resp, void *user) {
+  (void)user;
+
+  set_text(resp);
+  for (size_t i = req->body_len; i > 0; i -= 1) {
+    server->append_body(resp, &req->body[i - 1], 1);
+  }
+  return HANDLER_DONE;
+}
+
+static int add_route(int method, const char *prefix, const char *route,
+                     HandlerFn fn) {
+  char full[ROUTE_MAX];
+  int len = snprintf(full, sizeof(full), "%s%s", prefix, route);
+  if (len < 0 || (size_t)len >= sizeof(full)) {
+    return -1;
+  }
+  return server->register_route(server, method, full, fn, NULL);
+}
+
+int route_module_init(const HandlerHost *host, const char *arg) {
+  // the query is only there since version 2
+  if (host->version < 2) {
+    printf("example module needs handler API 2, the server has %u\n",
+           host->version);
+    return -1;
+  }
+  server = host;
+
+  const char *prefix = arg == NULL ? "/example" : arg;
+  if (add_route(HANDLER_GET, prefix, "/echo/*", &echo) != 0 ||
+      add_route(HANDLER_GET, prefix, "/later", &later) != 0 ||
+      add_route(HANDLER_POST, prefix, "/reverse", &reverse) != 0) {
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,849 @@
+// Sends a traffic capture (see app/capture.h) to a running instance again
+// and reports the latency of every request.
+//
+//   gcc -Wall -Wextra -O2 -o /tmp/replay tools/replay.c
+//   /tmp/replay <capture> [--target <host>:<port>] [--speed <factor>|max]
+//                         [--timeout <ms>]
+//
+// Every captured connection is opened again and gets the same bytes:
+//   --speed 1     the default, at the offsets they originally arrived
+//   --speed <n>   n times as fast, 0.5 is half the speed
+//   --speed max   connections start at once and each sends its next request
+//                 as soon as the last response is complete
+//
+// HTTP/1.1 requests and responses are framed to measure from the last byte
+// of a request to the last byte of its response. Connections that switch
+// protocols (HTTP/2, WebSocket) are sent as they are without measuring.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../app/capture.h"
+
+#define DEFAULT_TARGET "127.0.0.1:4221"
+#define DEFAULT_TIMEOUT_MS 30000
+#define READ_CHUNK (64 * 1024)
+// a protocol switched connection is closed after this much silence at max
+// speed, there is nothing to wait for
+#define RAW_IDLE_MS 200
+// response heads larger than this are taken as garbage
+#define MAX_RESPONSE_HEAD (64 * 1024)
+
+struct Chunk {
+  uint64_t time;
+  // end of the chunk in the connection's stream
+  size_t end;
+};
+
+typedef struct Chunk Chunk;
+
+enum ResponseState {
+  RESPONSE_HEAD,
+  RESPONSE_BODY,
+  RESPONSE_CHUNK_SIZE,
+  RESPONSE_CHUNK_DATA,
+  RESPONSE_CHUNK_END,
+  RESPONSE_TRAILER,
+  RESPONSE_UNTIL_CLOSE,
+};
+
+typedef enum ResponseState ResponseState;
+
+// Frames responses as they arrive without keeping their bodies
+struct ResponseParser {
+  ResponseState state;
+  uint8_t *head;
+  size_t head_len;
+  size_t head_capacity;
+  uint64_t remaining;
+  unsigned status;
+  // after a 101 everything is passed through
+  bool switched;
+};
+
+typedef struct ResponseParser ResponseParser;
+
+struct Replayed {
+  uint32_t id;
+  uint64_t open_time;
+  uint64_t close_time;
+
+  uint8_t *stream;
+  size_t stream_len;
+  size_t stream_capacity;
+  Chunk *chunks;
+  size_t chunk_count;
+  size_t chunk_capacity;
+
+  // where each framed request ends, requests after `measured_len` bytes
+  // aren't HTTP/1.1
+  size_t *request_ends;
+  size_t request_count;
+  size_t request_capacity;
+  size_t measured_len;
+
+  // replay state
+  int fd;
+  bool started;
+  bool finished;
+  size_t sent;
+  size_t next_chunk;
+  // requests completely sent
+  size_t requests_sent;
+  uint64_t *sent_at;
+  size_t responses;
+  uint64_t last_activity;
+  ResponseParser parser;
+};
+
+typedef struct Replayed Replayed;
+
+struct Report {
+  uint64_t *latencies;
+  size_t latency_count;
+  size_t latency_capacity;
+  size_t errors;
+  size_t timeouts;
+  size_t status_classes[6];
+  size_t bytes_sent;
+};
+
+typedef struct Report Report;
+
+static uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint64_t get_le(const uint8_t *buf, size_t len) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < len; i += 1) {
+    value |= (uint64_t)buf[i] << (8 * i);
+  }
+  return value;
+}
+
+static void *grow_array(void *ptr, size_t *capacity, size_t needed,
+                        size_t size) {
+  if (needed <= *capacity) {
+    return ptr;
+  }
+  size_t next = *capacity == 0 ? 16 : *capacity;
+  while (next < needed) {
+    next *= 2;
+  }
+  ptr = realloc(ptr, next * size);
+  if (ptr == NULL) {
+    printf("out of memory\n");
+    exit(1);
+  }
+  *capacity = next;
+  return ptr;
+}
+
+// Connections indexed by id, ids without an open record stay NULL
+struct Capture {
+  Replayed **connections;
+  size_t count;
+  size_t capacity;
+  uint64_t duration;
+};
+
+typedef struct Capture Capture;
+
+static Replayed *find_connection(Capture *capture, uint32_t id, bool create,
+                                 uint64_t time) {
+  if (id >= capture->count) {
+    if (!create) {
+      return NULL;
+    }
+    size_t old = capture->capacity;
+    capture->connections = grow_array(capture->connections,
+                                      &capture->capacity, id + 1,
+                                      sizeof(Replayed *));
+    memset(capture->connections + old, 0,
+           (capture->capacity - old) * sizeof(Replayed *));
+    capture->count = id + 1;
+  }
+
+  Replayed *conn = capture->connections[id];
+  if (conn == NULL && create) {
+    conn = calloc(1, sizeof(Replayed));
+    conn->id = id;
+    conn->open_time = time;
+    conn->close_time = UINT64_MAX;
+    conn->fd = -1;
+    capture->connections[id] = conn;
+  }
+  return conn;
+}
+
+static bool load_capture(const char *path, Capture *capture) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    printf("failed to open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  char magic[CAPTURE_MAGIC_LEN];
+  if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+      memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+    printf("%s is not a capture\n", path);
+    fclose(file);
+    return false;
+  }
+
+  uint8_t header[CAPTURE_DATA_HEADER];
+  while (fread(header, 1, CAPTURE_RECORD_HEADER, file) ==
+         CAPTURE_RECORD_HEADER) {
+    CaptureKind kind = header[0];
+    uint32_t id = get_le(header + 1, 4);
+    uint64_t time = get_le(header + 5, 8);
+    capture->duration = time;
+
+    if (kind == CAPTURE_OPEN) {
+      find_connection(capture, id, true, time);
+    } else if (kind == CAPTURE_CLOSE) {
+      Replayed *conn = find_connection(capture, id, false, time);
+      if (conn != NULL) {
+        conn->close_time = time;
+      }
+    } else if (kind == CAPTURE_DATA) {
+      if (fread(header + CAPTURE_RECORD_HEADER, 1, 4, file) != 4) {
+        break;
+      }
+      size_t len = get_le(header + CAPTURE_RECORD_HEADER, 4);
+      Replayed *conn = find_connection(capture, id, true, time);
+      conn->stream = grow_array(conn->stream, &conn->stream_capacity,
+                                conn->stream_len + len, 1);
+      if (fread(conn->stream + conn->stream_len, 1, len, file) != len) {
+        // cut off while the server was writing it
+        break;
+      }
+      conn->stream_len += len;
+      conn->chunks = grow_array(conn->chunks, &conn->chunk_capacity,
+                                conn->chunk_count + 1, sizeof(Chunk));
+      conn->chunks[conn->chunk_count] = (Chunk){
+          .time = time,
+          .end = conn->stream_len,
+      };
+      conn->chunk_count += 1;
+    } else {
+      printf("unknown record %d, stopping there\n", kind);
+      break;
+    }
+  }
+
+  fclose(file);
+  return true;
+}
+
+static const char *find_header_value(const char *head, size_t len,
+                                     const char *key) {
+  size_t key_len = strlen(key);
+  const char *line = memmem(head, len, "\r\n", 2);
+  while (line != NULL && (size_t)(line - head) + 2 < len) {
+    line += 2;
+    size_t left = len - (line - head);
+    if (left > key_len && strncasecmp(line, key, key_len) == 0 &&
+        line[key_len] == ':') {
+      return line + key_len + 1;
+    }
+    line = memmem(line, left, "\r\n", 2);
+  }
+  return NULL;
+}
+
+// Length of the chunked body at `buf` or 0 while it is incomplete
+static size_t chunked_length(const uint8_t *buf, size_t len) {
+  size_t pos = 0;
+  while (1) {
+    const uint8_t *line_end = memmem(buf + pos, len - pos, "\r\n", 2);
+    if (line_end == NULL) {
+      return 0;
+    }
+    uint64_t size = strtoull((const char *)buf + pos, NULL, 16);
+    pos = line_end - buf + 2;
+    if (size == 0) {
+      // trailers up to the empty line
+      const uint8_t *end = memmem(buf + pos - 2, len - pos + 2, "\r\n\r\n", 4);
+      return end == NULL ? 0 : (size_t)(end - buf) + 4;
+    }
+    if (len - pos < size + 2) {
+      return 0;
+    }
+    pos += size + 2;
+  }
+}
+
+// Frames the requests of a connection, stops at the first one that isn't
+// HTTP/1.1 or switches protocols
+static void frame_requests(Replayed *conn) {
+  size_t pos = 0;
+  while (pos < conn->stream_len) {
+    const char *start = (const char *)conn->stream + pos;
+    size_t left = conn->stream_len - pos;
+    const char *head_end = memmem(start, left, "\r\n\r\n", 4);
+    const char *line_end = memmem(start, left, "\r\n", 2);
+    if (head_end == NULL || line_end == NULL ||
+        memmem(start, line_end - start, " HTTP/1.", 8) == NULL) {
+      break;
+    }
+
+    size_t head_len = head_end - start + 4;
+    size_t body_len = 0;
+    const char *length = find_header_value(start, head_len, "Content-Length");
+    const char *encoding =
+        find_header_value(start, head_len, "Transfer-Encoding");
+    if (encoding != NULL && strncasecmp(encoding + strspn(encoding, " "),
+                                        "chunked", 7) == 0) {
+      body_len = chunked_length((const uint8_t *)start + head_len,
+                                left - head_len);
+      if (body_len == 0) {
+        break;
+      }
+    } else if (length != NULL) {
+      body_len = strtoull(length, NULL, 10);
+      if (left - head_len < body_len) {
+        break;
+      }
+    }
+
+    pos += head_len + body_len;
+    conn->request_ends = grow_array(conn->request_ends, &conn->request_capacity,
+                                    conn->request_count + 1, sizeof(size_t));
+    conn->request_ends[conn->request_count] = pos;
+    conn->request_count += 1;
+
+    if (find_header_value(start, head_len, "Upgrade") != NULL) {
+      break;
+    }
+  }
+
+  conn->measured_len = pos;
+  conn->sent_at = calloc(conn->request_count + 1, sizeof(uint64_t));
+}
+
+static void record_response(Replayed *conn, Report *report, uint64_t now) {
+  unsigned status = conn->parser.status;
+  if (status >= 100 && status < 600) {
+    report->status_classes[status / 100] += 1;
+  }
+
+  if (conn->responses < conn->request_count) {
+    // answered before the request was complete, e.g. a 413
+    uint64_t sent = conn->sent_at[conn->responses];
+    report->latencies =
+        grow_array(report->latencies, &report->latency_capacity,
+                   report->latency_count + 1, sizeof(uint64_t));
+    report->latencies[report->latency_count] =
+        sent == 0 || now < sent ? 0 : now - sent;
+    report->latency_count += 1;
+  }
+  conn->responses += 1;
+}
+
+// The body framing once the head is complete
+static void start_body(ResponseParser *parser) {
+  const char *head = (const char *)parser->head;
+  parser->status = strtoul(head + strcspn(head, " "), NULL, 10);
+
+  const char *length =
+      find_header_value(head, parser->head_len, "Content-Length");
+  const char *encoding =
+      find_header_value(head, parser->head_len, "Transfer-Encoding");
+
+  if (parser->status == 101) {
+    parser->switched = true;
+    parser->state = RESPONSE_HEAD;
+  } else if (parser->status < 200 || parser->status == 204 ||
+             parser->status == 304) {
+    parser->state = RESPONSE_HEAD;
+  } else if (encoding != NULL &&
+             strncasecmp(encoding + strspn(encoding, " "), "chunked", 7) ==
+                 0) {
+    parser->state = RESPONSE_CHUNK_SIZE;
+  } else if (length != NULL) {
+    parser->remaining = strtoull(length, NULL, 10);
+    // an empty body is complete with the head
+    parser->state = parser->remaining == 0 ? RESPONSE_HEAD : RESPONSE_BODY;
+  } else {
+    parser->state = RESPONSE_UNTIL_CLOSE;
+  }
+  parser->head_len = 0;
+}
+
+// Feeds received bytes, records every complete response. Returns false for
+// something that isn't HTTP/1.1.
+static bool parse_responses(Replayed *conn, Report *report, const uint8_t *buf,
+                            size_t len, uint64_t now) {
+  ResponseParser *parser = &conn->parser;
+  size_t pos = 0;
+
+  while (pos < len && !parser->switched) {
+    switch (parser->state) {
+    case RESPONSE_HEAD:
+    case RESPONSE_CHUNK_SIZE:
+    case RESPONSE_CHUNK_END:
+    case RESPONSE_TRAILER: {
+      // lines are collected until they are complete
+      parser->head = grow_array(parser->head, &parser->head_capacity,
+                                parser->head_len + 2, 1);
+      parser->head[parser->head_len] = buf[pos];
+      parser->head_len += 1;
+      parser->head[parser->head_len] = '\0';
+      pos += 1;
+      if (parser->head_len > MAX_RESPONSE_HEAD) {
+        return false;
+      }
+
+      bool line_done = parser->head_len >= 2 &&
+                       memcmp(parser->head + parser->head_len - 2, "\r\n",
+                              2) == 0;
+      if (parser->state == RESPONSE_HEAD) {
+        if (parser->head_len >= 4 &&
+            memcmp(parser->head + parser->head_len - 4, "\r\n\r\n", 4) ==
+                0) {
+          if (strncmp((const char *)parser->head, "HTTP/1.", 7) != 0) {
+            return false;
+          }
+          bool interim = false;
+          start_body(parser);
+          interim = parser->status < 200 && parser->status != 101;
+          if (!interim && parser->state == RESPONSE_HEAD) {
+            record_response(conn, report, now);
+          }
+        }
+      } else if (line_done && parser->state == RESPONSE_CHUNK_SIZE) {
+        parser->remaining = strtoull((const char *)parser->head, NULL, 16);
+        parser->head_len = 0;
+        parser->state =
+            parser->remaining == 0 ? RESPONSE_TRAILER : RESPONSE_CHUNK_DATA;
+      } else if (line_done && parser->state == RESPONSE_CHUNK_END) {
+        parser->head_len = 0;
+        parser->state = RESPONSE_CHUNK_SIZE;
+      } else if (line_done && parser->state == RESPONSE_TRAILER) {
+        bool empty = parser->head_len == 2;
+        parser->head_len = 0;
+        if (empty) {
+          parser->state = RESPONSE_HEAD;
+          record_response(conn, report, now);
+        }
+      }
+      break;
+    }
+    case RESPONSE_BODY:
+    case RESPONSE_CHUNK_DATA: {
+      size_t take = len - pos < parser->remaining ? len - pos
+                                                  : parser->remaining;
+      pos += take;
+      parser->remaining -= take;
+      if (parser->remaining == 0) {
+        if (parser->state == RESPONSE_BODY) {
+          parser->state = RESPONSE_HEAD;
+          record_response(conn, report, now);
+        } else {
+          parser->state = RESPONSE_CHUNK_END;
+        }
+      }
+      break;
+    }
+    case RESPONSE_UNTIL_CLOSE:
+      pos = len;
+      break;
+    }
+  }
+  return true;
+}
+
+static int connect_target(const char *target) {
+  char host[256];
+  const char *colon = strrchr(target, ':');
+  if (colon == NULL || (size_t)(colon - target) >= sizeof(host)) {
+    return -1;
+  }
+  memcpy(host, target, colon - target);
+  host[colon - target] = '\0';
+
+  struct addrinfo hints = {
+      .ai_family = AF_UNSPEC,
+      .ai_socktype = SOCK_STREAM,
+  };
+  struct addrinfo *addresses = NULL;
+  if (getaddrinfo(host, colon + 1, &hints, &addresses) != 0) {
+    return -1;
+  }
+
+  int fd = -1;
+  for (struct addrinfo *curr = addresses; curr != NULL; curr = curr->ai_next) {
+    fd = socket(curr->ai_family, curr->ai_socktype | SOCK_CLOEXEC,
+                curr->ai_protocol);
+    if (fd == -1) {
+      continue;
+    }
+    if (connect(fd, curr->ai_addr, curr->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addresses);
+
+  if (fd != -1) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  }
+  return fd;
+}
+
+struct Replay {
+  Capture *capture;
+  const char *target;
+  // 0 for max
+  double speed;
+  uint64_t timeout_ns;
+  uint64_t start;
+  Report report;
+};
+
+typedef struct Replay Replay;
+
+// Capture time to replay time
+static uint64_t scheduled(Replay *replay, uint64_t time) {
+  return replay->speed == 0 ? replay->start
+                            : replay->start + (uint64_t)(time / replay->speed);
+}
+
+// Bytes the connection may have sent by now
+static size_t send_limit(Replay *replay, Replayed *conn, uint64_t now) {
+  if (replay->speed == 0) {
+    // one request at a time, the rest of a switched stream at once
+    if (conn->responses < conn->request_count) {
+      return conn->request_ends[conn->responses];
+    }
+    return conn->responses == conn->request_count ? conn->stream_len
+                                                  : conn->sent;
+  }
+
+  while (conn->next_chunk < conn->chunk_count &&
+         scheduled(replay, conn->chunks[conn->next_chunk].time) <= now) {
+    conn->next_chunk += 1;
+  }
+  return conn->next_chunk == 0 ? 0 : conn->chunks[conn->next_chunk - 1].end;
+}
+
+static void finish_connection(Replay *replay, Replayed *conn) {
+  if (conn->finished) {
+    return;
+  }
+  if (conn->fd != -1) {
+    close(conn->fd);
+    conn->fd = -1;
+  }
+  conn->finished = true;
+  // requests that never got an answer
+  if (conn->responses < conn->request_count) {
+    replay->report.errors += conn->request_count - conn->responses;
+  }
+}
+
+static void send_pending(Replay *replay, Replayed *conn, uint64_t now) {
+  size_t limit = send_limit(replay, conn, now);
+  while (conn->sent < limit) {
+    ssize_t res = send(conn->fd, conn->stream + conn->sent, limit - conn->sent,
+                       MSG_NOSIGNAL);
+    if (res == -1 && errno == EINTR) {
+      continue;
+    } else if (res == -1 && errno == EAGAIN) {
+      return;
+    } else if (res <= 0) {
+      finish_connection(replay, conn);
+      return;
+    }
+    conn->sent += res;
+    replay->report.bytes_sent += res;
+
+    now = now_ns();
+    while (conn->requests_sent < conn->request_count &&
+           conn->request_ends[conn->requests_sent] <= conn->sent) {
+      conn->sent_at[conn->requests_sent] = now;
+      conn->requests_sent += 1;
+    }
+  }
+}
+
+static void receive(Replay *replay, Replayed *conn, uint64_t now) {
+  uint8_t buf[READ_CHUNK];
+  while (conn->fd != -1) {
+    ssize_t res = recv(conn->fd, buf, sizeof(buf), 0);
+    if (res == -1 && errno == EINTR) {
+      continue;
+    } else if (res == -1 && errno == EAGAIN) {
+      return;
+    } else if (res <= 0) {
+      if (conn->parser.state == RESPONSE_UNTIL_CLOSE) {
+        record_response(conn, &replay->report, now);
+      }
+      finish_connection(replay, conn);
+      return;
+    }
+
+    conn->last_activity = now;
+    if (!parse_responses(conn, &replay->report, buf, res, now)) {
+      printf("connection %u: response isn't HTTP/1.1, stopped measuring\n",
+             conn->id);
+      conn->parser.switched = true;
+    }
+  }
+}
+
+// Whether nothing is left to do on the connection
+static bool is_done(Replay *replay, Replayed *conn, uint64_t now) {
+  bool answered = conn->responses >= conn->request_count;
+  bool all_sent = conn->sent == conn->stream_len;
+  bool measured = conn->measured_len == conn->stream_len &&
+                  !conn->parser.switched;
+
+  if (replay->speed == 0) {
+    if (measured) {
+      return all_sent && answered;
+    }
+    return all_sent && answered && now - conn->last_activity > RAW_IDLE_MS * 1000000ULL;
+  }
+
+  // the original client closed here
+  uint64_t close_time = conn->close_time == UINT64_MAX
+                            ? replay->capture->duration
+                            : conn->close_time;
+  return all_sent && (measured ? answered : true) &&
+         now >= scheduled(replay, close_time);
+}
+
+static bool has_timed_out(Replay *replay, Replayed *conn, uint64_t now) {
+  if (conn->responses >= conn->requests_sent) {
+    return false;
+  }
+  uint64_t sent = conn->sent_at[conn->responses];
+  return sent != 0 && now > sent && now - sent > replay->timeout_ns;
+}
+
+static void run_replay(Replay *replay) {
+  Capture *capture = replay->capture;
+  struct pollfd *pfds = calloc(capture->count + 1, sizeof(struct pollfd));
+  Replayed **polled = calloc(capture->count + 1, sizeof(Replayed *));
+
+  replay->start = now_ns();
+  size_t open = 0;
+  do {
+    uint64_t now = now_ns();
+    // the next scheduled chunk or connection, bounds the poll below
+    uint64_t next_event = now + 100 * 1000000ULL;
+    size_t count = 0;
+    open = 0;
+
+    for (size_t i = 0; i < capture->count; i += 1) {
+      Replayed *conn = capture->connections[i];
+      if (conn == NULL || conn->finished) {
+        continue;
+      }
+      open += 1;
+
+      if (!conn->started) {
+        uint64_t at = scheduled(replay, conn->open_time);
+        if (at > now) {
+          next_event = at < next_event ? at : next_event;
+          continue;
+        }
+        conn->started = true;
+        conn->last_activity = now;
+        conn->fd = connect_target(replay->target);
+        if (conn->fd == -1) {
+          printf("connection %u: failed to connect to %s\n", conn->id,
+                 replay->target);
+          finish_connection(replay, conn);
+          continue;
+        }
+      }
+
+      send_pending(replay, conn, now);
+      if (conn->fd != -1 && has_timed_out(replay, conn, now)) {
+        replay->report.timeouts += 1;
+        finish_connection(replay, conn);
+      }
+      if (conn->fd == -1 || is_done(replay, conn, now)) {
+        finish_connection(replay, conn);
+        continue;
+      }
+
+      if (replay->speed != 0 && conn->next_chunk < conn->chunk_count) {
+        uint64_t at = scheduled(replay, conn->chunks[conn->next_chunk].time);
+        next_event = at < next_event ? at : next_event;
+      }
+      pfds[count] = (struct pollfd){
+          .fd = conn->fd,
+          .events = POLLIN | (conn->sent < send_limit(replay, conn, now)
+                                  ? POLLOUT
+                                  : 0),
+          .revents = 0,
+      };
+      polled[count] = conn;
+      count += 1;
+    }
+
+    now = now_ns();
+    int timeout = next_event > now ? (next_event - now) / 1000000 : 0;
+    if (poll(pfds, count, timeout) <= 0) {
+      continue;
+    }
+
+    now = now_ns();
+    for (size_t i = 0; i < count; i += 1) {
+      if (pfds[i].revents == 0) {
+        continue;
+      }
+      receive(replay, polled[i], now);
+      if (polled[i]->fd != -1) {
+        send_pending(replay, polled[i], now);
+      }
+    }
+  } while (open > 0);
+
+  free(pfds);
+  free(polled);
+}
+
+static int compare_latencies(const void *a, const void *b) {
+  uint64_t left = *(const uint64_t *)a;
+  uint64_t right = *(const uint64_t *)b;
+  return (left > right) - (left < right);
+}
+
+static double percentile(Report *report, double p) {
+  if (report->latency_count == 0) {
+    return 0;
+  }
+  size_t index = (size_t)(p * report->latency_count + 0.5);
+  index = index == 0 ? 0 : index - 1;
+  if (index >= report->latency_count) {
+    index = report->latency_count - 1;
+  }
+  return report->latencies[index] / 1e6;
+}
+
+static void print_report(Replay *replay, uint64_t elapsed) {
+  Report *report = &replay->report;
+  size_t connections = 0;
+  size_t requests = 0;
+  for (size_t i = 0; i < replay->capture->count; i += 1) {
+    if (replay->capture->connections[i] != NULL) {
+      connections += 1;
+      requests += replay->capture->connections[i]->request_count;
+    }
+  }
+
+  qsort(report->latencies, report->latency_count, sizeof(uint64_t),
+        &compare_latencies);
+
+  double seconds = elapsed / 1e9;
+  printf("connections %zu, requests %zu, responses %zu, unanswered %zu, "
+         "timeouts %zu\n",
+         connections, requests, report->latency_count, report->errors,
+         report->timeouts);
+  printf("elapsed %.3fs (captured %.3fs), %.1f requests/s, %.1f MB sent\n",
+         seconds, replay->capture->duration / 1e9,
+         seconds > 0 ? report->latency_count / seconds : 0,
+         report->bytes_sent / 1e6);
+  printf("latency ms p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f max %.3f\n",
+         percentile(report, 0.5), percentile(report, 0.9),
+         percentile(report, 0.99), percentile(report, 0.999),
+         percentile(report, 1));
+  printf("status 1xx %zu 2xx %zu 3xx %zu 4xx %zu 5xx %zu\n",
+         report->status_classes[1], report->status_classes[2],
+         report->status_classes[3], report->status_classes[4],
+         report->status_classes[5]);
+}
+
+static void usage() {
+  printf("usage: replay <capture> [--target <host>:<port>] "
+         "[--speed <factor>|max] [--timeout <ms>]\n");
+}
+
+int main(int argc, char **argv) {
+  setbuf(stdout, NULL);
+
+  if (argc < 2) {
+    usage();
+    return 1;
+  }
+
+  Capture capture = {0};
+  Replay replay = {
+      .capture = &capture,
+      .target = DEFAULT_TARGET,
+      .speed = 1,
+      .timeout_ns = DEFAULT_TIMEOUT_MS * 1000000ULL,
+  };
+
+  for (int i = 2; i < argc; i += 2) {
+    if (i + 1 == argc) {
+      usage();
+      return 1;
+    }
+    const char *key = argv[i];
+    const char *value = argv[i + 1];
+    if (strcmp(key, "--target") == 0) {
+      replay.target = value;
+    } else if (strcmp(key, "--speed") == 0) {
+      replay.speed = strcmp(value, "max") == 0 ? 0 : strtod(value, NULL);
+      if (strcmp(value, "max") != 0 && replay.speed <= 0) {
+        usage();
+        return 1;
+      }
+    } else if (strcmp(key, "--timeout") == 0) {
+      replay.timeout_ns = strtoull(value, NULL, 10) * 1000000ULL;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+
+  if (!load_capture(argv[1], &capture)) {
+    return 1;
+  }
+  for (size_t i = 0; i < capture.count; i += 1) {
+    if (capture.connections[i] != NULL) {
+      frame_requests(capture.connections[i]);
+    }
+  }
+
+  uint64_t start = now_ns();
+  run_replay(&replay);
+  print_report(&replay, now_ns() - start);
+
+  for (size_t i = 0; i < capture.count; i += 1) {
+    Replayed *conn = capture.connections[i];
+    if (conn != NULL) {
+      free(conn->stream);
+      free(conn->chunks);
+      free(conn->request_ends);
+      free(conn->sent_at);
+      free(conn->parser.head);
+      free(conn);
+    }
+  }
+  free(capture.connections);
+  free(replay.report.latencies);
+  return 0;
+}